@@ -200,9 +200,9 @@ static void load_pk_signature(
 
 template <typename Dict>
 static void load(store& s, Dict& d) {
-    auto [data, expiry, pubkey_alt, pubkey] =
-        load_fields<std::string_view, system_clock::time_point, std::string, std::string>(
-                d, "data", "expiry", "pubKey", "pubkey");
+    auto [data, expiry, pubkey_alt, pubkey, quorum] =
+        load_fields<std::string_view, system_clock::time_point, std::string, std::string, unsigned>(
+                d, "data", "expiry", "pubKey", "pubkey", "quorum");
 
     // timestamp and ttl are special snowflakes: for backwards compat reasons, they can be passed as
     // strings when loading from json.
@@ -226,6 +226,7 @@ static void load(store& s, Dict& d) {
     require_exactly_one_of("expiry", expiry, "ttl", ttl);
     s.timestamp = *timestamp;
     s.expiry = expiry ? *expiry : s.timestamp + std::chrono::milliseconds{*ttl};
+    s.quorum = quorum.value_or(0);
 
     require("data", data);
     if constexpr (std::is_same_v<Dict, json>) {
@@ -316,11 +317,12 @@ static bool is_valid_message_hash(std::string_view hash) {
 
 template <typename Dict>
 static void load(delete_msgs& dm, Dict& d) {
-    auto [messages, pubkey, pubkey_ed25519, signature] =
-        load_fields<std::vector<std::string>, std::string, std::string_view, std::string_view>(
-            d, "messages", "pubkey", "pubkey_ed25519", "signature");
+    auto [messages, pubkey, pubkey_ed25519, quorum, signature] =
+        load_fields<std::vector<std::string>, std::string, std::string_view, unsigned, std::string_view>(
+            d, "messages", "pubkey", "pubkey_ed25519", "quorum", "signature");
 
     load_pk_signature(dm, d, pubkey, pubkey_ed25519, signature);
+    dm.quorum = quorum.value_or(0);
     require("messages", messages);
     dm.messages = std::move(*messages);
     if (dm.messages.empty())
@@ -349,11 +351,12 @@ bt_value delete_msgs::to_bt() const {
 
 template <typename Dict>
 static void load(delete_all& da, Dict& d) {
-    auto [pubkey, pubkey_ed25519, signature, timestamp] =
-        load_fields<std::string, std::string_view, std::string_view, system_clock::time_point>(
-            d, "pubkey", "pubkey_ed25519", "signature", "timestamp");
+    auto [pubkey, pubkey_ed25519, quorum, signature, timestamp] =
+        load_fields<std::string, std::string_view, unsigned, std::string_view, system_clock::time_point>(
+            d, "pubkey", "pubkey_ed25519", "quorum", "signature", "timestamp");
 
     load_pk_signature(da, d, pubkey, pubkey_ed25519, signature);
+    da.quorum = quorum.value_or(0);
     require("timestamp", timestamp);
     da.timestamp = std::move(*timestamp);
 }
@@ -373,11 +376,12 @@ bt_value delete_all::to_bt() const {
 
 template <typename Dict>
 static void load(delete_before& db, Dict& d) {
-    auto [before, pubkey, pubkey_ed25519, signature] =
-        load_fields<system_clock::time_point, std::string, std::string_view, std::string_view>(
-            d, "before", "pubkey", "pubkey_ed25519", "signature");
+    auto [before, pubkey, pubkey_ed25519, quorum, signature] =
+        load_fields<system_clock::time_point, std::string, std::string_view, unsigned, std::string_view>(
+            d, "before", "pubkey", "pubkey_ed25519", "quorum", "signature");
 
     load_pk_signature(db, d, pubkey, pubkey_ed25519, signature);
+    db.quorum = quorum.value_or(0);
     require("before", before);
     db.before = std::move(*before);
 }
@@ -397,11 +401,12 @@ bt_value delete_before::to_bt() const {
 
 template <typename Dict>
 static void load(expire_all& e, Dict& d) {
-    auto [expiry, pubkey, pubkey_ed25519, signature] =
-        load_fields<system_clock::time_point, std::string, std::string_view, std::string_view>(
-            d, "expiry", "pubkey", "pubkey_ed25519", "signature");
+    auto [expiry, pubkey, pubkey_ed25519, quorum, signature] =
+        load_fields<system_clock::time_point, std::string, std::string_view, unsigned, std::string_view>(
+            d, "expiry", "pubkey", "pubkey_ed25519", "quorum", "signature");
 
     load_pk_signature(e, d, pubkey, pubkey_ed25519, signature);
+    e.quorum = quorum.value_or(0);
     require("expiry", expiry);
     e.expiry = std::move(*expiry);
 }
@@ -421,11 +426,12 @@ bt_value expire_all::to_bt() const {
 
 template <typename Dict>
 static void load(expire_msgs& e, Dict& d) {
-    auto [expiry, messages, pubkey, pubkey_ed25519, signature] =
-        load_fields<system_clock::time_point, std::vector<std::string>, std::string, std::string_view, std::string_view>(
-            d, "expiry", "messages", "pubkey", "pubkey_ed25519", "signature");
+    auto [expiry, messages, pubkey, pubkey_ed25519, quorum, signature] =
+        load_fields<system_clock::time_point, std::vector<std::string>, std::string, std::string_view, unsigned, std::string_view>(
+            d, "expiry", "messages", "pubkey", "pubkey_ed25519", "quorum", "signature");
 
     load_pk_signature(e, d, pubkey, pubkey_ed25519, signature);
+    e.quorum = quorum.value_or(0);
     require("expiry", expiry);
     e.expiry = std::move(*expiry);
     require("messages", messages);
@@ -456,12 +462,14 @@ bt_value expire_msgs::to_bt() const {
 
 template <typename Dict>
 static void load(get_swarm& g, Dict& d) {
-    auto [pubKey, pubkey] = load_fields<std::string, std::string>(d, "pubKey", "pubkey");
+    auto [etag, pubKey, pubkey] = load_fields<std::string, std::string, std::string>(
+            d, "etag", "pubKey", "pubkey");
 
     require_exactly_one_of("pubkey", pubkey, "pubKey", pubKey, true);
     if (!g.pubkey.load(std::move(pubkey ? *pubkey : *pubKey)))
         throw parse_error{fmt::format("Pubkey must be {} hex digits/{} bytes long",
                 USER_PUBKEY_SIZE_HEX, USER_PUBKEY_SIZE_BYTES)};
+    g.etag = std::move(etag);
 }
 void get_swarm::load_from(json params) { load(*this, params); }
 void get_swarm::load_from(bt_dict_consumer params) { load(*this, params); }
@@ -8,6 +8,7 @@
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <type_traits>
 
 #include <nlohmann/json.hpp>
 #include <oxenmq/bt_serialize.h>
@@ -54,10 +55,20 @@ struct no_args : endpoint {
 /// - "reason": a reason string, e.g. propagating a thrown exception messages
 /// - "bad_peer_response": true if the peer returned an unparseable response
 /// - "query_failure": true if the database failed to perform the query
+///
+/// Recursive requests also take an optional `quorum` parameter.  By default the reply waits for
+/// every swarm member's result.  If `quorum` is set to N, we reply as soon as N swarm members
+/// (including the node handling the request) have succeeded.  Such a reply has a top-level
+/// "quorum" key with "required" (N), "confirmed" (how many members have succeeded) and "pending"
+/// (a list of the ed25519 pubkeys of the members that had not yet replied).  Results that arrive
+/// after the reply are not included.
 struct recursive : endpoint {
     // True on the initial client request, false on forwarded requests
     bool recurse;
 
+    // If non-zero, reply once this many swarm members have succeeded rather than waiting for all
+    unsigned quorum = 0;
+
     virtual oxenmq::bt_value to_bt() const = 0;
 };
 
@@ -346,10 +357,13 @@ struct expire_msgs final : recursive {
 
 /// Retrieves the swarm information for a given pubkey. Takes keys of:
 /// - `pubkey` (required) the pubkey to query, in hex (66) or bytes (33).
+/// - `etag` (optional) the "etag" value of a previous get_swarm response.  If the swarm is
+///   unchanged since then the response is just `{"etag": ..., "t": ..., "unchanged": true}`.
 struct get_swarm final : endpoint {
     static constexpr auto names() { return NAMES("get_swarm", "get_snodes_for_pubkey"); }
 
     user_pubkey_t pubkey;
+    std::optional<std::string> etag;
 
     void load_from(nlohmann::json params) override;
     void load_from(oxenmq::bt_dict_consumer params) override;
@@ -366,6 +380,9 @@ struct get_swarm final : endpoint {
 ///
 /// See oxend rpc documentation (or the oxen-core/src/rpc/core_rpc_server_command_defs.h file) for
 /// information on using these oxend rpc endpoints.
+///
+/// Successful results are cached until the next block, so repeating a request within the same
+/// block returns the same result (with a new "t" value) without contacting oxend again.
 struct oxend_request final : endpoint {
     static constexpr auto names() { return NAMES("oxend_request"); }
 
@@ -394,4 +411,16 @@ using client_rpc_types = type_list<
     info
 >;
 
+// True for the RPC types above that read or modify the messages of a single owner (`pubkey`);
+// these are the requests that can run on the owner's shard (see request_shards).
+template <typename RPC>
+inline constexpr bool owner_request =
+    std::is_same_v<RPC, store> ||
+    std::is_same_v<RPC, retrieve> ||
+    std::is_same_v<RPC, delete_msgs> ||
+    std::is_same_v<RPC, delete_all> ||
+    std::is_same_v<RPC, delete_before> ||
+    std::is_same_v<RPC, expire_msgs> ||
+    std::is_same_v<RPC, expire_all>;
+
 }
@@ -43,6 +43,13 @@ void command_line_parser::parse_args(int argc, char* argv[]) {
         ("version,v", po::bool_switch(&options_.print_version), "Print the version of this binary")
         ("help", po::bool_switch(&options_.print_help),"Shows this help message")
         ("stats-access-key", po::value(&options_.stats_access_keys)->multitoken(), "A public key (x25519) that will be given access to the `get_stats` omq endpoint")
+        ("omq-threads", po::value(&options_.threads.general), "Number of general OxenMQ worker threads, which handle any kind of request (0 = based on the number of CPU cores)")
+        ("omq-threads-sn", po::value(&options_.threads.sn), "Number of OxenMQ worker threads reserved for requests from other service nodes (0 = based on the number of CPU cores)")
+        ("omq-threads-storage", po::value(&options_.threads.storage), "Number of OxenMQ worker threads reserved for client requests over OxenMQ (0 = based on the number of CPU cores)")
+        ("omq-threads-https", po::value(&options_.threads.https), "Number of OxenMQ worker threads reserved for HTTPS requests (0 = based on the number of CPU cores)")
+        ("omq-threads-bulk", po::value(&options_.threads.bulk), "Number of OxenMQ worker threads reserved for storing message transfers from other service nodes (0 = based on the number of CPU cores)")
+        ("client-shards", po::value(&options_.client_shards), "Number of worker threads that client requests are sharded across by owner pubkey, each with its own database read connection (0 = process client requests on whichever thread receives them)")
+        ("store-batch-window", po::value(&options_.store_batch_window), "How long (in milliseconds) to wait for more stores headed to the same swarm member before forwarding them together; 0 only combines stores that are already waiting to be sent")
 #ifdef INTEGRATION_TEST
         ("oxend-key", po::value(&options_.oxend_key), "Legacy secret key (integration testing only)")
         ("oxend-x25519-key", po::value(&options_.oxend_x25519_key), "x25519 secret key (integration testing only)")
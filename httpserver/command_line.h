@@ -1,5 +1,7 @@
 #pragma once
 
+#include "thread_pools.h"
+
 #include <boost/program_options.hpp>
 #include <string>
 
@@ -21,6 +23,12 @@ struct command_line_options {
     std::string oxend_ed25519_key; // test only
     // x25519 key that will be given access to get_stats omq endpoint
     std::vector<std::string> stats_access_keys;
+    // How long (in ms) we wait to coalesce stores forwarded to the same swarm member
+    uint16_t store_batch_window = 1;
+    // OxenMQ worker thread counts; 0 means pick based on the number of cores
+    thread_counts threads;
+    // Number of per-owner client request worker threads; 0 disables request sharding
+    int client_shards = 0;
 };
 
 class command_line_parser {
@@ -0,0 +1,75 @@
+#include "concurrency_limiter.h"
+
+#include <vector>
+
+namespace oxen {
+
+ConcurrencyLimiter::ConcurrencyLimiter(size_t max_in_flight, size_t max_per_key,
+        size_t max_queued, size_t max_queued_per_key)
+    : max_in_flight_{max_in_flight},
+      max_per_key_{max_per_key},
+      max_queued_{max_queued},
+      max_queued_per_key_{max_queued_per_key} {}
+
+bool ConcurrencyLimiter::submit(const std::string& key, std::function<void()> start) {
+    {
+        std::lock_guard lock{mutex_};
+        auto& c = keys_[key];
+        if (in_flight_ < max_in_flight_ && c.in_flight < max_per_key_) {
+            in_flight_++;
+            c.in_flight++;
+        } else if (queue_.size() < max_queued_ && c.queued < max_queued_per_key_) {
+            c.queued++;
+            queue_.emplace_back(key, std::move(start));
+            return true;
+        } else {
+            if (c.in_flight == 0 && c.queued == 0)
+                keys_.erase(key);
+            return false;
+        }
+    }
+    start();
+    return true;
+}
+
+void ConcurrencyLimiter::finished(const std::string& key) {
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard lock{mutex_};
+        auto it = keys_.find(key);
+        if (it == keys_.end() || it->second.in_flight == 0)
+            return;
+        in_flight_--;
+        if (--it->second.in_flight == 0 && it->second.queued == 0)
+            keys_.erase(it);
+
+        // Start queued operations, oldest first, skipping over any whose destination is still
+        // at its limit.
+        for (auto q = queue_.begin(); q != queue_.end() && in_flight_ < max_in_flight_;) {
+            auto& c = keys_[q->first];
+            if (c.in_flight >= max_per_key_) {
+                ++q;
+                continue;
+            }
+            c.queued--;
+            c.in_flight++;
+            in_flight_++;
+            ready.push_back(std::move(q->second));
+            q = queue_.erase(q);
+        }
+    }
+    for (auto& start : ready)
+        start();
+}
+
+size_t ConcurrencyLimiter::in_flight() const {
+    std::lock_guard lock{mutex_};
+    return in_flight_;
+}
+
+size_t ConcurrencyLimiter::queued() const {
+    std::lock_guard lock{mutex_};
+    return queue_.size();
+}
+
+} // namespace oxen
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace oxen {
+
+/// Limits how many asynchronous operations (e.g. outgoing HTTP requests) are in progress at once,
+/// both in total and per destination.  Operations over the limit wait in a bounded queue and are
+/// started, in order, as earlier ones finish; once the queue is full (or a single destination has
+/// used up its share of it) new operations are refused rather than queued, so that a slow
+/// destination can't make us accumulate an unbounded backlog.
+class ConcurrencyLimiter {
+  public:
+    ConcurrencyLimiter(size_t max_in_flight, size_t max_per_key, size_t max_queued,
+            size_t max_queued_per_key);
+
+    // Starts `start` right away if both limits allow it, otherwise queues it.  Returns false if the
+    // operation could be neither started nor queued, in which case `start` is not called.  Every
+    // operation that gets started must be followed (eventually) by a call to `finished(key)`.
+    //
+    // `start` is never called with the limiter's lock held, so it may call back into the limiter.
+    bool submit(const std::string& key, std::function<void()> start);
+
+    // Signals that an operation started for `key` has completed, and starts any queued operations
+    // that can now go ahead.
+    void finished(const std::string& key);
+
+    size_t in_flight() const;
+    size_t queued() const;
+
+  private:
+    struct counts {
+        size_t in_flight = 0;
+        size_t queued = 0;
+    };
+
+    const size_t max_in_flight_, max_per_key_, max_queued_, max_queued_per_key_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, counts> keys_;
+    std::deque<std::pair<std::string, std::function<void()>>> queue_;
+    size_t in_flight_ = 0;
+};
+
+} // namespace oxen
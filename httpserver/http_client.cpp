@@ -0,0 +1,205 @@
+#include "http_client.h"
+#include "oxen_logger.h"
+#include "string_utils.hpp"
+
+#include <curl/curl.h>
+#include <oxenmq/oxenmq.h>
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace oxen {
+
+struct HttpClient::transfer {
+    CURL* easy = nullptr;
+    curl_slist* headers = nullptr;
+    Request req;
+    Response res;
+    std::function<void(Response)> callback;
+    char error[CURL_ERROR_SIZE] = {};
+
+    ~transfer() {
+        if (easy)
+            curl_easy_cleanup(easy);
+        if (headers)
+            curl_slist_free_all(headers);
+    }
+};
+
+const std::string* HttpClient::Response::header(std::string_view name) const {
+    for (auto& [k, v] : headers)
+        if (k.size() == name.size() && std::equal(k.begin(), k.end(), name.begin(),
+                    [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); }))
+            return &v;
+    return nullptr;
+}
+
+static size_t write_body(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    static_cast<HttpClient::Response*>(userdata)->body.append(ptr, size * nmemb);
+    return size * nmemb;
+}
+
+static size_t write_header(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    auto& res = *static_cast<HttpClient::Response*>(userdata);
+    std::string_view line{ptr, size * nmemb};
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+        line.remove_suffix(1);
+
+    if (util::starts_with(line, "HTTP/")) {
+        // A new status line (there can be more than one, e.g. after a 100 Continue), so start over
+        res.headers.clear();
+        res.status_text.clear();
+        // "HTTP/1.1 200 OK": we want the "OK"
+        if (auto sp = line.find(' '); sp != std::string_view::npos)
+            if (auto sp2 = line.find(' ', sp + 1); sp2 != std::string_view::npos)
+                res.status_text = line.substr(sp2 + 1);
+    } else if (auto colon = line.find(':'); colon != std::string_view::npos) {
+        std::string name{line.substr(0, colon)};
+        std::transform(name.begin(), name.end(), name.begin(),
+                [](unsigned char c) { return std::tolower(c); });
+        auto value = line.substr(colon + 1);
+        while (!value.empty() && value.front() == ' ')
+            value.remove_prefix(1);
+        res.headers.emplace_back(std::move(name), value);
+    }
+    return size * nmemb;
+}
+
+HttpClient::HttpClient(oxenmq::OxenMQ& omq) : omq_{omq} {
+    static std::once_flag curl_init;
+    std::call_once(curl_init, [] { curl_global_init(CURL_GLOBAL_ALL); });
+
+    multi_ = curl_multi_init();
+    if (!multi_)
+        throw std::runtime_error{"Failed to initialize curl"};
+    curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS, MAX_IDLE_CONNECTIONS);
+    curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS);
+
+    thread_ = std::thread{[this] { run(); }};
+}
+
+HttpClient::~HttpClient() {
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+    }
+    curl_multi_wakeup(multi_);
+    thread_.join();
+    curl_multi_cleanup(multi_);
+}
+
+void HttpClient::post(Request req, std::function<void(Response)> callback) {
+    auto t = std::make_unique<transfer>();
+    t->req = std::move(req);
+    t->callback = std::move(callback);
+    pending_++;
+    {
+        std::lock_guard lock{mutex_};
+        queue_.push_back(std::move(t));
+    }
+    curl_multi_wakeup(multi_);
+}
+
+// Sets up the easy handle for a new transfer
+static void setup(HttpClient::Request& req, HttpClient::Response& res, CURL* easy,
+        curl_slist*& headers, char* error) {
+    curl_easy_setopt(easy, CURLOPT_URL, req.url.c_str());
+    curl_easy_setopt(easy, CURLOPT_POST, 1L);
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, req.body.data());
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(req.body.size()));
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, static_cast<long>(req.timeout.count()));
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 0L);
+    curl_easy_setopt(easy, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
+    if (!req.verify_tls) {
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+    curl_easy_setopt(easy, CURLOPT_DNS_CACHE_TIMEOUT,
+            static_cast<long>(std::chrono::seconds{HttpClient::DNS_CACHE_TIME}.count()));
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    for (auto& [k, v] : req.headers)
+        headers = curl_slist_append(headers, (k + ": " + v).c_str());
+    // Don't make curl wait for a "100 Continue" before sending larger bodies
+    headers = curl_slist_append(headers, "Expect:");
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &res);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, write_header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, &res);
+    curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, error);
+}
+
+void HttpClient::run() {
+    std::vector<std::unique_ptr<transfer>> incoming;
+    std::unordered_map<CURL*, std::unique_ptr<transfer>> active;
+    while (true) {
+        {
+            std::lock_guard lock{mutex_};
+            if (stopping_)
+                break;
+            incoming.swap(queue_);
+        }
+
+        for (auto& t : incoming) {
+            t->easy = curl_easy_init();
+            if (!t->easy) {
+                OXEN_LOG(err, "Failed to create curl handle for request to {}", t->req.url);
+                t->res.error = "Failed to create curl handle";
+                pending_--;
+                omq_.job([cb=std::move(t->callback), res=std::move(t->res)]() mutable {
+                    cb(std::move(res));
+                });
+                continue;
+            }
+            setup(t->req, t->res, t->easy, t->headers, t->error);
+            curl_multi_add_handle(multi_, t->easy);
+            active.emplace(t->easy, std::move(t));
+        }
+        incoming.clear();
+
+        int running;
+        curl_multi_perform(multi_, &running);
+
+        int remaining;
+        while (CURLMsg* msg = curl_multi_info_read(multi_, &remaining)) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            auto it = active.find(msg->easy_handle);
+            if (it == active.end())
+                continue;
+            auto t = std::move(it->second);
+            active.erase(it);
+            // `msg` is invalidated by removing the handle, so take what we need first
+            auto result = msg->data.result;
+            curl_multi_remove_handle(multi_, t->easy);
+
+            auto& res = t->res;
+            if (result == CURLE_OK) {
+                long code = 0;
+                curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &code);
+                res.ok = true;
+                res.status_code = static_cast<int>(code);
+            } else {
+                res.timed_out = result == CURLE_OPERATION_TIMEDOUT;
+                res.error = t->error[0] ? t->error : curl_easy_strerror(result);
+            }
+            pending_--;
+            omq_.job([cb=std::move(t->callback), res=std::move(res)]() mutable {
+                cb(std::move(res));
+            });
+        }
+
+        curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+    }
+
+    // Shutting down: drop anything still in progress
+    for (auto& [easy, t] : active)
+        curl_multi_remove_handle(multi_, easy);
+}
+
+} // namespace oxen
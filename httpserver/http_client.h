@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace oxenmq {
+class OxenMQ;
+}
+
+namespace oxen {
+
+using namespace std::literals;
+
+/// Asynchronous HTTP(S) client for our outgoing requests (HTTPS reachability tests, legacy storage
+/// tests, and onion requests proxied to a server).  All requests are driven by a single thread
+/// using libcurl's multi interface, which also lets them share open connections (so that repeated
+/// requests to the same host reuse a kept-alive connection) and a DNS cache.  Completion
+/// callbacks are queued as OxenMQ jobs rather than being called on the client's thread.
+class HttpClient {
+  public:
+    // How many idle connections we keep around for reuse, and how many connections we open at
+    // once to any one host (further requests to the host queue until one is available).
+    inline static constexpr long MAX_IDLE_CONNECTIONS = 256;
+    inline static constexpr long MAX_HOST_CONNECTIONS = 8;
+
+    // How long resolved host names are cached
+    inline static constexpr auto DNS_CACHE_TIME = 5min;
+
+    struct Request {
+        std::string url;
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+        // The deadline for the whole request, including connecting and reading the response
+        std::chrono::milliseconds timeout = 30s;
+        // Verify the remote's TLS certificate; turned off for requests to service nodes, which
+        // use self-signed certificates.
+        bool verify_tls = true;
+    };
+
+    struct Response {
+        // True if we got an HTTP response (of any status); false if the request failed, in which
+        // case `error` says why.
+        bool ok = false;
+        bool timed_out = false;
+        std::string error;
+
+        int status_code = 0;
+        std::string status_text;
+        // Response headers, with lower-case names
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+
+        // Returns the value of a response header (the name is case-insensitive), or nullptr if
+        // not present.
+        const std::string* header(std::string_view name) const;
+    };
+
+    explicit HttpClient(oxenmq::OxenMQ& omq);
+
+    // Stops the client thread; callbacks of requests still in progress are not called.
+    ~HttpClient();
+
+    // Starts a POST request; `callback` is called with the result once it completes.
+    void post(Request req, std::function<void(Response)> callback);
+
+    // The number of requests that have been started but not yet completed.
+    size_t pending() const { return pending_; }
+
+  private:
+    struct transfer;
+
+    oxenmq::OxenMQ& omq_;
+    void* multi_; // CURLM*
+
+    std::vector<std::unique_ptr<transfer>> queue_;
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::atomic<size_t> pending_ = 0;
+
+    std::thread thread_;
+
+    void run();
+};
+
+} // namespace oxen
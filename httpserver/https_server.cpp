@@ -73,7 +73,7 @@ HTTPSServer::HTTPSServer(
     // Add a category for handling incoming https requests
     omq_.add_category("https",
             oxenmq::AuthLevel::basic,
-            2, // minimum # of threads reserved threads for this category
+            service_node_.omq_server().threads().https, // threads reserved for this category
             1000 // max queued requests
     );
 
@@ -21,6 +21,7 @@
 #include <cstdlib>
 #include <filesystem>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -185,11 +186,16 @@ int main(int argc, char* argv[]) {
 
         // Set up oxenmq now, but don't actually start it until after we set up the ServiceNode
         // instance (because ServiceNode and OxenmqServer reference each other).
-        auto oxenmq_server_ptr = std::make_unique<OxenmqServer>(me, private_key_x25519, stats_access_keys);
+        auto threads = options.threads.resolve(std::thread::hardware_concurrency());
+        OXEN_LOG(info, "Using {} general OxenMQ threads; reserved threads: {} sn, {} storage, {} https, {} bulk",
+                threads.general, threads.sn, threads.storage, threads.https, threads.bulk);
+        auto oxenmq_server_ptr = std::make_unique<OxenmqServer>(
+                me, private_key_x25519, stats_access_keys, threads);
         auto& oxenmq_server = *oxenmq_server_ptr;
 
         ServiceNode service_node{
-            me, private_key, oxenmq_server, data_dir, options.force_start};
+            me, private_key, oxenmq_server, data_dir, options.force_start,
+            std::chrono::milliseconds{options.store_batch_window}, options.client_shards};
 
         RequestHandler request_handler{service_node, channel_encryption, private_key_ed25519};
 
@@ -14,6 +14,8 @@
 
 #include <chrono>
 #include <exception>
+#include <filesystem>
+#include <future>
 #include <nlohmann/json.hpp>
 #include <oxenmq/bt_serialize.h>
 #include <oxenmq/hex.h>
@@ -40,28 +42,123 @@ std::string OxenmqServer::peer_lookup(std::string_view pubkey_bin) const {
     return "";
 }
 
+namespace {
+
+// A task queued in (or being run by) the "bulk" category on behalf of an sn request.  It holds one
+// of the slots counted by `pending` until it is destroyed, and sends the `failed` reply then if it
+// hasn't replied yet (e.g. because the task threw, or OxenMQ dropped it without running it).
+struct bulk_task {
+    std::atomic<int>& pending;
+    oxenmq::Message::DeferredSend send;
+    std::vector<std::string> failed;
+    bool replied = false;
+
+    bulk_task(std::atomic<int>& pending, oxenmq::Message::DeferredSend send,
+            std::vector<std::string> failed)
+        : pending{pending}, send{std::move(send)}, failed{std::move(failed)} {}
+    bulk_task(const bulk_task&) = delete;
+    bulk_task& operator=(const bulk_task&) = delete;
+
+    template <typename... T>
+    void reply(T&&... parts) {
+        replied = true;
+        send.reply(std::forward<T>(parts)...);
+    }
+
+    ~bulk_task() {
+        if (!replied)
+            send.reply(oxenmq::send_option::data_parts(failed.begin(), failed.end()));
+        pending--;
+    }
+};
+
+// Reserves one of the `max` slots counted by `pending`; returns false if they are all taken.
+// There can be several sn threads doing this at once, so the slot is taken before checking.
+bool reserve_slot(std::atomic<int>& pending, int max) {
+    if (pending.fetch_add(1) < max)
+        return true;
+    pending--;
+    return false;
+}
+
+} // namespace
+
 void OxenmqServer::handle_sn_data(oxenmq::Message& message) {
 
     OXEN_LOG(debug, "[LMQ] handle_sn_data");
-    OXEN_LOG(debug, "[LMQ]   thread id: {}", std::this_thread::get_id());
     OXEN_LOG(debug, "[LMQ]   from: {}", oxenmq::to_hex(message.conn.pubkey()));
 
-    std::stringstream ss;
+    // Storing a batch can take a while, so we don't do it here: that would hold up the sn.*
+    // requests (onion requests, pings, forwarded client requests, etc.) that need to be answered
+    // quickly.  Instead it gets queued in the "bulk" category, which has its own threads.
+    if (!reserve_slot(bulk_pending_, BULK_MAX_QUEUE)) {
+        OXEN_LOG(debug, "Too many data batches queued; rejecting batch from {}", message.remote);
+        return message.send_reply("ERROR");
+    }
+
+    // From here on the slot belongs to `task` (inject_task needs a copyable function, hence the
+    // shared_ptr)
+    auto task = std::make_shared<bulk_task>(
+            bulk_pending_, message.send_later(), std::vector<std::string>{"ERROR"});
 
+    std::string blob;
     // We are only expecting a single part message, so consider removing this
-    for (auto& part : message.data) {
-        ss << part;
+    for (auto& part : message.data)
+        blob += part;
+
+    omq_.inject_task("bulk", "sn.data", message.remote, [this, task, blob = std::move(blob)] {
+        OXEN_LOG(debug, "[LMQ] storing {}-byte data batch", blob.size());
+
+        bool stored = false;
+        try {
+            // TODO: proces push batch should move to "Request handler"
+            stored = service_node_->process_push_batch(blob);
+        } catch (const std::exception& e) {
+            OXEN_LOG(err, "Failed to store data batch: {}", e.what());
+        }
+
+        // The reply acknowledges the batch, so that the sender knows whether it has to resend it
+        task->reply(stored ? "OK" : "ERROR");
+    });
+}
+
+void OxenmqServer::handle_sn_reconcile(oxenmq::Message& message) {
+    if (message.conn.pubkey().size() != 32) {
+        OXEN_LOG(err, "bug: invalid sn.reconcile omq request from {} with no pubkey", message.remote);
+        return message.send_reply("ERROR", "invalid pubkey");
     }
 
-    // TODO: proces push batch should move to "Request handler"
-    service_node_->process_push_batch(ss.str());
+    // Answering can mean scanning the database for our fingerprints (when the cached ones are too
+    // old), and fetches read messages from it, so like sn.data this goes to the bulk threads.
+    if (!reserve_slot(reconcile_pending_, RECONCILE_MAX_QUEUE)) {
+        OXEN_LOG(debug, "Too many reconciliation requests queued; rejecting request from {}",
+                message.remote);
+        return message.send_reply("ERROR", "busy");
+    }
 
-    OXEN_LOG(debug, "[LMQ] send reply");
+    auto task = std::make_shared<bulk_task>(reconcile_pending_, message.send_later(),
+            std::vector<std::string>{"ERROR", "request failed"});
+
+    omq_.inject_task("bulk", "sn.reconcile", message.remote,
+        [this, task, from = x25519_pubkey::from_bytes(message.conn.pubkey()),
+            parts = std::vector<std::string>{message.data.begin(), message.data.end()},
+            remote = message.remote] {
+            try {
+                auto reply = service_node_->process_reconcile(
+                        from, std::vector<std::string_view>{parts.begin(), parts.end()});
+                task->reply(oxenmq::send_option::data_parts(reply.begin(), reply.end()));
+            } catch (const std::exception& e) {
+                OXEN_LOG(debug, "invalid sn.reconcile omq request from {}: {}", remote, e.what());
+                task->reply("ERROR", e.what());
+            }
+        });
+}
 
-    // TODO: Investigate if the above could fail and whether we should report
-    // that to the sending SN
-    message.send_reply();
-};
+void OxenmqServer::handle_sn_store_batch(oxenmq::Message& message) {
+    OXEN_LOG(debug, "Handling batch of {} forwarded stores", message.data.size());
+    auto replies = request_handler_->process_store_batch(message.data);
+    message.send_reply(oxenmq::send_option::data_parts(replies.begin(), replies.end()));
+}
 
 void OxenmqServer::handle_ping(oxenmq::Message& message) {
     OXEN_LOG(debug, "Remote pinged me");
@@ -195,6 +292,31 @@ void OxenmqServer::handle_get_stats(oxenmq::Message& message) {
     message.send_reply(payload);
 }
 
+void OxenmqServer::handle_snapshot(oxenmq::Message& message, bool export_) {
+
+    if (message.data.size() != 1) {
+        message.send_reply("error", "expected a single snapshot path argument");
+        return;
+    }
+
+    std::filesystem::path path{std::filesystem::u8path(message.data[0])};
+    OXEN_LOG(info, "Received {} request via LMQ for {}",
+            export_ ? "snapshot export" : "snapshot import", path.u8string());
+
+    // This can take a while for a large database, so don't tie up the service category thread
+    omq_.job([this, path = std::move(path), export_, reply = message.send_later()] {
+        try {
+            auto count = export_
+                ? service_node_->export_snapshot(path)
+                : service_node_->import_snapshot(path);
+            reply.reply(std::to_string(count));
+        } catch (const std::exception& e) {
+            OXEN_LOG(err, "Snapshot {} failed: {}", export_ ? "export" : "import", e.what());
+            reply.reply("error", e.what());
+        }
+    });
+}
+
 namespace {
 
 template <typename RPC>
@@ -216,7 +338,7 @@ void register_client_rpc_endpoint(OxenmqServer::rpc_map& regs) {
         }
         if constexpr (std::is_base_of_v<rpc::recursive, RPC>)
             req.recurse = recursive;
-        h.process_client_req(std::move(req), std::move(cb));
+        h.dispatch_client_req(std::move(req), std::move(cb));
     };
     for (auto& name : RPC::names()) {
         [[maybe_unused]] auto [it, ins] = regs.emplace(name, call);
@@ -383,7 +505,9 @@ void omq_logger(oxenmq::LogLevel level, const char* file, int line,
 OxenmqServer::OxenmqServer(
         const sn_record& me,
         const x25519_seckey& privkey,
-        const std::vector<x25519_pubkey>& stats_access_keys) :
+        const std::vector<x25519_pubkey>& stats_access_keys,
+        const thread_counts& threads) :
+    threads_{threads},
     omq_{
         std::string{me.pubkey_x25519.view()},
         std::string{privkey.view()},
@@ -398,21 +522,33 @@ OxenmqServer::OxenmqServer(
     // clang-format off
 
     // Endpoints invoked by other SNs
-    omq_.add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false}, 2 /*reserved threads*/, 1000 /*max queue*/)
+    omq_.add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false}, threads_.sn, 1000 /*max queue*/)
         .add_request_command("data", [this](auto& m) { handle_sn_data(m); })
         .add_request_command("ping", [this](auto& m) { handle_ping(m); })
+        // The heartbeat reply lists the optional commands we handle, so that peers know what they
+        // can send us.
+        .add_request_command("heartbeat", [](auto& m) { m.send_reply("store_batch"); })
+        .add_request_command("reconcile", [this](auto& m) { handle_sn_reconcile(m); })
         .add_request_command("storage_test", [this](auto& m) { handle_storage_test(m); }) // NB: requires a 60s request timeout
         .add_request_command("onion_request", [this](auto& m) { handle_onion_request(m); })
         .add_request_command("storage_cc", [this](auto& m) {
             if (m.data.size() >= 2) return handle_client_request(m.data[0], m, true);
             OXEN_LOG(warn, "Invalid forwarded client request: incorrect number of message parts ({})",  m.data.size());
         })
+        .add_request_command("store_batch", [this](auto& m) { handle_sn_store_batch(m); })
         ;
 
+    // Bulk message transfers (sn.data) and reconciliation requests (sn.reconcile) between SNs get
+    // handed off to here, so that they have their own threads and queue and can't starve the sn
+    // category.  There are no commands: tasks are only injected, by handle_sn_data() and
+    // handle_sn_reconcile().
+    omq_.add_category("bulk", oxenmq::Access{oxenmq::AuthLevel::none, true, false},
+            threads_.bulk, BULK_MAX_QUEUE + RECONCILE_MAX_QUEUE + BULK_QUEUE_HEADROOM);
+
     // storage.WHATEVER (e.g. storage.store, storage.retrieve, etc.) endpoints are invokable by
     // anyone (i.e. clients) and have the same WHATEVER endpoints as the "method" values for the
     // HTTPS /storage_rpc/v1 endpoint.
-    auto st_cat = omq_.add_category("storage", oxenmq::AuthLevel::none, 1 /*reserved threads*/, 200 /*max queue*/);
+    auto st_cat = omq_.add_category("storage", oxenmq::AuthLevel::none, threads_.storage, 200 /*max queue*/);
     for (const auto& [name, _cb] : RequestHandler::client_rpc_endpoints)
         st_cat.add_request_command(std::string{name}, [this, name=name](auto& m) { handle_client_request(name, m); });
 
@@ -420,6 +556,8 @@ OxenmqServer::OxenmqServer(
     omq_.add_category("service", oxenmq::AuthLevel::admin)
         .add_request_command("get_stats", [this](auto& m) { handle_get_stats(m); })
         .add_request_command("get_logs", [this](auto& m) { handle_get_logs(m); })
+        .add_request_command("export_snapshot", [this](auto& m) { handle_snapshot(m, true); })
+        .add_request_command("import_snapshot", [this](auto& m) { handle_snapshot(m, false); })
         ;
 
     // We send a sub.block to oxend to tell it to push new block notifications to us via this
@@ -431,7 +569,14 @@ OxenmqServer::OxenmqServer(
         });
 
     // clang-format on
-    omq_.set_general_threads(1);
+    omq_.set_general_threads(threads_.general);
+
+    thread_monitor_.add_pool("general", threads_.general);
+    thread_monitor_.add_pool("sn", threads_.sn);
+    thread_monitor_.add_pool("storage", threads_.storage);
+    thread_monitor_.add_pool("https", threads_.https);
+    thread_monitor_.add_pool("bulk", threads_.bulk);
+    omq_.add_timer([this] { probe_threads(); }, thread_monitor::PROBE_INTERVAL);
 
     omq_.MAX_MSG_SIZE =
         10 * 1024 * 1024; // 10 MB (needed by the fileserver, and swarm msg serialization)
@@ -440,6 +585,14 @@ OxenmqServer::OxenmqServer(
     omq_.EPHEMERAL_ROUTING_ID = false;
 }
 
+void OxenmqServer::probe_threads() {
+    if (thread_monitor_.probe_start("general"))
+        omq_.job([this] { thread_monitor_.probe_done("general"); });
+    for (auto* cat : {"sn", "storage", "https", "bulk"})
+        if (thread_monitor_.probe_start(cat))
+            omq_.inject_task(cat, "probe", "", [this, cat] { thread_monitor_.probe_done(cat); });
+}
+
 void OxenmqServer::connect_oxend(const oxenmq::address& oxend_rpc) {
     // Establish our persistent connection to oxend.
     auto start = std::chrono::steady_clock::now();
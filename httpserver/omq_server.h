@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <string>
@@ -11,9 +12,23 @@
 
 #include "oxenmq/bt_serialize.h"
 #include "sn_record.h"
+#include "thread_pools.h"
 
 namespace oxen {
 
+// The most batches we queue up for the "bulk" category that stores the data batches that other SNs
+// send us via sn.data (see OxenmqServer::handle_sn_data).
+inline constexpr int BULK_MAX_QUEUE = 32;
+
+// The most sn.reconcile requests we queue up for the "bulk" category (answering one can mean
+// scanning the database; see OxenmqServer::handle_sn_reconcile).
+inline constexpr int RECONCILE_MAX_QUEUE = 8;
+
+// Extra room in the "bulk" category's queue beyond the above, for the thread monitor's probe (of
+// which there is never more than one queued).  The category's queue must never fill up from our
+// own tasks: OxenMQ drops an injected task when it does.
+inline constexpr int BULK_QUEUE_HEADROOM = 1;
+
 class ServiceNode;
 class RequestHandler;
 class RateLimiter;
@@ -30,6 +45,9 @@ nlohmann::json bt_to_json(oxenmq::bt_list_consumer l);
 
 class OxenmqServer {
 
+    const thread_counts threads_;
+    thread_monitor thread_monitor_;
+
     oxenmq::OxenMQ omq_;
     oxenmq::ConnectionID oxend_conn_;
 
@@ -40,9 +58,17 @@ class OxenmqServer {
 
     RateLimiter* rate_limiter_ = nullptr;
 
+    // sn.data batches queued in, or being stored by, the "bulk" category
+    std::atomic<int> bulk_pending_ = 0;
+    // sn.reconcile requests queued in, or being answered by, the "bulk" category
+    std::atomic<int> reconcile_pending_ = 0;
+
     // Get node's address
     std::string peer_lookup(std::string_view pubkey_bin) const;
 
+    // Timer callback: queues a probe job into each thread pool for thread_monitor_.
+    void probe_threads();
+
     // Handle Session data coming from peer SN
     void handle_sn_data(oxenmq::Message& message);
 
@@ -58,6 +84,12 @@ class OxenmqServer {
     // sn.ping - sent by SNs to ping each other.
     void handle_ping(oxenmq::Message& message);
 
+    // sn.reconcile - anti-entropy reconciliation requests from members of our swarm (see reconcile.h)
+    void handle_sn_reconcile(oxenmq::Message& message);
+
+    // sn.store_batch - a batch of stores forwarded by a member of our swarm (see store_batcher)
+    void handle_sn_store_batch(oxenmq::Message& message);
+
     // sn.storage_test
     void handle_storage_test(oxenmq::Message& message);
 
@@ -84,6 +116,10 @@ class OxenmqServer {
 
     void handle_get_stats(oxenmq::Message& message);
 
+    // Writes (`export` == true) or loads a database snapshot at the path given in the first
+    // message part; replies with the number of messages exported/imported, or an error string.
+    void handle_snapshot(oxenmq::Message& message, bool export_);
+
     // Access pubkeys for the 'service' command category (for access stats & logs), in binary.
     std::unordered_set<std::string> stats_access_keys_;
 
@@ -95,7 +131,8 @@ class OxenmqServer {
     OxenmqServer(
             const sn_record& me,
             const x25519_seckey& privkey,
-            const std::vector<x25519_pubkey>& stats_access_keys_hex);
+            const std::vector<x25519_pubkey>& stats_access_keys_hex,
+            const thread_counts& threads);
 
     // Initialize oxenmq; return a future that completes once we have connected to and initialized
     // from oxend.
@@ -105,6 +142,12 @@ class OxenmqServer {
     oxenmq::OxenMQ& operator*() { return omq_; }
     oxenmq::OxenMQ* operator->() { return &omq_; }
 
+    // The worker thread counts we were configured with (with defaults filled in).
+    const thread_counts& threads() const { return threads_; }
+
+    // How long jobs are waiting for a worker in each thread pool.
+    const thread_monitor& thread_load() const { return thread_monitor_; }
+
     // Returns the OMQ ConnectionID for the connection to oxend.
     const oxenmq::ConnectionID& oxend_conn() const { return oxend_conn_; }
 
@@ -0,0 +1,168 @@
+#include "oxend_cache.h"
+#include "omq_server.h"
+#include "oxen_logger.h"
+
+#include <cassert>
+
+#include <nlohmann/json.hpp>
+#include <oxenmq/bt_serialize.h>
+
+namespace oxen {
+
+using nlohmann::json;
+
+// As with swarm_responses, "t" sorts after "result" so it can simply be appended.
+std::string oxend_cache::entry::json_body(int64_t t) const {
+    std::string body;
+    body.reserve(json.size() + 25);
+    body += json;
+    body += ",\"t\":";
+    body += std::to_string(t);
+    body += '}';
+    return body;
+}
+
+std::string oxend_cache::entry::bt_body(int64_t t) const {
+    assert(bt);
+    std::string body;
+    body.reserve(bt->size() + 26);
+    body += *bt;
+    body += "1:ti";
+    body += std::to_string(t);
+    body += "ee";
+    return body;
+}
+
+// Converts oxend's reply into the reply we give the client.
+static oxend_cache::reply make_reply(bool success, std::vector<std::string>& data) {
+    oxend_cache::reply r;
+    // Currently we only support json endpoints; if we want to support non-json endpoints (which end
+    // in ".bin") at some point in the future then we'll need to return those endpoint results
+    // differently here.
+    if (success && data.size() >= 2 && data[0] == "200") {
+        json result = json::parse(data[1], nullptr, false);
+        if (result.is_discarded()) {
+            OXEN_LOG(warn, "Invalid oxend response to client request: result is not valid json");
+            r.status = http::BAD_GATEWAY;
+            r.error = "oxend returned unparseable data";
+            return r;
+        }
+        auto e = std::make_shared<oxend_cache::entry>();
+        json res{{"result", std::move(result)}};
+        e->json = res.dump();
+        e->json.pop_back(); // }
+        try {
+            e->bt = oxenmq::bt_serialize(json_to_bt(std::move(res)));
+            e->bt->pop_back(); // e
+        } catch (const std::exception&) {
+            // Leave it nullopt; only bt-encoded requests for it will fail
+        }
+        r.result = std::move(e);
+        return r;
+    }
+    r.status = http::BAD_REQUEST;
+    r.error = data.size() >= 2 && !data[1].empty() ? std::move(data[1]) : "Unknown oxend error";
+    return r;
+}
+
+void oxend_cache::get(std::string_view block, std::string_view endpoint,
+        const std::optional<json>& params, callback cb, const fetcher& fetch) {
+
+    if (block.empty()) {
+        {
+            std::lock_guard lock{mutex_};
+            misses_++;
+        }
+        return fetch([cb = std::move(cb)](bool success, std::vector<std::string> data) {
+            cb(make_reply(success, data));
+        });
+    }
+
+    // nlohmann::json keeps object keys sorted, so dumping the params gives the same key for the
+    // same params regardless of how the client ordered (or spaced) them.
+    std::string key{endpoint};
+    key += '\n';
+    if (params && !params->empty())
+        key += params->dump();
+
+    std::shared_ptr<const entry> cached;
+    std::shared_ptr<pending> p;
+    {
+        std::lock_guard lock{mutex_};
+        if (block != block_) {
+            entries_.clear();
+            order_.clear();
+            bytes_ = 0;
+            block_ = block;
+        }
+        if (auto it = entries_.find(key); it != entries_.end()) {
+            hits_++;
+            cached = it->second;
+        } else if (auto it = pending_.find(key); it != pending_.end() && it->second->block == block) {
+            coalesced_++;
+            it->second->waiters.push_back(std::move(cb));
+            return;
+        } else {
+            misses_++;
+            p = std::make_shared<pending>();
+            p->block = block;
+            p->waiters.push_back(std::move(cb));
+            // This replaces any request still in progress from an older block
+            pending_[key] = p;
+        }
+    }
+
+    if (cached) {
+        reply r;
+        r.result = std::move(cached);
+        return cb(r);
+    }
+
+    fetch([this, key = std::move(key), p = std::move(p)](bool success, std::vector<std::string> data) {
+        fetched(key, p, success, std::move(data));
+    });
+}
+
+void oxend_cache::fetched(const std::string& key, const std::shared_ptr<pending>& p,
+        bool success, std::vector<std::string> data) {
+    auto r = make_reply(success, data);
+    std::vector<callback> waiters;
+    {
+        std::lock_guard lock{mutex_};
+        if (auto it = pending_.find(key); it != pending_.end() && it->second == p)
+            pending_.erase(it);
+        if (r.result && p->block == block_)
+            insert(key, r.result);
+        waiters = std::move(p->waiters);
+    }
+    for (auto& cb : waiters) {
+        try {
+            cb(r);
+        } catch (const std::exception& e) {
+            OXEN_LOG(err, "oxend request callback raised an exception: {}", e.what());
+        }
+    }
+}
+
+void oxend_cache::insert(std::string key, std::shared_ptr<const entry> e) {
+    auto size = e->bytes();
+    if (size > MAX_BYTES || entries_.count(key))
+        return;
+    while (bytes_ + size > MAX_BYTES && !order_.empty()) {
+        auto it = entries_.find(order_.front());
+        bytes_ -= it->second->bytes();
+        entries_.erase(it);
+        order_.pop_front();
+        evictions_++;
+    }
+    bytes_ += size;
+    order_.push_back(key);
+    entries_.emplace(std::move(key), std::move(e));
+}
+
+oxend_cache::stats oxend_cache::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return {hits_, coalesced_, misses_, evictions_, entries_.size(), bytes_};
+}
+
+} // namespace oxen
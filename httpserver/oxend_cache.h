@@ -0,0 +1,107 @@
+#pragma once
+
+#include "http.h"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace oxen {
+
+/// Caches the results of the (whitelisted, read-only) oxend rpc requests that clients make through
+/// `oxend_request`.  Results are keyed on the endpoint and the canonical (i.e. key-sorted, compact)
+/// json encoding of the params, and are only valid for the block at which they were fetched: the
+/// whole cache is dropped as soon as a request arrives with a different block hash.
+///
+/// Identical requests made while one is already on its way to oxend don't make another request:
+/// they wait for and share the reply of the first one.  Only successful replies are cached; failures
+/// (including timeouts) are handed to the waiting callers but not kept.
+///
+/// Cached results are stored serialized (as both json and bt), so that answering from the cache
+/// costs no more than a copy; the total size is bounded by MAX_BYTES, evicting the oldest results
+/// first.
+///
+/// This class is thread safe.
+class oxend_cache {
+  public:
+    // The maximum total size of the cached results.
+    inline static constexpr size_t MAX_BYTES = 16 * 1024 * 1024;
+
+    struct entry {
+        // The serialized `{"result": ...}` response, without the final closing `}` (json) or `e`
+        // (bt); use json_body() or bt_body() to complete it with the "t" value.  `bt` is nullopt if
+        // the result cannot be bt-encoded (e.g. because it contains a float or null).
+        std::string json;
+        std::optional<std::string> bt;
+
+        std::string json_body(int64_t t) const;
+        std::string bt_body(int64_t t) const;
+
+        size_t bytes() const { return json.size() + (bt ? bt->size() : 0); }
+    };
+
+    // The reply to a request: `result` is set if oxend returned a result; otherwise `status` and
+    // `error` contain the failure to return to the client.
+    struct reply {
+        http::response_code status = http::OK;
+        std::shared_ptr<const entry> result;
+        std::string error;
+    };
+
+    using callback = std::function<void(const reply&)>;
+
+    // Makes the actual request to oxend, calling the given function (exactly once) with oxend's
+    // reply in the form that OxenMQ returns it: `success` and the reply message parts.
+    using fetcher = std::function<void(std::function<void(bool success, std::vector<std::string> data)>)>;
+
+    struct stats {
+        // Requests answered from the cache, by joining an identical request that was already in
+        // progress, and by making a request to oxend.
+        uint64_t hits, coalesced, misses;
+        // Results dropped to stay within MAX_BYTES
+        uint64_t evictions;
+        size_t entries, bytes;
+    };
+
+    // Answers a request to `endpoint` with `params` at block `block` (the block hash).  `cb` is
+    // invoked immediately with a cached result, when there is one; otherwise it is invoked once
+    // oxend replies to `fetch` (which is only called if there isn't an identical request already in
+    // progress).  If `block` is empty (e.g. while oxend is syncing) then the cache is bypassed
+    // entirely.
+    void get(std::string_view block, std::string_view endpoint,
+            const std::optional<nlohmann::json>& params, callback cb, const fetcher& fetch);
+
+    stats get_stats() const;
+
+  private:
+    struct pending {
+        std::string block;
+        std::vector<callback> waiters;
+    };
+
+    // Called with oxend's reply to the request for `key`.
+    void fetched(const std::string& key, const std::shared_ptr<pending>& p, bool success,
+            std::vector<std::string> data);
+
+    void insert(std::string key, std::shared_ptr<const entry> e);
+
+    mutable std::mutex mutex_;
+    std::string block_;
+    std::unordered_map<std::string, std::shared_ptr<const entry>> entries_;
+    // Keys of `entries_` in insertion order, for eviction
+    std::deque<std::string> order_;
+    size_t bytes_ = 0;
+    std::unordered_map<std::string, std::shared_ptr<pending>> pending_;
+    uint64_t hits_ = 0, coalesced_ = 0, misses_ = 0, evictions_ = 0;
+};
+
+} // namespace oxen
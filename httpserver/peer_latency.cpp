@@ -0,0 +1,67 @@
+#include "peer_latency.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace oxen {
+
+using std::chrono::milliseconds;
+
+milliseconds peer_latency::peer::quantile(double q) const {
+    std::vector<milliseconds> sorted{samples.begin(), samples.begin() + std::min(count, SAMPLES)};
+    auto nth = sorted.begin() + static_cast<size_t>(q * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), nth, sorted.end());
+    return *nth;
+}
+
+void peer_latency::success(const legacy_pubkey& pk, milliseconds rtt) {
+    std::lock_guard lock{mutex_};
+    auto& p = peers_[pk];
+    p.samples[p.count % SAMPLES] = rtt;
+    p.average = p.count == 0 ? rtt.count()
+        : p.average + EWMA_WEIGHT * (rtt.count() - p.average);
+    p.count++;
+    p.failures = 0;
+}
+
+void peer_latency::failure(const legacy_pubkey& pk) {
+    std::lock_guard lock{mutex_};
+    peers_[pk].failures++;
+}
+
+milliseconds peer_latency::timeout(const legacy_pubkey& pk) const {
+    std::lock_guard lock{mutex_};
+    auto it = peers_.find(pk);
+    if (it == peers_.end() || it->second.count < MIN_SAMPLES)
+        return MAX_TIMEOUT;
+    auto& p = it->second;
+    auto t = TIMEOUT_MULTIPLIER * p.quantile(0.95);
+    for (int i = 0; i < p.failures && t < MAX_TIMEOUT; i++)
+        t *= 2;
+    return std::clamp<milliseconds>(t, MIN_TIMEOUT, MAX_TIMEOUT);
+}
+
+bool peer_latency::unreachable(const legacy_pubkey& pk) const {
+    std::lock_guard lock{mutex_};
+    auto it = peers_.find(pk);
+    return it != peers_.end() && it->second.failures >= UNREACHABLE_FAILURES;
+}
+
+std::optional<peer_latency::summary> peer_latency::get(const legacy_pubkey& pk) const {
+    std::lock_guard lock{mutex_};
+    auto it = peers_.find(pk);
+    if (it == peers_.end())
+        return std::nullopt;
+    auto& p = it->second;
+    summary s;
+    s.samples = std::min(p.count, SAMPLES);
+    s.failures = p.failures;
+    if (p.count > 0) {
+        s.average = milliseconds{static_cast<int64_t>(p.average + 0.5)};
+        s.p50 = p.quantile(0.5);
+        s.p95 = p.quantile(0.95);
+    }
+    return s;
+}
+
+} // namespace oxen
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "oxend_key.h"
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+namespace oxen {
+
+using namespace std::literals;
+
+/// Tracks the response times and failures of requests to other service nodes, so that requests
+/// that wait on several peers at once (such as recursive swarm requests) can use deadlines based on
+/// how quickly each peer usually answers, rather than one fixed timeout that a single slow or dead
+/// peer holds everyone to.
+class peer_latency {
+  public:
+    // How many recent response times we keep per peer for computing percentiles.
+    inline static constexpr size_t SAMPLES = 64;
+
+    // Until we have this many samples for a peer we use MAX_TIMEOUT.
+    inline static constexpr size_t MIN_SAMPLES = 5;
+
+    // A peer's timeout is TIMEOUT_MULTIPLIER times its 95th percentile response time, doubled for
+    // each consecutive failure, and kept within [MIN_TIMEOUT, MAX_TIMEOUT].
+    inline static constexpr int TIMEOUT_MULTIPLIER = 3;
+    inline static constexpr auto MIN_TIMEOUT = 1s;
+    inline static constexpr auto MAX_TIMEOUT = 5s;
+
+    // After this many consecutive failures we consider a peer unreachable until it next answers.
+    inline static constexpr int UNREACHABLE_FAILURES = 3;
+
+    // Weight of each new response time in the moving average.
+    inline static constexpr double EWMA_WEIGHT = 0.125;
+
+    struct summary {
+        std::chrono::milliseconds average{0}; // Exponentially weighted moving average
+        std::chrono::milliseconds p50{0};
+        std::chrono::milliseconds p95{0};
+        size_t samples = 0;
+        int failures = 0; // Consecutive
+    };
+
+    // Records a response from `pk` that took `rtt`.
+    void success(const legacy_pubkey& pk, std::chrono::milliseconds rtt);
+
+    // Records a request to `pk` that failed or timed out.
+    void failure(const legacy_pubkey& pk);
+
+    // Returns how long to wait for a response from `pk`.
+    std::chrono::milliseconds timeout(const legacy_pubkey& pk) const;
+
+    // True if the last UNREACHABLE_FAILURES requests to `pk` all failed.
+    bool unreachable(const legacy_pubkey& pk) const;
+
+    std::optional<summary> get(const legacy_pubkey& pk) const;
+
+  private:
+    struct peer {
+        std::array<std::chrono::milliseconds, SAMPLES> samples;
+        size_t count = 0; // Total samples recorded; the latest goes in samples[(count-1) % SAMPLES]
+        double average = 0;
+        int failures = 0;
+
+        // Returns the `q`th quantile (0 to 1) of the recorded samples; requires count > 0.
+        std::chrono::milliseconds quantile(double q) const;
+    };
+
+    std::unordered_map<legacy_pubkey, peer> peers_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace oxen
@@ -82,10 +82,10 @@ std::optional<sn_record> reachability_testing::next_random(
 
     // We exhausted the queue so repopulate it and try again
 
-    auto& all = swarm.all_funded_nodes();
-    testing_queue.reserve(all.size());
+    auto state = swarm.snapshot();
+    testing_queue.reserve(state->all_funded_nodes.size());
 
-    for (const auto& [pk, _sn] : all)
+    for (const auto& [pk, _sn] : state->all_funded_nodes)
         testing_queue.push_back(pk);
 
     std::shuffle(testing_queue.begin(), testing_queue.end(), util::rng());
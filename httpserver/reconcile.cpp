@@ -0,0 +1,310 @@
+#include "reconcile.h"
+
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace oxen::reconcile {
+
+uint64_t fingerprint(std::string_view msg_hash) {
+    // FNV-1a, followed by the murmur3 finalizer so that the high bits (which decide which range a
+    // message falls into) are well mixed.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : msg_hash) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+std::vector<range> split(const range& r) {
+    std::vector<range> parts;
+    const uint64_t width = r.hi - r.lo; // One less than the actual width
+    const uint64_t step = width / FANOUT + 1;
+    uint64_t lo = r.lo;
+    for (size_t i = 0; i < FANOUT; i++) {
+        if (i == FANOUT - 1 || width - (lo - r.lo) < step) {
+            parts.push_back({lo, r.hi});
+            break;
+        }
+        parts.push_back({lo, lo + step - 1});
+        lo += step;
+    }
+    return parts;
+}
+
+fingerprint_set::fingerprint_set(std::vector<std::string> msg_hashes) {
+    entries_.reserve(msg_hashes.size());
+    for (auto& h : msg_hashes)
+        entries_.emplace_back(fingerprint(h), std::move(h));
+    std::sort(entries_.begin(), entries_.end());
+    // A message stored for more than one owner (or, very improbably, a fingerprint collision)
+    // only counts once.
+    entries_.erase(std::unique(entries_.begin(), entries_.end(),
+                [](const auto& a, const auto& b) { return a.first == b.first; }),
+            entries_.end());
+
+    prefix_.resize(entries_.size() + 1);
+    for (size_t i = 0; i < entries_.size(); i++)
+        prefix_[i + 1] = prefix_[i] ^ entries_[i].first;
+}
+
+std::pair<size_t, size_t> fingerprint_set::bounds(const range& r) const {
+    auto begin = std::lower_bound(entries_.begin(), entries_.end(), r.lo,
+            [](const auto& e, uint64_t fp) { return e.first < fp; });
+    auto end = std::upper_bound(begin, entries_.end(), r.hi,
+            [](uint64_t fp, const auto& e) { return fp < e.first; });
+    return {begin - entries_.begin(), end - entries_.begin()};
+}
+
+summary fingerprint_set::summarize(const range& r) const {
+    auto [b, e] = bounds(r);
+    return {e - b, prefix_[e] ^ prefix_[b]};
+}
+
+std::vector<uint64_t> fingerprint_set::fingerprints(const range& r) const {
+    auto [b, e] = bounds(r);
+    std::vector<uint64_t> fps;
+    fps.reserve(e - b);
+    for (auto i = b; i < e; i++)
+        fps.push_back(entries_[i].first);
+    return fps;
+}
+
+std::vector<std::string> fingerprint_set::hashes(const range& r) const {
+    auto [b, e] = bounds(r);
+    std::vector<std::string> result;
+    result.reserve(e - b);
+    for (auto i = b; i < e; i++)
+        result.push_back(entries_[i].second);
+    return result;
+}
+
+const std::string* fingerprint_set::find(uint64_t fp) const {
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), fp,
+            [](const auto& e, uint64_t fp) { return e.first < fp; });
+    if (it == entries_.end() || it->first != fp)
+        return nullptr;
+    return &it->second;
+}
+
+std::vector<reply> respond(const fingerprint_set& ours, const std::vector<query>& queries) {
+    std::vector<reply> replies;
+    replies.reserve(queries.size());
+    for (auto& q : queries) {
+        auto& rep = replies.emplace_back();
+        auto s = ours.summarize(q.r);
+        if (s == q.s)
+            rep.k = reply::kind::same;
+        else if (s.count <= LEAF_SIZE) {
+            // Only our count matters here: it bounds the size of the reply, whereas a requester
+            // with few (or no) fingerprints in a huge range would otherwise get all of ours at
+            // once.
+            rep.k = reply::kind::leaf;
+            rep.fps = ours.fingerprints(q.r);
+        } else {
+            rep.k = reply::kind::split;
+            for (auto& part : split(q.r))
+                rep.parts.push_back(ours.summarize(part));
+        }
+    }
+    return replies;
+}
+
+session::session(std::shared_ptr<const fingerprint_set> ours) : ours_{std::move(ours)} {
+    pending_.push_back(range{});
+}
+
+std::vector<query> session::next_queries() {
+    std::vector<query> queries;
+    while (!pending_.empty() && queries.size() < MAX_RANGES) {
+        auto& r = pending_.back();
+        queries.push_back({r, ours_->summarize(r)});
+        pending_.pop_back();
+    }
+    return queries;
+}
+
+void session::process(const std::vector<query>& sent, const std::vector<reply>& replies) {
+    if (sent.size() != replies.size())
+        throw std::invalid_argument{"reconciliation reply has the wrong number of ranges"};
+    rounds++;
+
+    for (size_t i = 0; i < sent.size(); i++) {
+        auto& r = sent[i].r;
+        auto& rep = replies[i];
+        switch (rep.k) {
+            case reply::kind::same:
+                break;
+
+            case reply::kind::split: {
+                auto parts = split(r);
+                if (rep.parts.size() != parts.size())
+                    throw std::invalid_argument{"reconciliation reply has the wrong number of parts"};
+                for (size_t j = 0; j < parts.size(); j++) {
+                    auto& theirs = rep.parts[j];
+                    if (theirs == ours_->summarize(parts[j]))
+                        continue;
+                    if (theirs.count == 0) {
+                        // They have nothing at all here, so don't need another round to tell
+                        for (auto& h : ours_->hashes(parts[j]))
+                            extra_.push_back(std::move(h));
+                    } else
+                        pending_.push_back(parts[j]);
+                }
+                break;
+            }
+
+            case reply::kind::leaf: {
+                auto ours = ours_->fingerprints(r);
+                auto theirs = rep.fps;
+                std::sort(theirs.begin(), theirs.end());
+                std::set_difference(theirs.begin(), theirs.end(), ours.begin(), ours.end(),
+                        std::back_inserter(missing_));
+                std::vector<uint64_t> extra;
+                std::set_difference(ours.begin(), ours.end(), theirs.begin(), theirs.end(),
+                        std::back_inserter(extra));
+                for (auto fp : extra)
+                    if (auto* h = ours_->find(fp))
+                        extra_.push_back(*h);
+                break;
+            }
+        }
+    }
+}
+
+namespace {
+
+void append(std::string& out, uint64_t val) {
+    boost::endian::native_to_little_inplace(val);
+    out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+uint64_t consume(std::string_view& in) {
+    if (in.size() < sizeof(uint64_t))
+        throw std::invalid_argument{"reconciliation data is truncated"};
+    uint64_t val;
+    std::memcpy(&val, in.data(), sizeof(val));
+    in.remove_prefix(sizeof(val));
+    boost::endian::little_to_native_inplace(val);
+    return val;
+}
+
+} // namespace
+
+std::string encode(const std::vector<query>& queries) {
+    std::string out;
+    out.reserve(queries.size() * 4 * sizeof(uint64_t));
+    for (auto& q : queries) {
+        append(out, q.r.lo);
+        append(out, q.r.hi);
+        append(out, q.s.count);
+        append(out, q.s.digest);
+    }
+    return out;
+}
+
+// Each reply is a header of (n << 2 | kind), followed by n (count, digest) pairs for `split` or n
+// fingerprints for `leaf`.
+std::string encode(const std::vector<reply>& replies) {
+    std::string out;
+    for (auto& rep : replies) {
+        uint64_t n = rep.k == reply::kind::split ? rep.parts.size()
+            : rep.k == reply::kind::leaf ? rep.fps.size() : 0;
+        append(out, n << 2 | static_cast<uint64_t>(rep.k));
+        for (auto& s : rep.parts) {
+            append(out, s.count);
+            append(out, s.digest);
+        }
+        for (auto fp : rep.fps)
+            append(out, fp);
+    }
+    return out;
+}
+
+std::string encode(const std::vector<uint64_t>& fps) {
+    std::string out;
+    out.reserve(fps.size() * sizeof(uint64_t));
+    for (auto fp : fps)
+        append(out, fp);
+    return out;
+}
+
+std::vector<query> decode_queries(std::string_view data) {
+    std::vector<query> queries;
+    while (!data.empty()) {
+        auto& q = queries.emplace_back();
+        q.r.lo = consume(data);
+        q.r.hi = consume(data);
+        q.s.count = consume(data);
+        q.s.digest = consume(data);
+        if (q.r.lo > q.r.hi)
+            throw std::invalid_argument{"invalid reconciliation range"};
+    }
+    return queries;
+}
+
+std::vector<reply> decode_replies(std::string_view data) {
+    std::vector<reply> replies;
+    while (!data.empty()) {
+        auto& rep = replies.emplace_back();
+        auto header = consume(data);
+        auto n = header >> 2;
+        switch (header & 3) {
+            case static_cast<uint64_t>(reply::kind::same):
+                break;
+            case static_cast<uint64_t>(reply::kind::split):
+                if (n > FANOUT)
+                    throw std::invalid_argument{"too many parts in reconciliation reply"};
+                rep.k = reply::kind::split;
+                for (uint64_t i = 0; i < n; i++) {
+                    auto& s = rep.parts.emplace_back();
+                    s.count = consume(data);
+                    s.digest = consume(data);
+                }
+                break;
+            case static_cast<uint64_t>(reply::kind::leaf):
+                if (n > data.size() / sizeof(uint64_t))
+                    throw std::invalid_argument{"reconciliation data is truncated"};
+                rep.k = reply::kind::leaf;
+                rep.fps.reserve(n);
+                for (uint64_t i = 0; i < n; i++)
+                    rep.fps.push_back(consume(data));
+                break;
+            default:
+                throw std::invalid_argument{"invalid reconciliation reply type"};
+        }
+    }
+    return replies;
+}
+
+std::vector<uint64_t> decode_fingerprints(std::string_view data) {
+    if (data.size() % sizeof(uint64_t))
+        throw std::invalid_argument{"reconciliation data is truncated"};
+    std::vector<uint64_t> fps;
+    fps.reserve(data.size() / sizeof(uint64_t));
+    while (!data.empty())
+        fps.push_back(consume(data));
+    return fps;
+}
+
+struct run_guard::active {
+    std::shared_ptr<std::atomic<bool>> flag;
+    explicit active(std::shared_ptr<std::atomic<bool>> flag) : flag{std::move(flag)} {}
+    ~active() { *flag = false; }
+};
+
+run_guard::token run_guard::start() {
+    if (running_->exchange(true))
+        return nullptr;
+    return std::make_shared<const active>(running_);
+}
+
+} // namespace oxen::reconcile
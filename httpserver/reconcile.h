@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// Anti-entropy reconciliation of the messages stored by two members of a swarm.
+///
+/// Each message hash is mapped to a 64-bit fingerprint, and the fingerprint space is treated as a
+/// Merkle-style range tree: a range is summarized by the number of fingerprints in it and their
+/// XOR.  The requesting node sends summaries of the ranges it wants to compare; for each range the
+/// other node replies that it matches, or with its summaries of the range's FANOUT sub-ranges, or
+/// (once it has no more than LEAF_SIZE fingerprints in the range) with its fingerprints
+/// themselves.  The requester then recurses into the sub-ranges that differ, so the number of
+/// rounds is logarithmic in the database size and the data exchanged scales with the size of the
+/// difference rather than the number of stored messages.
+namespace oxen::reconcile {
+
+// Number of sub-ranges a differing range is split into.
+inline constexpr size_t FANOUT = 16;
+
+// Ranges in which the responder has no more than this many fingerprints are compared by sending
+// the fingerprints directly rather than splitting them further; this bounds the size of a reply
+// to MAX_RANGES * LEAF_SIZE fingerprints.
+inline constexpr uint64_t LEAF_SIZE = 64;
+
+// Maximum number of ranges the requester puts in a single request.
+inline constexpr size_t MAX_RANGES = 256;
+
+// Maximum number of messages requested at once when fetching the messages we are missing.
+inline constexpr size_t MAX_FETCH = 100;
+
+// Returns the fingerprint of a message hash.  This has to be the same on every node, and so does
+// not use std::hash.
+uint64_t fingerprint(std::string_view msg_hash);
+
+// An inclusive range [lo, hi] of fingerprints (inclusive so that one range can cover everything).
+struct range {
+    uint64_t lo = 0;
+    uint64_t hi = UINT64_MAX;
+};
+
+// Splits a range into (up to) FANOUT roughly equal sub-ranges.
+std::vector<range> split(const range& r);
+
+// The count and XOR of the fingerprints in a range.
+struct summary {
+    uint64_t count = 0;
+    uint64_t digest = 0;
+
+    bool operator==(const summary& s) const { return count == s.count && digest == s.digest; }
+    bool operator!=(const summary& s) const { return !(*this == s); }
+};
+
+// The fingerprints of a set of messages, for computing range summaries.
+class fingerprint_set {
+    // Sorted fingerprints and the message hash of each one
+    std::vector<std::pair<uint64_t, std::string>> entries_;
+    // prefix_[i] is the XOR of the first i fingerprints, so that we can summarize any range with a
+    // couple of binary searches.
+    std::vector<uint64_t> prefix_;
+
+    std::pair<size_t, size_t> bounds(const range& r) const;
+
+  public:
+    explicit fingerprint_set(std::vector<std::string> msg_hashes);
+
+    size_t size() const { return entries_.size(); }
+
+    summary summarize(const range& r) const;
+
+    std::vector<uint64_t> fingerprints(const range& r) const;
+
+    // Returns the hashes of the messages in a range.
+    std::vector<std::string> hashes(const range& r) const;
+
+    // Returns the message hash with the given fingerprint, or nullptr if we don't have it.
+    const std::string* find(uint64_t fp) const;
+};
+
+// One range of a reconciliation request, with the requester's summary of it.
+struct query {
+    range r;
+    summary s;
+};
+
+// The responder's answer for one range.
+struct reply {
+    enum class kind : uint8_t { same, split, leaf };
+    kind k = kind::same;
+    // The responder's summaries of split(r), for `split`
+    std::vector<summary> parts;
+    // The responder's fingerprints in the range, for `leaf`
+    std::vector<uint64_t> fps;
+};
+
+// Answers a reconciliation request from the responder's fingerprints.
+std::vector<reply> respond(const fingerprint_set& ours, const std::vector<query>& queries);
+
+// The requesting side of a reconciliation with one peer.
+class session {
+    std::shared_ptr<const fingerprint_set> ours_;
+    std::vector<range> pending_;
+    std::vector<uint64_t> missing_;
+    std::vector<std::string> extra_;
+
+  public:
+    explicit session(std::shared_ptr<const fingerprint_set> ours);
+
+    // Number of request/reply rounds so far.
+    int rounds = 0;
+
+    // True once there are no more ranges to compare.
+    bool done() const { return pending_.empty(); }
+
+    // Removes and returns the next (up to MAX_RANGES) ranges to send to the peer.
+    std::vector<query> next_queries();
+
+    // Processes the peer's replies to the queries returned by next_queries().  Throws if the
+    // replies don't fit the queries.
+    void process(const std::vector<query>& sent, const std::vector<reply>& replies);
+
+    // Fingerprints of messages the peer has and we don't.
+    const std::vector<uint64_t>& missing() const { return missing_; }
+
+    // Hashes of messages we have and the peer doesn't.
+    const std::vector<std::string>& extra() const { return extra_; }
+};
+
+// Makes sure that we run only one reconciliation at a time.  start() hands out a token that every
+// asynchronous step of the reconciliation keeps (e.g. captured in its request callbacks); once the
+// last copy of it is gone, however the reconciliation ended (finished, failed, or threw part way
+// through), the next one can start.
+class run_guard {
+    struct active;
+    std::shared_ptr<std::atomic<bool>> running_ = std::make_shared<std::atomic<bool>>(false);
+
+  public:
+    using token = std::shared_ptr<const active>;
+
+    // Returns the token for a new reconciliation, or nullptr if one is already running.
+    token start();
+
+    bool running() const { return *running_; }
+};
+
+// Wire encodings of the request and reply bodies, as packed little-endian 64-bit integers.  The
+// decode functions throw std::invalid_argument on malformed input.
+std::string encode(const std::vector<query>& queries);
+std::string encode(const std::vector<reply>& replies);
+std::string encode(const std::vector<uint64_t>& fps);
+std::vector<query> decode_queries(std::string_view data);
+std::vector<reply> decode_replies(std::string_view data);
+std::vector<uint64_t> decode_fingerprints(std::string_view data);
+
+} // namespace oxen::reconcile
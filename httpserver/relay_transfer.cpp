@@ -0,0 +1,174 @@
+#include "relay_transfer.h"
+
+#include <algorithm>
+
+namespace oxen {
+
+using fseconds = std::chrono::duration<double>;
+
+relay_transfer::relay_transfer(sn_record dest, swarm_id_t swarm, clock::time_point now)
+    : dest{std::move(dest)}, swarm{swarm} {
+    stats_.started = now;
+}
+
+bool relay_transfer::ready(clock::time_point now) {
+    if (status_ == status::stalled && now >= resume_at_) {
+        status_ = status::sending;
+        read_cursor_ = acked_cursor_;
+        read_message_cursor_ = acked_message_cursor_;
+        read_done_ = false;
+        stats_.resumes++;
+    }
+    return status_ == status::sending;
+}
+
+bool relay_transfer::wants_chunk() const {
+    return status_ == status::sending && !read_done_ && !reading_ && chunks_.size() < WINDOW;
+}
+
+std::optional<relay_transfer::read_ticket> relay_transfer::start_read() {
+    if (!wants_chunk())
+        return std::nullopt;
+    reading_ = true;
+    return read_ticket{++read_id_, read_cursor_, read_message_cursor_};
+}
+
+bool relay_transfer::finish_read(const read_ticket& read) {
+    if (!reading_ || read.id != read_id_)
+        return false;
+    reading_ = false;
+    return true;
+}
+
+void relay_transfer::add_chunk(const read_ticket& read, std::vector<std::string> batches,
+        size_t messages, int64_t end_cursor, int64_t end_message_cursor) {
+    if (!finish_read(read))
+        return;
+    auto& c = chunks_.emplace_back();
+    c.end_cursor = end_cursor;
+    c.end_message_cursor = end_message_cursor;
+    c.messages = messages;
+    c.remaining = batches.size();
+    c.batches.resize(batches.size());
+    for (size_t i = 0; i < batches.size(); i++)
+        c.batches[i].data = std::move(batches[i]);
+    read_cursor_ = end_cursor;
+    read_message_cursor_ = end_message_cursor;
+
+    // An empty chunk at the front completes right away
+    advance(clock::now());
+}
+
+void relay_transfer::read_done(const read_ticket& read, clock::time_point now) {
+    if (!finish_read(read))
+        return;
+    read_done_ = true;
+    advance(now);
+}
+
+void relay_transfer::cancel_read(const read_ticket& read) {
+    finish_read(read);
+}
+
+std::vector<relay_transfer::outgoing> relay_transfer::due(clock::time_point now) {
+    std::vector<outgoing> result;
+    if (status_ != status::sending)
+        return result;
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        for (size_t j = 0; j < chunks_[i].batches.size(); j++) {
+            auto& b = chunks_[i].batches[j];
+            if (b.acked || b.in_flight || b.retry_at > now)
+                continue;
+            b.in_flight = true;
+            stats_.batches_sent++;
+            if (b.failures > 0)
+                stats_.retries++;
+            result.push_back({first_seq_ + i, j, b.data});
+        }
+    }
+    return result;
+}
+
+relay_transfer::chunk* relay_transfer::find_chunk(uint64_t seq) {
+    // Responses for chunks we have dropped (because we stalled) are ignored
+    if (seq < first_seq_ || seq - first_seq_ >= chunks_.size())
+        return nullptr;
+    return &chunks_[seq - first_seq_];
+}
+
+void relay_transfer::acked(uint64_t seq, size_t index, clock::time_point now) {
+    auto* c = find_chunk(seq);
+    if (!c || index >= c->batches.size())
+        return;
+    auto& b = c->batches[index];
+    if (b.acked || !b.in_flight)
+        return;
+    b.in_flight = false;
+    b.acked = true;
+    b.failures = 0;
+    stats_.batches_acked++;
+    stats_.bytes_acked += b.data.size();
+    // Free the data now rather than when the whole chunk completes
+    std::string{}.swap(b.data);
+    c->remaining--;
+    advance(now);
+}
+
+void relay_transfer::failed(uint64_t seq, size_t index, clock::time_point now) {
+    auto* c = find_chunk(seq);
+    if (!c || index >= c->batches.size())
+        return;
+    auto& b = c->batches[index];
+    if (b.acked || !b.in_flight)
+        return;
+    b.in_flight = false;
+    if (++b.failures > MAX_RETRIES) {
+        stall(now);
+        return;
+    }
+    auto backoff = RETRY_BACKOFF * (1 << std::min(b.failures - 1, 16));
+    b.retry_at = now + std::min<clock::duration>(backoff, RETRY_BACKOFF_MAX);
+}
+
+void relay_transfer::abort(clock::time_point now) {
+    first_seq_ += chunks_.size();
+    chunks_.clear();
+    reading_ = false;
+    status_ = status::failed;
+    stats_.finished = now;
+}
+
+void relay_transfer::advance(clock::time_point now) {
+    while (!chunks_.empty() && chunks_.front().remaining == 0) {
+        acked_cursor_ = chunks_.front().end_cursor;
+        acked_message_cursor_ = chunks_.front().end_message_cursor;
+        stats_.messages_acked += chunks_.front().messages;
+        chunks_.pop_front();
+        first_seq_++;
+    }
+    if (read_done_ && chunks_.empty() && status_ == status::sending) {
+        status_ = status::done;
+        stats_.finished = now;
+    }
+}
+
+void relay_transfer::stall(clock::time_point now) {
+    first_seq_ += chunks_.size();
+    chunks_.clear();
+    reading_ = false;
+    if (stats_.resumes >= MAX_RESUMES) {
+        status_ = status::failed;
+        stats_.finished = now;
+        return;
+    }
+    status_ = status::stalled;
+    resume_at_ = now + RESUME_DELAY;
+}
+
+double relay_transfer::throughput(clock::time_point now) const {
+    auto end = finished() ? stats_.finished : now;
+    auto elapsed = fseconds{end - stats_.started}.count();
+    return elapsed > 0 ? stats_.bytes_acked / elapsed : 0.0;
+}
+
+} // namespace oxen
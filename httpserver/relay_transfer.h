@@ -0,0 +1,198 @@
+#pragma once
+
+#include "oxen_common.h"
+#include "sn_record.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace oxen {
+
+/// Tracks the transfer of our stored messages to one other service node, typically a node that
+/// has just joined our swarm.  The messages are read from the database a chunk of owners at a
+/// time (a large owner can be split across chunks); each chunk becomes one or more serialized
+/// `sn.data` batches, and at most WINDOW chunks are outstanding at once.  A chunk is complete once
+/// the recipient has acknowledged all of its batches, and the transfer's resume point (the owner
+/// and message cursors) only moves past complete chunks, so that if the recipient stops responding
+/// we can later pick up from there rather than starting again from the beginning.
+///
+/// This class only does the bookkeeping: the ServiceNode reads the database and sends the batches.
+/// It is not thread safe; callers must hold `mutex` while using it, except while reading a chunk
+/// reserved with start_read() from the database.
+class relay_transfer {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // The most owners we read from the database for each chunk.  A chunk also ends (possibly part
+    // way through an owner) once it holds about CHUNK_BYTES of message data; owners' messages are
+    // read MESSAGE_PAGE at a time.
+    inline static constexpr int OWNER_CHUNK = 200;
+    inline static constexpr size_t CHUNK_BYTES = 4 * 1024 * 1024;
+    inline static constexpr int MESSAGE_PAGE = 100;
+
+    // The maximum number of chunks that we keep in flight (i.e. sent but not yet fully
+    // acknowledged) at once.
+    inline static constexpr size_t WINDOW = 4;
+
+    // Exponential backoff for a failed batch: we retry it after RETRY_BACKOFF, doubling after
+    // each consecutive failure up to RETRY_BACKOFF_MAX.
+    inline static constexpr auto RETRY_BACKOFF = 1s;
+    inline static constexpr auto RETRY_BACKOFF_MAX = 1min;
+
+    // After this many consecutive failures of the same batch we stop sending and wait for
+    // RESUME_DELAY before resuming from the last acknowledged position.
+    inline static constexpr int MAX_RETRIES = 5;
+    inline static constexpr auto RESUME_DELAY = 5min;
+
+    // How many times we resume a stalled transfer before giving up on it entirely.
+    inline static constexpr int MAX_RESUMES = 3;
+
+    // How long we wait for the recipient to acknowledge a batch.
+    inline static constexpr auto REQUEST_TIMEOUT = 30s;
+
+    // How often the ServiceNode checks transfers for retries and resumes that are due.
+    inline static constexpr auto TIMER_INTERVAL = 1s;
+
+    // How long we keep a finished (or failed) transfer around so that it shows up in the stats.
+    inline static constexpr auto KEEP_FINISHED = 10min;
+
+    enum class status { sending, stalled, done, failed };
+
+    relay_transfer(sn_record dest, swarm_id_t swarm, clock::time_point now = clock::now());
+
+    // The node we are sending to, and the swarm whose messages we send to it.
+    const sn_record dest;
+    const swarm_id_t swarm;
+
+    std::mutex mutex;
+
+    // Returns true if the transfer is currently sending; a stalled transfer starts sending again
+    // (from acked_cursor()) once its resume delay has passed.
+    bool ready(clock::time_point now = clock::now());
+
+    // Returns true if there is room in the window for another chunk (and we haven't yet read
+    // everything from the database, nor are currently reading a chunk).
+    bool wants_chunk() const;
+
+    // A chunk read reserved by start_read(): the chunk starts from owner cursor `cursor` (as for
+    // Database::get_owners) and, within the first owner after it, from message cursor
+    // `message_cursor` (as for Database::get_messages).
+    struct read_ticket {
+        uint64_t id;
+        int64_t cursor;
+        int64_t message_cursor;
+    };
+
+    // Reserves the next chunk for reading if wants_chunk(), or returns nullopt.  The caller reads
+    // the chunk without holding `mutex` and then passes the ticket (with `mutex` held again) to
+    // add_chunk(), read_done() or, if the read failed, cancel_read().  If the transfer stalls or is
+    // aborted in the meantime then those calls ignore the ticket.
+    std::optional<read_ticket> start_read();
+
+    // Adds the chunk read for `read`, which ends just before owner cursor `end_cursor` and message
+    // cursor `end_message_cursor` (0 if it ends at an owner boundary): `batches` are its serialized
+    // batches containing `messages` messages in total.  A chunk can be empty (if none of its owners
+    // belong to `swarm`), in which case it completes immediately.
+    void add_chunk(const read_ticket& read, std::vector<std::string> batches, size_t messages,
+            int64_t end_cursor, int64_t end_message_cursor = 0);
+
+    // Called when the database has no more owners after the position of `read`.
+    void read_done(const read_ticket& read, clock::time_point now = clock::now());
+
+    // Releases `read` without adding anything, so that the chunk is read again later.
+    void cancel_read(const read_ticket& read);
+
+    // A batch to be sent: the chunk sequence number and batch index identify it to acked() and
+    // failed().  `data` refers into the transfer, and so must not be used after unlocking `mutex`.
+    struct outgoing {
+        uint64_t chunk;
+        size_t index;
+        const std::string& data;
+    };
+
+    // Returns the batches that should be sent now (either not yet sent, or failed and due for a
+    // retry) and marks them as in flight.
+    std::vector<outgoing> due(clock::time_point now = clock::now());
+
+    // Records the acknowledgement of a batch returned by due().
+    void acked(uint64_t chunk, size_t index, clock::time_point now = clock::now());
+
+    // Records the failure of a batch returned by due(), scheduling a retry; after too many
+    // consecutive failures the transfer stalls (or, after too many stalls, fails).
+    void failed(uint64_t chunk, size_t index, clock::time_point now = clock::now());
+
+    // Abandons the transfer (e.g. because the destination left the swarm).
+    void abort(clock::time_point now = clock::now());
+
+    status state() const { return status_; }
+    bool finished() const { return status_ == status::done || status_ == status::failed; }
+
+    // The owner and message cursors up to which everything has been acknowledged; a stalled
+    // transfer resumes from here.
+    int64_t acked_cursor() const { return acked_cursor_; }
+    int64_t acked_message_cursor() const { return acked_message_cursor_; }
+
+    // Progress counters, as reported in the stats.
+    struct progress {
+        clock::time_point started, finished;
+        uint64_t batches_sent = 0, batches_acked = 0, retries = 0;
+        uint64_t messages_acked = 0, bytes_acked = 0;
+        int resumes = 0;
+    };
+    const progress& stats() const { return stats_; }
+
+    // Acknowledged bytes per second since the transfer started (or until it finished).
+    double throughput(clock::time_point now = clock::now()) const;
+
+  private:
+    struct batch {
+        std::string data;
+        bool in_flight = false;
+        bool acked = false;
+        int failures = 0;
+        clock::time_point retry_at{};
+    };
+
+    struct chunk {
+        int64_t end_cursor;
+        int64_t end_message_cursor;
+        size_t messages;
+        std::vector<batch> batches;
+        size_t remaining;
+    };
+
+    // Chunks in sequence order; the first one has sequence number first_seq_.
+    std::deque<chunk> chunks_;
+    uint64_t first_seq_ = 0;
+
+    int64_t read_cursor_ = 0, read_message_cursor_ = 0;
+    int64_t acked_cursor_ = 0, acked_message_cursor_ = 0;
+    bool read_done_ = false;
+    // Whether the read with ticket id read_id_ is in progress
+    bool reading_ = false;
+    uint64_t read_id_ = 0;
+
+    status status_ = status::sending;
+    clock::time_point resume_at_{};
+
+    progress stats_;
+
+    chunk* find_chunk(uint64_t seq);
+
+    // Ends the read of `read`; returns false if it is no longer the current read.
+    bool finish_read(const read_ticket& read);
+
+    // Pops complete chunks off the front, advancing the resume point past them, and checks for
+    // the end of the transfer.
+    void advance(clock::time_point now);
+
+    // Drops everything in flight and waits RESUME_DELAY before resuming from acked_cursor_.
+    void stall(clock::time_point now);
+};
+
+} // namespace oxen
@@ -7,15 +7,16 @@
 #include "oxenmq/oxenmq.h"
 #include "signature.h"
 #include "service_node.h"
+#include "store_batcher.h"
 #include "string_utils.hpp"
+#include "swarm_results.h"
 #include "time.hpp"
 #include "utils.hpp"
 #include "version.h"
 
+#include <algorithm>
 #include <chrono>
-#include <future>
 
-#include <cpr/cpr.h>
 #include <nlohmann/json.hpp>
 #include <openssl/sha.h>
 #include <oxenmq/base32z.h>
@@ -51,26 +52,12 @@ std::string to_string(const Response& res) {
 
 namespace {
 
-json swarm_to_json(const SwarmInfo& swarm) {
-
-    json snodes_json = json::array();
-    for (const auto& sn : swarm.snodes) {
-        snodes_json.push_back(json{
-                {"address", oxenmq::to_base32z(sn.pubkey_legacy.view()) + ".snode"}, // Deprecated, use pubkey_legacy instead
-                {"pubkey_legacy", sn.pubkey_legacy.hex()},
-                {"pubkey_x25519", sn.pubkey_x25519.hex()},
-                {"pubkey_ed25519", sn.pubkey_ed25519.hex()},
-                {"port", std::to_string(sn.port)}, // Deprecated port (as a string) for backwards compat; use "port_https" instead
-                {"port_https", sn.port},
-                {"port_omq", sn.omq_port},
-                {"ip", sn.ip}});
-    }
-
-    return json{
-        {"snodes", std::move(snodes_json)},
-        {"swarm", util::int_to_string(swarm.swarm_id, 16)},
-        {"t", to_epoch_ms(std::chrono::system_clock::now())},
-    };
+// True if the response body is a string containing serialized json, rather than plain text.
+bool is_json_text(const Response& res) {
+    return !std::holds_alternative<json>(res.body) &&
+        std::any_of(res.headers.begin(), res.headers.end(), [](const auto& h) {
+            return util::string_iequal(h.first, "content-type") && h.second == "application/json";
+        });
 }
 
 std::string obfuscate_pubkey(const user_pubkey_t& pk) {
@@ -81,6 +68,38 @@ std::string obfuscate_pubkey(const user_pubkey_t& pk) {
         + u8"…" + oxenmq::to_hex(std::prev(pk_raw.end()), pk_raw.end());
 }
 
+// Serializes retrieved messages into the body of a retrieve response (json if `b64`, otherwise
+// bt), without the "t" value and the closing `}` or `e`, so that the body can be shared by
+// identical retrieves (see retrieve_flights).
+std::string serialize_retrieved(std::vector<message>& msgs, bool b64) {
+    std::string body;
+    if (b64) {
+        json messages = json::array();
+        for (const auto& msg : msgs) {
+            messages.push_back(json{
+                {"hash", msg.hash},
+                {"timestamp", to_epoch_ms(msg.timestamp)},
+                {"expiration", to_epoch_ms(msg.expiry)},
+                {"data", oxenmq::to_base64(msg.data)},
+            });
+        }
+        body = json{{"messages", std::move(messages)}}.dump();
+    } else {
+        oxenmq::bt_list messages;
+        for (auto& msg : msgs) {
+            messages.push_back(oxenmq::bt_dict{
+                {"hash", std::move(msg.hash)},
+                {"timestamp", to_epoch_ms(msg.timestamp)},
+                {"expiration", to_epoch_ms(msg.expiry)},
+                {"data", std::move(msg.data)},
+            });
+        }
+        body = oxenmq::bt_serialize(oxenmq::bt_dict{{"messages", std::move(messages)}});
+    }
+    body.pop_back();
+    return body;
+}
+
 template <typename RPC>
 void register_client_rpc_endpoint(RequestHandler::rpc_map& regs) {
     auto call = [](RequestHandler& h, const json& params, std::function<void(Response)> cb) {
@@ -88,7 +107,7 @@ void register_client_rpc_endpoint(RequestHandler::rpc_map& regs) {
         req.load_from(params);
         if constexpr (std::is_base_of_v<rpc::recursive, RPC>)
             req.recurse = true; // Requests through HTTP or onion reqs are *always* client requests, so always recurse
-        h.process_client_req(std::move(req), std::move(cb));
+        h.dispatch_client_req(std::move(req), std::move(cb));
     };
     for (auto& name : RPC::names()) {
         [[maybe_unused]] auto [it, ins] = regs.emplace(name, call);
@@ -271,30 +290,38 @@ RequestHandler::RequestHandler(
         ServiceNode& sn,
         const ChannelEncryption& ce,
         ed25519_seckey edsk)
-    : service_node_{sn}, channel_cipher_(ce), ed25519_sk_{std::move(edsk)} {
+    : service_node_{sn}, channel_cipher_(ce), ed25519_sk_{std::move(edsk)} {}
 
-    // Periodically clean up any proxy request futures
-    service_node_.omq_server()->add_timer([this] {
-        pending_proxy_requests_.remove_if(
-                [](auto& f) { return f.wait_for(0ms) == std::future_status::ready; });
-    }, 1s);
+std::shared_ptr<const swarm_responses::entry> RequestHandler::swarm_entry(
+        const user_pubkey_t& pubkey) {
+    auto state = service_node_.swarm_state();
+    return swarm_responses_.get(state->version, get_swarm_by_pk(state->all_valid_swarms, pubkey));
 }
 
-Response RequestHandler::handle_wrong_swarm(const user_pubkey_t& pubKey) {
+Response RequestHandler::swarm_response(
+        http::response_code status, const swarm_responses::entry& swarm, bool b64) {
+    auto t = to_epoch_ms(system_clock::now());
+    if (b64)
+        return {status, swarm.json_body(t), {{"Content-Type", "application/json"}}};
+    return {status, swarm.bt_body(t)};
+}
+
+Response RequestHandler::handle_wrong_swarm(const user_pubkey_t& pubKey, bool b64) {
 
     OXEN_LOG(trace, "Got client request to a wrong swarm");
 
-    return {
-        http::MISDIRECTED_REQUEST,
-        swarm_to_json(service_node_.get_swarm(pubKey))};
+    return swarm_response(http::MISDIRECTED_REQUEST, *swarm_entry(pubKey), b64);
 }
 
 struct swarm_response {
     std::mutex mutex;
-    int pending;
     bool b64;
     nlohmann::json result;
     std::function<void(oxen::Response)> cb;
+    // Which swarm members we are waiting on, and when to reply
+    swarm_quorum quorum;
+    // Successful peer replies, left encoded until we reply; failures go straight into `result`.
+    raw_swarm_results peer_results;
 };
 
 // Replies to a recursive swarm request via its callback; sends an http::OK unless all of the swarm
@@ -308,66 +335,116 @@ void reply_or_fail(const std::shared_ptr<swarm_response>& res) {
             break;
         }
     }
-    res->cb(Response{res_code, std::move(res->result)});
+    if (res->peer_results.empty())
+        res->cb(Response{res_code, std::move(res->result)});
+    else if (res->b64) {
+        merge_swarm_results(res->result, res->peer_results, true);
+        res->cb(Response{res_code, std::move(res->result)});
+    } else
+        // bt-encoded request, so we can splice the peers' replies straight into ours
+        res->cb(Response{res_code,
+                splice_swarm_results(std::move(res->result), std::move(res->peer_results))});
+}
+
+// Called, with res->mutex held, once a swarm member's result (ours, if `peer` is empty) has been
+// added to the response.  Replies once every member has responded or, if the client asked for a
+// quorum, as soon as enough of them have succeeded; see swarm_quorum.
+void member_done(
+        const std::shared_ptr<swarm_response>& res, bool success, const std::string& peer = "") {
+    if (!res->quorum.done(peer, success))
+        return;
+    res->quorum.add_quorum(res->result);
+    reply_or_fail(res);
 }
 
 
+// Forwards a recursive request to the rest of our swarm.  Must be called with res->mutex held.
 static void distribute_command(
         ServiceNode& sn,
         std::shared_ptr<swarm_response>& res,
         std::string_view cmd,
         const rpc::recursive& req) {
-    auto peers = sn.get_swarm_peers();
-    res->pending += peers.size();
-
-    for (auto& peer : peers) {
-        sn.omq_server()->request(
-                peer.pubkey_x25519.view(),
-                "sn.storage_cc",
-                [res, peer, cmd](bool success, auto parts) {
-                    json peer_result;
-                    if (!success)
-                        OXEN_LOG(warn, "Response timeout from {} for forwarded command {}",
-                                peer.pubkey_legacy, cmd);
-                    bool good_result = success && parts.size() == 1;
-                    if (good_result) {
-                        try {
-                            peer_result = bt_to_json(oxenmq::bt_dict_consumer{parts[0]});
-                        } catch (const std::exception& e) {
-                            OXEN_LOG(warn, "Received unparseable response to {} from {}: {}",
-                                    cmd, peer.pubkey_legacy, e.what());
-                            good_result = false;
-                        }
-                    }
-
-                    std::lock_guard lock{res->mutex};
-
-                    // If we're the last response then we reply:
-                    bool send_reply = --res->pending == 0;
-
-                    if (!good_result) {
-                        peer_result = json{{"failed", true}};
-                        if (!success) peer_result["timeout"] = true;
-                        else if (parts.size() == 2) {
-                            peer_result["code"] = parts[0];
-                            peer_result["reason"] = parts[1];
-                        }
-                        else peer_result["bad_peer_response"] = true;
-                    }
-                    else if (res->b64) {
-                        if (auto it = peer_result.find("signature"); it != peer_result.end() && it->is_string())
-                            *it = oxenmq::to_base64(it->get_ref<const std::string&>());
-                    }
-
-                    res->result["swarm"][peer.pubkey_ed25519.hex()] = std::move(peer_result);
-
-                    if (send_reply)
-                        reply_or_fail(res);
-                },
-                cmd,
-                bt_serialize(req.to_bt()),
-                oxenmq::send_option::request_timeout{5s}
-        );
+    auto& latency = sn.latency();
+    // Every peer gets the same request, so only encode it once
+    const auto payload = bt_serialize(req.to_bt());
+
+    for (auto& peer : sn.get_swarm_peers()) {
+        // Peers whose last few requests all failed still get the request (so that they pick it up
+        // if they are back, and so that we notice when they are), but we don't hold up the
+        // response waiting for them.
+        bool wait = !latency.unreachable(peer.pubkey_legacy);
+        if (wait)
+            res->quorum.wait(peer.pubkey_ed25519.hex());
+        else
+            res->result["swarm"][peer.pubkey_ed25519.hex()] =
+                json{{"failed", true}, {"unreachable", true}};
+
+        auto on_reply = [res, peer, cmd, &latency, wait, sent=std::chrono::steady_clock::now()]
+                (bool success, std::vector<std::string> parts) {
+            if (success)
+                latency.success(peer.pubkey_legacy,
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - sent));
+            else
+                latency.failure(peer.pubkey_legacy);
+            if (!wait)
+                return;
+
+            if (!success)
+                OXEN_LOG(warn, "Response timeout from {} for forwarded command {}",
+                        peer.pubkey_legacy, cmd);
+            bool good_result = success && parts.size() == 1;
+            bool peer_success = false;
+            if (good_result) {
+                try {
+                    peer_success = !scan_swarm_result(parts[0]);
+                } catch (const std::exception& e) {
+                    OXEN_LOG(warn, "Received unparseable response to {} from {}: {}",
+                            cmd, peer.pubkey_legacy, e.what());
+                    good_result = false;
+                }
+            }
+
+            std::lock_guard lock{res->mutex};
+            auto peer_hex = peer.pubkey_ed25519.hex();
+
+            if (res->quorum.replied()) {
+                // We already replied (having reached the requested quorum), so this one
+                // only gets logged.
+                OXEN_LOG(debug, "{} result from {} for {} arrived after quorum reply",
+                        peer_success ? "Successful" : "Failed", peer.pubkey_legacy, cmd);
+                res->quorum.done(peer_hex, peer_success);
+                return;
+            }
+
+            if (good_result)
+                res->peer_results.emplace_back(peer_hex, std::move(parts[0]));
+            else {
+                json peer_result{{"failed", true}};
+                if (!success) peer_result["timeout"] = true;
+                else if (parts.size() == 2) {
+                    peer_result["code"] = parts[0];
+                    peer_result["reason"] = parts[1];
+                }
+                else peer_result["bad_peer_response"] = true;
+                res->result["swarm"][peer_hex] = std::move(peer_result);
+            }
+
+            member_done(res, peer_success, peer_hex);
+        };
+
+        auto timeout = latency.timeout(peer.pubkey_legacy);
+        if (cmd == rpc::store::names()[0])
+            // Stores can get coalesced with others headed to the same peer
+            sn.forward_store(peer, payload, std::move(on_reply), timeout);
+        else
+            sn.omq_server()->request(
+                    peer.pubkey_x25519.view(),
+                    "sn.storage_cc",
+                    std::move(on_reply),
+                    cmd,
+                    payload,
+                    oxenmq::send_option::request_timeout{timeout});
     }
 }
 
@@ -376,38 +453,49 @@ std::pair<std::shared_ptr<swarm_response>, std::unique_lock<std::mutex>>
 static setup_recursive_request(ServiceNode& sn, RPC& req, std::function<void(Response)> cb) {
     auto res = std::make_shared<swarm_response>();
     res->cb = std::move(cb);
-    res->pending = 1;
     res->b64 = req.b64;
+    if (req.recurse)
+        res->quorum = swarm_quorum{req.quorum};
+    // Our own result
+    res->quorum.wait();
 
     std::unique_lock<std::mutex> lock{res->mutex, std::defer_lock};
     if (req.recurse) {
-        // Send it off to our peers right away, before we process it ourselves
-        distribute_command(sn, res, RPC::names()[0], req);
+        // Send it off to our peers right away, before we process it ourselves.  We hold the lock
+        // from here until our own result is in, so peer results can't complete the response
+        // (e.g. by reaching a quorum) without ours.
         lock.lock();
+        distribute_command(sn, res, RPC::names()[0], req);
     }
     return {std::move(res), std::move(lock)};
 }
 
-void RequestHandler::process_client_req(
-        rpc::store&& req, std::function<void(Response)> cb) {
-
-    if (OXEN_LOG_ENABLED(trace))
-        OXEN_LOG(trace, "Storing message: {}", oxenmq::to_base64(req.data));
-
+std::optional<Response> RequestHandler::check_store(
+        const rpc::store& req, system_clock::time_point now) {
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return handle_wrong_swarm(req.pubkey, req.b64);
 
-    using namespace std::chrono;
     auto ttl = duration_cast<milliseconds>(req.expiry - req.timestamp);
     if (ttl < TTL_MINIMUM || ttl > TTL_MAXIMUM) {
         OXEN_LOG(warn, "Forbidden. Invalid TTL: {}ms", ttl.count());
-        return cb(Response{http::FORBIDDEN, "Provided expiry/TTL is not valid."sv});
+        return Response{http::FORBIDDEN, "Provided expiry/TTL is not valid."sv};
     }
-    auto now = system_clock::now();
     if (req.timestamp > now + STORE_TOLERANCE || req.expiry < now - STORE_TOLERANCE) {
         OXEN_LOG(debug, "Forbidden. Invalid Timestamp: {}", to_epoch_ms(req.timestamp));
-        return cb(Response{http::NOT_ACCEPTABLE, "Timestamp error: check your clock"sv});
+        return Response{http::NOT_ACCEPTABLE, "Timestamp error: check your clock"sv};
     }
+    return std::nullopt;
+}
+
+void RequestHandler::process_client_req(
+        rpc::store&& req, std::function<void(Response)> cb) {
+
+    if (OXEN_LOG_ENABLED(trace))
+        OXEN_LOG(trace, "Storing message: {}", oxenmq::to_base64(req.data));
+
+    auto now = system_clock::now();
+    if (auto error = check_store(req, now))
+        return cb(std::move(*error));
 
     bool entry_router = req.recurse == true;
     if (!service_node_.hf_at_least(HARDFORK_RECURSIVE_STORE))
@@ -454,63 +542,118 @@ void RequestHandler::process_client_req(
 
     OXEN_LOG(trace, "Successfully stored message {} for {}", message_hash, obfuscate_pubkey(req.pubkey));
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    member_done(res, !mine.count("failed"));
+}
+
+// Encodes a response to one of the stores in an sn.store_batch the same way that a reply to an
+// individual (bt-encoded) sn.storage_cc request would be.
+static std::string encode_batch_reply(Response res) {
+    std::string body;
+    if (auto* j = std::get_if<json>(&res.body))
+        body = bt_serialize(json_to_bt(std::move(*j)));
+    else
+        body = view_body(res);
+    if (res.status == http::OK)
+        return store_batcher::encode_reply({std::move(body)});
+    return store_batcher::encode_reply({std::to_string(res.status.first), std::move(body)});
+}
+
+std::vector<std::string> RequestHandler::process_store_batch(
+        const std::vector<std::string_view>& stores) {
+    std::vector<std::string> replies(stores.size());
+    std::vector<message> msgs;
+    std::vector<size_t> msg_reply; // The index in `replies` of each of `msgs`
+    auto now = system_clock::now();
+    bool use_old_hash = !service_node_.hf_at_least(HARDFORK_HASH_BLAKE2B);
+
+    for (size_t i = 0; i < stores.size(); i++) {
+        rpc::store req;
+        try {
+            req.load_from(oxenmq::bt_dict_consumer{stores[i]});
+            req.b64 = false;
+        } catch (const std::exception& e) {
+            OXEN_LOG(debug, "Invalid store in forwarded batch: {}", e.what());
+            replies[i] = encode_batch_reply({http::BAD_REQUEST, "invalid request: "s + e.what()});
+            continue;
+        }
+        if (auto error = check_store(req, now)) {
+            replies[i] = encode_batch_reply(std::move(*error));
+            continue;
+        }
+        auto hash = computeMessageHash(
+                req.timestamp, req.expiry, req.pubkey, req.data, use_old_hash);
+        msgs.emplace_back(req.pubkey, std::move(hash), req.timestamp, req.expiry, std::move(req.data));
+        msg_reply.push_back(i);
+    }
+
+    std::vector<std::optional<bool>> stored;
+    std::string failure;
+    try {
+        stored = service_node_.process_store_batch(msgs);
+    } catch (const std::exception& e) {
+        OXEN_LOG(err, "Internal Server Error. Could not store batch of {} messages: {}",
+                msgs.size(), e.what());
+        failure = e.what();
+        stored.resize(msgs.size());
+    }
+
+    for (size_t i = 0; i < msgs.size(); i++) {
+        json result;
+        if (stored[i]) {
+            result["hash"] = msgs[i].hash;
+            auto sig = create_signature(ed25519_sk_, msgs[i].hash);
+            result["signature"] = util::view_guts(sig);
+            if (!*stored[i]) result["already"] = true;
+        } else {
+            if (!failure.empty()) result["reason"] = failure;
+            result["failed"] = true;
+            result["query_failure"] = true;
+        }
+        replies[msg_reply[i]] = encode_batch_reply({http::OK, std::move(result)});
+    }
+    return replies;
 }
 
 void RequestHandler::process_client_req(
         rpc::oxend_request&& req, std::function<void(oxen::Response)> cb) {
 
-    std::optional<std::string> oxend_params;
-    if (req.params)
-        oxend_params = req.params->dump();
-
-    service_node_.omq_server().oxend_request(
-        "rpc." + req.endpoint,
-        [cb = std::move(cb)](bool success, auto&& data) {
-            std::string err;
-            // Currently we only support json endpoints; if we want to support non-json endpoints
-            // (which end in ".bin") at some point in the future then we'll need to return those
-            // endpoint results differently here.
-            if (success && data.size() >= 2 && data[0] == "200") {
-                json result = json::parse(data[1], nullptr, false);
-                if (result.is_discarded()) {
-                    OXEN_LOG(warn, "Invalid oxend response to client request: result is not valid json");
-                    return cb({http::BAD_GATEWAY, "oxend returned unparseable data"s});
-                }
-                return cb({http::OK, json{
-                    {"result", std::move(result)},
-                    {"t", to_epoch_ms(std::chrono::system_clock::now())},
-                }});
-            }
-            return cb({http::BAD_REQUEST,
-                data.size() >= 2 && !data[1].empty()
-                    ? std::move(data[1]) : "Unknown oxend error"s});
-        },
-        oxend_params);
+    service_node_.oxend_client_request(req.endpoint, req.params,
+        [cb = std::move(cb), b64 = req.b64](const oxend_cache::reply& r) {
+            if (!r.result)
+                return cb({r.status, r.error});
+            auto t = to_epoch_ms(system_clock::now());
+            if (b64)
+                return cb({http::OK, r.result->json_body(t), {{"Content-Type", "application/json"}}});
+            if (!r.result->bt)
+                return cb({http::INTERNAL_SERVER_ERROR, "oxend result cannot be bt-encoded"s});
+            cb({http::OK, r.result->bt_body(t)});
+        });
 }
 
 void RequestHandler::process_client_req(
         rpc::get_swarm&& req, std::function<void(oxen::Response)> cb) {
 
-    const auto swarm = service_node_.get_swarm(req.pubkey);
+    auto swarm = swarm_entry(req.pubkey);
 
     OXEN_LOG(debug, "get swarm for {}, swarm size: {}",
-            obfuscate_pubkey(req.pubkey), swarm.snodes.size());
+            obfuscate_pubkey(req.pubkey), swarm->size);
 
-    auto body = swarm_to_json(swarm);
+    if (req.etag && *req.etag == swarm->etag)
+        return cb(Response{http::OK, json{
+            {"etag", swarm->etag},
+            {"t", to_epoch_ms(system_clock::now())},
+            {"unchanged", true}}});
 
-    if (OXEN_LOG_ENABLED(trace))
-        OXEN_LOG(trace, "swarm details for pk {}: {}", obfuscate_pubkey(req.pubkey), body.dump());
+    OXEN_LOG(trace, "swarm details for pk {}: {}}}", obfuscate_pubkey(req.pubkey), swarm->json);
 
-    cb(Response{http::OK, std::move(body)});
+    cb(swarm_response(http::OK, *swarm, req.b64));
 }
 
 void RequestHandler::process_client_req(
         rpc::retrieve&& req, std::function<void(oxen::Response)> cb) {
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.check_signature) {
@@ -524,32 +667,46 @@ void RequestHandler::process_client_req(
         }
     }
 
-    std::vector<message> msgs;
-    try {
-        msgs = service_node_.retrieve(req.pubkey, req.last_hash.value_or(""));
-    } catch (const std::exception& e) {
-        auto msg = fmt::format("Internal Server Error. Could not retrieve messages for {}",
-                obfuscate_pubkey(req.pubkey));
-        OXEN_LOG(critical, msg);
-        return cb(Response{http::INTERNAL_SERVER_ERROR, std::move(msg)});
-    }
-
-    OXEN_LOG(trace, "Retrieved {} messages for {}", msgs.size(), obfuscate_pubkey(req.pubkey));
-
-    json messages = json::array();
-    for (const auto& msg : msgs) {
-        messages.push_back(json{
-            {"hash", msg.hash},
-            {"timestamp", to_epoch_ms(msg.timestamp)},
-            {"expiration", to_epoch_ms(msg.expiry)},
-            {"data", req.b64 ? oxenmq::to_base64(msg.data) : std::move(msg.data)},
+    auto last_hash = req.last_hash.value_or("");
+    auto flight = service_node_.retrieves().join(req.pubkey, last_hash, req.b64,
+        [cb = std::move(cb), pubkey = req.pubkey, b64 = req.b64, t = to_epoch_ms(now)]
+        (std::shared_ptr<const std::string> body) {
+            if (!body)
+                return cb(Response{http::INTERNAL_SERVER_ERROR, fmt::format(
+                        "Internal Server Error. Could not retrieve messages for {}",
+                        obfuscate_pubkey(pubkey))});
+            std::string reply;
+            reply.reserve(body->size() + 26);
+            reply += *body;
+            if (b64) {
+                reply += ",\"t\":";
+                reply += std::to_string(t);
+                reply += '}';
+                return cb(Response{http::OK, std::move(reply), {{"Content-Type", "application/json"}}});
+            }
+            reply += "1:ti";
+            reply += std::to_string(t);
+            reply += "ee";
+            cb(Response{http::OK, std::move(reply)});
         });
+
+    if (!flight) {
+        // An identical retrieve is already in progress; we get its reply when it finishes
+        OXEN_LOG(trace, "Joined a retrieve in progress for {}", obfuscate_pubkey(req.pubkey));
+        service_node_.record_retrieve_request();
+        return;
     }
 
-    return cb(Response{http::OK, json{
-        {"messages", std::move(messages)},
-        {"t", to_epoch_ms(now)},
-    }});
+    std::shared_ptr<const std::string> body;
+    try {
+        auto msgs = service_node_.retrieve(req.pubkey, last_hash);
+        OXEN_LOG(trace, "Retrieved {} messages for {}", msgs.size(), obfuscate_pubkey(req.pubkey));
+        body = std::make_shared<const std::string>(serialize_retrieved(msgs, req.b64));
+    } catch (const std::exception&) {
+        OXEN_LOG(critical, "Internal Server Error. Could not retrieve messages for {}",
+                obfuscate_pubkey(req.pubkey));
+    }
+    service_node_.retrieves().finish(flight, std::move(body));
 }
 
 void RequestHandler::process_client_req(
@@ -567,7 +724,7 @@ void RequestHandler::process_client_req(
     OXEN_LOG(debug, "processing delete_all {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     const auto tolerance = req.recurse ? SIGNATURE_TOLERANCE : SIGNATURE_TOLERANCE_FORWARDED;
@@ -601,8 +758,7 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         mine["t"] = to_epoch_ms(now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    member_done(res, !mine.count("failed"));
 }
 
 void RequestHandler::process_client_req(
@@ -610,7 +766,7 @@ void RequestHandler::process_client_req(
     OXEN_LOG(debug, "processing delete_msgs {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     if (!verify_signature(req.pubkey, req.pubkey_ed25519, req.signature, "delete", req.messages)) {
         OXEN_LOG(debug, "delete_msgs: signature verification failed");
@@ -637,8 +793,7 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         mine["t"] = to_epoch_ms(std::chrono::system_clock::now());
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    member_done(res, !mine.count("failed"));
 }
 
 void RequestHandler::process_client_req(
@@ -646,7 +801,7 @@ void RequestHandler::process_client_req(
     OXEN_LOG(debug, "processing delete_before {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.before > now + 1min) {
@@ -679,8 +834,7 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         mine["t"] = to_epoch_ms(now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    member_done(res, !mine.count("failed"));
 }
 
 void RequestHandler::process_client_req(
@@ -688,7 +842,7 @@ void RequestHandler::process_client_req(
     OXEN_LOG(debug, "processing expire_all {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.expiry < now - (req.recurse ? SIGNATURE_TOLERANCE : SIGNATURE_TOLERANCE_FORWARDED)) {
@@ -721,15 +875,14 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         mine["t"] = to_epoch_ms(now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    member_done(res, !mine.count("failed"));
 }
 void RequestHandler::process_client_req(
         rpc::expire_msgs&& req, std::function<void(Response)> cb) {
     OXEN_LOG(debug, "processing expire_msgs {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.expiry < now - 1min) {
@@ -762,8 +915,7 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         mine["t"] = to_epoch_ms(now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    member_done(res, !mine.count("failed"));
 }
 
 void RequestHandler::process_client_req(
@@ -842,6 +994,18 @@ Response RequestHandler::process_retrieve_all() {
 }
 
 
+struct RequestHandler::pending_storage_test {
+    uint64_t height;
+    legacy_pubkey tester;
+    std::string hash;
+    steady_clock::time_point started;
+    std::function<void(MessageTestStatus, std::string, steady_clock::duration)> callback;
+    // The deadline timer, and our current wait_for_message() registration
+    oxenmq::TimerID timer;
+    std::atomic<uint64_t> waiter = 0;
+    std::atomic<bool> done = false;
+};
+
 void RequestHandler::process_storage_test_req(
         uint64_t height,
         legacy_pubkey tester,
@@ -858,34 +1022,55 @@ void RequestHandler::process_storage_test_req(
     auto [status, answer] = service_node_.process_storage_test_req(
             height, tester, msg_hash_hex);
 
-    if (status == MessageTestStatus::RETRY) {
-        // Our first attempt returned a RETRY, so set up a timer to keep retrying
-
-        auto timer = std::make_shared<oxenmq::TimerID>();
-        auto& timer_ref = *timer;
-        service_node_.omq_server()->add_timer(timer_ref, [
-                this,
-                timer=std::move(timer),
-                height,
-                tester,
-                hash=std::move(msg_hash_hex),
-                started,
-                callback=std::move(callback)] {
-            auto elapsed = steady_clock::now() - started;
-
-            OXEN_LOG(trace, "Performing storage test retry, {} since started",
-                    util::friendly_duration(elapsed));
-
-            auto [status, answer] = service_node_.process_storage_test_req(
-                    height, tester, hash);
-            if (status == MessageTestStatus::RETRY && elapsed < TEST_RETRY_PERIOD && !service_node_.shutting_down())
-                return; // Still retrying so wait for the next call
-            service_node_.omq_server()->cancel_timer(*timer);
-            callback(status, std::move(answer), elapsed);
-        }, TEST_RETRY_INTERVAL);
-    } else {
-        callback(status, std::move(answer), steady_clock::now() - started);
-    }
+    if (status != MessageTestStatus::RETRY)
+        return callback(status, std::move(answer), steady_clock::now() - started);
+
+    // We don't have the message (or block) yet, so wait until it arrives or we time out
+    auto test = std::make_shared<pending_storage_test>();
+    test->height = height;
+    test->tester = tester;
+    test->hash = std::move(msg_hash_hex);
+    test->started = started;
+    test->callback = std::move(callback);
+
+    service_node_.omq_server()->add_timer(test->timer, [this, test] {
+        if (!test->done) {
+            service_node_.cancel_message_wait(test->hash, test->waiter);
+            finish_storage_test(*test, MessageTestStatus::RETRY, "");
+        }
+    }, TEST_RETRY_PERIOD);
+
+    retry_storage_test(std::move(test));
+}
+
+void RequestHandler::retry_storage_test(std::shared_ptr<pending_storage_test> test) {
+    if (test->done)
+        return;
+
+    // Register before checking, so that we can't miss the message being stored in between
+    test->waiter = service_node_.wait_for_message(test->hash, [this, test] {
+        // We get called from whatever is storing the message, so don't do the test there
+        service_node_.omq_server()->job([this, test] { retry_storage_test(test); });
+    });
+
+    OXEN_LOG(trace, "Performing storage test retry, {} since started",
+            util::friendly_duration(steady_clock::now() - test->started));
+
+    auto [status, answer] = service_node_.process_storage_test_req(
+            test->height, test->tester, test->hash);
+    if (status == MessageTestStatus::RETRY && !service_node_.shutting_down())
+        return; // Keep waiting
+
+    service_node_.cancel_message_wait(test->hash, test->waiter);
+    finish_storage_test(*test, status, std::move(answer));
+}
+
+void RequestHandler::finish_storage_test(
+        pending_storage_test& test, MessageTestStatus status, std::string answer) {
+    if (test.done.exchange(true))
+        return;
+    service_node_.omq_server()->cancel_timer(test.timer);
+    test.callback(status, std::move(answer), steady_clock::now() - test.started);
 }
 
 Response RequestHandler::wrap_proxy_response(Response res,
@@ -896,7 +1081,16 @@ Response RequestHandler::wrap_proxy_response(Response res,
 
     int status = res.status.first;
     std::string body;
-    if (std::holds_alternative<std::string>(res.body))
+    if (embed_json && is_json_text(res)) {
+        // Already serialized json (such as a cached swarm response): splice it in as is
+        auto text = view_body(res);
+        body.reserve(text.size() + 25);
+        body += R"({"body":)";
+        body += text;
+        body += R"(,"status":)";
+        body += std::to_string(status);
+        body += '}';
+    } else if (std::holds_alternative<std::string>(res.body))
         body = json{{"status", status}, {"body", std::move(std::get<std::string>(res.body))}}.dump();
     else if (std::holds_alternative<std::string_view>(res.body))
         body = json{{"status", status}, {"body", std::get<std::string_view>(res.body)}}.dump();
@@ -1015,38 +1209,48 @@ void RequestHandler::process_onion_req(
 
     service_node_.record_proxy_request();
 
-    pending_proxy_requests_.emplace_front(
-        cpr::PostCallback(
-            [&omq=*service_node_.omq_server(), cb=std::move(data.cb)](cpr::Response r) {
-                Response res;
-                if (r.error.code != cpr::ErrorCode::OK) {
-                    OXEN_LOG(debug, "Onion proxied request to {} failed: {}", r.url.str(), r.error.message);
-                    res.body = r.error.message;
-                    if (r.error.code == cpr::ErrorCode::OPERATION_TIMEDOUT)
-                        res.status = http::GATEWAY_TIMEOUT;
-                    else
-                        res.status = http::BAD_GATEWAY;
-                } else {
-                    res.status.first = r.status_code;
-                    res.status.second = r.status_line;
-                    for (auto& [k, v] : r.header)
-                        res.headers.emplace_back(std::move(k), std::move(v));
-                    res.body = std::move(r.text);
-                }
+    HttpClient::Request req;
+    req.url = std::move(urlstr);
+    req.headers = {
+        {"User-Agent", "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
+        {"Content-Type", "application/octet-stream"}
+    };
+    req.timeout = ONION_URL_TIMEOUT;
+    req.body = std::move(info.payload);
+
+    // Limit how many requests we have going to any one server (and in total), so that a burst of
+    // requests to a slow server can't pile up without bound.
+    auto server = util::lowercase_ascii_string(info.host) + ':' + std::to_string(info.port);
+
+    auto on_reply = [this, server, url=req.url, cb=data.cb](HttpClient::Response r) {
+        service_node_.proxy_limiter().finished(server);
+        Response res;
+        if (!r.ok) {
+            OXEN_LOG(debug, "Onion proxied request to {} failed: {}", url, r.error);
+            res.body = std::move(r.error);
+            res.status = r.timed_out ? http::GATEWAY_TIMEOUT : http::BAD_GATEWAY;
+        } else {
+            // The status text has to outlive the response, so use our own for the codes we
+            // know and leave it empty for the ones we don't.
+            res.status = http::from_code(r.status_code);
+            if (res.status.first != r.status_code)
+                res.status = {r.status_code, ""sv};
+            for (auto& [k, v] : r.headers)
+                res.headers.emplace_back(std::move(k), std::move(v));
+            res.body = std::move(r.body);
+        }
 
-                cb(std::move(res));
-            },
-            cpr::Url{std::move(urlstr)},
-            cpr::Header{
-                {"User-Agent", "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
-                {"Content-Type", "application/octet-stream"}
-            },
-            cpr::Timeout{ONION_URL_TIMEOUT},
-            cpr::Ssl(cpr::ssl::TLSv1_2{}),
-            cpr::MaxRedirects{0},
-            cpr::Body{std::move(info.payload)}
-        )
-    );
+        cb(std::move(res));
+    };
+    bool accepted = service_node_.proxy_limiter().submit(server,
+        [this, req=std::move(req), on_reply=std::move(on_reply)]() mutable {
+            service_node_.http_client().post(std::move(req), std::move(on_reply));
+        });
+    if (!accepted) {
+        OXEN_LOG(debug, "Dropping onion request to {}: too many requests in progress", server);
+        data.cb(wrap_proxy_response({http::SERVICE_UNAVAILABLE, "Too many pending requests"s},
+            data.ephem_key, data.enc_type));
+    }
 }
 
 void RequestHandler::process_onion_req(ProcessCiphertextError&& error,
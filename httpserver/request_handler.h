@@ -5,13 +5,14 @@
 #include "http.h"
 #include "onion_processing.h"
 #include "oxen_common.h"
+#include "oxen_logger.h"
 #include "oxend_key.h"
 #include "service_node.h"
 #include "string_utils.hpp"
+#include "swarm_responses.h"
 
 #include <chrono>
-#include <forward_list>
-#include <future>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <type_traits>
@@ -21,11 +22,9 @@
 
 namespace oxen {
 
-// When a storage test returns a "retry" response, we retry again after this interval:
-inline constexpr auto TEST_RETRY_INTERVAL = 50ms;
-
 // If a storage test is still returning "retry" after this long since the initial request then we
-// give up and send an error response back to the requestor:
+// give up and send an error response back to the requestor.  (Until then we retry it whenever the
+// message gets stored or we get a new block; see ServiceNode::wait_for_message).
 inline constexpr auto TEST_RETRY_PERIOD = 55s;
 
 // Minimum and maximum TTL permitted for a message storage request
@@ -130,7 +129,16 @@ class RequestHandler {
     const ChannelEncryption& channel_cipher_;
     const ed25519_seckey ed25519_sk_;
 
-    std::forward_list<std::future<void>> pending_proxy_requests_;
+    // Serialized swarm info for get_swarm requests and wrong-swarm responses
+    swarm_responses swarm_responses_;
+
+    // Returns the serialized info of the swarm that `pubkey` belongs to.
+    std::shared_ptr<const swarm_responses::entry> swarm_entry(const user_pubkey_t& pubkey);
+
+    // Builds a response with the serialized swarm info: a json body if `b64` is true (i.e. for a
+    // json request) and a bt-encoded body otherwise.
+    static Response swarm_response(
+            http::response_code status, const swarm_responses::entry& swarm, bool b64);
 
     // Wrap response `res` to an intermediate node
     Response wrap_proxy_response(
@@ -140,8 +148,13 @@ class RequestHandler {
             bool json = false,
             bool base64 = true) const;
 
-    // Return the correct swarm for `pubKey`
-    Response handle_wrong_swarm(const user_pubkey_t& pubKey);
+    // Return the correct swarm for `pubKey`, json or bt-encoded according to `b64`
+    Response handle_wrong_swarm(const user_pubkey_t& pubKey, bool b64 = true);
+
+    // Checks that a store request is for our swarm and has a valid TTL and timestamp; returns the
+    // error response if not.
+    std::optional<Response> check_store(
+            const rpc::store& req, std::chrono::system_clock::time_point now);
 
     // ===== Session Client Requests =====
 
@@ -155,6 +168,17 @@ class RequestHandler {
     // Query the database and return requested messages
     Response process_retrieve(const nlohmann::json& params);
 
+    // A storage test that is waiting for its message (or block) to arrive
+    struct pending_storage_test;
+
+    // Retries a pending storage test, first registering to be woken up again if it still needs
+    // to wait.
+    void retry_storage_test(std::shared_ptr<pending_storage_test> test);
+
+    // Invokes a pending storage test's callback, unless it has already finished.
+    void finish_storage_test(
+            pending_storage_test& test, MessageTestStatus status, std::string answer);
+
     // ===================================
 
   public:
@@ -172,6 +196,40 @@ class RequestHandler {
     void process_client_req(rpc::expire_all&&, std::function<void(Response)> cb);
     void process_client_req(rpc::expire_msgs&&, std::function<void(Response)> cb);
 
+    // Processes a parsed client request.  If client request sharding is enabled then requests that
+    // act on a single owner's messages are queued for the owner's shard (see request_shards);
+    // otherwise (and for other requests) this is the same as calling process_client_req directly.
+    template <typename RPC>
+    void dispatch_client_req(RPC&& req, std::function<void(Response)> cb) {
+        if constexpr (rpc::owner_request<RPC>) {
+            if (auto& shards = service_node_.client_shards(); shards.enabled()) {
+                auto pubkey = req.pubkey;
+                bool queued = shards.run(pubkey,
+                    [this, req = std::move(req), cb]() mutable {
+                        try {
+                            process_client_req(std::move(req), cb);
+                        } catch (const std::exception& e) {
+                            OXEN_LOG(warn, "Client request raised an exception: {}", e.what());
+                            cb(Response{http::INTERNAL_SERVER_ERROR, "request failed"sv});
+                        }
+                    },
+                    [cb] { cb(Response{http::SERVICE_UNAVAILABLE, "shutting down"sv}); });
+                if (!queued)
+                    // The shard queue is shared by every owner that hashes to it, so this isn't
+                    // necessarily the client's own doing.
+                    cb(Response{http::SERVICE_UNAVAILABLE, service_node_.shutting_down()
+                            ? "shutting down"sv : "request shard busy"sv});
+                return;
+            }
+        }
+        process_client_req(std::move(req), std::move(cb));
+    }
+
+    // Handles a batch of stores forwarded from a swarm member (see store_batcher), storing them
+    // in a single database transaction.  `stores` are the bt-encoded store requests; returns the
+    // encoded reply to each one, in the same order.
+    std::vector<std::string> process_store_batch(const std::vector<std::string_view>& stores);
+
     using rpc_map = std::unordered_map<
         std::string_view,
         std::function<void(RequestHandler&, const nlohmann::json&, std::function<void(Response)>)>
@@ -191,8 +249,8 @@ class RequestHandler {
             std::function<void(Response)> cb);
 
     // Processes a swarm test request; if it succeeds the callback is immediately invoked, otherwise
-    // the test is scheduled for retries for some time until it succeeds, fails, or times out, at
-    // which point the callback is invoked to return the result.
+    // the test waits for the message to be stored (or for a new block) until it succeeds, fails,
+    // or times out, at which point the callback is invoked to return the result.
     void process_storage_test_req(
             uint64_t height,
             legacy_pubkey tester,
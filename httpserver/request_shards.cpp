@@ -0,0 +1,94 @@
+#include "request_shards.h"
+#include "oxen_logger.h"
+
+#include <string_view>
+
+namespace oxen {
+
+request_shards::request_shards(int count, std::function<void()> thread_init) {
+    for (int i = 0; i < count; i++)
+        shards_.push_back(std::make_unique<shard>());
+    for (auto& s : shards_)
+        s->thread = std::thread{[s = s.get(), thread_init] { run_shard(*s, thread_init); }};
+}
+
+request_shards::~request_shards() { stop(); }
+
+size_t request_shards::shard_for(const user_pubkey_t& pubkey) const {
+    return std::hash<std::string_view>{}(pubkey.raw()) % shards_.size();
+}
+
+bool request_shards::run(
+        const user_pubkey_t& pubkey, std::function<void()> job, std::function<void()> dropped) {
+    auto& s = *shards_[shard_for(pubkey)];
+    {
+        std::lock_guard lock{s.mutex};
+        if (s.stopping || s.queue.size() >= MAX_QUEUE)
+            return false;
+        s.queue.emplace_back(std::move(job), std::move(dropped));
+    }
+    s.cv.notify_one();
+    return true;
+}
+
+void request_shards::stop() {
+    for (auto& s : shards_) {
+        std::lock_guard lock{s->mutex};
+        s->stopping = true;
+    }
+    for (auto& s : shards_) {
+        s->cv.notify_one();
+        if (s->thread.joinable())
+            s->thread.join();
+    }
+    for (auto& s : shards_) {
+        decltype(s->queue) dropped;
+        {
+            std::lock_guard lock{s->mutex};
+            dropped.swap(s->queue);
+        }
+        for (auto& [job, cb] : dropped) {
+            if (!cb)
+                continue;
+            try {
+                cb();
+            } catch (const std::exception& e) {
+                OXEN_LOG(err, "Uncaught exception in dropped request shard job: {}", e.what());
+            }
+        }
+    }
+}
+
+void request_shards::run_shard(shard& s, const std::function<void()>& thread_init) {
+    if (thread_init)
+        thread_init();
+
+    std::unique_lock lock{s.mutex};
+    while (true) {
+        s.cv.wait(lock, [&s] { return s.stopping || !s.queue.empty(); });
+        if (s.stopping)
+            break;
+        auto job = std::move(s.queue.front().first);
+        s.queue.pop_front();
+        lock.unlock();
+        try {
+            job();
+        } catch (const std::exception& e) {
+            OXEN_LOG(err, "Uncaught exception in request shard job: {}", e.what());
+        }
+        lock.lock();
+        s.jobs++;
+    }
+}
+
+std::vector<request_shards::shard_stats> request_shards::stats() const {
+    std::vector<shard_stats> result;
+    result.reserve(shards_.size());
+    for (auto& s : shards_) {
+        std::lock_guard lock{s->mutex};
+        result.push_back({s->jobs, s->queue.size()});
+    }
+    return result;
+}
+
+} // namespace oxen
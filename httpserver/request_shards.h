@@ -0,0 +1,79 @@
+#pragma once
+
+#include "oxen_common.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace oxen {
+
+/// Runs client requests on a fixed set of worker threads ("shards") chosen by the owner pubkey of
+/// the request, rather than on whichever https/omq worker happened to receive it.  All requests for
+/// an owner thus run one at a time, in arrival order, on the same thread, so that per-owner
+/// operations (store, retrieve, delete) never contend with each other on the owner's rows, and the
+/// thread's database statements (and its own read connection; see Database::use_thread_reader())
+/// stay warm.
+class request_shards {
+  public:
+    // The most jobs we queue for a single shard; beyond that, run() refuses new jobs.
+    inline static constexpr size_t MAX_QUEUE = 1000;
+
+    // Starts `count` shard threads, each of which calls `thread_init` (if given) before running
+    // any jobs.  A count of 0 disables sharding: enabled() returns false and no threads are
+    // started.
+    explicit request_shards(int count = 0, std::function<void()> thread_init = nullptr);
+
+    // Stops the threads; see stop().
+    ~request_shards();
+
+    request_shards(const request_shards&) = delete;
+    request_shards& operator=(const request_shards&) = delete;
+
+    bool enabled() const { return !shards_.empty(); }
+
+    // The number of shards.
+    size_t size() const { return shards_.size(); }
+
+    // Returns the shard that handles requests for `pubkey`.  Must not be called when disabled.
+    size_t shard_for(const user_pubkey_t& pubkey) const;
+
+    // Queues `job` on the shard for `pubkey`.  Returns false (without queuing the job) if the
+    // shard's queue is full, or if we are stopped.  If the job is still queued when we stop then
+    // it doesn't run, and `dropped` (if given) is called instead, e.g. to reply to the client.
+    bool run(const user_pubkey_t& pubkey, std::function<void()> job,
+            std::function<void()> dropped = nullptr);
+
+    // Stops the shard threads, after they finish their current job, and waits for them to exit.
+    // Jobs still queued are dropped (calling their `dropped` callbacks).  Subsequent run() calls
+    // return false.
+    void stop();
+
+    struct shard_stats {
+        uint64_t jobs;  // Jobs run so far
+        size_t queued;  // Jobs waiting to run
+    };
+    std::vector<shard_stats> stats() const;
+
+  private:
+    struct shard {
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        // Each job along with its `dropped` callback
+        std::deque<std::pair<std::function<void()>, std::function<void()>>> queue;
+        uint64_t jobs = 0;
+        bool stopping = false;
+        std::thread thread;
+    };
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    static void run_shard(shard& s, const std::function<void()>& thread_init);
+};
+
+} // namespace oxen
@@ -0,0 +1,70 @@
+#include "retrieve_flights.h"
+#include "oxen_logger.h"
+
+#include <algorithm>
+
+namespace oxen {
+
+std::shared_ptr<retrieve_flights::flight> retrieve_flights::join(
+        const user_pubkey_t& pubkey, const std::string& last_hash, bool b64, callback cb) {
+    std::lock_guard lock{mutex_};
+    auto& flights = flights_[pubkey];
+    for (auto& f : flights) {
+        if (f->last_hash == last_hash && f->b64 == b64) {
+            f->waiters.push_back(std::move(cb));
+            coalesced_++;
+            return nullptr;
+        }
+    }
+    auto& f = flights.emplace_back(std::make_shared<flight>());
+    f->pubkey = pubkey;
+    f->last_hash = last_hash;
+    f->b64 = b64;
+    f->waiters.push_back(std::move(cb));
+    count_++;
+    executed_++;
+    return f;
+}
+
+void retrieve_flights::finish(const std::shared_ptr<flight>& f, std::shared_ptr<const std::string> body) {
+    std::vector<callback> waiters;
+    {
+        std::lock_guard lock{mutex_};
+        // It might not be here anymore if it was invalidated
+        if (auto it = flights_.find(f->pubkey); it != flights_.end()) {
+            auto& flights = it->second;
+            if (auto fit = std::find(flights.begin(), flights.end(), f); fit != flights.end()) {
+                flights.erase(fit);
+                count_--;
+                if (flights.empty())
+                    flights_.erase(it);
+            }
+        }
+        waiters = std::move(f->waiters);
+    }
+    for (auto& cb : waiters) {
+        try {
+            cb(body);
+        } catch (const std::exception& e) {
+            OXEN_LOG(err, "retrieve callback raised an exception: {}", e.what());
+        }
+    }
+}
+
+void retrieve_flights::invalidate(const user_pubkey_t& pubkey) {
+    if (count_ == 0)
+        return;
+    std::lock_guard lock{mutex_};
+    if (auto it = flights_.find(pubkey); it != flights_.end()) {
+        count_ -= it->second.size();
+        flights_.erase(it);
+    }
+}
+
+void retrieve_flights::invalidate_all() {
+    std::lock_guard lock{mutex_};
+    flights_.clear();
+    count_ = 0;
+}
+
+} // namespace oxen
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "oxen_common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace oxen {
+
+/// Tracks the client retrieve requests that are currently being executed, so that identical
+/// retrieves (same owner, `last_hash` and encoding) arriving while one is in progress can wait for
+/// and share its serialized reply instead of each running the same query and serialization.  This
+/// matters for popular (e.g. closed group) pubkeys that are polled by many clients at once.
+///
+/// Only the data is shared: the callers must each have passed their own authentication checks
+/// before joining.
+///
+/// So that a joining caller can't miss a change that it should have seen, every write to an
+/// owner's messages must call invalidate() once the write has been committed: that stops retrieves
+/// already in progress for the owner from taking on any more callers (those already waiting still
+/// get the reply).
+///
+/// This class is thread safe.
+class retrieve_flights {
+  public:
+    // Called with the shared reply: the serialized response without its "t" value and final closing
+    // `}` (json) or `e` (bt), or nullptr if the retrieve failed.
+    using callback = std::function<void(std::shared_ptr<const std::string> body)>;
+
+    struct flight;
+
+    // Adds `cb` to the in-progress retrieve for (`pubkey`, `last_hash`, `b64`) if there is one, and
+    // returns nullptr.  Otherwise starts a new one and returns it: the caller must then perform the
+    // retrieve and call finish() with the result (which invokes `cb` along with any that joined it).
+    std::shared_ptr<flight> join(const user_pubkey_t& pubkey, const std::string& last_hash,
+            bool b64, callback cb);
+
+    // Completes a retrieve started by join(), passing `body` to all of its callbacks.
+    void finish(const std::shared_ptr<flight>& f, std::shared_ptr<const std::string> body);
+
+    // Stops in-progress retrieves for `pubkey` (or for everyone) from being joined; see above.
+    void invalidate(const user_pubkey_t& pubkey);
+    void invalidate_all();
+
+    // The number of retrieves that were executed, and that joined another one instead.
+    uint64_t executed() const { return executed_; }
+    uint64_t coalesced() const { return coalesced_; }
+
+  private:
+    std::unordered_map<user_pubkey_t, std::vector<std::shared_ptr<flight>>> flights_;
+    // Lets invalidate() skip taking the lock when nothing is in progress
+    std::atomic<size_t> count_ = 0;
+    std::mutex mutex_;
+
+    std::atomic<uint64_t> executed_ = 0, coalesced_ = 0;
+};
+
+struct retrieve_flights::flight {
+    user_pubkey_t pubkey;
+    std::string last_hash;
+    bool b64;
+    std::vector<callback> waiters;
+};
+
+} // namespace oxen
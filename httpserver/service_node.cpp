@@ -13,7 +13,6 @@
 
 #include <boost/endian/conversion.hpp>
 #include <chrono>
-#include <cpr/cpr.h>
 #include <mutex>
 #include <nlohmann/json.hpp>
 #include <oxenmq/base32z.h>
@@ -22,16 +21,13 @@
 #include <oxenmq/oxenmq.h>
 
 #include <algorithm>
+#include <deque>
+#include <unordered_set>
 
 using json = nlohmann::json;
 
 namespace oxen {
 
-// Threshold of missing data records at which we start warning and consult bootstrap nodes (mainly
-// so that we don't bother producing warning spam or going to the bootstrap just for a few new nodes
-// that will often have missing info for a few minutes).
-using MISSING_PUBKEY_THRESHOLD = std::ratio<3, 100>;
-
 /// TODO: there should be config.h to store constants like these
 constexpr std::chrono::seconds OXEND_PING_INTERVAL = 30s;
 constexpr int CLIENT_RETRIEVE_MESSAGE_LIMIT = 100;
@@ -41,30 +37,32 @@ ServiceNode::ServiceNode(
         const legacy_seckey& skey,
         OxenmqServer& omq_server,
         const std::filesystem::path& db_location,
-        const bool force_start) :
+        const bool force_start,
+        std::chrono::milliseconds store_batch_window,
+        int client_shards) :
       force_start_{force_start},
       db_{std::make_unique<Database>(db_location)},
       our_address_{std::move(address)},
       our_seckey_{skey},
       omq_server_{omq_server},
-      all_stats_{*omq_server} {
+      store_batch_window_{store_batch_window},
+      all_stats_{*omq_server},
+      http_client_{std::make_unique<HttpClient>(*omq_server)},
+      client_shards_{client_shards, [this] { db_->use_thread_reader(); }} {
 
     swarm_ = std::make_unique<Swarm>(our_address_);
 
+    warm_start_ = load_saved_state();
+
     OXEN_LOG(info, "Requesting initial swarm state");
 
 #ifdef INTEGRATION_TEST
     syncing_ = false;
 #endif
 
-    omq_server->add_timer([this] { std::lock_guard l{sn_mutex_}; db_->clean_expired(); },
-            Database::CLEANUP_PERIOD);
+    omq_server->add_timer([this] { db_->clean_expired(); }, Database::CLEANUP_PERIOD);
 
-    // Periodically clean up any https request futures
-    omq_server_->add_timer([this] {
-        outstanding_https_reqs_.remove_if(
-                [](auto& f) { return f.wait_for(0ms) == std::future_status::ready; });
-    }, 1s);
+    omq_server_->add_timer([this] { relay_tick(); }, relay_transfer::TIMER_INTERVAL);
 
     // We really want to make sure nodes don't get stuck in "syncing" mode,
     // so if we are still "syncing" after a long time, activate SN regardless
@@ -72,7 +70,7 @@ ServiceNode::ServiceNode(
     auto& dtimer = *delay_timer; // Get reference before we move away the shared_ptr
     omq_server_->add_timer(dtimer, [this, timer=std::move(delay_timer)] {
         omq_server_->cancel_timer(*timer);
-        std::lock_guard lock{sn_mutex_};
+        std::lock_guard lock{block_mutex_};
         if (!syncing_)
             return;
         OXEN_LOG(warn, "Block syncing is taking too long, activating SS regardless");
@@ -87,6 +85,13 @@ void ServiceNode::on_oxend_connected() {
     omq_server_->add_timer([this] { oxend_ping(); }, OXEND_PING_INTERVAL);
     omq_server_->add_timer([this] { ping_peers(); },
             reachability_testing::TESTING_TIMER_INTERVAL);
+    omq_server_->add_timer([this] { reconcile_with_peer(); }, RECONCILE_INTERVAL);
+    omq_server_->add_timer([this] { heartbeat_peers(); }, PEER_HEARTBEAT_INTERVAL);
+
+    if (warm_start_) {
+        OXEN_LOG(info, "Using saved swarm state until we hear back from oxend");
+        return;
+    }
 
     std::unique_lock lock{first_response_mutex_};
     while (true) {
@@ -99,108 +104,8 @@ void ServiceNode::on_oxend_connected() {
     }
 }
 
-template <typename T>
-static T get_or(const json& j, std::string_view key, std::common_type_t<T> default_val) {
-    if (auto it = j.find(key); it != j.end())
-        return it->get<T>();
-    return default_val;
-}
-
-static block_update
-parse_swarm_update(const std::string& response_body) {
-
-    if (response_body.empty()) {
-        OXEN_LOG(critical, "Bad oxend rpc response: no response body");
-        throw std::runtime_error("Failed to parse swarm update");
-    }
-
-    std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
-    block_update bu;
-
-    OXEN_LOG(trace, "swarm repsonse: <{}>", response_body);
-
-    try {
-        json result = json::parse(response_body, nullptr, true);
-
-        bu.height = result.at("height").get<uint64_t>();
-        bu.block_hash = result.at("block_hash").get<std::string>();
-        bu.hardfork = result.at("hardfork").get<int>();
-        bu.snode_revision = get_or<int>(result, "snode_revision", 0);
-        bu.unchanged = get_or<bool>(result, "unchanged", false);
-        if (bu.unchanged)
-            return bu;
-
-        const json service_node_states = result.at("service_node_states");
-
-        int missing_aux_pks = 0, total = 0;
-
-        for (const auto& sn_json : service_node_states) {
-            /// We want to include (test) decommissioned nodes, but not
-            /// partially funded ones.
-            if (!sn_json.at("funded").get<bool>()) {
-                continue;
-            }
-
-            total++;
-            const auto& pk_hex = sn_json.at("service_node_pubkey").get_ref<const std::string&>();
-            const auto& pk_x25519_hex =
-                sn_json.at("pubkey_x25519").get_ref<const std::string&>();
-            const auto& pk_ed25519_hex =
-                sn_json.at("pubkey_ed25519").get_ref<const std::string&>();
-
-            if (pk_x25519_hex.empty() || pk_ed25519_hex.empty()) {
-                // These will always either both be present or neither present.  If they are missing
-                // there isn't much we can do: it means the remote hasn't transmitted them yet (or
-                // our local oxend hasn't received them yet).
-                missing_aux_pks++;
-                OXEN_LOG(debug, "ed25519/x25519 pubkeys are missing from service node info {}", pk_hex);
-                continue;
-            }
-
-            auto sn = sn_record{
-                sn_json.at("public_ip").get_ref<const std::string&>(),
-                sn_json.at("storage_port").get<uint16_t>(),
-                sn_json.at("storage_lmq_port").get<uint16_t>(),
-                legacy_pubkey::from_hex(pk_hex),
-                ed25519_pubkey::from_hex(pk_ed25519_hex),
-                x25519_pubkey::from_hex(pk_x25519_hex)};
-
-            const swarm_id_t swarm_id =
-                sn_json.at("swarm_id").get<swarm_id_t>();
-
-            /// Storing decommissioned nodes (with dummy swarm id) in
-            /// a separate data structure as it seems less error prone
-            if (swarm_id == INVALID_SWARM_ID) {
-                bu.decommissioned_nodes.push_back(std::move(sn));
-            } else {
-                bu.active_x25519_pubkeys.emplace(sn.pubkey_x25519.view());
-
-                swarm_map[swarm_id].push_back(std::move(sn));
-            }
-        }
-
-        if (missing_aux_pks >
-                MISSING_PUBKEY_THRESHOLD::num*total/MISSING_PUBKEY_THRESHOLD::den) {
-            OXEN_LOG(warn, "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
-                    "oxend may be out of sync with the network", missing_aux_pks, total);
-        }
-
-    } catch (const std::exception& e) {
-        OXEN_LOG(critical, "Bad oxend rpc response: invalid json ({})", e.what());
-        throw std::runtime_error("Failed to parse swarm update");
-    }
-
-    for (auto const& swarm : swarm_map) {
-        bu.swarms.emplace_back(SwarmInfo{swarm.first, swarm.second});
-    }
-
-    return bu;
-}
-
 void ServiceNode::bootstrap_data() {
 
-    std::lock_guard guard(sn_mutex_);
-
     OXEN_LOG(trace, "Bootstrapping peer data");
 
     std::string params = json{
@@ -272,18 +177,23 @@ void ServiceNode::bootstrap_data() {
 
                 if (++(*req_counter) == node_count) {
                     OXEN_LOG(info, "Bootstrapping done");
-                    if (target_height_ > 0)
-                        update_swarms();
-                    else {
+                    bool have_target;
+                    {
+                        std::lock_guard lock{block_mutex_};
+                        have_target = target_height_ > 0;
                         // If target height is still 0 after having contacted
                         // (successfully or not) all seed nodes, just assume we have
                         // finished syncing. (Otherwise we will never get a chance
                         // to update syncing status.)
+                        if (!have_target)
+                            syncing_ = false;
+                    }
+                    if (have_target)
+                        update_swarms();
+                    else
                         OXEN_LOG(warn,
                             "Could not contact any bootstrap nodes to get target "
                             "height. Assuming our local height is correct.");
-                        syncing_ = false;
-                    }
                 }
             },
             params,
@@ -294,6 +204,7 @@ void ServiceNode::bootstrap_data() {
 
 void ServiceNode::shutdown() {
     shutting_down_ = true;
+    client_shards_.stop();
 }
 
 bool ServiceNode::snode_ready(std::string* reason) {
@@ -302,16 +213,28 @@ bool ServiceNode::snode_ready(std::string* reason) {
         return false;
     }
 
-    std::lock_guard guard(sn_mutex_);
+    hf_revision hf;
+    bool syncing;
+    {
+        std::lock_guard lock{block_mutex_};
+        hf = hardfork_;
+        syncing = syncing_;
+    }
+    bool in_swarm = swarm_ && swarm_->snapshot()->is_valid();
+
+    return check_ready(hf, syncing, in_swarm, reason);
+}
+
+bool ServiceNode::check_ready(hf_revision hf, bool syncing, bool in_swarm, std::string* reason) const {
 
     std::vector<std::string> problems;
 
-    if (!hf_at_least(STORAGE_SERVER_HARDFORK))
+    if (hf < STORAGE_SERVER_HARDFORK)
         problems.push_back(fmt::format("not yet on hardfork {}.{}",
                     STORAGE_SERVER_HARDFORK.first, STORAGE_SERVER_HARDFORK.second));
-    if (!swarm_ || !swarm_->is_valid())
+    if (!in_swarm)
         problems.push_back("not in any swarm");
-    if (syncing_)
+    if (syncing)
         problems.push_back("not done syncing");
 
     if (reason)
@@ -355,9 +278,9 @@ void ServiceNode::record_proxy_request() { all_stats_.bump_proxy_requests(); }
 
 void ServiceNode::record_onion_request() { all_stats_.bump_onion_requests(); }
 
-bool ServiceNode::process_store(message msg, bool* new_msg) {
+void ServiceNode::record_retrieve_request() { all_stats_.bump_retrieve_requests(); }
 
-    std::lock_guard guard{sn_mutex_};
+bool ServiceNode::process_store(message msg, bool* new_msg) {
 
     /// only accept a message if we are in a swarm
     if (!swarm_) {
@@ -374,41 +297,187 @@ bool ServiceNode::process_store(message msg, bool* new_msg) {
         OXEN_LOG(trace, *stored ? "saved message: {}" : "message already exists: {}", msg.data);
     if (new_msg)
         *new_msg = stored.value_or(false);
+    if (stored && *stored) {
+        retrieve_flights_.invalidate(msg.pubkey);
+        if (have_message_waiters_)
+            notify_message_waiters(&msg, &msg + 1);
+    }
 
     bool legacy_store = !hf_at_least(HARDFORK_RECURSIVE_STORE);
     if (legacy_store) {
         auto serialized = std::move(serialize_messages(&msg, &msg+1, SERIALIZATION_VERSION_OLD).front());
 
-        for (auto& peer : swarm_->other_nodes())
+        auto peers = get_swarm_peers();
+        for (auto& peer : peers)
             relay_data_reliable(serialized, peer);
 
-        OXEN_LOG(debug, "Relayed message to {} swarm peers", swarm_->other_nodes().size());
+        OXEN_LOG(debug, "Relayed message to {} swarm peers", peers.size());
     }
     return true;
 }
 
-void ServiceNode::save_bulk(const std::vector<message>& msgs) {
+std::vector<std::optional<bool>> ServiceNode::process_store_batch(const std::vector<message>& msgs) {
+    if (!swarm_) {
+        OXEN_LOG(err, "error: my swarm in not initialized");
+        return std::vector<std::optional<bool>>(msgs.size());
+    }
+
+    all_stats_.bump_store_requests(msgs.size());
 
-    std::lock_guard guard(sn_mutex_);
+    auto stored = db_->store_batch(msgs);
+    OXEN_LOG(trace, "stored batch of {} messages", msgs.size());
+    for (size_t i = 0; i < stored.size(); i++)
+        if (stored[i].value_or(false))
+            retrieve_flights_.invalidate(msgs[i].pubkey);
+    if (have_message_waiters_)
+        notify_message_waiters(msgs.data(), msgs.data() + msgs.size());
+    return stored;
+}
+
+void ServiceNode::forward_store(const sn_record& peer, std::string_view store,
+        store_batcher::callback cb, std::chrono::milliseconds timeout) {
+    bool batch = false;
+    {
+        std::lock_guard lock{peer_conns_mutex_};
+        auto it = peer_conns_.find(peer.pubkey_legacy);
+        batch = it != peer_conns_.end() && it->second.store_batch;
+    }
+    if (!batch) {
+        omq_server_->request(peer.pubkey_x25519.view(), "sn.storage_cc", std::move(cb),
+                "store", store, oxenmq::send_option::request_timeout{timeout});
+        return;
+    }
+
+    auto pk = peer.pubkey_x25519;
+    auto added = store_batcher_.add(pk, store, std::move(cb), timeout);
+    if (added.full) {
+        if (auto b = store_batcher_.take(pk, added.id))
+            send_store_batch(std::move(*b));
+    } else if (added.first) {
+        auto flush = [this, pk, id=added.id] {
+            if (auto b = store_batcher_.take(pk, id))
+                send_store_batch(std::move(*b));
+        };
+        if (store_batch_window_ == 0ms)
+            // No waiting, but whatever else gets forwarded before the job runs still joins in
+            omq_server_->job(std::move(flush));
+        else {
+            auto timer = std::make_shared<oxenmq::TimerID>();
+            auto& t = *timer;
+            omq_server_->add_timer(t, [this, timer=std::move(timer), flush=std::move(flush)] {
+                omq_server_->cancel_timer(*timer);
+                flush();
+            }, store_batch_window_);
+        }
+    }
+}
+
+void ServiceNode::send_store_batch(store_batcher::batch b) {
+    OXEN_LOG(debug, "Forwarding batch of {} stores to {}", b.stores.size(), b.peer);
+    auto batch = std::make_shared<store_batcher::batch>(std::move(b));
+    omq_server_->request(batch->peer.view(), "sn.store_batch",
+            [this, batch](bool success, std::vector<std::string> replies) {
+                if (success || replies.empty() || replies[0] != "UNKNOWNCOMMAND")
+                    return store_batcher::deliver(*batch, success, std::move(replies));
+
+                // The peer advertised sn.store_batch but doesn't know it (e.g. it has since been
+                // downgraded), so stop batching for it and send the stores one at a time.
+                OXEN_LOG(info, "{} does not handle sn.store_batch; forwarding stores individually",
+                        batch->peer);
+                {
+                    std::lock_guard lock{peer_conns_mutex_};
+                    for (auto& [pk, peer] : peer_conns_)
+                        if (peer.sn.pubkey_x25519 == batch->peer)
+                            peer.store_batch = false;
+                }
+                for (size_t i = 0; i < batch->stores.size(); i++)
+                    omq_server_->request(batch->peer.view(), "sn.storage_cc",
+                            std::move(batch->callbacks[i]), "store", batch->stores[i],
+                            oxenmq::send_option::request_timeout{batch->timeout});
+            },
+            oxenmq::send_option::data_parts(batch->stores.begin(), batch->stores.end()),
+            oxenmq::send_option::request_timeout{batch->timeout});
+}
+
+bool ServiceNode::save_bulk(const std::vector<message>& msgs) {
 
     try { db_->bulk_store(msgs); }
     catch (const std::exception& e) {
         OXEN_LOG(err, "failed to save batch to the database: {}", e.what());
-        return;
+        return false;
     }
 
     OXEN_LOG(trace, "saved messages count: {}", msgs.size());
+    for (auto& msg : msgs)
+        retrieve_flights_.invalidate(msg.pubkey);
+    if (have_message_waiters_)
+        notify_message_waiters(msgs.data(), msgs.data() + msgs.size());
+    return true;
+}
+
+uint64_t ServiceNode::wait_for_message(const std::string& msg_hash, std::function<void()> notify) {
+    std::lock_guard lock{message_waiters_mutex_};
+    auto id = ++next_waiter_id_;
+    message_waiters_.emplace(msg_hash, std::make_pair(id, std::move(notify)));
+    have_message_waiters_ = true;
+    return id;
+}
+
+void ServiceNode::cancel_message_wait(const std::string& msg_hash, uint64_t id) {
+    std::lock_guard lock{message_waiters_mutex_};
+    auto [begin, end] = message_waiters_.equal_range(msg_hash);
+    for (auto it = begin; it != end; ++it) {
+        if (it->second.first == id) {
+            message_waiters_.erase(it);
+            break;
+        }
+    }
+    have_message_waiters_ = !message_waiters_.empty();
+}
+
+void ServiceNode::notify_message_waiters(const message* begin, const message* end) {
+    std::vector<std::function<void()>> wake;
+    {
+        std::lock_guard lock{message_waiters_mutex_};
+        for (auto* msg = begin; msg != end; ++msg) {
+            auto [first, last] = message_waiters_.equal_range(msg->hash);
+            for (auto it = first; it != last; ++it)
+                wake.push_back(std::move(it->second.second));
+            message_waiters_.erase(first, last);
+        }
+        have_message_waiters_ = !message_waiters_.empty();
+    }
+    for (auto& notify : wake)
+        notify();
+}
+
+void ServiceNode::notify_all_message_waiters() {
+    decltype(message_waiters_) waiters;
+    {
+        std::lock_guard lock{message_waiters_mutex_};
+        waiters.swap(message_waiters_);
+        have_message_waiters_ = false;
+    }
+    for (auto& [hash, waiter] : waiters)
+        waiter.second();
 }
 
 void ServiceNode::on_bootstrap_update(block_update&& bu) {
 
-    // Used in a callback to needs a mutex even if it is private
-    std::lock_guard guard(sn_mutex_);
+    bool syncing;
+    {
+        std::lock_guard lock{block_mutex_};
+        target_height_ = std::max(target_height_, bu.height);
+        syncing = syncing_;
+    }
 
-    swarm_->apply_swarm_changes(bu.swarms);
-    target_height_ = std::max(target_height_, bu.height);
+    {
+        std::lock_guard lock{swarm_mutex_};
+        swarm_->apply_swarm_changes(bu.swarms);
+        swarm_->publish();
+    }
 
-    if (syncing_)
+    if (syncing)
         omq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
 }
 
@@ -454,84 +523,107 @@ static SnodeStatus derive_snode_status(const block_update& bu,
 void ServiceNode::on_swarm_update(block_update&& bu) {
 
     hf_revision net_ver{bu.hardfork, bu.snode_revision};
-    if (hardfork_ != net_ver) {
-        OXEN_LOG(info, "New hardfork: {}.{}", net_ver.first, net_ver.second);
-        hardfork_ = net_ver;
-    }
-
-    if (syncing_ && target_height_ != 0) {
-        syncing_ = bu.height < target_height_;
-    }
-
-    /// We don't have anything to do until we have synced
-    if (syncing_) {
-        OXEN_LOG(debug, "Still syncing: {}/{}", bu.height, target_height_);
-        // Note that because we are still syncing, we won't update our swarm id
-        return;
-    }
+    bool syncing;
+    {
+        std::lock_guard lock{block_mutex_};
 
-    if (bu.block_hash != block_hash_) {
+        if (hardfork_ != net_ver) {
+            OXEN_LOG(info, "New hardfork: {}.{}", net_ver.first, net_ver.second);
+            hardfork_ = net_ver;
+        }
 
-        OXEN_LOG(debug, "new block, height: {}, hash: {}", bu.height,
-                 bu.block_hash);
+        if (syncing_ && target_height_ != 0) {
+            syncing_ = bu.height < target_height_;
+        }
 
-        if (bu.height > block_height_ + 1 && block_height_ != 0) {
-            OXEN_LOG(warn, "Skipped some block(s), old: {} new: {}",
-                     block_height_, bu.height);
-            /// TODO: if we skipped a block, should we try to run peer tests for
-            /// them as well?
-        } else if (bu.height <= block_height_) {
-            // TODO: investigate how testing will be affected under reorg
-            OXEN_LOG(warn,
-                     "new block height is not higher than the current height");
+        /// We don't have anything to do until we have synced
+        if (syncing_) {
+            OXEN_LOG(debug, "Still syncing: {}/{}", bu.height, target_height_);
+            // Note that because we are still syncing, we won't update our swarm id
+            return;
         }
+        syncing = syncing_;
+
+        if (bu.block_hash != block_hash_) {
+
+            OXEN_LOG(debug, "new block, height: {}, hash: {}", bu.height,
+                     bu.block_hash);
+
+            if (bu.height > block_height_ + 1 && block_height_ != 0) {
+                OXEN_LOG(warn, "Skipped some block(s), old: {} new: {}",
+                         block_height_, bu.height);
+                /// TODO: if we skipped a block, should we try to run peer tests for
+                /// them as well?
+            } else if (bu.height <= block_height_) {
+                // TODO: investigate how testing will be affected under reorg
+                OXEN_LOG(warn,
+                         "new block height is not higher than the current height");
+            }
 
-        block_height_ = bu.height;
-        block_hash_ = bu.block_hash;
+            block_height_ = bu.height;
+            block_hash_ = bu.block_hash;
 
-        while (block_hashes_cache_.size() >= BLOCK_HASH_CACHE_SIZE)
-            block_hashes_cache_.erase(block_hashes_cache_.begin());
+            while (block_hashes_cache_.size() >= BLOCK_HASH_CACHE_SIZE)
+                block_hashes_cache_.erase(block_hashes_cache_.begin());
 
-        block_hashes_cache_.insert_or_assign(block_hashes_cache_.end(), bu.height, std::move(bu.block_hash));
-    } else {
-        OXEN_LOG(trace, "already seen this block");
-        return;
+            block_hashes_cache_.insert_or_assign(block_hashes_cache_.end(), bu.height, std::move(bu.block_hash));
+        } else {
+            OXEN_LOG(trace, "already seen this block");
+            return;
+        }
     }
 
     omq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
 
-    const SwarmEvents events = swarm_->derive_swarm_events(bu.swarms);
+    SwarmEvents events;
+    bool ready;
+    {
+        std::lock_guard lock{swarm_mutex_};
 
-    // TODO: check our node's state
+        events = swarm_->derive_swarm_events(bu.swarms);
 
-    const auto status = derive_snode_status(bu, our_address_);
+        // TODO: check our node's state
 
-    if (status_ != status) {
-        OXEN_LOG(info, "Node status updated: {}", status);
-        status_ = status;
-    }
+        const auto status = derive_snode_status(bu, our_address_);
 
-    swarm_->set_swarm_id(events.our_swarm_id);
+        if (status_.exchange(status) != status)
+            OXEN_LOG(info, "Node status updated: {}", status);
 
-    if (std::string reason; !snode_ready(&reason)) {
-        OXEN_LOG(warn, "Storage server is still not ready: {}", reason);
-        swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, false);
-        return;
-    } else {
-        if (!active_) {
-            // NOTE: because we never reset `active_` after we get
-            // decommissioned, this code won't run when the node comes back
-            // again
-            OXEN_LOG(info, "Storage server is now active!");
-            active_ = true;
+        swarm_->set_swarm_id(events.our_swarm_id);
+
+        bool in_swarm = events.our_swarm_id != INVALID_SWARM_ID;
+        if (std::string reason; !(ready = check_ready(net_ver, syncing, in_swarm, &reason))) {
+            OXEN_LOG(warn, "Storage server is still not ready: {}", reason);
+            swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, false);
+        } else {
+            if (!active_) {
+                // NOTE: because we never reset `active_` after we get
+                // decommissioned, this code won't run when the node comes back
+                // again
+                OXEN_LOG(info, "Storage server is now active!");
+                active_ = true;
+            }
+
+            swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, true);
         }
+
+        swarm_->publish();
     }
 
-    swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, true);
+    update_peer_connections();
 
-    if (!events.new_snodes.empty()) {
-        relay_messages(get_all_messages(), events.new_snodes);
-    }
+    // Everything from here on touches the database, and so must not hold the swarm update lock
+
+    save_state(bu);
+
+    // Storage tests that were waiting for us to catch up to their height can go ahead now
+    notify_all_message_waiters();
+
+    if (!ready)
+        return;
+
+    for (const auto& sn : events.new_snodes)
+        start_relay(sn, events.our_swarm_id);
 
     if (!events.new_swarms.empty()) {
         bootstrap_swarms(events.new_swarms);
@@ -547,6 +639,157 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
 #endif
 }
 
+oxenmq::ConnectionID ServiceNode::connect_peer(const sn_record& sn) {
+    return omq_server_->connect_sn(sn.pubkey_x25519.view(),
+            oxenmq::connect_option::keep_alive{PEER_KEEP_ALIVE},
+            oxenmq::connect_option::hint{fmt::format("tcp://{}:{}", sn.ip, sn.omq_port)});
+}
+
+void ServiceNode::update_peer_connections() {
+    auto swarm = swarm_->snapshot();
+    auto& peers = swarm->swarm_peers;
+
+    std::lock_guard lock{peer_conns_mutex_};
+    for (auto it = peer_conns_.begin(); it != peer_conns_.end(); ) {
+        if (std::find(peers.begin(), peers.end(), it->second.sn) == peers.end()) {
+            OXEN_LOG(debug, "Closing connection to former swarm peer {}", it->first);
+            omq_server_->disconnect(it->second.conn);
+            it = peer_conns_.erase(it);
+        } else
+            ++it;
+    }
+    for (auto& sn : peers) {
+        auto [it, inserted] = peer_conns_.try_emplace(sn.pubkey_legacy);
+        if (inserted)
+            OXEN_LOG(debug, "Connecting to swarm peer {}", sn.pubkey_legacy);
+        it->second.sn = sn;
+        it->second.conn = connect_peer(sn);
+    }
+}
+
+void ServiceNode::heartbeat_peers() {
+    // Reconnects to anyone we got disconnected from, and refreshes the connections' keep-alive
+    update_peer_connections();
+
+    const auto sent = std::chrono::steady_clock::now();
+    std::lock_guard lock{peer_conns_mutex_};
+    for (auto& [pk, peer] : peer_conns_) {
+        omq_server_->request(peer.sn.pubkey_x25519.view(), "sn.heartbeat",
+            [this, pk=pk, sent](bool success, const auto& data) {
+                std::lock_guard lock{peer_conns_mutex_};
+                auto it = peer_conns_.find(pk);
+                if (it == peer_conns_.end())
+                    return;
+                auto& peer = it->second;
+                if (success) {
+                    peer.heartbeats = true;
+                    peer.store_batch =
+                        std::find(data.begin(), data.end(), "store_batch") != data.end();
+                    peer.failures = 0;
+                    peer.rtt = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - sent);
+                    peer_latency_.success(pk, peer.rtt);
+                    return;
+                }
+                if (peer.heartbeats)
+                    peer_latency_.failure(pk);
+                if (!peer.heartbeats || ++peer.failures < PEER_HEARTBEAT_FAILURES)
+                    return;
+                OXEN_LOG(debug, "Swarm peer {} missed {} heartbeats; reconnecting",
+                        pk, peer.failures);
+                omq_server_->disconnect(peer.conn);
+                peer.conn = connect_peer(peer.sn);
+                peer.failures = 0;
+            },
+            oxenmq::send_option::request_timeout{PEER_HEARTBEAT_TIMEOUT});
+    }
+}
+
+void ServiceNode::save_state(const block_update& bu) {
+    try {
+        json block_state;
+        {
+            std::lock_guard lock{block_mutex_};
+            block_state = {
+                {"saved", std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count()},
+                {"height", block_height_},
+                {"block_hash", block_hash_},
+                {"hardfork", hardfork_.first},
+                {"snode_revision", hardfork_.second},
+                {"block_hashes", block_hashes_cache_}};
+        }
+
+        std::lock_guard lock{saved_state_mutex_};
+        auto swarms = serialize_swarms(bu);
+        if (auto hash = std::hash<std::string>{}(swarms); hash != saved_swarms_hash_) {
+            db_->save_state("swarms", swarms);
+            saved_swarms_hash_ = hash;
+        }
+        db_->save_state("block_state", block_state.dump());
+    } catch (const std::exception& e) {
+        OXEN_LOG(warn, "Failed to save swarm state: {}", e.what());
+    }
+}
+
+bool ServiceNode::load_saved_state() {
+    try {
+        auto block_data = db_->load_state("block_state");
+        auto swarm_data = db_->load_state("swarms");
+        if (!block_data || !swarm_data)
+            return false;
+
+        auto block_state = json::parse(*block_data);
+        auto age = std::chrono::system_clock::now() - std::chrono::system_clock::time_point{
+            std::chrono::seconds{block_state.at("saved").get<int64_t>()}};
+        if (age > SAVED_STATE_MAX_AGE) {
+            OXEN_LOG(info, "Not using saved swarm state from {} ago", util::short_duration(age));
+            return false;
+        }
+
+        block_update bu;
+        bu.height = block_state.at("height").get<uint64_t>();
+        bu.block_hash = block_state.at("block_hash").get<std::string>();
+        bu.hardfork = block_state.at("hardfork").get<int>();
+        bu.snode_revision = block_state.at("snode_revision").get<int>();
+        deserialize_swarms(*swarm_data, bu);
+
+        {
+            std::lock_guard lock{block_mutex_};
+            hardfork_ = {bu.hardfork, bu.snode_revision};
+            block_height_ = bu.height;
+            block_hash_ = bu.block_hash;
+            block_hashes_cache_ =
+                block_state.at("block_hashes").get<std::map<uint64_t, std::string>>();
+            syncing_ = false;
+        }
+
+        omq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
+
+        {
+            std::lock_guard lock{swarm_mutex_};
+            auto events = swarm_->derive_swarm_events(bu.swarms);
+            status_ = derive_snode_status(bu, our_address_);
+            swarm_->set_swarm_id(events.our_swarm_id);
+            swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events,
+                    events.our_swarm_id != INVALID_SWARM_ID);
+            swarm_->publish();
+        }
+
+        {
+            std::lock_guard lock{saved_state_mutex_};
+            saved_swarms_hash_ = std::hash<std::string>{}(*swarm_data);
+        }
+
+        OXEN_LOG(info, "Loaded saved swarm state from height {} ({} ago)",
+                bu.height, util::short_duration(age));
+        return true;
+    } catch (const std::exception& e) {
+        OXEN_LOG(warn, "Failed to load saved swarm state: {}", e.what());
+    }
+    return false;
+}
+
 void ServiceNode::update_swarms() {
 
     if (updating_swarms_.exchange(true)) {
@@ -554,8 +797,6 @@ void ServiceNode::update_swarms() {
         return;
     }
 
-    std::lock_guard lock{sn_mutex_};
-
     OXEN_LOG(debug, "Swarm update triggered");
 
     json params{
@@ -575,8 +816,16 @@ void ServiceNode::update_swarms() {
         }},
         {"active_only", false}
     };
-    if (got_first_response_ && !block_hash_.empty())
-        params["poll_block_hash"] = block_hash_;
+    bool have_first_response;
+    {
+        std::lock_guard l{first_response_mutex_};
+        have_first_response = got_first_response_;
+    }
+    if (have_first_response) {
+        std::lock_guard lock{block_mutex_};
+        if (!block_hash_.empty())
+            params["poll_block_hash"] = block_hash_;
+    }
 
     omq_server_.oxend_request("rpc.get_service_nodes",
         [this](bool success, std::vector<std::string> data) {
@@ -586,15 +835,20 @@ void ServiceNode::update_swarms() {
                 return;
             }
             try {
-                std::lock_guard lock{sn_mutex_};
-                block_update bu = parse_swarm_update(data[1]);
-                if (!got_first_response_) {
+                block_update bu;
+                {
+                    std::lock_guard lock{sn_list_mutex_};
+                    bu = parse_swarm_update(data[1], &sn_list_cache_);
+                }
+                bool first_response;
+                {
+                    std::lock_guard l{first_response_mutex_};
+                    first_response = !got_first_response_;
+                    got_first_response_ = true;
+                }
+                if (first_response) {
                     OXEN_LOG(info, "Got initial swarm information from local Oxend");
 
-                    {
-                        std::lock_guard l{first_response_mutex_};
-                        got_first_response_ = true;
-                    }
                     first_response_cv_.notify_all();
 
                     // Request some recent block hash heights so that we can properly carry out and
@@ -610,6 +864,7 @@ void ServiceNode::update_swarms() {
                                     std::string_view hash{data[1].data() + 1, data[1].size() - 2};
                                     if (oxenmq::is_hex(hash)) {
                                         OXEN_LOG(debug, "Pre-loaded hash {} for height {}", hash, h);
+                                        std::lock_guard lock{block_mutex_};
                                         block_hashes_cache_.insert_or_assign(h, hash);
                                     }
                                 },
@@ -634,6 +889,7 @@ void ServiceNode::update_swarms() {
                                 MISSING_PUBKEY_THRESHOLD::num*total/MISSING_PUBKEY_THRESHOLD::den) {
                         OXEN_LOG(info, "Initialized from oxend with {}/{} SN records",
                                 total-missing, total);
+                        std::lock_guard lock{block_mutex_};
                         syncing_ = false;
                     } else {
                         OXEN_LOG(info, "Detected some missing SN data ({}/{}); "
@@ -657,35 +913,40 @@ void ServiceNode::update_swarms() {
 }
 
 void ServiceNode::update_last_ping(ReachType type) {
+    std::lock_guard lock{reach_mutex_};
     reach_records_.incoming_ping(type);
 }
 
 void ServiceNode::ping_peers() {
 
-    std::lock_guard lock{sn_mutex_};
+    std::vector<std::pair<sn_record, int>> to_test;
+    {
+        // TODO: Don't do anything until we are fully funded
 
-    // TODO: Don't do anything until we are fully funded
+        const auto status = status_.load();
+        if (status == SnodeStatus::UNSTAKED || status == SnodeStatus::UNKNOWN) {
+            OXEN_LOG(trace, "Skipping peer testing (unstaked)");
+            return;
+        }
 
-    if (status_ == SnodeStatus::UNSTAKED || status_ == SnodeStatus::UNKNOWN) {
-        OXEN_LOG(trace, "Skipping peer testing (unstaked)");
-        return;
-    }
+        auto now = std::chrono::steady_clock::now();
 
-    auto now = std::chrono::steady_clock::now();
+        std::lock_guard reach_lock{reach_mutex_};
 
-    // Check if we've been tested (reached) recently ourselves
-    reach_records_.check_incoming_tests(now);
+        // Check if we've been tested (reached) recently ourselves
+        reach_records_.check_incoming_tests(now);
 
-    if (status_ == SnodeStatus::DECOMMISSIONED) {
-        OXEN_LOG(trace, "Skipping peer testing (decommissioned)");
-        return;
-    }
+        if (status == SnodeStatus::DECOMMISSIONED) {
+            OXEN_LOG(trace, "Skipping peer testing (decommissioned)");
+            return;
+        }
 
-    /// We always test nodes due to be tested plus one general, non-failing node.
+        /// We always test nodes due to be tested plus one general, non-failing node.
 
-    auto to_test = reach_records_.get_failing(*swarm_, now);
-    if (auto rando = reach_records_.next_random(*swarm_, now))
-        to_test.emplace_back(std::move(*rando), 0);
+        to_test = reach_records_.get_failing(*swarm_, now);
+        if (auto rando = reach_records_.next_random(*swarm_, now))
+            to_test.emplace_back(std::move(*rando), 0);
+    }
 
     if (to_test.empty())
         OXEN_LOG(trace, "no nodes to test this tick");
@@ -726,81 +987,75 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
             sn, 0);
 
     bool old_ping_test = !hf_at_least(HARDFORK_HTTPS_PING_TEST_URL);
-    cpr::Url url{fmt::format("https://{}:{}{}/ping_test/v1",
-            sn.ip, sn.port, old_ping_test ? "/swarms" : "")};
-    cpr::Body body{""};
-    cpr::Header headers{
+    HttpClient::Request req;
+    req.url = fmt::format("https://{}:{}{}/ping_test/v1",
+            sn.ip, sn.port, old_ping_test ? "/swarms" : "");
+    req.headers = {
         {"Host", sn.pubkey_ed25519
             ? oxenmq::to_base32z(sn.pubkey_ed25519.view()) + ".snode"
             : "service-node.snode"},
         {"Content-Type", "application/octet-stream"},
         {"User-Agent", "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
     };
+    req.timeout = SN_PING_TIMEOUT;
+    req.verify_tls = false;
 
     if (old_ping_test)
-        for (auto& [h, v] : sign_request(body.str()))
-            headers[h] = std::move(v);
-
-    OXEN_LOG(debug, "Sending HTTPS ping to {} @ {}", sn.pubkey_legacy, url);
-    outstanding_https_reqs_.emplace_front(
-        cpr::PostCallback(
-            [this, &omq=*omq_server(), old_ping_test, test_results, previous_failures]
-            (cpr::Response r) {
-                auto& [sn, result] = *test_results;
-                auto& pk = sn.pubkey_legacy;
-                bool success = false;
-                if (r.error.code != cpr::ErrorCode::OK) {
-                    OXEN_LOG(debug, "FAILED HTTPS ping test of {}: {} {}", pk, r.error.code, r.error.message);
-                } else if (r.status_code != 200) {
-                    OXEN_LOG(debug, "FAILED HTTPS ping test of {}: received non-200 status {} {}",
-                            pk, r.status_code, r.status_line);
+        for (auto& [h, v] : sign_request(req.body))
+            req.headers.emplace_back(std::move(h), std::move(v));
+
+    OXEN_LOG(debug, "Sending HTTPS ping to {} @ {}", sn.pubkey_legacy, req.url);
+    http_client_->post(std::move(req),
+        [this, old_ping_test, test_results, previous_failures](HttpClient::Response r) {
+            auto& [sn, result] = *test_results;
+            auto& pk = sn.pubkey_legacy;
+            bool success = false;
+            if (!r.ok) {
+                OXEN_LOG(debug, "FAILED HTTPS ping test of {}: {}", pk, r.error);
+            } else if (r.status_code != 200) {
+                OXEN_LOG(debug, "FAILED HTTPS ping test of {}: received non-200 status {} {}",
+                        pk, r.status_code, r.status_text);
+            } else {
+                if (old_ping_test) {
+                    if (r.header(http::SNODE_SIGNATURE_HEADER))
+                        // The signature returned is of the cert.pem which is impossible to
+                        // verify without going deeper into the low level SSL layer which isn't
+                        // worth the bother, so just accept anything with the signature header
+                        // set.
+                        success = true;
+                    else
+                        OXEN_LOG(debug, "FAILED HTTPS ping test of {}: {} response header missing",
+                                pk, http::SNODE_SIGNATURE_HEADER);
                 } else {
-                    if (old_ping_test) {
-                        if (r.header.count(http::SNODE_SIGNATURE_HEADER))
-                            // The signature returned is of the cert.pem which is impossible to
-                            // verify without going deeper into the low level SSL layer which isn't
-                            // worth the bother, so just accept anything with the signature header
-                            // set.
-                            success = true;
-                        else
-                            OXEN_LOG(debug, "FAILED HTTPS ping test of {}: {} response header missing",
-                                    pk, http::SNODE_SIGNATURE_HEADER);
-                    } else {
-                        if (auto it = r.header.find(http::SNODE_PUBKEY_HEADER);
-                                it == r.header.end())
-                            OXEN_LOG(debug, "FAILED HTTPS ping test of {}: {} response header missing",
-                                    pk, http::SNODE_PUBKEY_HEADER);
-                        else if (auto remote_pk = parse_legacy_pubkey(it->second); remote_pk != pk)
-                            OXEN_LOG(debug, "FAILED HTTPS ping test of {}: reply has wrong pubkey {}",
-                                    pk, remote_pk);
-                        else
-                            success = true;
-                    }
+                    if (auto* remote = r.header(http::SNODE_PUBKEY_HEADER); !remote)
+                        OXEN_LOG(debug, "FAILED HTTPS ping test of {}: {} response header missing",
+                                pk, http::SNODE_PUBKEY_HEADER);
+                    else if (auto remote_pk = parse_legacy_pubkey(*remote); remote_pk != pk)
+                        OXEN_LOG(debug, "FAILED HTTPS ping test of {}: reply has wrong pubkey {}",
+                                pk, remote_pk);
+                    else
+                        success = true;
                 }
-                if (success)
-                    OXEN_LOG(debug, "Successful HTTPS ping test of {}", pk);
+            }
+            if (success)
+                OXEN_LOG(debug, "Successful HTTPS ping test of {}", pk);
 
-                if (auto r = result.exchange(success ? TEST_PASSED : TEST_FAILED); r != TEST_WAITING)
-                    report_reachability(sn, success && r == TEST_PASSED, previous_failures);
-            },
-            std::move(url),
-            cpr::Timeout{SN_PING_TIMEOUT},
-            cpr::Ssl(
-                    cpr::ssl::TLSv1_2{},
-                    cpr::ssl::VerifyHost{false},
-                    cpr::ssl::VerifyPeer{false},
-                    cpr::ssl::VerifyStatus{false}),
-            cpr::MaxRedirects{0},
-            std::move(headers),
-            std::move(body)
-        )
-    );
+            if (auto r = result.exchange(success ? TEST_PASSED : TEST_FAILED); r != TEST_WAITING)
+                report_reachability(sn, success && r == TEST_PASSED, previous_failures);
+        });
 
     // test omq port:
     omq_server_->request(
         sn.pubkey_x25519.view(), "sn.ping",
-        [this, test_results=std::move(test_results), previous_failures](bool success, const auto&) {
+        [this, test_results=std::move(test_results), previous_failures,
+                sent=std::chrono::steady_clock::now()](bool success, const auto&) {
             auto& [sn, result] = *test_results;
+            if (success)
+                peer_latency_.success(sn.pubkey_legacy,
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - sent));
+            else
+                peer_latency_.failure(sn.pubkey_legacy);
 
             OXEN_LOG(debug, "{} response for OxenMQ ping test of {}",
                     success ? "Successful" : "FAILED", sn.pubkey_legacy);
@@ -814,9 +1069,25 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
     );
 }
 
-void ServiceNode::oxend_ping() {
+void ServiceNode::oxend_client_request(std::string_view endpoint,
+        const std::optional<nlohmann::json>& params, oxend_cache::callback cb) {
+    std::string block;
+    {
+        std::lock_guard lock{block_mutex_};
+        // Our block hash isn't updated while syncing, so don't cache anything until we're caught up
+        if (!syncing_)
+            block = block_hash_;
+    }
 
-    std::lock_guard guard(sn_mutex_);
+    oxend_cache_.get(block, endpoint, params, std::move(cb), [&](auto done) {
+        std::optional<std::string> oxend_params;
+        if (params)
+            oxend_params = params->dump();
+        omq_server_.oxend_request("rpc." + std::string{endpoint}, std::move(done), oxend_params);
+    });
+}
+
+void ServiceNode::oxend_ping() {
 
     json oxend_params{
         {"version", STORAGE_SERVER_VERSION},
@@ -907,63 +1178,59 @@ void ServiceNode::send_storage_test_req(const sn_record& testee,
                                         uint64_t test_height,
                                         const message& msg) {
 
+    uint64_t height;
+    {
+        std::lock_guard lock{block_mutex_};
+        height = block_height_;
+    }
+
     if (!hf_at_least(HARDFORK_OMQ_STORAGE_TESTS)) {
         // Deprecated HTTPS storage test: remove after HF18.1
-        cpr::Body body{json{{"height", test_height}, {"hash", msg.hash}}.dump()};
-        cpr::Header headers{
+        HttpClient::Request req;
+        req.url = fmt::format("https://{}:{}/swarms/storage_test/v1", testee.ip, testee.port);
+        req.body = json{{"height", test_height}, {"hash", msg.hash}}.dump();
+        req.headers = {
             {"Host", testee.pubkey_ed25519
                 ? oxenmq::to_base32z(testee.pubkey_ed25519.view()) + ".snode"
                 : "service-node.snode"},
             {"User-Agent", "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
         };
-
-        for (auto& [h, v] : sign_request(body.str()))
-            headers[h] = std::move(v);
-
-        outstanding_https_reqs_.emplace_front(
-            cpr::PostCallback(
-                [this, testee, msg, height=block_height_]
-                (cpr::Response r) {
-                    auto& pk = testee.pubkey_legacy;
-                    std::string status;
-                    std::string answer;
-                    if (r.error.code != cpr::ErrorCode::OK)
-                        OXEN_LOG(debug, "FAILED storage test of {}: {}", pk, r.error.message);
-                    else if (r.status_code != 200)
-                        OXEN_LOG(debug, "FAILED storage test of {}: received non-200 status {} {}",
-                                pk, r.status_code, r.status_line);
-                    else if (r.text.empty())
-                        OXEN_LOG(debug, "FAILED storage test of {}: received empty body", pk);
-                    else {
-                        try {
-                            json res_json = json::parse(r.text);
-                            status = res_json.at("status").get<std::string>();
-                            auto& ans = res_json.at("value").get_ref<const std::string&>();
-                            if (oxenmq::is_base64(ans))
-                                answer = oxenmq::from_base64(ans);
-                            else
-                                OXEN_LOG(debug, "FAILED storage test of {}: body of legacy HTTP request was not base64");
-                        } catch (const std::exception& e) {
-                            OXEN_LOG(debug, "FAILED storage test of {}: invalid json response ({})", pk, e.what());
-                            status.clear();
-                            answer.clear();
-                        }
+        req.timeout = STORAGE_TEST_TIMEOUT;
+        req.verify_tls = false;
+
+        for (auto& [h, v] : sign_request(req.body))
+            req.headers.emplace_back(std::move(h), std::move(v));
+
+        http_client_->post(std::move(req),
+            [this, testee, msg, height](HttpClient::Response r) {
+                auto& pk = testee.pubkey_legacy;
+                std::string status;
+                std::string answer;
+                if (!r.ok)
+                    OXEN_LOG(debug, "FAILED storage test of {}: {}", pk, r.error);
+                else if (r.status_code != 200)
+                    OXEN_LOG(debug, "FAILED storage test of {}: received non-200 status {} {}",
+                            pk, r.status_code, r.status_text);
+                else if (r.body.empty())
+                    OXEN_LOG(debug, "FAILED storage test of {}: received empty body", pk);
+                else {
+                    try {
+                        json res_json = json::parse(r.body);
+                        status = res_json.at("status").get<std::string>();
+                        auto& ans = res_json.at("value").get_ref<const std::string&>();
+                        if (oxenmq::is_base64(ans))
+                            answer = oxenmq::from_base64(ans);
+                        else
+                            OXEN_LOG(debug, "FAILED storage test of {}: body of legacy HTTP request was not base64");
+                    } catch (const std::exception& e) {
+                        OXEN_LOG(debug, "FAILED storage test of {}: invalid json response ({})", pk, e.what());
+                        status.clear();
+                        answer.clear();
                     }
+                }
 
-                    process_storage_test_response(testee, msg, height, std::move(status), std::move(answer));
-                },
-                cpr::Url{fmt::format("https://{}:{}/swarms/storage_test/v1", testee.ip, testee.port)},
-                cpr::Timeout{STORAGE_TEST_TIMEOUT},
-                cpr::Ssl(
-                        cpr::ssl::TLSv1_2{},
-                        cpr::ssl::VerifyHost{false},
-                        cpr::ssl::VerifyPeer{false},
-                        cpr::ssl::VerifyStatus{false}),
-                cpr::MaxRedirects{0},
-                std::move(headers),
-                std::move(body)
-            )
-        );
+                process_storage_test_response(testee, msg, height, std::move(status), std::move(answer));
+            });
         return;
     }
 
@@ -977,7 +1244,7 @@ void ServiceNode::send_storage_test_req(const sn_record& testee,
 
     omq_server_->request(
         testee.pubkey_x25519.view(), "sn.storage_test",
-        [this, testee, msg, height=block_height_](bool success, auto data) {
+        [this, testee, msg, height](bool success, auto data) {
             if (!success || data.size() != 2) {
                 OXEN_LOG(debug, "Storage test request failed: {}",
                         !success ? "request timed out" : "wrong number of elements in response");
@@ -988,7 +1255,7 @@ void ServiceNode::send_storage_test_req(const sn_record& testee,
         },
         oxenmq::send_option::request_timeout{STORAGE_TEST_TIMEOUT},
         // Data parts: test height and msg hash (in bytes)
-        std::to_string(block_height_),
+        std::to_string(height),
         is_hex ? oxenmq::from_hex(msg.hash) : oxenmq::from_base64(msg.hash)
     );
 }
@@ -1031,7 +1298,7 @@ void ServiceNode::report_reachability(const sn_record& sn, bool reachable, int p
             std::move(cb), params.dump());
 
     if (!reachable || previous_failures > 0) {
-        std::lock_guard guard(sn_mutex_);
+        std::lock_guard lock{reach_mutex_};
         if (!reachable)
             reach_records_.add_failing_node(sn.pubkey_legacy, previous_failures);
         else
@@ -1043,9 +1310,7 @@ void ServiceNode::report_reachability(const sn_record& sn, bool reachable, int p
 // failure.
 std::optional<std::pair<sn_record, sn_record>> ServiceNode::derive_tester_testee(uint64_t blk_height) {
 
-    std::lock_guard guard(sn_mutex_);
-
-    std::vector<sn_record> members = swarm_->other_nodes();
+    std::vector<sn_record> members = get_swarm_peers();
     members.push_back(our_address_);
 
     if (members.size() < 2) {
@@ -1057,22 +1322,25 @@ std::optional<std::pair<sn_record, sn_record>> ServiceNode::derive_tester_testee
             [](const auto& a, const auto& b) { return a.pubkey_legacy < b.pubkey_legacy; });
 
     std::string block_hash;
-    if (blk_height == block_height_) {
-        block_hash = block_hash_;
-    } else if (blk_height < block_height_) {
+    {
+        std::lock_guard lock{block_mutex_};
+        if (blk_height == block_height_) {
+            block_hash = block_hash_;
+        } else if (blk_height < block_height_) {
 
-        OXEN_LOG(trace, "got storage test request for an older block: {}/{}",
-                 blk_height, block_height_);
+            OXEN_LOG(trace, "got storage test request for an older block: {}/{}",
+                     blk_height, block_height_);
 
-        if (auto it = block_hashes_cache_.find(blk_height); it != block_hashes_cache_.end()) {
-            block_hash = it->second;
+            if (auto it = block_hashes_cache_.find(blk_height); it != block_hashes_cache_.end()) {
+                block_hash = it->second;
+            } else {
+                OXEN_LOG(debug, "Could not find hash for a given block height");
+                return std::nullopt;
+            }
         } else {
-            OXEN_LOG(debug, "Could not find hash for a given block height");
+            OXEN_LOG(debug, "Could not find hash: block height is in the future");
             return std::nullopt;
         }
-    } else {
-        OXEN_LOG(debug, "Could not find hash: block height is in the future");
-        return std::nullopt;
     }
 
     uint64_t seed;
@@ -1100,15 +1368,14 @@ std::pair<MessageTestStatus, std::string> ServiceNode::process_storage_test_req(
     const legacy_pubkey& tester_pk,
     const std::string& msg_hash_hex) {
 
-    std::lock_guard guard(sn_mutex_);
-
     // 1. Check height, retry if we are behind
-    std::string block_hash;
-
-    if (blk_height > block_height_) {
-        OXEN_LOG(debug, "Our blockchain is behind, height: {}, requested: {}",
-                 block_height_, blk_height);
-        return {MessageTestStatus::RETRY, ""};
+    {
+        std::lock_guard lock{block_mutex_};
+        if (blk_height > block_height_) {
+            OXEN_LOG(debug, "Our blockchain is behind, height: {}, requested: {}",
+                     block_height_, blk_height);
+            return {MessageTestStatus::RETRY, ""};
+        }
     }
 
     // 2. Check tester/testee pair
@@ -1148,17 +1415,20 @@ std::pair<MessageTestStatus, std::string> ServiceNode::process_storage_test_req(
 
 void ServiceNode::initiate_peer_test() {
 
-    std::lock_guard guard(sn_mutex_);
-
     // 1. Select the tester/testee pair
 
-    if (block_height_ < TEST_BLOCKS_BUFFER) {
-        OXEN_LOG(debug, "Height {} is too small, skipping all tests",
-                 block_height_);
+    uint64_t height;
+    {
+        std::lock_guard lock{block_mutex_};
+        height = block_height_;
+    }
+
+    if (height < TEST_BLOCKS_BUFFER) {
+        OXEN_LOG(debug, "Height {} is too small, skipping all tests", height);
         return;
     }
 
-    const uint64_t test_height = block_height_ - TEST_BLOCKS_BUFFER;
+    const uint64_t test_height = height - TEST_BLOCKS_BUFFER;
 
     auto tester_testee = derive_tester_testee(test_height);
     if (!tester_testee)
@@ -1182,68 +1452,495 @@ void ServiceNode::initiate_peer_test() {
     }
 }
 
+// State of an in-progress bootstrap_swarms() job.  The job walks the database an owner chunk at a
+// time, reading each owner's messages a page at a time and relaying them to the swarms they belong
+// to, and pauses whenever too much relayed data is still awaiting a response; the response
+// handlers then resume it.  Only one thread runs the job at a time: it is either running or paused
+// waiting for responses, never both.
+struct ServiceNode::bootstrap_job {
+    // The swarms as of when we started: later swarm updates don't affect the job
+    std::shared_ptr<const SwarmState> state;
+    // The swarms to bootstrap, or empty for all swarms
+    std::unordered_set<swarm_id_t> targets;
+    int64_t cursor = 0;
+    // The owners of the current owner chunk that we still have to read (along with their swarm),
+    // and the message cursor within the first of them.
+    std::deque<std::pair<user_pubkey_t, const SwarmInfo*>> pending;
+    int64_t message_cursor = 0;
+    std::atomic<size_t> in_flight = 0;
+    std::atomic<bool> paused = false;
+    // Only touched by whichever thread is currently running the job
+    size_t owners = 0, messages = 0;
+};
+
 void ServiceNode::bootstrap_swarms(
     const std::vector<swarm_id_t>& swarms) const {
 
-    std::lock_guard guard(sn_mutex_);
-
     if (swarms.empty())
         OXEN_LOG(info, "Bootstrapping all swarms");
     else if (OXEN_LOG_ENABLED(info))
         OXEN_LOG(info, "Bootstrapping swarms: [{}]", util::join(", ", swarms));
 
-    const auto& all_swarms = swarm_->all_valid_swarms();
+    auto job = std::make_shared<bootstrap_job>();
+    job->state = swarm_->snapshot();
+    job->targets.insert(swarms.begin(), swarms.end());
+    // Don't hold up the caller (typically the block update) with the database reads
+    omq_server_->job([this, job = std::move(job)] { bootstrap_continue(job); });
+}
+
+void ServiceNode::bootstrap_continue(std::shared_ptr<bootstrap_job> job) const {
 
-    std::unordered_map<user_pubkey_t, swarm_id_t> pk_swarm_cache;
-    std::unordered_map<swarm_id_t, std::vector<message>> to_relay;
+    const auto version = !hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
+        ? SERIALIZATION_VERSION_OLD : SERIALIZATION_VERSION_BT;
+    const auto& all_swarms = job->state->all_valid_swarms;
+
+    while (true) {
+        while (job->in_flight < BOOTSTRAP_MAX_IN_FLIGHT) {
+            if (job->pending.empty()) {
+                auto owners = db_->get_owners(job->cursor, BOOTSTRAP_OWNER_CHUNK);
+                if (owners.empty()) {
+                    OXEN_LOG(info, "Bootstrapping done: relayed {} messages of {} owners",
+                            job->messages, job->owners);
+                    return;
+                }
+                for (auto& pk : owners) {
+                    const auto& swarm = get_swarm_by_pk(all_swarms, pk);
+                    if (swarm.swarm_id != INVALID_SWARM_ID &&
+                            (job->targets.empty() || job->targets.count(swarm.swarm_id)))
+                        job->pending.emplace_back(std::move(pk), &swarm);
+                }
+                continue;
+            }
 
-    std::vector<message> all_entries = get_all_messages();
-    OXEN_LOG(debug, "We have {} messages", all_entries.size());
-    for (auto& entry : all_entries) {
-        if (!entry.pubkey) {
-            OXEN_LOG(err, "Invalid pubkey in a message while bootstrapping other nodes");
-            continue;
+            std::unordered_map<const SwarmInfo*, std::vector<message>> to_relay;
+            size_t bytes = 0;
+            while (!job->pending.empty() && bytes < BOOTSTRAP_SEND_BYTES) {
+                auto& [pk, swarm] = job->pending.front();
+                bool first_page = job->message_cursor == 0;
+                auto msgs = db_->get_messages(pk, job->message_cursor, BOOTSTRAP_MESSAGE_PAGE);
+                if (first_page && !msgs.empty())
+                    job->owners++;
+                job->messages += msgs.size();
+                auto& relay = to_relay[swarm];
+                for (auto& msg : msgs) {
+                    bytes += msg.data.size();
+                    relay.push_back(std::move(msg));
+                }
+                if (msgs.size() < size_t(BOOTSTRAP_MESSAGE_PAGE)) {
+                    job->pending.pop_front();
+                    job->message_cursor = 0;
+                }
+            }
+
+            for (auto& [swarm, msgs] : to_relay) {
+                if (msgs.empty())
+                    continue;
+                for (auto& batch : serialize_messages(msgs.begin(), msgs.end(), version)) {
+                    for (const auto& sn : swarm->snodes) {
+                        job->in_flight += batch.size();
+                        omq_server_->request(
+                                sn.pubkey_x25519.view(),
+                                "sn.data",
+                                [this, job, size=batch.size()](bool success, auto&&) {
+                                    if (!success)
+                                        OXEN_LOG(err, "Failed to relay batch data: timeout");
+                                    if ((job->in_flight -= size) < BOOTSTRAP_MAX_IN_FLIGHT
+                                            && job->paused.exchange(false))
+                                        omq_server_->job([this, job] { bootstrap_continue(job); });
+                                },
+                                batch);
+                    }
+                }
+            }
         }
 
-        auto [it, ins] = pk_swarm_cache.try_emplace(entry.pubkey);
-        if (ins)
-            it->second = get_swarm_by_pk(all_swarms, entry.pubkey).swarm_id;
-        auto swarm_id = it->second;
+        // Wait for responses to bring the in-flight data back under the limit (unless they all
+        // came back already, in which case we un-pause ourselves and keep going).
+        job->paused = true;
+        if (job->in_flight >= BOOTSTRAP_MAX_IN_FLIGHT || !job->paused.exchange(false))
+            return;
+    }
+}
 
-        if (swarms.empty() || std::find(swarms.begin(), swarms.end(), swarm_id) != swarms.end())
-            to_relay[swarm_id].push_back(std::move(entry));
+void ServiceNode::start_relay(const sn_record& sn, swarm_id_t swarm) {
+    std::shared_ptr<relay_transfer> transfer;
+    {
+        std::lock_guard lock{relays_mutex_};
+        auto& t = relays_[sn.pubkey_legacy];
+        if (t) {
+            std::lock_guard tlock{t->mutex};
+            if (!t->finished()) {
+                OXEN_LOG(debug, "Transfer to {} is already in progress", sn.pubkey_legacy);
+                return;
+            }
+        }
+        transfer = t = std::make_shared<relay_transfer>(sn, swarm);
+    }
+
+    OXEN_LOG(info, "Starting transfer of stored messages to {}", sn.pubkey_legacy);
+    relay_continue(transfer);
+}
+
+static void log_relay_done(const relay_transfer& t) {
+    const auto& s = t.stats();
+    if (t.state() == relay_transfer::status::done)
+        OXEN_LOG(info, "Transfer to {} done: {} messages ({} bytes) in {}, {} retries",
+                t.dest.pubkey_legacy, s.messages_acked, s.bytes_acked,
+                util::short_duration(s.finished - s.started), s.retries);
+    else
+        OXEN_LOG(warn, "Transfer to {} failed after {} messages; giving up",
+                t.dest.pubkey_legacy, s.messages_acked);
+}
+
+void ServiceNode::relay_continue(const std::shared_ptr<relay_transfer>& transfer) {
+
+    auto& t = *transfer;
+    const auto now = relay_transfer::clock::now();
+    auto state = swarm_->snapshot();
+    const auto& swarms = state->all_valid_swarms;
+    {
+        std::lock_guard lock{t.mutex};
+        if (!t.ready(now))
+            return;
+
+        // Give up if the node has left the swarm since we started
+        auto it = std::lower_bound(swarms.begin(), swarms.end(), t.swarm,
+                [](const SwarmInfo& s, swarm_id_t id) { return s.swarm_id < id; });
+        if (it == swarms.end() || it->swarm_id != t.swarm || std::none_of(
+                    it->snodes.begin(), it->snodes.end(),
+                    [&t](const sn_record& sn) { return sn.pubkey_legacy == t.dest.pubkey_legacy; })) {
+            OXEN_LOG(info, "Abandoning transfer to {}: no longer in swarm {}",
+                    t.dest.pubkey_legacy, t.swarm);
+            t.abort(now);
+            return;
+        }
     }
 
-    OXEN_LOG(trace, "Bootstrapping {} swarms", to_relay.size());
+    const auto version = !hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
+        ? SERIALIZATION_VERSION_OLD : SERIALIZATION_VERSION_BT;
 
-    std::unordered_map<swarm_id_t, size_t> swarm_id_to_idx;
-    for (size_t i = 0; i < all_swarms.size(); ++i)
-        swarm_id_to_idx.emplace(all_swarms[i].swarm_id, i);
+    while (true) {
+        std::optional<relay_transfer::read_ticket> read;
+        {
+            std::lock_guard lock{t.mutex};
+            // Send what we have so far before (possibly) reading the next chunk
+            relay_send(transfer);
+            read = t.start_read();
+            if (!read)
+                return;
+        }
 
-    for (const auto& [swarm_id, items] : to_relay)
-        relay_messages(items, all_swarms[swarm_id_to_idx[swarm_id]].snodes);
+        // Read and serialize the chunk without holding the lock, so that acknowledgements (and
+        // anything else that needs the transfer) don't have to wait for the database.
+        int64_t cursor = read->cursor, message_cursor = read->message_cursor;
+        size_t count = 0;
+        bool end = false;
+        std::vector<std::string> batches;
+        try {
+            std::vector<message> msgs;
+            size_t bytes = 0;
+            for (int i = 0; i < relay_transfer::OWNER_CHUNK && bytes < relay_transfer::CHUNK_BYTES;
+                    i++) {
+                int64_t next = cursor;
+                auto owner = db_->get_owners(next, 1);
+                if (owner.empty()) {
+                    end = true;
+                    break;
+                }
+                if (get_swarm_by_pk(swarms, owner[0]).swarm_id == t.swarm) {
+                    size_t page;
+                    do {
+                        auto page_msgs = db_->get_messages(
+                                owner[0], message_cursor, relay_transfer::MESSAGE_PAGE);
+                        page = page_msgs.size();
+                        for (auto& msg : page_msgs) {
+                            bytes += msg.data.size();
+                            msgs.push_back(std::move(msg));
+                        }
+                    } while (page == size_t(relay_transfer::MESSAGE_PAGE)
+                            && bytes < relay_transfer::CHUNK_BYTES);
+                    // If the chunk is full part way through the owner then the next chunk picks up
+                    // from here.
+                    if (page == size_t(relay_transfer::MESSAGE_PAGE))
+                        break;
+                }
+                cursor = next;
+                message_cursor = 0;
+            }
+            count = msgs.size();
+            if (!msgs.empty())
+                batches = serialize_messages(msgs.begin(), msgs.end(), version);
+        } catch (...) {
+            std::lock_guard lock{t.mutex};
+            t.cancel_read(*read);
+            throw;
+        }
+
+        std::lock_guard lock{t.mutex};
+        if (end && count == 0)
+            t.read_done(*read);
+        else
+            t.add_chunk(*read, std::move(batches), count, cursor, message_cursor);
+        if (t.finished()) {
+            log_relay_done(t);
+            return;
+        }
+    }
 }
 
-void ServiceNode::relay_messages(const std::vector<message>& messages,
-                                 const std::vector<sn_record>& snodes) const {
-    std::vector<std::string> batches = serialize_messages(messages.begin(), messages.end(),
-            !hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
-                ? SERIALIZATION_VERSION_OLD : SERIALIZATION_VERSION_BT);
+void ServiceNode::relay_send(const std::shared_ptr<relay_transfer>& transfer) {
+    auto& t = *transfer;
+    for (auto& b : t.due()) {
+        omq_server_->request(
+                t.dest.pubkey_x25519.view(),
+                "sn.data",
+                [this, transfer, chunk=b.chunk, index=b.index](bool success, auto&& data) {
+                    // Older nodes reply with nothing at all, rather than "OK", on success
+                    bool ok = success && (data.empty() || data[0] != "ERROR");
+                    {
+                        std::lock_guard lock{transfer->mutex};
+                        if (ok)
+                            transfer->acked(chunk, index);
+                        else {
+                            OXEN_LOG(debug, "Failed to relay batch to {}: {}",
+                                    transfer->dest.pubkey_legacy,
+                                    data.empty() ? "no response" : data[0]);
+                            transfer->failed(chunk, index);
+                        }
+                        if (transfer->finished()) {
+                            log_relay_done(*transfer);
+                            return;
+                        }
+                    }
+                    // Retries of failed batches are left for the timer, to give them a backoff
+                    if (ok)
+                        relay_continue(transfer);
+                },
+                b.data,
+                oxenmq::send_option::request_timeout{relay_transfer::REQUEST_TIMEOUT});
+    }
+}
 
-    if (OXEN_LOG_ENABLED(debug)) {
-        OXEN_LOG(debug, "Relayed messages:");
-        for (auto msg : batches)
-            OXEN_LOG(debug, "    {}", msg);
-        OXEN_LOG(debug, "To Snodes:");
-        for (auto sn : snodes)
-            OXEN_LOG(debug, "    {}", sn.pubkey_legacy);
+void ServiceNode::relay_tick() {
+    std::vector<std::shared_ptr<relay_transfer>> active;
+    {
+        const auto now = relay_transfer::clock::now();
+        std::lock_guard lock{relays_mutex_};
+        for (auto it = relays_.begin(); it != relays_.end(); ) {
+            auto& t = *it->second;
+            std::lock_guard tlock{t.mutex};
+            if (!t.finished())
+                active.push_back(it->second);
+            else if (now - t.stats().finished > relay_transfer::KEEP_FINISHED) {
+                it = relays_.erase(it);
+                continue;
+            }
+            ++it;
+        }
+    }
+    for (auto& t : active)
+        relay_continue(t);
+}
 
-        OXEN_LOG(debug, "Serialised batches: {}", batches.size());
+std::shared_ptr<const reconcile::fingerprint_set> ServiceNode::reconcile_fingerprints(
+        swarm_id_t swarm) {
+    std::unique_lock lock{reconcile_mutex_};
+    const auto now = std::chrono::steady_clock::now();
+    const bool current = reconcile_set_ && reconcile_set_swarm_ == swarm;
+    if (current && (now - reconcile_set_time_ <= RECONCILE_CACHE_TIME || reconcile_refreshing_))
+        // Fresh enough, or someone is already updating it: the previous set will do until then,
+        // rather than holding up every other request while we scan the database.
+        return reconcile_set_;
+
+    reconcile_refreshing_ = true;
+    lock.unlock();
+
+    std::shared_ptr<const reconcile::fingerprint_set> fps;
+    try {
+        auto state = swarm_->snapshot();
+        fps = std::make_shared<reconcile::fingerprint_set>(db_->get_message_hashes(
+                    [&state, swarm](const user_pubkey_t& pk) {
+                        return get_swarm_by_pk(state->all_valid_swarms, pk).swarm_id == swarm;
+                    }));
+    } catch (...) {
+        lock.lock();
+        reconcile_refreshing_ = false;
+        throw;
     }
+    OXEN_LOG(debug, "Computed reconciliation fingerprints of {} messages in {}",
+            fps->size(), util::short_duration(std::chrono::steady_clock::now() - now));
+
+    lock.lock();
+    reconcile_refreshing_ = false;
+    reconcile_set_ = fps;
+    reconcile_set_swarm_ = swarm;
+    reconcile_set_time_ = now;
+    return fps;
+}
 
-    for (const sn_record& sn : snodes)
-        for (auto& batch : batches)
-            relay_data_reliable(batch, sn);
+void ServiceNode::reconcile_with_peer() {
+    if (!snode_ready())
+        return;
+    auto state = swarm_->snapshot();
+    if (!state->is_valid() || state->swarm_peers.empty())
+        return;
+    // Whichever way the reconciliation ends, the next one can start once this (and the copies that
+    // get passed along to each step) are gone.
+    auto run = reconciling_.start();
+    if (!run) {
+        OXEN_LOG(debug, "Not starting a reconciliation: the last one is still running");
+        return;
+    }
+
+    thread_local std::mt19937_64 rng{std::random_device{}()};
+    const auto& peer = state->swarm_peers[
+        std::uniform_int_distribution<size_t>{0, state->swarm_peers.size() - 1}(rng)];
+
+    OXEN_LOG(debug, "Reconciling stored messages with {}", peer.pubkey_legacy);
+    reconcile_runs_++;
+    try {
+        reconcile_round(peer, state->swarm_id,
+                std::make_shared<reconcile::session>(reconcile_fingerprints(state->swarm_id)),
+                std::move(run));
+    } catch (const std::exception& e) {
+        OXEN_LOG(err, "Reconciliation with {} failed: {}", peer.pubkey_legacy, e.what());
+    }
+}
+
+void ServiceNode::reconcile_round(
+        const sn_record& peer,
+        swarm_id_t swarm,
+        std::shared_ptr<reconcile::session> session,
+        reconcile::run_guard::token run) {
+
+    if (!session->done()) {
+        auto queries = session->next_queries();
+        auto body = reconcile::encode(queries);
+        omq_server_->request(
+                peer.pubkey_x25519.view(),
+                "sn.reconcile",
+                [this, peer, swarm, session, run, queries=std::move(queries)]
+                (bool success, auto&& data) {
+                    try {
+                        if (!success || data.size() != 2 || data[0] != "OK")
+                            throw std::runtime_error{data.size() >= 2 ? data[1]
+                                : data.empty() ? "no response" : data[0]};
+                        session->process(queries, reconcile::decode_replies(data[1]));
+                        reconcile_round(peer, swarm, session, run);
+                    } catch (const std::exception& e) {
+                        OXEN_LOG(debug, "Reconciliation with {} failed: {}", peer.pubkey_legacy, e.what());
+                    }
+                },
+                std::to_string(swarm),
+                "summary",
+                body,
+                oxenmq::send_option::request_timeout{RECONCILE_TIMEOUT});
+        return;
+    }
+
+    const auto& extra = session->extra();
+    const auto& missing = session->missing();
+    if (extra.empty() && missing.empty())
+        OXEN_LOG(debug, "Reconciled with {} in {} rounds: no differences",
+                peer.pubkey_legacy, session->rounds);
+    else
+        OXEN_LOG(info, "Reconciled with {} in {} rounds: sending {} messages, fetching {}",
+                peer.pubkey_legacy, session->rounds, extra.size(), missing.size());
+
+    // Push whatever they are missing in the background, just like a regular relay
+    if (!extra.empty()) {
+        std::vector<message> msgs;
+        for (auto& hash : extra)
+            if (auto msg = db_->retrieve_by_hash(hash))
+                msgs.push_back(std::move(*msg));
+        reconcile_pushed_ += msgs.size();
+        for (auto& batch : serialize_messages(msgs.begin(), msgs.end(),
+                    !hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
+                        ? SERIALIZATION_VERSION_OLD : SERIALIZATION_VERSION_BT))
+            relay_data_reliable(batch, peer);
+    }
+
+    reconcile_fetch(peer, swarm, std::make_shared<const std::vector<uint64_t>>(missing),
+            std::move(run));
+}
+
+void ServiceNode::reconcile_fetch(
+        const sn_record& peer,
+        swarm_id_t swarm,
+        std::shared_ptr<const std::vector<uint64_t>> fps,
+        reconcile::run_guard::token run,
+        size_t offset) {
+
+    if (offset >= fps->size())
+        return;
+
+    auto end = std::min(offset + reconcile::MAX_FETCH, fps->size());
+    omq_server_->request(
+            peer.pubkey_x25519.view(),
+            "sn.reconcile",
+            [this, peer, swarm, fps, run, end](bool success, auto&& data) {
+                if (!success || data.empty() || data[0] != "OK") {
+                    OXEN_LOG(debug, "Failed to fetch missing messages from {}", peer.pubkey_legacy);
+                    return;
+                }
+                try {
+                    for (size_t i = 1; i < data.size(); i++) {
+                        auto msgs = deserialize_messages(data[i]);
+                        reconcile_pulled_ += msgs.size();
+                        save_bulk(msgs);
+                    }
+                    reconcile_fetch(peer, swarm, fps, run, end);
+                } catch (const std::exception& e) {
+                    OXEN_LOG(warn, "Failed to store messages fetched from {}: {}",
+                            peer.pubkey_legacy, e.what());
+                }
+            },
+            std::to_string(swarm),
+            "fetch",
+            reconcile::encode(std::vector<uint64_t>{fps->begin() + offset, fps->begin() + end}),
+            oxenmq::send_option::request_timeout{RECONCILE_TIMEOUT});
+}
+
+std::vector<std::string> ServiceNode::process_reconcile(
+        const x25519_pubkey& from, const std::vector<std::string_view>& parts) {
+
+    if (parts.size() != 3)
+        throw std::invalid_argument{"expected 3 parts, got " + std::to_string(parts.size())};
+
+    auto state = swarm_->snapshot();
+    swarm_id_t swarm;
+    if (!util::parse_int(parts[0], swarm) || swarm != state->swarm_id)
+        throw std::invalid_argument{"not our swarm"};
+    if (std::none_of(state->swarm_peers.begin(), state->swarm_peers.end(),
+                [&from](const sn_record& sn) { return sn.pubkey_x25519 == from; }))
+        throw std::invalid_argument{"not a member of our swarm"};
+
+    auto fps = reconcile_fingerprints(swarm);
+
+    if (parts[1] == "summary")
+        return {"OK", reconcile::encode(
+                reconcile::respond(*fps, reconcile::decode_queries(parts[2])))};
+
+    if (parts[1] == "fetch") {
+        auto wanted = reconcile::decode_fingerprints(parts[2]);
+        if (wanted.size() > reconcile::MAX_FETCH)
+            throw std::invalid_argument{"too many messages requested"};
+        std::vector<message> msgs;
+        for (auto fp : wanted)
+            if (auto* hash = fps->find(fp))
+                if (auto msg = db_->retrieve_by_hash(*hash))
+                    msgs.push_back(std::move(*msg));
+
+        std::vector<std::string> reply{{"OK"}};
+        if (!msgs.empty())
+            for (auto& batch : serialize_messages(msgs.begin(), msgs.end(),
+                        !hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
+                            ? SERIALIZATION_VERSION_OLD : SERIALIZATION_VERSION_BT))
+                reply.push_back(std::move(batch));
+        return reply;
+    }
+
+    throw std::invalid_argument{"unknown request type"};
 }
 
 std::vector<message> ServiceNode::retrieve(
@@ -1252,20 +1949,36 @@ std::vector<message> ServiceNode::retrieve(
     return db_->retrieve(pubkey, last_hash, CLIENT_RETRIEVE_MESSAGE_LIMIT);
 }
 
+int64_t ServiceNode::export_snapshot(const std::filesystem::path& path) {
+    return db_->export_snapshot(path);
+}
+
+int64_t ServiceNode::import_snapshot(const std::filesystem::path& path) {
+    auto imported = db_->import_snapshot(path);
+    retrieve_flights_.invalidate_all();
+    return imported;
+}
+
 std::optional<std::vector<std::string>> ServiceNode::delete_all_messages(
         const user_pubkey_t& pubkey) {
-    return db_->delete_all(pubkey);
+    auto deleted = db_->delete_all(pubkey);
+    retrieve_flights_.invalidate(pubkey);
+    return deleted;
 }
 
 std::optional<std::vector<std::string>> ServiceNode::delete_messages(
         const user_pubkey_t& pubkey,
         const std::vector<std::string>& msg_hashes) {
-    return db_->delete_by_hash(pubkey, msg_hashes);
+    auto deleted = db_->delete_by_hash(pubkey, msg_hashes);
+    retrieve_flights_.invalidate(pubkey);
+    return deleted;
 }
 
 std::optional<std::vector<std::string>> ServiceNode::delete_messages_before(
         const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) {
-    return db_->delete_by_timestamp(pubkey, timestamp);
+    auto deleted = db_->delete_by_timestamp(pubkey, timestamp);
+    retrieve_flights_.invalidate(pubkey);
+    return deleted;
 }
 
 std::optional<std::vector<std::string>>
@@ -1273,14 +1986,18 @@ ServiceNode::update_messages_expiry(
         const user_pubkey_t& pubkey,
         const std::vector<std::string>& msg_hashes,
         std::chrono::system_clock::time_point new_exp) {
-    return db_->update_expiry(pubkey, msg_hashes, new_exp);
+    auto updated = db_->update_expiry(pubkey, msg_hashes, new_exp);
+    retrieve_flights_.invalidate(pubkey);
+    return updated;
 }
 
 std::optional<std::vector<std::string>>
 ServiceNode::update_all_expiries(
         const user_pubkey_t& pubkey,
         std::chrono::system_clock::time_point new_exp) {
-    return db_->update_all_expiries(pubkey, new_exp);
+    auto updated = db_->update_all_expiries(pubkey, new_exp);
+    retrieve_flights_.invalidate(pubkey);
+    return updated;
 }
 
 void to_json(nlohmann::json& j, const test_result& val) {
@@ -1325,12 +2042,103 @@ std::string ServiceNode::get_stats() const {
     auto val = to_json(all_stats_);
 
     val["version"] = STORAGE_SERVER_VERSION_STRING;
-    val["height"] = block_height_;
-    val["target_height"] = target_height_;
+    {
+        std::lock_guard lock{block_mutex_};
+        val["height"] = block_height_;
+        val["target_height"] = target_height_;
+    }
 
     val["total_stored"] = db_->get_message_count();
     val["db_used"] = db_->get_used_bytes();
     val["db_max"] = Database::SIZE_LIMIT;
+    val["http_requests_pending"] = http_client_->pending();
+    val["proxy_requests_in_flight"] = proxy_limiter_.in_flight();
+    val["proxy_requests_queued"] = proxy_limiter_.queued();
+    val["retrieves"] = {
+        {"executed", retrieve_flights_.executed()},
+        {"coalesced", retrieve_flights_.coalesced()}};
+    val["store_batches"] = {
+        {"sent", store_batcher_.batches()},
+        {"stores", store_batcher_.batched_stores()}};
+
+    auto cache = oxend_cache_.get_stats();
+    auto cache_requests = cache.hits + cache.coalesced + cache.misses;
+    val["oxend_cache"] = {
+        {"hits", cache.hits},
+        {"coalesced", cache.coalesced},
+        {"misses", cache.misses},
+        {"hit_rate", cache_requests ? double(cache.hits + cache.coalesced) / cache_requests : 0.0},
+        {"evictions", cache.evictions},
+        {"entries", cache.entries},
+        {"bytes", cache.bytes}};
+
+    if (client_shards_.enabled()) {
+        auto& shards = val["client_shards"] = json::array();
+        for (auto& s : client_shards_.stats())
+            shards.push_back({{"jobs", s.jobs}, {"queued", s.queued}});
+    }
+
+    auto& threads = val["threads"] = json::object();
+    for (auto& pool : omq_server_.thread_load().stats())
+        threads[pool.name] = {
+            {"threads", pool.threads},
+            {"average_delay_ms", pool.average_delay.count() / 1000.0},
+            {"last_delay_ms", pool.last_delay.count() / 1000.0},
+            {"samples", pool.samples},
+            {"state", to_string(pool.state)},
+            {"suggested_threads", pool.suggested_threads}};
+
+    val["reconciliation"] = {
+        {"runs", reconcile_runs_.load()},
+        {"pulled", reconcile_pulled_.load()},
+        {"pushed", reconcile_pushed_.load()}};
+
+    auto& peers = val["swarm_peers"] = json::array();
+    {
+        std::lock_guard lock{peer_conns_mutex_};
+        for (auto& [pk, peer] : peer_conns_) {
+            auto& p = peers.emplace_back();
+            p["pubkey"] = pk.hex();
+            if (peer.heartbeats) {
+                p["rtt_ms"] = peer.rtt.count();
+                p["missed_heartbeats"] = peer.failures;
+            }
+            if (auto lat = peer_latency_.get(pk)) {
+                p["latency_avg_ms"] = lat->average.count();
+                p["latency_p50_ms"] = lat->p50.count();
+                p["latency_p95_ms"] = lat->p95.count();
+                p["timeout_ms"] = peer_latency_.timeout(pk).count();
+                p["failures"] = lat->failures;
+            }
+        }
+    }
+
+    auto& relays = val["relays"] = json::array();
+    {
+        const auto now = relay_transfer::clock::now();
+        std::lock_guard lock{relays_mutex_};
+        for (auto& [pk, t] : relays_) {
+            std::lock_guard tlock{t->mutex};
+            const auto& s = t->stats();
+            auto state = t->state();
+            relays.push_back(json{
+                {"to", pk.hex()},
+                {"swarm", t->swarm},
+                {"status",
+                    state == relay_transfer::status::sending ? "sending" :
+                    state == relay_transfer::status::stalled ? "stalled" :
+                    state == relay_transfer::status::done ? "done" : "failed"},
+                {"batches_sent", s.batches_sent},
+                {"batches_acked", s.batches_acked},
+                {"messages_acked", s.messages_acked},
+                {"bytes_acked", s.bytes_acked},
+                {"retries", s.retries},
+                {"resumes", s.resumes},
+                {"elapsed", std::chrono::duration<double>(
+                        (t->finished() ? s.finished : now) - s.started).count()},
+                {"bytes_per_second", t->throughput(now)}});
+        }
+    }
 
     return val.dump();
 }
@@ -1341,7 +2149,11 @@ std::string ServiceNode::get_status_line() const {
     // status message has to be fairly short: has to fit on one line, and if
     // it's too long systemd just truncates it when displaying it.
 
-    std::lock_guard guard(sn_mutex_);
+    bool syncing;
+    {
+        std::lock_guard lock{block_mutex_};
+        syncing = syncing_;
+    }
 
     // v2.3.4; sw=abcd…789(n=7); 1234 msgs (47.3MB) for 567 users; reqs(S/R/O/P): 123/456/789/1011 (last 62.3min)
     std::ostringstream s;
@@ -1349,15 +2161,15 @@ std::string ServiceNode::get_status_line() const {
     if (!oxen::is_mainnet)
         s << " (TESTNET)";
 
-    if (syncing_)
+    if (syncing)
         s << "; SYNCING";
     s << "; sw=";
-    if (!swarm_ || !swarm_->is_valid())
+    if (auto state = swarm_ ? swarm_->snapshot() : nullptr; !state || !state->is_valid())
         s << "NONE";
     else {
-        std::string swarm = fmt::format("{:016x}", swarm_->our_swarm_id());
+        std::string swarm = fmt::format("{:016x}", state->swarm_id);
         s << swarm.substr(0, 4) << u8"…" << swarm.substr(swarm.size()-3);
-        s << "(n=" << (1 + swarm_->other_nodes().size()) << ")";
+        s << "(n=" << (1 + state->swarm_peers.size()) << ")";
     }
     s << "; " << db_->get_message_count() << " msgs";
 
@@ -1392,12 +2204,10 @@ std::vector<message> ServiceNode::get_all_messages() const {
     return db_->retrieve_all();
 }
 
-void ServiceNode::process_push_batch(const std::string& blob) {
-
-    std::lock_guard guard(sn_mutex_);
+bool ServiceNode::process_push_batch(const std::string& blob) {
 
     if (blob.empty())
-        return;
+        return true;
 
     std::vector<message> items = deserialize_messages(blob);
 
@@ -1406,15 +2216,14 @@ void ServiceNode::process_push_batch(const std::string& blob) {
     OXEN_LOG(debug, "Got {} messages from peers, size: {}", items.size(),
              blob.size());
 
-    save_bulk(items);
+    bool saved = save_bulk(items);
 
     OXEN_LOG(trace, "Saving all: end");
+    return saved;
 }
 
 bool ServiceNode::is_pubkey_for_us(const user_pubkey_t& pk) const {
 
-    std::lock_guard guard(sn_mutex_);
-
     if (!swarm_) {
         OXEN_LOG(err, "Swarm data missing");
         return false;
@@ -1422,23 +2231,17 @@ bool ServiceNode::is_pubkey_for_us(const user_pubkey_t& pk) const {
     return swarm_->is_pubkey_for_us(pk);
 }
 
-SwarmInfo ServiceNode::get_swarm(const user_pubkey_t& pk) {
-
-    std::lock_guard guard(sn_mutex_);
-
+std::shared_ptr<const SwarmState> ServiceNode::swarm_state() const {
     if (!swarm_) {
         OXEN_LOG(err, "Swarm data missing");
-        return {};
+        return std::make_shared<const SwarmState>();
     }
-
-    return get_swarm_by_pk(swarm_->all_valid_swarms(), pk);
+    return swarm_->snapshot();
 }
 
 std::vector<sn_record>
 ServiceNode::get_swarm_peers() {
-    std::lock_guard guard{sn_mutex_};
-
-    return swarm_->other_nodes();
+    return swarm_->snapshot()->swarm_peers;
 }
 
 } // namespace oxen
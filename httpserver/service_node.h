@@ -1,20 +1,31 @@
 #pragma once
 
 #include <chrono>
-#include <forward_list>
-#include <future>
+#include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+
+#include <oxenmq/connections.h>
 
 #include "Database.hpp"
+#include "concurrency_limiter.h"
+#include "http_client.h"
 #include "oxen_common.h"
+#include "oxend_cache.h"
 #include "oxend_key.h"
+#include "peer_latency.h"
 #include "reachability_testing.h"
+#include "reconcile.h"
+#include "relay_transfer.h"
+#include "request_shards.h"
+#include "retrieve_flights.h"
 #include "stats.h"
+#include "store_batcher.h"
 #include "swarm.h"
 
 namespace oxen {
@@ -30,6 +41,52 @@ inline constexpr auto STORAGE_TEST_TIMEOUT = 15s;
 // Timeout for bootstrap node OMQ requests
 inline constexpr auto BOOTSTRAP_TIMEOUT = 10s;
 
+// bootstrap_swarms() reads the database this many owners at a time, and stops reading (until some
+// responses come back) when about this many bytes of relayed data are awaiting a response.
+inline constexpr int BOOTSTRAP_OWNER_CHUNK = 1000;
+inline constexpr size_t BOOTSTRAP_MAX_IN_FLIGHT = 64 * 1024 * 1024;
+// Each owner's messages are read this many at a time (so that an owner with a huge number of
+// messages doesn't have to fit in memory, or under BOOTSTRAP_MAX_IN_FLIGHT, all at once), and
+// what has been read is sent off whenever it reaches about BOOTSTRAP_SEND_BYTES.
+inline constexpr int BOOTSTRAP_MESSAGE_PAGE = 100;
+inline constexpr size_t BOOTSTRAP_SEND_BYTES = 4 * 1024 * 1024;
+
+// How often we reconcile our stored messages with a random member of our swarm (see reconcile.h),
+// to repair messages that either of us missed (e.g. while one of us was briefly offline).
+inline constexpr auto RECONCILE_INTERVAL = 5min;
+
+// Timeout for each reconciliation request
+inline constexpr auto RECONCILE_TIMEOUT = 30s;
+
+// How long we reuse the fingerprints of our stored messages, so that we don't rescan the database
+// for every round of a reconciliation.
+inline constexpr auto RECONCILE_CACHE_TIME = 30s;
+
+// Limits on onion requests we proxy to external servers: how many we have in progress at once (in
+// total, and to any one server), and how many more wait for one of those to finish before we start
+// refusing new ones.  The per-server limit matches the HTTP client's per-host connection limit so
+// that requests wait in our queue (where they don't count towards their timeout) rather than in
+// curl's.
+inline constexpr size_t PROXY_MAX_IN_FLIGHT = 256;
+inline constexpr size_t PROXY_MAX_PER_SERVER = HttpClient::MAX_HOST_CONNECTIONS;
+inline constexpr size_t PROXY_MAX_QUEUED = 1024;
+inline constexpr size_t PROXY_MAX_QUEUED_PER_SERVER = 64;
+
+// We keep connections open to the other members of our swarm (rather than connecting on demand), so
+// that recursive requests and relayed data to them don't have to wait for a connection handshake.
+// Each connection is kept alive for PEER_KEEP_ALIVE after its last activity, and we send a
+// heartbeat every PEER_HEARTBEAT_INTERVAL, which keeps the connection active and lets us notice
+// dead connections: after PEER_HEARTBEAT_FAILURES missed heartbeats in a row we drop the connection
+// and make a new one.
+inline constexpr auto PEER_HEARTBEAT_INTERVAL = 30s;
+inline constexpr auto PEER_HEARTBEAT_TIMEOUT = 10s;
+inline constexpr int PEER_HEARTBEAT_FAILURES = 2;
+inline constexpr auto PEER_KEEP_ALIVE = 5min;
+
+// How old the swarm state saved in the database can be for us to start up using it (rather than
+// waiting for oxend to give us the current state before we start serving requests).
+inline constexpr auto SAVED_STATE_MAX_AGE = 1h;
+
 /// We test based on the height a few blocks back to minimise discrepancies between nodes (we could
 /// also use checkpoints, but that is still not bulletproof: swarms are calculated based on the
 /// latest block, so they might be still different and thus derive different pairs)
@@ -63,28 +120,40 @@ enum class SnodeStatus { UNKNOWN, UNSTAKED, DECOMMISSIONED, ACTIVE };
 
 /// All service node logic that is not network-specific
 class ServiceNode {
+    // Block and sync state; guarded by block_mutex_.
     bool syncing_ = true;
+    hf_revision hardfork_ = {0, 0};
+    uint64_t block_height_ = 0;
+    uint64_t target_height_ = 0;
+    std::string block_hash_;
+    /// Cache for block_height/block_hash mapping
+    std::map<uint64_t, std::string> block_hashes_cache_;
+    mutable std::mutex block_mutex_;
+
+    // Swarm topology and our status within it.  Readers never lock: they load the swarm's current
+    // snapshot (see Swarm::snapshot()).  swarm_mutex_ serializes updates to the swarm (and guards
+    // active_); it is only taken when applying a block update, and database operations must never
+    // be performed while holding it.
+    std::unique_ptr<Swarm> swarm_;
+    std::atomic<SnodeStatus> status_ = SnodeStatus::UNKNOWN;
     bool active_ = false;
+    std::mutex swarm_mutex_;
+
+    // Lock ordering: if both are ever needed at once then block_mutex_ must be taken before
+    // swarm_mutex_, and reach_mutex_ always last.
+
     bool got_first_response_ = false;
     std::condition_variable first_response_cv_;
     std::mutex first_response_mutex_;
     bool force_start_ = false;
     std::atomic<bool> shutting_down_ = false;
-    hf_revision hardfork_ = {0, 0};
-    uint64_t block_height_ = 0;
-    uint64_t target_height_ = 0;
-    std::string block_hash_;
-    std::unique_ptr<Swarm> swarm_;
-    std::unique_ptr<Database> db_;
 
-    SnodeStatus status_ = SnodeStatus::UNKNOWN;
+    // The database does its own locking
+    std::unique_ptr<Database> db_;
 
     const sn_record our_address_;
     const legacy_seckey our_seckey_;
 
-    /// Cache for block_height/block_hash mapping
-    std::map<uint64_t, std::string> block_hashes_cache_;
-
     // Need to make sure we only use this to get OxenMQ object and
     // not call any method that would in turn call a method in SN
     // causing a deadlock
@@ -97,25 +166,122 @@ class ServiceNode {
     // when syncing when we get tons of block notifications quickly).
     std::atomic<bool> updating_swarms_ = false;
 
+    // The last service node list we got from oxend, so that we can skip re-parsing it when it
+    // hasn't changed.
+    sn_list_cache sn_list_cache_;
+    std::mutex sn_list_mutex_;
+
+    // True if we started up with a recent swarm state loaded from the database
+    bool warm_start_ = false;
+    // Hash of the node list we last saved to the database, so that we only rewrite it on changes
+    size_t saved_swarms_hash_ = 0;
+    std::mutex saved_state_mutex_;
+
     reachability_testing reach_records_;
+    std::mutex reach_mutex_;
+
+    // Transfers of our stored messages to nodes that joined our swarm, keyed by the recipient.
+    // Finished transfers are kept for a while so that they show up in the stats.  If both are
+    // needed then relays_mutex_ must be taken before the transfer's own mutex.
+    std::unordered_map<legacy_pubkey, std::shared_ptr<relay_transfer>> relays_;
+    mutable std::mutex relays_mutex_;
+
+    // Cached fingerprints of our swarm's messages for reconciliation; guarded by reconcile_mutex_
+    // (which is not held while computing them, but reconcile_refreshing_ is set).
+    std::shared_ptr<const reconcile::fingerprint_set> reconcile_set_;
+    swarm_id_t reconcile_set_swarm_ = INVALID_SWARM_ID;
+    std::chrono::steady_clock::time_point reconcile_set_time_;
+    bool reconcile_refreshing_ = false;
+    std::mutex reconcile_mutex_;
+    // So that we only ever reconcile with one peer at a time
+    reconcile::run_guard reconciling_;
+    std::atomic<uint64_t> reconcile_runs_ = 0, reconcile_pulled_ = 0, reconcile_pushed_ = 0;
+
+    // Connections we keep open to the members of our swarm; see PEER_HEARTBEAT_INTERVAL.
+    struct peer_connection {
+        sn_record sn;
+        oxenmq::ConnectionID conn;
+        // Set once the peer answers a heartbeat.  Peers running older versions don't know the
+        // command, and so we just keep the connection open without treating the missing
+        // replies as failures.
+        bool heartbeats = false;
+        // Set if the peer's heartbeat replies say that it handles sn.store_batch
+        bool store_batch = false;
+        int failures = 0;
+        std::chrono::milliseconds rtt{0};
+    };
+    std::unordered_map<legacy_pubkey, peer_connection> peer_conns_;
+    mutable std::mutex peer_conns_mutex_;
+
+    // Response times of other nodes, from recursive requests, heartbeats and reachability pings
+    peer_latency peer_latency_;
+
+    // Stores being forwarded to swarm peers, waiting to be sent in batches; see forward_store().
+    store_batcher store_batcher_;
+    const std::chrono::milliseconds store_batch_window_;
+
+    // Results of the oxend rpc requests that clients make through us; see oxend_client_request().
+    oxend_cache oxend_cache_;
 
     mutable all_stats_t all_stats_;
 
-    mutable std::recursive_mutex sn_mutex_;
+    // Callbacks waiting for a message to be stored, keyed by message hash; see wait_for_message().
+    std::unordered_multimap<std::string, std::pair<uint64_t, std::function<void()>>> message_waiters_;
+    uint64_t next_waiter_id_ = 0;
+    // Lets the store paths skip taking the lock when nothing is waiting
+    std::atomic<bool> have_message_waiters_ = false;
+    std::mutex message_waiters_mutex_;
+
+    // Wakes up the waiters for the hashes of the messages in [begin, end).
+    void notify_message_waiters(const message* begin, const message* end);
+
+    // Wakes up all waiters (e.g. when we get a new block, which can also unblock a storage test).
+    void notify_all_message_waiters();
+
+    // Client retrieves in progress, which identical retrieves can share; see retrieves().
+    retrieve_flights retrieve_flights_;
 
-    std::forward_list<std::future<void>> outstanding_https_reqs_;
+    // Outgoing HTTPS requests (reachability and legacy storage tests, and proxied onion requests)
+    std::unique_ptr<HttpClient> http_client_;
 
-    // Save multiple messages to the database at once (i.e. in a single transaction)
-    void save_bulk(const std::vector<message>& msgs);
+    // Bounds the onion requests we have in progress to external servers
+    ConcurrencyLimiter proxy_limiter_{PROXY_MAX_IN_FLIGHT, PROXY_MAX_PER_SERVER, PROXY_MAX_QUEUED,
+        PROXY_MAX_QUEUED_PER_SERVER};
+
+    // Worker threads for client requests, by owner pubkey (if enabled).  Last so that the threads
+    // are stopped before anything they use is destroyed.
+    request_shards client_shards_;
+
+    // Common implementation of snode_ready() for when the caller already has the current state
+    bool check_ready(hf_revision hf, bool syncing, bool in_swarm, std::string* reason) const;
+
+    // Save multiple messages to the database at once (i.e. in a single transaction).  Returns false
+    // if the messages could not be saved.
+    bool save_bulk(const std::vector<message>& msgs);
 
     void on_bootstrap_update(block_update&& bu);
 
     void on_swarm_update(block_update&& bu);
 
+    // Saves the current block info and the node list from `bu` to the database, so that after a
+    // restart we can start serving requests before oxend has responded.
+    void save_state(const block_update& bu);
+
+    // Loads the state saved by save_state() if it is recent enough (see SAVED_STATE_MAX_AGE), as
+    // if we had received it from oxend.  Returns true if loaded.
+    bool load_saved_state();
+
     void bootstrap_data();
 
+    /// Relays our stored messages to the swarms they belong to (either just the given swarms, or
+    /// all swarms if empty).  The work is done by a job on an OxenMQ worker thread, so this returns
+    /// right away; the job sends the first part of the data and then the rest as earlier sends
+    /// complete (see BOOTSTRAP_MAX_IN_FLIGHT).
     void bootstrap_swarms(const std::vector<swarm_id_t>& swarms = {}) const;
 
+    struct bootstrap_job;
+    void bootstrap_continue(std::shared_ptr<bootstrap_job> job) const;
+
     /// Distribute all our data to where it belongs
     /// (called when our old node got dissolved)
     void salvage_data() const; // mutex not needed
@@ -125,9 +291,58 @@ class ServiceNode {
     relay_data_reliable(const std::string& blob,
                         const sn_record& address) const; // mutex not needed
 
-    void relay_messages(
-        const std::vector<message>& msgs,
-        const std::vector<sn_record>& snodes) const; // mutex not needed
+    /// Starts transferring the stored messages that belong to swarm `swarm` to `sn` (typically a
+    /// new member of our swarm), unless such a transfer is already underway.  See relay_transfer.
+    void start_relay(const sn_record& sn, swarm_id_t swarm);
+
+    // Reads and sends whatever the transfer has room for in its window, including any retries that
+    // are due.  Called when we start a transfer, as batches are acknowledged, and from a timer.
+    void relay_continue(const std::shared_ptr<relay_transfer>& transfer);
+
+    // Sends the transfer's batches that are due (see relay_transfer::due()).  The caller must hold
+    // the transfer's mutex.
+    void relay_send(const std::shared_ptr<relay_transfer>& transfer);
+
+    // Timer callback: continues in-progress transfers and drops old finished ones.
+    void relay_tick();
+
+    // Returns the fingerprints of the stored messages that belong to `swarm`, (re)building them
+    // if we don't have a recent enough set.  While one caller rebuilds them, others get the
+    // previous set (if it is for the same swarm) rather than waiting.
+    std::shared_ptr<const reconcile::fingerprint_set> reconcile_fingerprints(swarm_id_t swarm);
+
+    // Opens (or, if already open, refreshes the keep-alive of) our connection to a swarm peer.
+    oxenmq::ConnectionID connect_peer(const sn_record& sn);
+
+    // Connects to any new members of our swarm and disconnects from nodes that have left it.
+    void update_peer_connections();
+
+    // Timer callback: sends a heartbeat to each swarm peer, reconnecting to any that stopped
+    // answering.
+    void heartbeat_peers();
+
+    // Sends a batch of forwarded stores to its peer as a single sn.store_batch request, falling
+    // back to an sn.storage_cc request for each store if the peer doesn't know the command.
+    void send_store_batch(store_batcher::batch b);
+
+    // Timer callback: starts a reconciliation with a random peer of our swarm.
+    void reconcile_with_peer();
+
+    // Sends the next round of a reconciliation, or finishes it once there are no more ranges to
+    // compare.  `run` is the reconciliation's token from reconciling_, which each step passes on.
+    void reconcile_round(
+            const sn_record& peer,
+            swarm_id_t swarm,
+            std::shared_ptr<reconcile::session> session,
+            reconcile::run_guard::token run);
+
+    // Fetches the messages that the peer has and we don't, MAX_FETCH at a time from `offset`.
+    void reconcile_fetch(
+            const sn_record& peer,
+            swarm_id_t swarm,
+            std::shared_ptr<const std::vector<uint64_t>> fps,
+            reconcile::run_guard::token run,
+            size_t offset = 0);
 
     // Conducts any ping peer tests that are due; (this is designed to be called frequently and does
     // nothing if there are no tests currently due).
@@ -167,7 +382,9 @@ class ServiceNode {
                 const legacy_seckey& skey,
                 OxenmqServer& omq_server,
                 const std::filesystem::path& db_location,
-                bool force_start);
+                bool force_start,
+                std::chrono::milliseconds store_batch_window = store_batcher::DEFAULT_WINDOW,
+                int client_shards = 0);
 
     // Return info about this node as it is advertised to other nodes
     const sn_record& own_address() { return our_address_; }
@@ -179,6 +396,7 @@ class ServiceNode {
     // might move it out later
     void record_proxy_request();
     void record_onion_request();
+    void record_retrieve_request();
 
     /// Sends an onion request to the next SS
     void send_onion_to_sn(
@@ -187,7 +405,10 @@ class ServiceNode {
             OnionRequestMetadata&& data,
             std::function<void(bool success, std::vector<std::string> data)> cb) const;
 
-    bool hf_at_least(hf_revision version) const { return hardfork_ >= version; }
+    bool hf_at_least(hf_revision version) const {
+        std::lock_guard lock{block_mutex_};
+        return hardfork_ >= version;
+    }
 
     // Return true if the service node is ready to handle requests, which means the storage server
     // is fully initialized (and not trying to shut down), the service node is active and assigned
@@ -212,8 +433,37 @@ class ServiceNode {
     /// nullptr, sets it to true if we stored as a new message, false if we already had it.
     bool process_store(message msg, bool* new_msg = nullptr);
 
-    /// Process incoming blob of messages: add to DB if new
-    void process_push_batch(const std::string& blob);
+    /// Stores a batch of messages forwarded from a swarm member in a single database transaction.
+    /// Returns, for each message, true if stored as a new message, false if we already had it, or
+    /// nullopt if it could not be stored.
+    std::vector<std::optional<bool>> process_store_batch(const std::vector<message>& msgs);
+
+    /// Forwards a recursive store (bt-encoded in `store`) to swarm member `peer`, invoking `cb`
+    /// with the peer's reply.  Peers that advertise sn.store_batch support in their heartbeat
+    /// replies get stores sent within store_batch_window of each other coalesced into a single
+    /// sn.store_batch request; others (or if the batch turns out to be an unknown command after
+    /// all) get an sn.storage_cc request for each.
+    void forward_store(const sn_record& peer, std::string_view store, store_batcher::callback cb,
+            std::chrono::milliseconds timeout);
+
+    /// Answers a `sn.reconcile` request from `from`, which must be a member of our swarm.  The
+    /// request parts are our swarm id, the request type ("summary" or "fetch"), and the encoded
+    /// ranges or fingerprints.  Returns the reply parts; throws if the request is invalid.
+    std::vector<std::string> process_reconcile(
+            const x25519_pubkey& from, const std::vector<std::string_view>& parts);
+
+    /// Process incoming blob of messages: add to DB if new.  Returns false if the messages could
+    /// not be stored.
+    bool process_push_batch(const std::string& blob);
+
+    /// Registers `notify` to be called (once) when a message with the given hash is stored, or when
+    /// we get a new block.  This is one-shot: a waiter that still needs to wait after being
+    /// notified must register again.  To avoid missing a message stored concurrently, register
+    /// *before* looking for the message.  Returns an id for cancel_message_wait().
+    uint64_t wait_for_message(const std::string& msg_hash, std::function<void()> notify);
+
+    /// Removes a waiter registered with wait_for_message(), if it hasn't been notified yet.
+    void cancel_message_wait(const std::string& msg_hash, uint64_t id);
 
     // Attempt to find an answer (message body) to the storage test
     std::pair<MessageTestStatus, std::string> process_storage_test_req(uint64_t blk_height,
@@ -222,7 +472,8 @@ class ServiceNode {
 
     bool is_pubkey_for_us(const user_pubkey_t& pk) const;
 
-    SwarmInfo get_swarm(const user_pubkey_t& pk);
+    // Returns the current swarm state; see Swarm::snapshot().
+    std::shared_ptr<const SwarmState> swarm_state() const;
 
     std::vector<sn_record> get_swarm_peers();
 
@@ -231,6 +482,14 @@ class ServiceNode {
     /// return all messages for a particular PK
     std::vector<message> retrieve(const user_pubkey_t& pubkey, const std::string& last_hash);
 
+    /// Writes a snapshot of all stored messages to `path`, for backups; returns the number of
+    /// messages written.  Throws on failure.
+    int64_t export_snapshot(const std::filesystem::path& path);
+
+    /// Loads a snapshot written by `export_snapshot` (e.g. to restore a backup); returns the number
+    /// of newly stored messages.  Throws on failure.
+    int64_t import_snapshot(const std::filesystem::path& path);
+
     /// Deletes all messages belonging to a pubkey; returns the deleted hashes
     std::optional<std::vector<std::string>> delete_all_messages(
             const user_pubkey_t& pubkey);
@@ -276,7 +535,6 @@ class ServiceNode {
     template <typename PubKey>
     std::optional<sn_record>
     find_node(const PubKey& pk) const {
-        std::lock_guard guard{sn_mutex_};
         if (swarm_)
             return swarm_->find_node(pk);
         return std::nullopt;
@@ -284,13 +542,33 @@ class ServiceNode {
 
     // Called once we have established the initial connection to our local oxend to set up initial
     // data and timers that rely on an oxend connection.  This blocks until we get an initial
-    // service node block update back from oxend.
+    // service node block update back from oxend, unless we started up with a recent saved state.
     void on_oxend_connected();
 
     // Called when oxend notifies us of a new block to update swarm info
     void update_swarms();
 
     OxenmqServer& omq_server() { return omq_server_; }
+
+    HttpClient& http_client() { return *http_client_; }
+
+    ConcurrencyLimiter& proxy_limiter() { return proxy_limiter_; }
+
+    // Client retrieves currently in progress; the writes to the database made through us
+    // invalidate them as needed (see retrieve_flights).
+    retrieve_flights& retrieves() { return retrieve_flights_; }
+
+    /// Makes a request to one of oxend's public rpc endpoints on behalf of a client.  The result
+    /// is cached until the next block, and identical requests made while one is in progress share
+    /// its result; see oxend_cache.
+    void oxend_client_request(std::string_view endpoint, const std::optional<nlohmann::json>& params,
+            oxend_cache::callback cb);
+
+    // Per-owner worker threads for client requests; see request_shards.  Not enabled() unless
+    // we were started with client_shards > 0.
+    request_shards& client_shards() { return client_shards_; }
+
+    peer_latency& latency() { return peer_latency_; }
 };
 
 } // namespace oxen
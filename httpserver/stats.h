@@ -124,9 +124,9 @@ class all_stats_t {
         total_onion_requests++;
         current_onion_requests++;
     }
-    void bump_store_requests() {
-        total_client_store_requests++;
-        current_client_store_requests++;
+    void bump_store_requests(uint64_t count = 1) {
+        total_client_store_requests += count;
+        current_client_store_requests += count;
     }
     void bump_retrieve_requests() {
         total_client_retrieve_requests++;
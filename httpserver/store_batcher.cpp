@@ -0,0 +1,73 @@
+#include "store_batcher.h"
+#include "oxen_logger.h"
+
+#include <oxenmq/bt_serialize.h>
+
+#include <algorithm>
+
+namespace oxen {
+
+store_batcher::added store_batcher::add(const x25519_pubkey& peer, std::string_view store,
+        callback cb, std::chrono::milliseconds timeout) {
+    std::lock_guard lock{mutex_};
+    auto [it, first] = pending_.try_emplace(peer);
+    auto& b = it->second;
+    if (first) {
+        b.id = ++next_id_;
+        b.peer = peer;
+    }
+    b.stores.emplace_back(store);
+    b.callbacks.push_back(std::move(cb));
+    b.bytes += store.size();
+    b.timeout = std::max(b.timeout, timeout);
+    return {b.id, first, b.stores.size() >= MAX_STORES || b.bytes >= MAX_BYTES};
+}
+
+std::optional<store_batcher::batch> store_batcher::take(const x25519_pubkey& peer, uint64_t id) {
+    std::lock_guard lock{mutex_};
+    auto it = pending_.find(peer);
+    if (it == pending_.end() || it->second.id != id)
+        return std::nullopt;
+    std::optional<batch> b{std::move(it->second)};
+    pending_.erase(it);
+    batches_++;
+    batched_stores_ += b->stores.size();
+    return b;
+}
+
+void store_batcher::deliver(batch& b, bool success, std::vector<std::string> replies) {
+    if (success && replies.size() != b.callbacks.size()) {
+        OXEN_LOG(warn, "Invalid store batch reply from {}: expected {} replies, got {}",
+                b.peer, b.callbacks.size(), replies.size());
+        replies.clear();
+        replies.resize(b.callbacks.size());
+    }
+    for (size_t i = 0; i < b.callbacks.size(); i++) {
+        std::vector<std::string> parts;
+        if (success && !replies[i].empty()) {
+            try {
+                parts = decode_reply(replies[i]);
+            } catch (const std::exception& e) {
+                OXEN_LOG(warn, "Invalid store batch reply from {}: {}", b.peer, e.what());
+            }
+        }
+        b.callbacks[i](success, std::move(parts));
+    }
+}
+
+std::string store_batcher::encode_reply(const std::vector<std::string>& parts) {
+    oxenmq::bt_list l;
+    for (auto& p : parts)
+        l.emplace_back(std::string_view{p});
+    return oxenmq::bt_serialize(l);
+}
+
+std::vector<std::string> store_batcher::decode_reply(std::string_view reply) {
+    std::vector<std::string> parts;
+    oxenmq::bt_list_consumer l{reply};
+    while (!l.is_finished())
+        parts.push_back(l.consume_string());
+    return parts;
+}
+
+} // namespace oxen
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "oxend_key.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace oxen {
+
+using namespace std::literals;
+
+/// Coalesces the stores that we forward to the same swarm member within a short window into a
+/// single `sn.store_batch` request, rather than sending each one as its own `sn.storage_cc`
+/// request.  The recipient stores the whole batch in one database transaction and replies with one
+/// reply per store, which we hand back to each store's callback.
+///
+/// This class only does the bookkeeping: the ServiceNode sends the batches (and arranges for them
+/// to be taken once their window has passed).  It is thread safe.
+class store_batcher {
+  public:
+    // Invoked with the recipient's reply to one forwarded store, in the same form as the reply to
+    // an individual sn.storage_cc request: `success` is false if the batch request failed or timed
+    // out; otherwise `parts` is [BODY] on success or [CODE, BODY] on failure.  `parts` is empty if
+    // the recipient's reply to the batch was invalid.
+    using callback = std::function<void(bool success, std::vector<std::string> parts)>;
+
+    // How long we wait for more stores to the same peer before sending a batch.  A window of 0
+    // still batches whatever is queued up by the time the send job runs, without any extra delay.
+    inline static constexpr auto DEFAULT_WINDOW = 1ms;
+
+    // A batch is sent right away, without waiting for the rest of the window, once it has this
+    // many stores or this many bytes of them.
+    inline static constexpr size_t MAX_STORES = 100;
+    inline static constexpr size_t MAX_BYTES = 2 * 1024 * 1024;
+
+    struct batch {
+        uint64_t id;
+        x25519_pubkey peer;
+        // The encoded store requests, and their callbacks in the same order
+        std::vector<std::string> stores;
+        std::vector<callback> callbacks;
+        size_t bytes = 0;
+        // The longest of the timeouts requested for the stores
+        std::chrono::milliseconds timeout{0};
+    };
+
+    // Returned by add(): if `first` is set then this store started a new batch and the caller
+    // should call take(peer, id) once the window has passed.  If `full` is set then the batch
+    // should be taken and sent right away.
+    struct added {
+        uint64_t id;
+        bool first;
+        bool full;
+    };
+
+    // Queues a forwarded store for `peer`; `store` is the bt-encoded store request.
+    added add(const x25519_pubkey& peer, std::string_view store, callback cb,
+            std::chrono::milliseconds timeout);
+
+    // Removes and returns batch `id` for `peer`, or nullopt if it has already been taken.
+    std::optional<batch> take(const x25519_pubkey& peer, uint64_t id);
+
+    // Hands the recipient's reply to a batch back to each of its stores' callbacks.  `replies`
+    // are the reply message parts, which should be one (encoded with encode_reply) per store.
+    static void deliver(batch& b, bool success, std::vector<std::string> replies);
+
+    // Encodes (or decodes) the reply parts to one store for the batch reply.  decode_reply throws
+    // if the reply is not validly encoded.
+    static std::string encode_reply(const std::vector<std::string>& parts);
+    static std::vector<std::string> decode_reply(std::string_view reply);
+
+    // Total batches sent and stores sent in them, for the stats.
+    uint64_t batches() const { return batches_; }
+    uint64_t batched_stores() const { return batched_stores_; }
+
+  private:
+    std::unordered_map<x25519_pubkey, batch> pending_;
+    uint64_t next_id_ = 0;
+    std::mutex mutex_;
+
+    std::atomic<uint64_t> batches_ = 0, batched_stores_ = 0;
+};
+
+} // namespace oxen
@@ -3,10 +3,14 @@
 
 #include "service_node.h"
 
+#include <algorithm>
 #include <boost/endian/conversion.hpp>
 #include <cstdlib>
+#include <map>
+#include <nlohmann/json.hpp>
 #include <ostream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "string_utils.hpp"
 #include "utils.hpp"
@@ -41,16 +45,411 @@ void debug_print(std::ostream& os, const block_update& bu) {
     os << "}\n";
 }
 
-Swarm::~Swarm() = default;
+// sn_record's operator== only compares the legacy pubkey; this compares every field.
+static bool same_record(const sn_record& a, const sn_record& b) {
+    return a.pubkey_legacy == b.pubkey_legacy && a.ip == b.ip && a.port == b.port &&
+           a.omq_port == b.omq_port && a.pubkey_ed25519 == b.pubkey_ed25519 &&
+           a.pubkey_x25519 == b.pubkey_x25519;
+}
 
-bool Swarm::is_existing_swarm(swarm_id_t sid) const {
+static bool same_records(const std::vector<sn_record>& a, const std::vector<sn_record>& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), same_record);
+}
 
-    return std::any_of(all_valid_swarms_.begin(), all_valid_swarms_.end(),
-                       [sid](const SwarmInfo& cur_swarm_info) {
-                           return cur_swarm_info.swarm_id == sid;
-                       });
+static bool same_swarms(const std::vector<SwarmInfo>& a, const std::vector<SwarmInfo>& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+            [](const SwarmInfo& x, const SwarmInfo& y) {
+                return x.swarm_id == y.swarm_id && same_records(x.snodes, y.snodes);
+            });
 }
 
+namespace {
+
+/// SAX handler for parse_swarm_update: builds the block_update directly as the response streams
+/// past, keeping only the handful of fields we use from each service node entry.
+class swarm_update_parser {
+  public:
+    using json = nlohmann::json;
+    using number_integer_t = json::number_integer_t;
+    using number_unsigned_t = json::number_unsigned_t;
+    using number_float_t = json::number_float_t;
+    using string_t = json::string_t;
+    using binary_t = json::binary_t;
+
+    explicit swarm_update_parser(block_update& bu) : bu_{bu} {}
+
+    bool null() { return value(nullptr); }
+    bool boolean(bool val) { return value(val); }
+    bool number_integer(number_integer_t val) { return value(val); }
+    bool number_unsigned(number_unsigned_t val) { return value(val); }
+    bool number_float(number_float_t, const string_t&) { return value(nullptr); }
+    bool string(string_t& val) { return value(std::move(val)); }
+    bool binary(binary_t&) { return value(nullptr); }
+
+    bool start_object(std::size_t) {
+        if (in_states_ && depth_ == 2)
+            entry_ = {};
+        depth_++;
+        return true;
+    }
+
+    bool end_object() {
+        depth_--;
+        if (in_states_ && depth_ == 2)
+            add_entry();
+        return true;
+    }
+
+    bool start_array(std::size_t) {
+        if (depth_ == 1 && key_ == field::service_node_states) {
+            in_states_ = true;
+            have_states_ = true;
+        }
+        depth_++;
+        return true;
+    }
+
+    bool end_array() {
+        depth_--;
+        if (in_states_ && depth_ == 1)
+            in_states_ = false;
+        return true;
+    }
+
+    bool key(string_t& k) {
+        if (depth_ == 1 || (in_states_ && depth_ == 3))
+            key_ = to_field(k);
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex) {
+        throw std::runtime_error{ex.what()};
+    }
+
+    /// Called after parsing to check that we got everything and to finish off the block_update
+    void finish() {
+        bu_.height = require(height_, "height");
+        bu_.block_hash = require(block_hash_, "block_hash");
+        bu_.hardfork = static_cast<int>(require(hardfork_, "hardfork"));
+        bu_.snode_revision = static_cast<int>(snode_revision_.value_or(0));
+        bu_.unchanged = unchanged_.value_or(false);
+        if (bu_.unchanged)
+            return;
+
+        if (!have_states_)
+            throw std::runtime_error{"missing service_node_states"};
+
+        if (missing_aux_pks_ >
+                MISSING_PUBKEY_THRESHOLD::num*total_/MISSING_PUBKEY_THRESHOLD::den) {
+            OXEN_LOG(warn, "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
+                    "oxend may be out of sync with the network", missing_aux_pks_, total_);
+        }
+
+        bu_.swarms.reserve(swarm_map_.size());
+        for (auto& [swarm_id, snodes] : swarm_map_)
+            bu_.swarms.push_back(SwarmInfo{swarm_id, std::move(snodes)});
+    }
+
+  private:
+    enum class field {
+        other, height, block_hash, hardfork, snode_revision, unchanged, service_node_states,
+        funded, service_node_pubkey, pubkey_x25519, pubkey_ed25519, public_ip, storage_port,
+        storage_lmq_port, swarm_id
+    };
+
+    field to_field(std::string_view k) const {
+        if (depth_ == 1) {
+            if (k == "height") return field::height;
+            if (k == "block_hash") return field::block_hash;
+            if (k == "hardfork") return field::hardfork;
+            if (k == "snode_revision") return field::snode_revision;
+            if (k == "unchanged") return field::unchanged;
+            if (k == "service_node_states") return field::service_node_states;
+        } else {
+            if (k == "funded") return field::funded;
+            if (k == "service_node_pubkey") return field::service_node_pubkey;
+            if (k == "pubkey_x25519") return field::pubkey_x25519;
+            if (k == "pubkey_ed25519") return field::pubkey_ed25519;
+            if (k == "public_ip") return field::public_ip;
+            if (k == "storage_port") return field::storage_port;
+            if (k == "storage_lmq_port") return field::storage_lmq_port;
+            if (k == "swarm_id") return field::swarm_id;
+        }
+        return field::other;
+    }
+
+    struct sn_entry {
+        std::optional<bool> funded;
+        std::optional<std::string> pubkey, pubkey_x25519, pubkey_ed25519, public_ip;
+        std::optional<uint64_t> storage_port, storage_lmq_port, swarm_id;
+    };
+
+    template <typename T>
+    static T require(std::optional<T>& val, const char* name) {
+        if (!val)
+            throw std::runtime_error{"missing or invalid " + std::string{name}};
+        return std::move(*val);
+    }
+
+    // Assigns `val` to `out` if it holds the right type, and otherwise throws.
+    template <typename T, typename V>
+    static void assign(std::optional<T>& out, V&& val) {
+        if constexpr (std::is_same_v<T, std::string> && std::is_same_v<std::decay_t<V>, std::string>)
+            out = std::forward<V>(val);
+        else if constexpr (std::is_same_v<T, bool> && std::is_same_v<std::decay_t<V>, bool>)
+            out = val;
+        else if constexpr (std::is_same_v<T, uint64_t> && std::is_integral_v<std::decay_t<V>>
+                && !std::is_same_v<std::decay_t<V>, bool>)
+            out = static_cast<uint64_t>(val);
+        else
+            throw std::runtime_error{"invalid value type"};
+    }
+
+    template <typename V>
+    bool value(V&& val) {
+        if (depth_ == 1) {
+            switch (key_) {
+                case field::height: assign(height_, std::forward<V>(val)); break;
+                case field::block_hash: assign(block_hash_, std::forward<V>(val)); break;
+                case field::hardfork: assign(hardfork_, std::forward<V>(val)); break;
+                case field::snode_revision: assign(snode_revision_, std::forward<V>(val)); break;
+                case field::unchanged: assign(unchanged_, std::forward<V>(val)); break;
+                default: break;
+            }
+        } else if (in_states_ && depth_ == 3) {
+            auto& e = entry_;
+            switch (key_) {
+                case field::funded: assign(e.funded, std::forward<V>(val)); break;
+                case field::service_node_pubkey: assign(e.pubkey, std::forward<V>(val)); break;
+                case field::pubkey_x25519: assign(e.pubkey_x25519, std::forward<V>(val)); break;
+                case field::pubkey_ed25519: assign(e.pubkey_ed25519, std::forward<V>(val)); break;
+                case field::public_ip: assign(e.public_ip, std::forward<V>(val)); break;
+                case field::storage_port: assign(e.storage_port, std::forward<V>(val)); break;
+                case field::storage_lmq_port: assign(e.storage_lmq_port, std::forward<V>(val)); break;
+                case field::swarm_id: assign(e.swarm_id, std::forward<V>(val)); break;
+                default: break;
+            }
+        }
+        return true;
+    }
+
+    void add_entry() {
+        auto& e = entry_;
+        /// We want to include (test) decommissioned nodes, but not
+        /// partially funded ones.
+        if (!require(e.funded, "funded"))
+            return;
+
+        total_++;
+        auto pk_hex = require(e.pubkey, "service_node_pubkey");
+        auto pk_x25519_hex = require(e.pubkey_x25519, "pubkey_x25519");
+        auto pk_ed25519_hex = require(e.pubkey_ed25519, "pubkey_ed25519");
+
+        if (pk_x25519_hex.empty() || pk_ed25519_hex.empty()) {
+            // These will always either both be present or neither present.  If they are missing
+            // there isn't much we can do: it means the remote hasn't transmitted them yet (or
+            // our local oxend hasn't received them yet).
+            missing_aux_pks_++;
+            OXEN_LOG(debug, "ed25519/x25519 pubkeys are missing from service node info {}", pk_hex);
+            return;
+        }
+
+        auto sn = sn_record{
+            require(e.public_ip, "public_ip"),
+            static_cast<uint16_t>(require(e.storage_port, "storage_port")),
+            static_cast<uint16_t>(require(e.storage_lmq_port, "storage_lmq_port")),
+            legacy_pubkey::from_hex(pk_hex),
+            ed25519_pubkey::from_hex(pk_ed25519_hex),
+            x25519_pubkey::from_hex(pk_x25519_hex)};
+
+        const swarm_id_t swarm_id = require(e.swarm_id, "swarm_id");
+
+        /// Storing decommissioned nodes (with dummy swarm id) in
+        /// a separate data structure as it seems less error prone
+        if (swarm_id == INVALID_SWARM_ID) {
+            bu_.decommissioned_nodes.push_back(std::move(sn));
+        } else {
+            bu_.active_x25519_pubkeys.emplace(sn.pubkey_x25519.view());
+
+            swarm_map_[swarm_id].push_back(std::move(sn));
+        }
+    }
+
+    block_update& bu_;
+
+    // Number of currently open objects/arrays: the top-level response object is depth 1, so
+    // service node entries are objects at depth 3.
+    int depth_ = 0;
+    field key_ = field::other;
+    bool in_states_ = false;
+    bool have_states_ = false;
+
+    std::optional<uint64_t> height_, hardfork_, snode_revision_;
+    std::optional<std::string> block_hash_;
+    std::optional<bool> unchanged_;
+
+    sn_entry entry_;
+    std::map<swarm_id_t, std::vector<sn_record>> swarm_map_;
+    int missing_aux_pks_ = 0, total_ = 0;
+};
+
+// Finds the raw JSON array value of the (first) "key": in `body`, returning its offset and length.
+std::optional<std::pair<size_t, size_t>> find_json_array(std::string_view body, std::string_view key) {
+    std::string needle;
+    needle.reserve(key.size() + 2);
+    needle += '"';
+    needle += key;
+    needle += '"';
+
+    auto pos = body.find(needle);
+    if (pos == std::string_view::npos)
+        return std::nullopt;
+    pos += needle.size();
+
+    auto skip_ws = [&] {
+        while (pos < body.size() && (body[pos] == ' ' || body[pos] == '\t' || body[pos] == '\n' || body[pos] == '\r'))
+            pos++;
+    };
+    skip_ws();
+    if (pos >= body.size() || body[pos] != ':')
+        return std::nullopt;
+    pos++;
+    skip_ws();
+    if (pos >= body.size() || body[pos] != '[')
+        return std::nullopt;
+
+    const size_t start = pos;
+    int depth = 0;
+    bool in_string = false;
+    for (; pos < body.size(); pos++) {
+        const char c = body[pos];
+        if (in_string) {
+            if (c == '\\')
+                pos++;
+            else if (c == '"')
+                in_string = false;
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '[' || c == '{') {
+            depth++;
+        } else if ((c == ']' || c == '}') && --depth == 0) {
+            return std::make_pair(start, pos + 1 - start);
+        }
+    }
+    return std::nullopt;
+}
+
+} // namespace
+
+block_update parse_swarm_update(std::string_view response_body, sn_list_cache* cache) {
+
+    if (response_body.empty()) {
+        OXEN_LOG(critical, "Bad oxend rpc response: no response body");
+        throw std::runtime_error("Failed to parse swarm update");
+    }
+
+    block_update bu;
+
+    OXEN_LOG(trace, "swarm repsonse: <{}>", response_body);
+
+    try {
+        // If the raw service node list is identical to the one we last parsed then parse the
+        // response with the list replaced by [] (to just get the block info) and reuse the cached
+        // list.
+        std::optional<uint64_t> states_hash;
+        std::string elided;
+        if (cache) {
+            if (auto states = find_json_array(response_body, "service_node_states")) {
+                auto [offset, length] = *states;
+                states_hash = std::hash<std::string_view>{}(response_body.substr(offset, length));
+                if (cache->valid && cache->hash == *states_hash) {
+                    elided.reserve(response_body.size() - length + 2);
+                    elided += response_body.substr(0, offset);
+                    elided += "[]";
+                    elided += response_body.substr(offset + length);
+                }
+            }
+        }
+
+        swarm_update_parser parser{bu};
+        std::string_view input = elided.empty() ? response_body : elided;
+        nlohmann::json::sax_parse(input.begin(), input.end(), &parser);
+        parser.finish();
+
+        if (bu.unchanged || !cache)
+            return bu;
+
+        if (!elided.empty()) {
+            OXEN_LOG(debug, "Service node list unchanged");
+            bu.swarms = cache->swarms;
+            bu.decommissioned_nodes = cache->decommissioned_nodes;
+            bu.active_x25519_pubkeys = cache->active_x25519_pubkeys;
+        } else if (states_hash) {
+            cache->valid = true;
+            cache->hash = *states_hash;
+            cache->swarms = bu.swarms;
+            cache->decommissioned_nodes = bu.decommissioned_nodes;
+            cache->active_x25519_pubkeys = bu.active_x25519_pubkeys;
+        }
+
+    } catch (const std::exception& e) {
+        OXEN_LOG(critical, "Bad oxend rpc response: invalid json ({})", e.what());
+        throw std::runtime_error("Failed to parse swarm update");
+    }
+
+    return bu;
+}
+
+static nlohmann::json sn_to_json(const sn_record& sn) {
+    return {sn.ip, sn.port, sn.omq_port,
+        sn.pubkey_legacy.hex(), sn.pubkey_ed25519.hex(), sn.pubkey_x25519.hex()};
+}
+
+static sn_record sn_from_json(const nlohmann::json& j) {
+    return {j.at(0).get<std::string>(), j.at(1).get<uint16_t>(), j.at(2).get<uint16_t>(),
+        legacy_pubkey::from_hex(j.at(3).get<std::string>()),
+        ed25519_pubkey::from_hex(j.at(4).get<std::string>()),
+        x25519_pubkey::from_hex(j.at(5).get<std::string>())};
+}
+
+std::string serialize_swarms(const block_update& bu) {
+    auto swarms = nlohmann::json::array();
+    for (const auto& si : bu.swarms) {
+        auto snodes = nlohmann::json::array();
+        for (const auto& sn : si.snodes)
+            snodes.push_back(sn_to_json(sn));
+        swarms.push_back({si.swarm_id, std::move(snodes)});
+    }
+    auto decommissioned = nlohmann::json::array();
+    for (const auto& sn : bu.decommissioned_nodes)
+        decommissioned.push_back(sn_to_json(sn));
+
+    return nlohmann::json{
+        {"swarms", std::move(swarms)},
+        {"decommissioned", std::move(decommissioned)}}.dump();
+}
+
+void deserialize_swarms(std::string_view data, block_update& bu) {
+    auto j = nlohmann::json::parse(data);
+
+    bu.swarms.clear();
+    bu.decommissioned_nodes.clear();
+    bu.active_x25519_pubkeys.clear();
+
+    for (const auto& swarm : j.at("swarms")) {
+        auto& si = bu.swarms.emplace_back();
+        si.swarm_id = swarm.at(0).get<swarm_id_t>();
+        for (const auto& sn : swarm.at(1)) {
+            si.snodes.push_back(sn_from_json(sn));
+            bu.active_x25519_pubkeys.emplace(si.snodes.back().pubkey_x25519.view());
+        }
+    }
+    for (const auto& sn : j.at("decommissioned"))
+        bu.decommissioned_nodes.push_back(sn_from_json(sn));
+}
+
+Swarm::~Swarm() = default;
+
 SwarmEvents Swarm::derive_swarm_events(const std::vector<SwarmInfo>& swarms) const {
 
     SwarmEvents events = {};
@@ -74,14 +473,14 @@ SwarmEvents Swarm::derive_swarm_events(const std::vector<SwarmInfo>& swarms) con
     events.our_swarm_id = new_swarm_id;
     events.our_swarm_members = new_swarm_snodes;
 
-    if (cur_swarm_id_ == INVALID_SWARM_ID) {
+    if (next_.swarm_id == INVALID_SWARM_ID) {
         // Only started in a swarm, nothing to do at this stage
         return events;
     }
 
-    if (cur_swarm_id_ != new_swarm_id) {
+    if (next_.swarm_id != new_swarm_id) {
         // Got moved to a new swarm
-        if (!swarm_exists(swarms, cur_swarm_id_)) {
+        if (!swarm_exists(swarms, next_.swarm_id)) {
             // Dissolved, new to push all our data to new swarms
             events.dissolved = true;
         }
@@ -93,19 +492,25 @@ SwarmEvents Swarm::derive_swarm_events(const std::vector<SwarmInfo>& swarms) con
     /// --- WE are still in the same swarm if we reach here ---
 
     /// See if anyone joined our swarm
-    for (const auto& sn : new_swarm_snodes) {
+    std::unordered_set<legacy_pubkey> peers;
+    peers.reserve(next_.swarm_peers.size());
+    for (const auto& sn : next_.swarm_peers)
+        peers.insert(sn.pubkey_legacy);
 
-        const auto it = std::find(swarm_peers_.begin(), swarm_peers_.end(), sn);
-
-        if (it == swarm_peers_.end() && sn != our_address_) {
+    for (const auto& sn : new_swarm_snodes) {
+        if (sn != our_address_ && !peers.count(sn.pubkey_legacy)) {
             events.new_snodes.push_back(sn);
         }
     }
 
     /// See if there are any new swarms
+    std::unordered_set<swarm_id_t> existing;
+    existing.reserve(next_.all_valid_swarms.size());
+    for (const auto& swarm_info : next_.all_valid_swarms)
+        existing.insert(swarm_info.swarm_id);
 
     for (const auto& swarm_info : swarms)
-        if (!is_existing_swarm(swarm_info.swarm_id))
+        if (!existing.count(swarm_info.swarm_id))
             events.new_swarms.push_back(swarm_info.swarm_id);
 
     /// NOTE: need to be careful and make sure we don't miss any
@@ -120,14 +525,48 @@ void Swarm::set_swarm_id(swarm_id_t sid) {
         OXEN_LOG(warn, "We are not currently an active Service Node");
     } else {
 
-        if (cur_swarm_id_ == INVALID_SWARM_ID) {
+        if (next_.swarm_id == INVALID_SWARM_ID) {
             OXEN_LOG(info, "EVENT: started SN in swarm: 0x{}", util::int_to_string(sid, 16));
-        } else if (cur_swarm_id_ != sid) {
+        } else if (next_.swarm_id != sid) {
             OXEN_LOG(info, "EVENT: got moved into a new swarm: 0x{}", util::int_to_string(sid, 16));
         }
     }
 
-    cur_swarm_id_ = sid;
+    if (next_.swarm_id != sid) {
+        next_.swarm_id = sid;
+        changed_ = true;
+    }
+}
+
+void Swarm::publish() {
+    if (!changed_)
+        return;
+    next_.version++;
+    std::atomic_store(&current_, std::make_shared<const SwarmState>(next_));
+    published_version_.store(next_.version, std::memory_order_release);
+    changed_ = false;
+}
+
+uint64_t Swarm::next_id() {
+    static std::atomic<uint64_t> id = 0;
+    return ++id;
+}
+
+std::shared_ptr<const SwarmState> Swarm::snapshot() const {
+    thread_local struct {
+        uint64_t swarm = 0;
+        uint64_t version = 0;
+        std::shared_ptr<const SwarmState> state;
+    } cache;
+    if (cache.swarm != id_ ||
+            cache.version != published_version_.load(std::memory_order_acquire)) {
+        // Something new was published (or this thread last looked at a different Swarm).  We take
+        // the version from the snapshot itself, since it may be newer than the one we checked.
+        cache.state = std::atomic_load(&current_);
+        cache.swarm = id_;
+        cache.version = cache.state->version;
+    }
+    return cache.state;
 }
 
 static auto get_snode_map_from_swarms(const std::vector<SwarmInfo>& swarms) {
@@ -183,7 +622,17 @@ void Swarm::apply_swarm_changes(const std::vector<SwarmInfo>& new_swarms) {
 
     OXEN_LOG(trace, "Applying swarm changes");
 
-    all_valid_swarms_ = apply_ips(new_swarms, all_valid_swarms_);
+    auto swarms = apply_ips(new_swarms, next_.all_valid_swarms);
+
+    // Block updates arrive already sorted by id, so this is normally just a check
+    auto by_id = [](const SwarmInfo& a, const SwarmInfo& b) { return a.swarm_id < b.swarm_id; };
+    if (!std::is_sorted(swarms.begin(), swarms.end(), by_id))
+        std::sort(swarms.begin(), swarms.end(), by_id);
+
+    if (!same_swarms(swarms, next_.all_valid_swarms)) {
+        next_.all_valid_swarms = std::move(swarms);
+        changed_ = true;
+    }
 }
 
 void Swarm::update_state(const std::vector<SwarmInfo>& swarms,
@@ -214,54 +663,102 @@ void Swarm::update_state(const std::vector<SwarmInfo>& swarms,
         if (members.empty())
             return;
 
-        swarm_peers_.clear();
-        swarm_peers_.reserve(members.size() - 1);
+        std::vector<sn_record> peers;
+        peers.reserve(members.size() - 1);
 
         std::copy_if(members.begin(), members.end(),
-                     std::back_inserter(swarm_peers_),
+                     std::back_inserter(peers),
                      [this](const sn_record& record) {
                          return record != our_address_;
                      });
-    }
-
-    // Store a copy of every node in a separate data structure
-    all_funded_nodes_.clear();
-    all_funded_ed25519_.clear();
-    all_funded_x25519_.clear();
 
-    for (const auto& si : swarms) {
-        for (const auto& sn : si.snodes) {
-            all_funded_nodes_.emplace(sn.pubkey_legacy, sn);
+        if (!same_records(peers, next_.swarm_peers)) {
+            next_.swarm_peers = std::move(peers);
+            changed_ = true;
         }
     }
 
-    for (const auto& sn : decommissioned) {
-        all_funded_nodes_.emplace(sn.pubkey_legacy, sn);
-    }
+    update_funded_nodes(swarms, decommissioned);
+}
+
+// Removes `key` from `map` only if it still refers to `pk`
+template <typename Map>
+static void erase_if_mapped_to(Map& map, const typename Map::key_type& key, const legacy_pubkey& pk) {
+    if (auto it = map.find(key); it != map.end() && it->second == pk)
+        map.erase(it);
+}
 
-    for (const auto& [pk, sn] : all_funded_nodes_) {
-        all_funded_ed25519_.emplace(sn.pubkey_ed25519, pk);
-        all_funded_x25519_.emplace(sn.pubkey_x25519, pk);
+void Swarm::update_funded_nodes(const std::vector<SwarmInfo>& swarms,
+                                const std::vector<sn_record>& decommissioned) {
+
+    auto& funded = next_.all_funded_nodes;
+    auto& by_ed25519 = next_.all_funded_ed25519;
+    auto& by_x25519 = next_.all_funded_x25519;
+
+    std::unordered_set<legacy_pubkey> seen;
+    seen.reserve(funded.size());
+
+    auto apply = [&](const sn_record& sn) {
+        const auto& pk = sn.pubkey_legacy;
+        if (!seen.insert(pk).second)
+            return; // Duplicate: keep the first one
+        auto [it, inserted] = funded.try_emplace(pk, sn);
+        if (!inserted) {
+            auto& old = it->second;
+            if (same_record(old, sn))
+                return;
+            if (old.pubkey_ed25519 != sn.pubkey_ed25519)
+                erase_if_mapped_to(by_ed25519, old.pubkey_ed25519, pk);
+            if (old.pubkey_x25519 != sn.pubkey_x25519)
+                erase_if_mapped_to(by_x25519, old.pubkey_x25519, pk);
+            old = sn;
+        }
+        by_ed25519.insert_or_assign(sn.pubkey_ed25519, pk);
+        by_x25519.insert_or_assign(sn.pubkey_x25519, pk);
+        changed_ = true;
+    };
+
+    for (const auto& si : swarms)
+        for (const auto& sn : si.snodes)
+            apply(sn);
+
+    for (const auto& sn : decommissioned)
+        apply(sn);
+
+    // Anything we didn't see is no longer registered
+    if (seen.size() == funded.size())
+        return;
+
+    for (auto it = funded.begin(); it != funded.end(); ) {
+        const auto& [pk, sn] = *it;
+        if (seen.count(pk)) {
+            ++it;
+            continue;
+        }
+        erase_if_mapped_to(by_ed25519, sn.pubkey_ed25519, pk);
+        erase_if_mapped_to(by_x25519, sn.pubkey_x25519, pk);
+        it = funded.erase(it);
     }
+    changed_ = true;
 }
 
 std::optional<sn_record>
-Swarm::find_node(const legacy_pubkey& pk) const {
-    if (auto it = all_funded_nodes_.find(pk); it != all_funded_nodes_.end())
+SwarmState::find_node(const legacy_pubkey& pk) const {
+    if (auto it = all_funded_nodes.find(pk); it != all_funded_nodes.end())
         return it->second;
     return std::nullopt;
 }
 
 std::optional<sn_record>
-Swarm::find_node(const ed25519_pubkey& pk) const {
-    if (auto it = all_funded_ed25519_.find(pk); it != all_funded_ed25519_.end())
+SwarmState::find_node(const ed25519_pubkey& pk) const {
+    if (auto it = all_funded_ed25519.find(pk); it != all_funded_ed25519.end())
         return find_node(it->second);
     return std::nullopt;
 }
 
 std::optional<sn_record>
-Swarm::find_node(const x25519_pubkey& pk) const {
-    if (auto it = all_funded_x25519_.find(pk); it != all_funded_x25519_.end())
+SwarmState::find_node(const x25519_pubkey& pk) const {
+    if (auto it = all_funded_x25519.find(pk); it != all_funded_x25519.end())
         return find_node(it->second);
     return std::nullopt;
 }
@@ -282,10 +779,10 @@ uint64_t pubkey_to_swarm_space(const user_pubkey_t& pk) {
     return res;
 }
 
-bool Swarm::is_pubkey_for_us(const user_pubkey_t& pk) const {
+bool SwarmState::is_pubkey_for_us(const user_pubkey_t& pk) const {
 
     /// TODO: Make sure no exceptions bubble up from here!
-    return cur_swarm_id_ == get_swarm_by_pk(all_valid_swarms_, pk).swarm_id;
+    return swarm_id == get_swarm_by_pk(all_valid_swarms, pk).swarm_id;
 }
 
 static const SwarmInfo null_swarm{INVALID_SWARM_ID, {}};
@@ -299,59 +796,42 @@ const SwarmInfo& get_swarm_by_pk(
     /// We reserve UINT64_MAX as a sentinel swarm id for unassigned snodes
     constexpr swarm_id_t MAX_ID = INVALID_SWARM_ID - 1;
 
-    const SwarmInfo* cur_best = &null_swarm;
-    uint64_t cur_min = INVALID_SWARM_ID;
-
-    /// We don't require that all_swarms is sorted, so we find
-    /// the smallest/largest elements in the same loop
-    const SwarmInfo* leftmost = &null_swarm;
-    const SwarmInfo* rightmost = nullptr;
+    /// Just to be sure that no decommissioned node is exposed to clients we skip any dummy swarm,
+    /// which (being the maximum id) can only appear at the end.
+    auto begin = all_swarms.begin();
+    auto end = all_swarms.end();
+    while (end != begin && std::prev(end)->swarm_id == INVALID_SWARM_ID)
+        --end;
 
-    for (const auto& si : all_swarms) {
-
-        if (si.swarm_id == INVALID_SWARM_ID) {
-            /// Just to be sure we check again that no decomissioned
-            /// node is exposed to clients
-            continue;
-        }
+    if (begin == end) // Found no swarms at all
+        return null_swarm;
 
-        uint64_t dist =
-            (si.swarm_id > res) ? (si.swarm_id - res) : (res - si.swarm_id);
-        if (dist < cur_min) {
-            cur_best = &si;
-            cur_min = dist;
-        }
+    const SwarmInfo& leftmost = *begin;
+    const SwarmInfo& rightmost = *std::prev(end);
 
-        /// Find the letfmost
-        if (si.swarm_id < leftmost->swarm_id) {
-            leftmost = &si;
-        }
+    /// The nearest swarms are the first one with id >= res and the one just before it, except that
+    /// past either end of the ring we need to also consider wrapping around to the other end.
+    const auto it = std::lower_bound(begin, end, res,
+            [](const SwarmInfo& si, uint64_t val) { return si.swarm_id < val; });
 
-        if (!rightmost || si.swarm_id > rightmost->swarm_id) {
-            rightmost = &si;
-        }
-    }
-
-    if (!rightmost) // Found no swarms at all
-        return null_swarm;
-
-    // handle special case
-    if (res > rightmost->swarm_id) {
+    if (it == end) {
         // since rightmost is at least as large as leftmost,
         // res >= leftmost_id in this branch, so the value will
-        // not overflow; the same logic applies to the else branch
-        const uint64_t dist = (MAX_ID - res) + leftmost->swarm_id;
-        if (dist < cur_min) {
-            cur_best = leftmost;
-        }
-    } else if (res < leftmost->swarm_id) {
-        const uint64_t dist = res + (MAX_ID - rightmost->swarm_id);
-        if (dist < cur_min) {
-            cur_best = rightmost;
-        }
+        // not overflow; the same logic applies to the next branch
+        const uint64_t dist = res - rightmost.swarm_id;
+        const uint64_t wrap_dist = (MAX_ID - res) + leftmost.swarm_id;
+        return wrap_dist < dist ? leftmost : rightmost;
+    }
+
+    if (it == begin) {
+        const uint64_t dist = it->swarm_id - res;
+        const uint64_t wrap_dist = res + (MAX_ID - rightmost.swarm_id);
+        return wrap_dist < dist ? rightmost : *it;
     }
 
-    return *cur_best;
+    /// When equidistant the lower id wins
+    const auto prev = std::prev(it);
+    return it->swarm_id - res < res - prev->swarm_id ? *it : *prev;
 }
 
 std::pair<int, int> count_missing_data(const block_update& bu) {
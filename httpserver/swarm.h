@@ -1,8 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
+#include <memory>
 #include <oxenmq/auth.h>
+#include <optional>
+#include <ratio>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -31,13 +36,44 @@ struct block_update {
 
 void debug_print(std::ostream& os, const block_update& bu);
 
+// Threshold of missing data records at which we start warning and consult bootstrap nodes (mainly
+// so that we don't bother producing warning spam or going to the bootstrap just for a few new nodes
+// that will often have missing info for a few minutes).
+using MISSING_PUBKEY_THRESHOLD = std::ratio<3, 100>;
+
+/// The node list from the last full get_service_nodes response along with a hash of the raw
+/// `service_node_states` JSON it came from.  The list usually doesn't change from one block to the
+/// next, and when it hasn't parse_swarm_update reuses these rather than parsing it all again.
+struct sn_list_cache {
+    bool valid = false;
+    uint64_t hash = 0;
+    std::vector<SwarmInfo> swarms;
+    std::vector<sn_record> decommissioned_nodes;
+    oxenmq::pubkey_set active_x25519_pubkeys;
+};
+
+/// Parses an oxend `get_service_nodes` response into a block_update.  The response is streamed
+/// rather than loaded into a json tree, picking out just the fields we need as it goes.  If `cache`
+/// is given then an unchanged node list is copied from it instead of being parsed (and `cache` is
+/// updated whenever the list changes).  Throws std::runtime_error if the response is invalid.
+block_update parse_swarm_update(std::string_view response_body, sn_list_cache* cache = nullptr);
+
 // Returns a reference to the SwarmInfo member of `all_swarms` for the given user pub.  Returns a
 // reference to a null SwarmInfo with swarm_id set to INVALID_SWARM_ID on error (which will only
-// happen if there are no swarms at all).
+// happen if there are no swarms at all).  `all_swarms` must be sorted by swarm_id (as
+// SwarmState::all_valid_swarms always is): the lookup is a binary search around the swarm ring.
 const SwarmInfo& get_swarm_by_pk(
         const std::vector<SwarmInfo>& all_swarms,
         const user_pubkey_t& pk);
 
+// Serializes the node list (swarms and decommissioned nodes) of a block update, for saving it
+// across restarts.
+std::string serialize_swarms(const block_update& bu);
+
+// Loads a node list produced by `serialize_swarms` into `bu`, replacing its swarms, decommissioned
+// nodes, and active x25519 pubkeys.  Throws on invalid input.
+void deserialize_swarms(std::string_view data, block_update& bu);
+
 // Takes a swarm update, returns the number of active SN entries with missing
 // IP/port/ed25519/x25519 data and the total number of entries.  (We don't include
 // decommissioned nodes in either count).
@@ -69,23 +105,67 @@ struct SwarmEvents {
     std::vector<sn_record> our_swarm_members;
 };
 
+/// Immutable snapshot of the swarm state as of some block update.  Swarm publishes a new one after
+/// every update; readers hold on to whichever snapshot was current when they loaded it, and so
+/// can't see a partially applied update (see Swarm::snapshot() for how they get it without
+/// locking).
+struct SwarmState {
+    /// Incremented by each publish(), i.e. whenever the swarm topology (or anything else here)
+    /// changes; lets readers cache things derived from the state (see swarm_responses).
+    uint64_t version = 0;
+    swarm_id_t swarm_id = INVALID_SWARM_ID;
+    /// Note: this excludes the "dummy" swarm.  Sorted by swarm_id.
+    std::vector<SwarmInfo> all_valid_swarms;
+    std::vector<sn_record> swarm_peers;
+    /// This includes decommissioned nodes
+    std::unordered_map<legacy_pubkey, sn_record> all_funded_nodes;
+    std::unordered_map<ed25519_pubkey, legacy_pubkey> all_funded_ed25519;
+    std::unordered_map<x25519_pubkey, legacy_pubkey> all_funded_x25519;
+
+    bool is_valid() const { return swarm_id != INVALID_SWARM_ID; }
+
+    bool is_pubkey_for_us(const user_pubkey_t& pk) const;
+
+    // Get the node with public key `pk` if exists; these search *all* fully-funded SNs (including
+    // decommissioned ones), not just the current swarm.
+    std::optional<sn_record> find_node(const legacy_pubkey& pk) const;
+    std::optional<sn_record> find_node(const ed25519_pubkey& pk) const;
+    std::optional<sn_record> find_node(const x25519_pubkey& pk) const;
+};
+
 class Swarm {
 
-    swarm_id_t cur_swarm_id_ = INVALID_SWARM_ID;
-    /// Note: this excludes the "dummy" swarm
-    std::vector<SwarmInfo> all_valid_swarms_;
     sn_record our_address_;
-    std::vector<sn_record> swarm_peers_;
-    /// This includes decommissioned nodes
-    std::unordered_map<legacy_pubkey, sn_record> all_funded_nodes_;
-    std::unordered_map<ed25519_pubkey, legacy_pubkey> all_funded_ed25519_;
-    std::unordered_map<x25519_pubkey, legacy_pubkey> all_funded_x25519_;
 
-    /// Check if `sid` is an existing (active) swarm
-    bool is_existing_swarm(swarm_id_t sid) const;
+    /// Working copy of the state that the update methods below modify.  Nothing here is visible to
+    /// readers until `publish()` is called.  Updates are not internally synchronized: the caller
+    /// must ensure that only one thread at a time is updating.
+    SwarmState next_;
+
+    /// Whether next_ differs from the published snapshot
+    bool changed_ = false;
+
+    /// The currently published snapshot; only ever accessed via std::atomic_load/atomic_store.
+    /// Those aren't lock-free in libstdc++ (they lock a mutex from a global pool), so readers use
+    /// them only when `published_version_` says that a new snapshot has been published since they
+    /// last loaded one; see snapshot().
+    std::shared_ptr<const SwarmState> current_;
+    std::atomic<uint64_t> published_version_ = 0;
+
+    /// Distinguishes Swarm instances in the readers' per-thread caches
+    const uint64_t id_;
+
+    /// Updates the funded node lookup maps in place, touching only the entries that were added,
+    /// changed, or removed.
+    void update_funded_nodes(const std::vector<SwarmInfo>& swarms,
+                             const std::vector<sn_record>& decommissioned);
+
+    static uint64_t next_id();
 
   public:
-    Swarm(sn_record address) : our_address_(address) {}
+    Swarm(sn_record address)
+        : our_address_{std::move(address)}, current_{std::make_shared<const SwarmState>()},
+          id_{next_id()} {}
 
     ~Swarm();
 
@@ -100,31 +180,28 @@ class Swarm {
 
     void apply_swarm_changes(const std::vector<SwarmInfo>& new_swarms);
 
-    bool is_pubkey_for_us(const user_pubkey_t& pk) const;
+    void set_swarm_id(swarm_id_t sid);
 
-    const std::vector<sn_record>& other_nodes() const { return swarm_peers_; }
+    /// Atomically replaces the snapshot returned by `snapshot()` with the state built up by the
+    /// update methods above.  Does nothing if the updates didn't actually change anything.
+    void publish();
 
-    const std::vector<SwarmInfo>& all_valid_swarms() const {
-        return all_valid_swarms_;
-    }
+    /// Returns the most recently published state; safe to call concurrently with updates.  Each
+    /// thread caches the snapshot it last loaded, so this only takes a lock (to load the new
+    /// snapshot) the first time a thread calls it after a publish(); otherwise it is a lock-free
+    /// version check and reference count increment.
+    std::shared_ptr<const SwarmState> snapshot() const;
 
     const sn_record& our_address() const { return our_address_; }
 
-    swarm_id_t our_swarm_id() const { return cur_swarm_id_; }
-
-    bool is_valid() const { return cur_swarm_id_ != INVALID_SWARM_ID; }
-
-    void set_swarm_id(swarm_id_t sid);
-
-    const std::unordered_map<legacy_pubkey, sn_record>& all_funded_nodes() const {
-        return all_funded_nodes_;
+    bool is_pubkey_for_us(const user_pubkey_t& pk) const {
+        return snapshot()->is_pubkey_for_us(pk);
     }
 
-    // Get the node with public key `pk` if exists; these search *all* fully-funded SNs (including
-    // decommissioned ones), not just the current swarm.
-    std::optional<sn_record> find_node(const legacy_pubkey& pk) const;
-    std::optional<sn_record> find_node(const ed25519_pubkey& pk) const;
-    std::optional<sn_record> find_node(const x25519_pubkey& pk) const;
+    template <typename PubKey>
+    std::optional<sn_record> find_node(const PubKey& pk) const {
+        return snapshot()->find_node(pk);
+    }
 };
 
 } // namespace oxen
@@ -0,0 +1,115 @@
+#include "swarm_responses.h"
+#include "omq_server.h"
+#include "string_utils.hpp"
+
+#include <array>
+
+#include <nlohmann/json.hpp>
+#include <oxenmq/base32z.h>
+#include <oxenmq/bt_serialize.h>
+#include <oxenmq/hex.h>
+#include <sodium/crypto_generichash.h>
+
+namespace oxen {
+
+using nlohmann::json;
+
+json swarm_to_json(const SwarmInfo& swarm) {
+
+    json snodes_json = json::array();
+    for (const auto& sn : swarm.snodes) {
+        snodes_json.push_back(json{
+                {"address", oxenmq::to_base32z(sn.pubkey_legacy.view()) + ".snode"}, // Deprecated, use pubkey_legacy instead
+                {"pubkey_legacy", sn.pubkey_legacy.hex()},
+                {"pubkey_x25519", sn.pubkey_x25519.hex()},
+                {"pubkey_ed25519", sn.pubkey_ed25519.hex()},
+                {"port", std::to_string(sn.port)}, // Deprecated port (as a string) for backwards compat; use "port_https" instead
+                {"port_https", sn.port},
+                {"port_omq", sn.omq_port},
+                {"ip", sn.ip}});
+    }
+
+    return json{
+        {"snodes", std::move(snodes_json)},
+        {"swarm", util::int_to_string(swarm.swarm_id, 16)},
+    };
+}
+
+// The "t" key sorts after all the others, so appending it keeps the keys in order (which bt
+// requires, and which matches the order nlohmann::json would dump them in).
+std::string swarm_responses::entry::json_body(int64_t t) const {
+    std::string body;
+    body.reserve(json.size() + 25);
+    body += json;
+    body += ",\"t\":";
+    body += std::to_string(t);
+    body += '}';
+    return body;
+}
+
+std::string swarm_responses::entry::bt_body(int64_t t) const {
+    std::string body;
+    body.reserve(bt.size() + 26);
+    body += bt;
+    body += "1:ti";
+    body += std::to_string(t);
+    body += "ee";
+    return body;
+}
+
+static std::shared_ptr<const swarm_responses::entry> make_entry(const SwarmInfo& swarm) {
+    auto e = std::make_shared<swarm_responses::entry>();
+    auto j = swarm_to_json(swarm);
+
+    auto contents = oxenmq::bt_serialize(json_to_bt(j));
+    std::array<unsigned char, 8> hash;
+    crypto_generichash(hash.data(), hash.size(),
+            reinterpret_cast<const unsigned char*>(contents.data()), contents.size(), nullptr, 0);
+    e->etag = oxenmq::to_hex(hash.begin(), hash.end());
+    e->size = swarm.snodes.size();
+
+    j["etag"] = e->etag;
+    e->json = j.dump();
+    e->json.pop_back(); // }
+    e->bt = oxenmq::bt_serialize(json_to_bt(std::move(j)));
+    e->bt.pop_back(); // e
+    return e;
+}
+
+std::shared_ptr<const swarm_responses::entry> swarm_responses::get(
+        uint64_t version, const SwarmInfo& swarm) {
+    {
+        std::lock_guard lock{mutex_};
+        if (version == version_) {
+            if (auto it = entries_.find(swarm.swarm_id); it != entries_.end()) {
+                hits_++;
+                return it->second;
+            }
+        }
+        misses_++;
+    }
+
+    // Serialize without holding the lock; if another thread beats us to it we just use its entry.
+    auto e = make_entry(swarm);
+
+    std::lock_guard lock{mutex_};
+    if (version > version_) {
+        entries_.clear();
+        version_ = version;
+    }
+    if (version == version_)
+        return entries_.emplace(swarm.swarm_id, std::move(e)).first->second;
+    return e; // From an older version than we're caching now
+}
+
+uint64_t swarm_responses::hits() const {
+    std::lock_guard lock{mutex_};
+    return hits_;
+}
+
+uint64_t swarm_responses::misses() const {
+    std::lock_guard lock{mutex_};
+    return misses_;
+}
+
+} // namespace oxen
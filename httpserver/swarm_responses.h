@@ -0,0 +1,61 @@
+#pragma once
+
+#include "swarm.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace oxen {
+
+/// Serializes the swarm information that we return to `get_swarm` requests and in wrong-swarm
+/// (421) responses.  This only changes when the swarm topology does, so we serialize each swarm
+/// (as both json and bt) once per topology version (see SwarmState::version) and reuse that until
+/// the version changes, appending just the current time to each response.
+///
+/// Each swarm also gets an etag: a hash of its contents.  Clients can send it back with a later
+/// `get_swarm` request to get a short "unchanged" reply when the swarm is still the same.  Since it
+/// only depends on the contents, it stays valid across restarts and between swarm members.
+///
+/// This class is thread safe.
+class swarm_responses {
+  public:
+    struct entry {
+        // 16 hex digits identifying the contents of the swarm
+        std::string etag;
+        // The number of nodes in the swarm
+        size_t size;
+        // The serialized response, without the "t" key and without the final closing `}` (json) or
+        // `e` (bt); use json_body() or bt_body() to complete it.
+        std::string json;
+        std::string bt;
+
+        // Returns the complete json or bt-encoded response body, with the given "t" value.
+        std::string json_body(int64_t t) const;
+        std::string bt_body(int64_t t) const;
+    };
+
+    // Returns the serialized `swarm` from topology `version`, serializing it if we haven't already.
+    // Entries from any other version are dropped.
+    std::shared_ptr<const entry> get(uint64_t version, const SwarmInfo& swarm);
+
+    // The number of get() calls that found an existing entry, and that had to make one.
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+  private:
+    mutable std::mutex mutex_;
+    uint64_t version_ = 0;
+    std::unordered_map<swarm_id_t, std::shared_ptr<const entry>> entries_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+/// Builds the json description of a swarm (without a "t" value) that swarm_responses serializes.
+nlohmann::json swarm_to_json(const SwarmInfo& swarm);
+
+} // namespace oxen
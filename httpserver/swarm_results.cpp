@@ -0,0 +1,105 @@
+#include "swarm_results.h"
+#include "omq_server.h"
+
+#include <oxenmq/base64.h>
+#include <oxenmq/bt_serialize.h>
+
+#include <algorithm>
+
+namespace oxen {
+
+bool scan_swarm_result(std::string_view data) {
+    if (data.empty() || data.front() != 'd')
+        throw oxenmq::bt_deserialize_invalid{"swarm result is not a dict"};
+    bool failed = false;
+    oxenmq::bt_dict_consumer d{data};
+    while (!d.is_finished()) {
+        if (d.key() == "failed")
+            failed = true;
+        d.skip_value();
+    }
+    return failed;
+}
+
+static void append_key(std::string& out, std::string_view key) {
+    out += std::to_string(key.size());
+    out += ':';
+    out += key;
+}
+
+std::string splice_swarm_results(nlohmann::json result, raw_swarm_results peers) {
+    if (!peers.empty() && !result.contains("swarm"))
+        result["swarm"] = nlohmann::json::object();
+    // bt dict keys have to be in order; json objects already iterate in the same (byte) order.
+    std::sort(peers.begin(), peers.end());
+
+    std::string out;
+    out += 'd';
+    for (auto& [key, val] : result.items()) {
+        append_key(out, key);
+        if (key != "swarm" || !val.is_object()) {
+            out += oxenmq::bt_serialize(json_to_bt(std::move(val)));
+            continue;
+        }
+        // Merge our own entries (and the placeholders for peers that failed) with the raw ones
+        out += 'd';
+        auto peer = peers.begin();
+        for (auto& [k, v] : val.items()) {
+            for (; peer != peers.end() && peer->first < k; ++peer) {
+                append_key(out, peer->first);
+                out += peer->second;
+            }
+            append_key(out, k);
+            out += oxenmq::bt_serialize(json_to_bt(std::move(v)));
+        }
+        for (; peer != peers.end(); ++peer) {
+            append_key(out, peer->first);
+            out += peer->second;
+        }
+        out += 'e';
+    }
+    out += 'e';
+    return out;
+}
+
+void merge_swarm_results(nlohmann::json& result, const raw_swarm_results& peers, bool b64) {
+    auto& swarm = result["swarm"];
+    for (auto& [pk, data] : peers) {
+        auto j = bt_to_json(oxenmq::bt_dict_consumer{data});
+        if (b64)
+            if (auto it = j.find("signature"); it != j.end() && it->is_string())
+                *it = oxenmq::to_base64(it->get_ref<const std::string&>());
+        swarm[pk] = std::move(j);
+    }
+}
+
+void swarm_quorum::wait(std::string peer) {
+    pending_++;
+    if (!peer.empty())
+        waiting_.insert(std::move(peer));
+}
+
+bool swarm_quorum::done(const std::string& peer, bool success) {
+    pending_--;
+    if (!peer.empty())
+        waiting_.erase(peer);
+    if (replied_)
+        return false;
+    if (success)
+        confirmed_++;
+    bool quorum_reached = quorum_ > 0 && confirmed_ >= quorum_;
+    if (pending_ > 0 && !quorum_reached)
+        return false;
+    replied_ = true;
+    return true;
+}
+
+void swarm_quorum::add_quorum(nlohmann::json& result) const {
+    if (quorum_ > 0)
+        result["quorum"] = {
+            {"required", quorum_},
+            {"confirmed", confirmed_},
+            {"pending", waiting_}};
+}
+
+} // namespace oxen
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace oxen {
+
+/// Results of a recursive request from other swarm members, as the bt-encoded dicts they replied
+/// with, keyed by the member's ed25519 pubkey (in hex).  We keep these as-is while collecting them
+/// and only combine them with our own results when we reply, so that a reply to a bt-encoded
+/// request never needs to decode them at all.
+using raw_swarm_results = std::vector<std::pair<std::string, std::string>>;
+
+// Checks that `data` is a bt-encoded dict and returns true if it has a "failed" key.  Throws if it
+// is not a valid dict.
+bool scan_swarm_result(std::string_view data);
+
+// Returns `result` bt-encoded, with `peers` spliced into its "swarm" dict.
+std::string splice_swarm_results(nlohmann::json result, raw_swarm_results peers);
+
+// Decodes `peers` into the "swarm" dict of `result`, for json responses.  If `b64` is true then
+// the peers' signatures get base64-encoded.
+void merge_swarm_results(nlohmann::json& result, const raw_swarm_results& peers, bool b64);
+
+/// Decides when to reply to a recursive request: once every swarm member that we wait on
+/// (including ourself) has responded or, if the client asked for a quorum, as soon as that many of
+/// them have succeeded.  Members that come in after the reply are still counted off, but don't
+/// change anything else.
+///
+/// This class is not thread safe.
+class swarm_quorum {
+  public:
+    // If `quorum` is non-zero then we reply as soon as that many members have succeeded.
+    explicit swarm_quorum(unsigned quorum = 0) : quorum_{quorum} {}
+
+    // Starts waiting on a member: `peer` is its ed25519 pubkey (in hex), or empty for ourself.
+    // Members that we don't wait on (e.g. because they are unreachable) simply aren't added.
+    void wait(std::string peer = "");
+
+    // Records the result of a member added with wait().  Returns true if it is time to reply,
+    // which happens exactly once.
+    bool done(const std::string& peer, bool success);
+
+    bool replied() const { return replied_; }
+
+    // The number of members (including ourself) that we are still waiting on.
+    int pending() const { return pending_; }
+    unsigned confirmed() const { return confirmed_; }
+
+    // If a quorum was requested, adds the "quorum" object to `result` with the required and
+    // confirmed counts and the peers we are still waiting on.
+    void add_quorum(nlohmann::json& result) const;
+
+  private:
+    unsigned quorum_;
+    unsigned confirmed_ = 0;
+    int pending_ = 0;
+    bool replied_ = false;
+    std::set<std::string> waiting_;
+};
+
+} // namespace oxen
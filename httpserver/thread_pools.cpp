@@ -0,0 +1,109 @@
+#include "thread_pools.h"
+#include "oxen_logger.h"
+#include "string_utils.hpp"
+
+#include <algorithm>
+
+namespace oxen {
+
+thread_counts thread_counts::resolve(unsigned cores) const {
+    auto pick = [cores](int configured, unsigned cores_per_thread, int max) {
+        if (configured > 0)
+            return configured;
+        return std::clamp(static_cast<int>(cores / cores_per_thread), 1, max);
+    };
+    thread_counts t;
+    t.general = pick(general, 2, 8);
+    t.sn = pick(sn, 4, 4);
+    t.storage = pick(storage, 8, 2);
+    t.https = pick(https, 4, 4);
+    t.bulk = pick(bulk, 16, 2);
+    return t;
+}
+
+std::string_view to_string(thread_monitor::load l) {
+    switch (l) {
+        case thread_monitor::load::ok: return "ok"sv;
+        case thread_monitor::load::busy: return "busy"sv;
+        case thread_monitor::load::saturated: return "saturated"sv;
+    }
+    return "unknown"sv;
+}
+
+void thread_monitor::add_pool(std::string name, int threads) {
+    std::lock_guard lock{mutex_};
+    auto& p = pools_.emplace_back();
+    p.stats.name = std::move(name);
+    p.stats.threads = threads;
+    p.stats.suggested_threads = threads;
+}
+
+thread_monitor::pool* thread_monitor::find(std::string_view name) {
+    for (auto& p : pools_)
+        if (p.stats.name == name)
+            return &p;
+    return nullptr;
+}
+
+bool thread_monitor::probe_start(std::string_view name, clock::time_point now) {
+    std::lock_guard lock{mutex_};
+    auto* p = find(name);
+    if (!p)
+        return false;
+    if (p->probing) {
+        record(*p, now - p->probe_started);
+        return false;
+    }
+    p->probing = true;
+    p->probe_started = now;
+    return true;
+}
+
+void thread_monitor::probe_done(std::string_view name, clock::time_point now) {
+    std::lock_guard lock{mutex_};
+    auto* p = find(name);
+    if (!p || !p->probing)
+        return;
+    p->probing = false;
+    record(*p, now - p->probe_started);
+}
+
+void thread_monitor::record(pool& p, clock::duration delay) {
+    auto& s = p.stats;
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(delay);
+    p.average_us = s.samples == 0 ? us.count()
+        : p.average_us + EWMA_WEIGHT * (us.count() - p.average_us);
+    s.average_delay = std::chrono::microseconds{static_cast<int64_t>(p.average_us)};
+    s.last_delay = us;
+    s.samples++;
+
+    auto old_state = s.state;
+    s.state = s.average_delay >= SATURATED_DELAY ? load::saturated
+        : s.average_delay >= BUSY_DELAY ? load::busy
+        : load::ok;
+    s.suggested_threads = s.state == load::saturated ? 2 * s.threads
+        : s.state == load::busy ? s.threads + 1
+        : s.threads;
+    if (s.state == old_state)
+        return;
+
+    auto option = s.name == "general" ? "--omq-threads"s : "--omq-threads-" + s.name;
+    if (s.state == load::ok)
+        OXEN_LOG(info, "OxenMQ {} thread pool is keeping up again", s.name);
+    else
+        OXEN_LOG(warn, "OxenMQ {} thread pool is {}: jobs wait {} on average; consider "
+                "raising {} from {} to {}", s.name, to_string(s.state),
+                util::friendly_duration(s.average_delay), option, s.threads,
+                s.suggested_threads);
+}
+
+std::vector<thread_monitor::pool_stats> thread_monitor::stats() const {
+    std::lock_guard lock{mutex_};
+    std::vector<pool_stats> result;
+    result.reserve(pools_.size());
+    for (auto& p : pools_)
+        result.push_back(p.stats);
+    return result;
+}
+
+} // namespace oxen
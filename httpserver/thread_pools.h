@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace oxen {
+
+using namespace std::literals;
+
+/// OxenMQ worker thread counts: the general pool, which handles jobs of any category, and the
+/// threads reserved for each of our busy command categories.  A value of 0 means pick a count
+/// based on the number of CPU cores; see resolve().
+struct thread_counts {
+    int general = 0;
+    int sn = 0;
+    int storage = 0;
+    int https = 0;
+    int bulk = 0;
+
+    // Returns a copy with every 0 value replaced by a default for a machine with `cores` cores:
+    // enough to keep the cores busy during bursts, without oversubscribing small machines.
+    thread_counts resolve(unsigned cores) const;
+};
+
+/// Watches how long jobs wait in each OxenMQ thread pool before a worker picks them up, by
+/// periodically queueing a no-op probe job into each one and timing how long it takes to run.
+/// Pools whose probes are consistently delayed don't have enough threads for the load; we log
+/// that, along with a suggested thread count, and report it in the stats.
+///
+/// OxenMQ can't change its thread counts once started, so this doesn't resize anything itself:
+/// the counts are set at startup (see thread_counts), and the suggestions are for the operator.
+class thread_monitor {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // How often we probe each pool.
+    inline static constexpr auto PROBE_INTERVAL = 5s;
+
+    // A pool is busy when its probes wait BUSY_DELAY on average, and saturated beyond
+    // SATURATED_DELAY.
+    inline static constexpr auto BUSY_DELAY = 50ms;
+    inline static constexpr auto SATURATED_DELAY = 500ms;
+
+    // Weight of each new probe delay in the moving average.
+    inline static constexpr double EWMA_WEIGHT = 0.25;
+
+    enum class load { ok, busy, saturated };
+
+    // Adds a pool to watch, with its name and configured thread count.
+    void add_pool(std::string name, int threads);
+
+    // Called when we are about to queue a probe into pool `name`.  Returns false if the previous
+    // probe is still waiting to run, in which case we don't queue another but count how long it
+    // has waited so far as a sample.
+    bool probe_start(std::string_view name, clock::time_point now = clock::now());
+
+    // Called when the probe queued into pool `name` runs.
+    void probe_done(std::string_view name, clock::time_point now = clock::now());
+
+    struct pool_stats {
+        std::string name;
+        int threads;
+        std::chrono::microseconds average_delay{0}; // Exponentially weighted moving average
+        std::chrono::microseconds last_delay{0};
+        uint64_t samples = 0;
+        load state = load::ok;
+        int suggested_threads; // The same as `threads` unless busy or saturated
+    };
+
+    std::vector<pool_stats> stats() const;
+
+  private:
+    struct pool {
+        pool_stats stats;
+        double average_us = 0;
+        clock::time_point probe_started{};
+        bool probing = false;
+    };
+
+    std::vector<pool> pools_;
+    mutable std::mutex mutex_;
+
+    pool* find(std::string_view name);
+
+    void record(pool& p, clock::duration delay);
+};
+
+std::string_view to_string(thread_monitor::load l);
+
+} // namespace oxen
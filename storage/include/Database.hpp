@@ -5,9 +5,11 @@
 #include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace oxen {
@@ -31,6 +33,12 @@ class Database {
 
     ~Database();
 
+    // Gives the calling thread its own read-only connection to the database, which its retrieve()
+    // calls then use instead of the connection shared by all threads.  Meant for long-lived worker
+    // threads (see request_shards); the connection is closed when the thread exits or the database
+    // is destroyed, whichever comes first.
+    void use_thread_reader();
+
     // if the database is full then print an error only once ever N errors
     inline static constexpr int DB_FULL_FREQUENCY = 100;
 
@@ -42,6 +50,10 @@ class Database {
     // for insertion use `ins && *ins`.
     std::optional<bool> store(const message& msg);
 
+    // Stores several messages in a single transaction, returning the result of each as store()
+    // would.  If the database fills up then the messages that didn't make it get nullopt.
+    std::vector<std::optional<bool>> store_batch(const std::vector<message>& msgs);
+
     void bulk_store(const std::vector<message>& items);
 
     // Retrieves messages owned by pubkey received since `last_hash` (which must also be owned by
@@ -58,6 +70,24 @@ class Database {
     // Retrieves all messages.
     std::vector<message> retrieve_all();
 
+    // Returns up to `limit` owner pubkeys that have stored messages, for walking through the
+    // database an owner chunk at a time without loading everything at once.  `cursor` should be 0
+    // for the first call, and is updated to the position to continue from on the next call.  An
+    // empty result means there are no more owners.
+    std::vector<user_pubkey_t> get_owners(int64_t& cursor, int limit);
+
+    // Returns up to `limit` of the messages owned by `pubkey`, in the order they were stored, for
+    // reading an owner with many messages a page at a time.  Unlike retrieve(), the returned
+    // messages have their `pubkey` set.  `cursor` works as in get_owners(): 0 for the first page,
+    // updated to continue from on the next call.  Fewer than `limit` messages means there are no
+    // more.
+    std::vector<message> get_messages(const user_pubkey_t& pubkey, int64_t& cursor, int limit);
+
+    // Returns the hashes of all stored (unexpired) messages or, if `owner_filter` is given, of the
+    // messages of owners for which it returns true.
+    std::vector<std::string> get_message_hashes(
+            std::function<bool(const user_pubkey_t&)> owner_filter = nullptr);
+
     // Return the total number of messages stored
     int64_t get_message_count();
 
@@ -108,6 +138,39 @@ class Database {
     // hashes of messages that had their expiries shorten.
     std::vector<std::string> update_all_expiries(
             const user_pubkey_t& pubkey, std::chrono::system_clock::time_point new_exp);
+
+    // Stores `value` under `key` in a small key-value table for service node state that should
+    // survive a restart (such as the last known swarm topology), replacing any existing value.
+    // Throws on failure.
+    void save_state(const std::string& key, std::string_view value);
+
+    // Returns the value last stored under `key` by save_state, or nullopt if there isn't one.
+    std::optional<std::string> load_state(const std::string& key);
+
+    // Version stored (as the sqlite user_version) in snapshot files; import refuses snapshots with
+    // a different version.
+    inline static constexpr int SNAPSHOT_VERSION = 1;
+
+    // Writes a snapshot of the stored (unexpired) messages to a standalone sqlite file at `path`,
+    // replacing it if it already exists.  If `owner_filter` is given then only messages of owners
+    // for which it returns true are included (e.g. to export just the part of the swarm space that
+    // belongs to a given swarm); otherwise all messages are exported, which makes the snapshot
+    // usable as a backup.  The snapshot contains no indices to keep it compact.  Returns the
+    // number of exported messages; throws on failure.
+    int64_t export_snapshot(
+            const std::filesystem::path& path,
+            std::function<bool(const user_pubkey_t&)> owner_filter = nullptr);
+
+    // The most snapshot messages that import_snapshot copies in a single transaction.
+    inline static constexpr int64_t IMPORT_CHUNK = 10'000;
+
+    // Loads the unexpired messages of a snapshot produced by `export_snapshot` into the database,
+    // skipping any messages that we already have.  The messages are committed in chunks of (at
+    // most) IMPORT_CHUNK so that importing a large snapshot doesn't hold off other writes until
+    // it's done; if the import fails, the chunks committed before the failure stay imported.
+    // Returns the number of newly inserted messages; throws on failure (including if the file is
+    // not a valid snapshot).
+    int64_t import_snapshot(const std::filesystem::path& path);
 };
 
 } // namespace oxen
@@ -6,11 +6,16 @@
 #include "time.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
 #include <cstdlib>
 #include <exception>
-#include <shared_mutex>
-#include <thread>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <SQLiteCpp/SQLiteCpp.h>
@@ -146,27 +151,206 @@ std::vector<type_or_tuple<T...>> get_all(SQLite::Statement& st, const Bind&... b
     return results;
 }
 
+// Identifiers of the queries that we keep prepared (per thread) for repeated use; see
+// DatabaseImpl::prepared_st().  Queries that are only run once, or that vary in their number of
+// parameters, are prepared on the fly instead.
+enum class Q : size_t {
+    clean_expired,
+    count_messages,
+    count_owners,
+    page_count,
+    random_message,
+    message_by_hash,
+    store_message,
+    owner_id,
+    insert_owner,
+    insert_message,
+    message_id,
+    retrieve_after,
+    retrieve_from_start,
+    retrieve_all,
+    owners_after,
+    messages_after,
+    delete_all,
+    delete_one,
+    delete_before,
+    update_expiry_one,
+    update_all_expiries,
+
+    _count // Must be last
+};
+
+constexpr const char* query_sql(Q q) {
+    switch (q) {
+        case Q::clean_expired: return "DELETE FROM messages WHERE expiry <= ?";
+        case Q::count_messages: return "SELECT COUNT(*) FROM messages";
+        case Q::count_owners: return "SELECT COUNT(*) FROM owners";
+        case Q::page_count: return "PRAGMA page_count";
+        case Q::random_message:
+            return "SELECT hash, type, pubkey, timestamp, expiry, data"
+                " FROM owned_messages "
+                " WHERE mid = (SELECT id FROM messages ORDER BY RANDOM() LIMIT 1)";
+        case Q::message_by_hash:
+            return "SELECT hash, type, pubkey, timestamp, expiry, data"
+                " FROM owned_messages WHERE hash = ?";
+        case Q::store_message:
+            return "INSERT INTO owned_messages"
+                " (pubkey, type, hash, timestamp, expiry, data) VALUES (?, ?, ?, ?, ?, ?)";
+        case Q::owner_id: return "SELECT id FROM owners WHERE pubkey = ? AND type = ?";
+        case Q::insert_owner:
+            return "INSERT INTO owners (pubkey, type) VALUES (?, ?) ON CONFLICT DO NOTHING RETURNING id";
+        case Q::insert_message:
+            return "INSERT INTO messages (owner, hash, timestamp, expiry, data) VALUES (?, ?, ?, ?, ?)"
+                " ON CONFLICT DO NOTHING";
+        case Q::message_id: return "SELECT id FROM messages WHERE owner = ? AND hash = ?";
+        case Q::retrieve_after:
+            return "SELECT hash, timestamp, expiry, data FROM messages"
+                " WHERE owner = ? AND id > ? ORDER BY id LIMIT ?";
+        case Q::retrieve_from_start:
+            return "SELECT hash, timestamp, expiry, data FROM messages"
+                " WHERE owner = ? ORDER BY id LIMIT ?";
+        case Q::retrieve_all:
+            return "SELECT type, pubkey, hash, timestamp, expiry, data"
+                " FROM owned_messages ORDER BY mid";
+        case Q::owners_after:
+            return "SELECT id, type, pubkey FROM owners WHERE id > ? ORDER BY id LIMIT ?";
+        case Q::messages_after:
+            return "SELECT id, hash, timestamp, expiry, data FROM messages"
+                " WHERE owner = ? AND id > ? ORDER BY id LIMIT ?";
+        case Q::delete_all:
+            return "DELETE FROM messages WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
+                " RETURNING hash";
+        case Q::delete_one:
+            return "DELETE FROM messages"
+                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) AND hash = ?"
+                " RETURNING hash";
+        case Q::delete_before:
+            return "DELETE FROM messages"
+                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
+                " AND timestamp <= ? RETURNING hash";
+        case Q::update_expiry_one:
+            return "UPDATE messages SET expiry = ? "
+                "WHERE expiry > ? AND hash = ?"
+                " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
+                " RETURNING hash";
+        case Q::update_all_expiries:
+            return "UPDATE messages SET expiry = ? "
+                "WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) "
+                "RETURNING hash";
+        case Q::_count: break;
+    }
+    return nullptr;
+}
+
+// One thread's prepared statements for one database, indexed by Q.  Statements are prepared
+// lazily on first use.
+using StatementTable = std::array<std::unique_ptr<SQLite::Statement>, static_cast<size_t>(Q::_count)>;
+
+// Everything one thread keeps for one database: its statements on the shared connection and, if
+// it asked for one (see Database::use_thread_reader()), its own read-only connection along with
+// the statements prepared on it.  (`reader_statements` is declared after `reader` so that the
+// statements get finalized before the connection closes).
+struct ThreadDatabase {
+    StatementTable statements;
+    std::unique_ptr<SQLite::Database> reader;
+    StatementTable reader_statements;
+};
+
+// Tracks all the per-thread statement tables (and reader connections) of a database so that they can
+// be finalized before the database connection is closed.  Owned by a shared_ptr so that exiting threads can tell whether the
+// database is still alive before touching it.
+struct StatementRegistry {
+    std::mutex mutex;
+    std::list<ThreadDatabase> tables;
+
+    ThreadDatabase* add() {
+        std::lock_guard lock{mutex};
+        return &tables.emplace_back();
+    }
+
+    // Called when a thread exits: finalizes that thread's statements.
+    void remove(ThreadDatabase* table) {
+        std::lock_guard lock{mutex};
+        tables.remove_if([table](const auto& t) { return &t == table; });
+    }
+
+    // Called when the database is closing: finalizes everything.
+    void clear() {
+        std::lock_guard lock{mutex};
+        tables.clear();
+    }
+};
+
+// Each database gets a unique, never-reused id so that a thread's cached table can never be
+// mistaken for the table of a different database that happens to reuse the same address.
+std::atomic<uint64_t> next_db_instance{1};
+
+// The statement tables the current thread has obtained, one per database it has used (which in
+// practice is always just one, outside of the test suite).  On thread exit we finalize the
+// statements of any databases that are still open.
+struct ThreadStatementTables {
+    struct entry {
+        uint64_t instance;
+        std::weak_ptr<StatementRegistry> registry;
+        ThreadDatabase* table;
+    };
+    std::vector<entry> tables;
+
+    // Fast path: the most recently used table
+    uint64_t last_instance = 0;
+    ThreadDatabase* last_table = nullptr;
+
+    ~ThreadStatementTables() {
+        for (auto& t : tables)
+            if (auto reg = t.registry.lock())
+                reg->remove(t.table);
+    }
+
+    ThreadDatabase& get(uint64_t instance, const std::shared_ptr<StatementRegistry>& registry) {
+        if (instance == last_instance)
+            return *last_table;
+
+        auto it = std::find_if(tables.begin(), tables.end(),
+                [instance](const auto& t) { return t.instance == instance; });
+        if (it == tables.end()) {
+            // Drop any stale entries for databases that have since been closed
+            tables.erase(std::remove_if(tables.begin(), tables.end(),
+                        [](const auto& t) { return t.registry.expired(); }),
+                    tables.end());
+            tables.push_back({instance, registry, registry->add()});
+            it = std::prev(tables.end());
+        }
+        last_instance = instance;
+        last_table = it->table;
+        return *last_table;
+    }
+};
+
+thread_local ThreadStatementTables thread_statements;
+
 } // anon. namespace
 
 class DatabaseImpl {
 public:
 
     oxen::Database& parent;
+    const std::filesystem::path db_path;
     SQLite::Database db;
 
     // keep track of db full errorss so we don't print them on every store
     std::atomic<int> db_full_counter = 0;
 
     // SQLiteCpp's statements are not thread-safe, so we prepare them thread-locally when needed
-    std::unordered_map<std::thread::id, std::unordered_map<std::string, SQLite::Statement>> prepared_sts;
-    std::shared_mutex prepared_sts_mutex;
+    const uint64_t instance = next_db_instance++;
+    const std::shared_ptr<StatementRegistry> statements = std::make_shared<StatementRegistry>();
 
     int page_size;
 
-    DatabaseImpl(Database& parent, const std::filesystem::path& db_path) :
+    DatabaseImpl(Database& parent, const std::filesystem::path& db_dir) :
         parent{parent},
+        db_path{db_dir / std::filesystem::u8path("storage.db")},
         db{
-            db_path / std::filesystem::u8path("storage.db"),
+            db_path,
             SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE | SQLite::OPEN_FULLMUTEX,
             SQLite_busy_timeout.count()
         }
@@ -181,17 +365,47 @@ public:
             OXEN_LOG(err, "Failed to set synchronous mode to NORMAL: {}", sqlite3_errstr(rc));
 
         page_size = db.execAndGet("PRAGMA page_size").getInt();
+        set_max_page_count(db);
+
+        if (!db.tableExists("owners")) {
+            create_schema();
+        }
+
+        // Added after the initial schema, so may need creating in an existing database
+        db.exec("CREATE TABLE IF NOT EXISTS node_state (key TEXT PRIMARY KEY, value BLOB NOT NULL)");
+    }
+
+    ~DatabaseImpl() {
+        // Statements have to be finalized before the connection can be closed
+        statements->clear();
+    }
+
+    void set_max_page_count(SQLite::Database& conn) {
         // Would use a placeholder here, but sqlite3 apparently doesn't support them for PRAGMAs.
-        if (int rc = db.tryExec("PRAGMA max_page_count = " + std::to_string(Database::SIZE_LIMIT / page_size));
+        if (int rc = conn.tryExec("PRAGMA max_page_count = " + std::to_string(Database::SIZE_LIMIT / page_size));
                 rc != SQLITE_OK) {
             auto m = fmt::format("Failed to set max page count: {}", sqlite3_errstr(rc));
             OXEN_LOG(critical, m);
             throw std::runtime_error{m};
         }
+    }
 
-        if (!db.tableExists("owners")) {
-            create_schema();
-        }
+    // Snapshot import/export need to ATTACH the snapshot file and hold a long transaction, neither
+    // of which we can do on the shared `db` connection without interfering with other threads, so
+    // they use a separate, short-lived connection to the same database.
+    std::unique_ptr<SQLite::Database> open_snapshot_connection(
+            const std::filesystem::path& snapshot, bool create) {
+        // NB: ATTACH inherits the connection's open flags, so we need OPEN_CREATE to be able to
+        // create a new snapshot file.
+        auto conn = std::make_unique<SQLite::Database>(
+                db_path,
+                SQLite::OPEN_READWRITE | (create ? SQLite::OPEN_CREATE : 0),
+                SQLite_busy_timeout.count());
+        set_max_page_count(*conn);
+        if (!create && !std::filesystem::exists(snapshot))
+            throw std::runtime_error{"Snapshot file " + snapshot.u8string() + " does not exist"};
+        exec_query(*conn, "ATTACH DATABASE ? AS snap", snapshot.u8string());
+        return conn;
     }
 
     void create_schema() {
@@ -333,31 +547,42 @@ CREATE TRIGGER owned_messages_insert
     };
 
 
-    StatementWrapper prepared_st(const std::string& query) {
-        std::unordered_map<std::string, SQLite::Statement>* sts;
-        {
-            std::shared_lock rlock{prepared_sts_mutex};
-            if (auto it = prepared_sts.find(std::this_thread::get_id());
-                    it != prepared_sts.end())
-                sts = &it->second;
-            else {
-                rlock.unlock();
-                std::unique_lock wlock{prepared_sts_mutex};
-                sts = &prepared_sts.try_emplace(std::this_thread::get_id()).first->second;
-            }
-        }
-        if (auto qit = sts->find(query); qit != sts->end())
-            return StatementWrapper{qit->second};
-        return StatementWrapper{sts->try_emplace(query, db, query).first->second};
+    // Returns the current thread's prepared statement for the given query, preparing it if this
+    // is the first time this thread has used it.  No locking is needed here (except the first time
+    // a thread uses this database).
+    StatementWrapper prepared_st(Q query) {
+        auto& st = thread_statements.get(instance, statements).statements[static_cast<size_t>(query)];
+        if (!st)
+            st = std::make_unique<SQLite::Statement>(db, query_sql(query));
+        return StatementWrapper{*st};
+    }
+
+    // Same as prepared_st(), but for a read-only query: if the current thread has its own reader
+    // connection then the statement is prepared on that rather than the shared connection.
+    StatementWrapper reader_st(Q query) {
+        auto& t = thread_statements.get(instance, statements);
+        if (!t.reader)
+            return prepared_st(query);
+        auto& st = t.reader_statements[static_cast<size_t>(query)];
+        if (!st)
+            st = std::make_unique<SQLite::Statement>(*t.reader, query_sql(query));
+        return StatementWrapper{*st};
+    }
+
+    void open_thread_reader() {
+        auto& t = thread_statements.get(instance, statements);
+        if (!t.reader)
+            t.reader = std::make_unique<SQLite::Database>(
+                    db_path, SQLite::OPEN_READONLY, SQLite_busy_timeout.count());
     }
 
     template <typename... T>
-    int prepared_exec(const std::string& query, const T&... bind) {
+    int prepared_exec(Q query, const T&... bind) {
         return exec_query(prepared_st(query), bind...);
     }
 
     template <typename... T, typename... Bind>
-    auto prepared_get(const std::string& query, const Bind&... bind) {
+    auto prepared_get(Q query, const Bind&... bind) {
         return exec_and_get<T...>(prepared_st(query), bind...);
     }
 
@@ -374,21 +599,36 @@ Database::Database(const std::filesystem::path& db_path)
 
 Database::~Database() = default;
 
+void Database::use_thread_reader() {
+    impl->open_thread_reader();
+}
+
 void Database::clean_expired() {
-    impl->prepared_exec("DELETE FROM messages WHERE expiry <= ?",
+    impl->prepared_exec(Q::clean_expired,
             to_epoch_ms(std::chrono::system_clock::now()));
 }
 
 int64_t Database::get_message_count() {
-    return impl->prepared_get<int64_t>("SELECT COUNT(*) FROM messages");
+    return impl->prepared_get<int64_t>(Q::count_messages);
 }
 
 int64_t Database::get_owner_count() {
-    return impl->prepared_get<int64_t>("SELECT COUNT(*) FROM owners");
+    return impl->prepared_get<int64_t>(Q::count_owners);
 }
 
 int64_t Database::get_used_bytes() {
-    return impl->prepared_get<int64_t>("PRAGMA page_count") * impl->page_size;
+    return impl->prepared_get<int64_t>(Q::page_count) * impl->page_size;
+}
+
+void Database::save_state(const std::string& key, std::string_view value) {
+    exec_query(impl->db, "INSERT INTO node_state (key, value) VALUES (?, ?)"
+            " ON CONFLICT (key) DO UPDATE SET value = excluded.value",
+            key, blob_binder{value});
+}
+
+std::optional<std::string> Database::load_state(const std::string& key) {
+    SQLite::Statement st{impl->db, "SELECT value FROM node_state WHERE key = ?"};
+    return exec_and_maybe_get<std::string>(st, key);
 }
 
 static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement& st) {
@@ -408,23 +648,19 @@ static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement&
 
 std::optional<message> Database::retrieve_random() {
     clean_expired();
-    auto st = impl->prepared_st("SELECT hash, type, pubkey, timestamp, expiry, data"
-        " FROM owned_messages "
-        " WHERE mid = (SELECT id FROM messages ORDER BY RANDOM() LIMIT 1)");
+    auto st = impl->prepared_st(Q::random_message);
     return get_message(*impl, st);
 }
 
 std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
-    auto st = impl->prepared_st("SELECT hash, type, pubkey, timestamp, expiry, data"
-            " FROM owned_messages WHERE hash = ?");
+    auto st = impl->prepared_st(Q::message_by_hash);
     st->bindNoCopy(1, msg_hash);
     return get_message(*impl, st);
 }
 
-std::optional<bool> Database::store(const message& msg) {
-    auto st = impl->prepared_st("INSERT INTO owned_messages"
-           " (pubkey, type, hash, timestamp, expiry, data) VALUES (?, ?, ?, ?, ?, ?)");
-
+// Inserts a message using the store_message statement `st`; see Database::store().
+static std::optional<bool> store_message(
+        SQLite::Statement& st, const message& msg, std::atomic<int>& db_full_counter) {
     try {
         exec_query(st,
             msg.pubkey,
@@ -436,7 +672,7 @@ std::optional<bool> Database::store(const message& msg) {
         if (int rc = e.getErrorCode(); rc == SQLITE_CONSTRAINT)
             return false;
         else if (rc == SQLITE_FULL) {
-            if (impl->db_full_counter++ % DB_FULL_FREQUENCY == 0)
+            if (db_full_counter++ % Database::DB_FULL_FREQUENCY == 0)
                 OXEN_LOG(err, "Failed to store message: database is full");
             return std::nullopt;
         } else {
@@ -447,13 +683,37 @@ std::optional<bool> Database::store(const message& msg) {
     return true;
 }
 
+std::optional<bool> Database::store(const message& msg) {
+    return store_message(impl->prepared_st(Q::store_message), msg, impl->db_full_counter);
+}
+
+std::vector<std::optional<bool>> Database::store_batch(const std::vector<message>& msgs) {
+    std::vector<std::optional<bool>> results;
+    results.reserve(msgs.size());
+    SQLite::Transaction t{impl->db};
+    for (auto& msg : msgs) {
+        auto st = impl->prepared_st(Q::store_message);
+        results.push_back(store_message(st, msg, impl->db_full_counter));
+        if (!results.back()) {
+            // The database is full, so don't bother trying the rest.  SQLite may also have rolled
+            // back the whole transaction, in which case nothing got stored.
+            if (sqlite3_get_autocommit(impl->db.getHandle()))
+                results.assign(msgs.size(), std::nullopt);
+            else {
+                results.resize(msgs.size());
+                t.commit();
+            }
+            return results;
+        }
+    }
+    t.commit();
+    return results;
+}
 
 void Database::bulk_store(const std::vector<message>& items) {
     SQLite::Transaction t{impl->db};
-    auto get_owner = impl->prepared_st(
-            "SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto insert_owner = impl->prepared_st(
-            "INSERT INTO owners (pubkey, type) VALUES (?, ?) ON CONFLICT DO NOTHING RETURNING id");
+    auto get_owner = impl->prepared_st(Q::owner_id);
+    auto insert_owner = impl->prepared_st(Q::insert_owner);
     std::unordered_map<user_pubkey_t, int64_t> seen;
     for (auto& m : items) {
         if (!m.pubkey)
@@ -474,9 +734,7 @@ void Database::bulk_store(const std::vector<message>& items) {
         }
     }
 
-    auto insert_message = impl->prepared_st(
-            "INSERT INTO messages (owner, hash, timestamp, expiry, data) VALUES (?, ?, ?, ?, ?)"
-            " ON CONFLICT DO NOTHING");
+    auto insert_message = impl->prepared_st(Q::insert_message);
 
     for (auto& m : items) {
         if (!m.pubkey)
@@ -505,20 +763,18 @@ std::vector<message> Database::retrieve(
 
     std::vector<message> results;
 
-    auto owner_st = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
+    auto owner_st = impl->reader_st(Q::owner_id);
     auto ownerid = exec_and_maybe_get<int64_t>(owner_st, pubkey);
     if (!ownerid)
         return results;
 
     std::optional<int64_t> last_id;
     if (!last_hash.empty()) {
-        auto st = impl->prepared_st("SELECT id FROM messages WHERE owner = ? AND hash = ?");
+        auto st = impl->reader_st(Q::message_id);
         last_id = exec_and_maybe_get<int64_t>(st, *ownerid, last_hash);
     }
 
-    auto st = impl->prepared_st(last_id
-            ? "SELECT hash, timestamp, expiry, data FROM messages WHERE owner = ? AND id > ? ORDER BY id LIMIT ?"
-            : "SELECT hash, timestamp, expiry, data FROM messages WHERE owner = ? ORDER BY id LIMIT ?");
+    auto st = impl->reader_st(last_id ? Q::retrieve_after : Q::retrieve_from_start);
     st->bind(1, *ownerid);
     if (last_id) st->bind(2, *last_id);
     st->bind(last_id ? 3 : 2, num_results.value_or(-1));
@@ -532,10 +788,68 @@ std::vector<message> Database::retrieve(
     return results;
 }
 
+std::vector<user_pubkey_t> Database::get_owners(int64_t& cursor, int limit) {
+    std::vector<user_pubkey_t> owners;
+    auto st = impl->prepared_st(Q::owners_after);
+    st->bind(1, cursor);
+    st->bind(2, limit);
+    while (st->executeStep()) {
+        auto [id, type, pubkey] = get<int64_t, uint8_t, std::string>(st);
+        owners.push_back(impl->load_pubkey(type, std::move(pubkey)));
+        cursor = id;
+    }
+    return owners;
+}
+
+std::vector<message> Database::get_messages(
+        const user_pubkey_t& pubkey, int64_t& cursor, int limit) {
+    std::vector<message> results;
+
+    auto owner_st = impl->reader_st(Q::owner_id);
+    auto ownerid = exec_and_maybe_get<int64_t>(owner_st, pubkey);
+    if (!ownerid)
+        return results;
+
+    auto st = impl->reader_st(Q::messages_after);
+    st->bind(1, *ownerid);
+    st->bind(2, cursor);
+    st->bind(3, limit);
+    while (st->executeStep()) {
+        auto [id, hash, ts, exp, data] =
+            get<int64_t, std::string, int64_t, int64_t, std::string>(st);
+        results.emplace_back(pubkey, std::move(hash), from_epoch_ms(ts), from_epoch_ms(exp),
+                std::move(data));
+        cursor = id;
+    }
+    return results;
+}
+
+std::vector<std::string> Database::get_message_hashes(
+        std::function<bool(const user_pubkey_t&)> owner_filter) {
+    std::unordered_set<int64_t> owners;
+    if (owner_filter) {
+        SQLite::Statement st{impl->db, "SELECT id, type, pubkey FROM owners"};
+        while (st.executeStep()) {
+            auto [id, type, pubkey] = get<int64_t, uint8_t, std::string>(st);
+            if (owner_filter(impl->load_pubkey(type, std::move(pubkey))))
+                owners.insert(id);
+        }
+    }
+
+    std::vector<std::string> hashes;
+    SQLite::Statement st{impl->db, "SELECT owner, hash FROM messages WHERE expiry > ?"};
+    st.bind(1, to_epoch_ms(std::chrono::system_clock::now()));
+    while (st.executeStep()) {
+        auto [owner, hash] = get<int64_t, std::string>(st);
+        if (!owner_filter || owners.count(owner))
+            hashes.push_back(std::move(hash));
+    }
+    return hashes;
+}
+
 std::vector<message> Database::retrieve_all() {
     std::vector<message> results;
-    auto st = impl->prepared_st("SELECT type, pubkey, hash, timestamp, expiry, data"
-            " FROM owned_messages ORDER BY mid");
+    auto st = impl->prepared_st(Q::retrieve_all);
 
     while (st->executeStep()) {
         auto [type, pubkey, hash, ts, exp, data] =
@@ -552,9 +866,7 @@ std::vector<message> Database::retrieve_all() {
 }
 
 std::vector<std::string> Database::delete_all(const user_pubkey_t& pubkey) {
-    auto st = impl->prepared_st(
-            "DELETE FROM messages WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING hash");
+    auto st = impl->prepared_st(Q::delete_all);
     return get_all<std::string>(st, pubkey);
 }
 
@@ -574,9 +886,7 @@ std::vector<std::string> Database::delete_by_hash(
         const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) {
     if (msg_hashes.size() == 1) {
         // Use an optimized prepared statement for very common single-hash deletions
-        auto st = impl->prepared_st("DELETE FROM messages"
-                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) AND hash = ?"
-                " RETURNING hash");
+        auto st = impl->prepared_st(Q::delete_one);
         return get_all<std::string>(st, pubkey, msg_hashes[0]);
     }
 
@@ -594,9 +904,7 @@ std::vector<std::string> Database::delete_by_hash(
 
 std::vector<std::string> Database::delete_by_timestamp(
         const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) {
-    auto st = impl->prepared_st("DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND timestamp <= ? RETURNING hash");
+    auto st = impl->prepared_st(Q::delete_before);
     return get_all<std::string>(st, pubkey, to_epoch_ms(timestamp));
 }
 
@@ -610,10 +918,7 @@ Database::update_expiry(
 
     if (msg_hashes.size() == 1) {
         // Pre-prepared version for the common single hash case
-        auto st = impl->prepared_st("UPDATE messages SET expiry = ? "
-                "WHERE expiry > ? AND hash = ?"
-                " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " RETURNING hash");
+        auto st = impl->prepared_st(Q::update_expiry_one);
         return get_all<std::string>(st, new_exp_ms, new_exp_ms, msg_hashes[0], pubkey);
     }
 
@@ -637,10 +942,144 @@ Database::update_all_expiries(
         std::chrono::system_clock::time_point new_exp
         ) {
     auto new_exp_ms = to_epoch_ms(new_exp);
-    auto st = impl->prepared_st("UPDATE messages SET expiry = ? "
-            "WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) "
-            "RETURNING hash");
+    auto st = impl->prepared_st(Q::update_all_expiries);
     return get_all<std::string>(st, new_exp_ms, new_exp_ms, pubkey);
 }
 
+int64_t Database::export_snapshot(
+        const std::filesystem::path& path,
+        std::function<bool(const user_pubkey_t&)> owner_filter) {
+
+    // Write to a temporary file and move it into place once complete so that we never leave a
+    // partial snapshot behind at `path`.
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+    std::filesystem::remove(tmp_path);
+
+    int64_t count;
+    {
+        auto conn = impl->open_snapshot_connection(tmp_path, true);
+
+        // The snapshot is a throwaway file until renamed, so there's no point in journalling it
+        conn->exec("PRAGMA snap.journal_mode = OFF");
+        conn->exec("PRAGMA snap.synchronous = OFF");
+        conn->exec("PRAGMA snap.user_version = " + std::to_string(SNAPSHOT_VERSION));
+
+        // Same columns as our main tables, but without any of the indices, triggers, or views: the
+        // importer builds whatever it needs on its side.
+        conn->exec(R"(
+CREATE TABLE snap.owners (
+    id INTEGER PRIMARY KEY,
+    type INTEGER NOT NULL,
+    pubkey BLOB NOT NULL
+);
+
+CREATE TABLE snap.messages (
+    id INTEGER PRIMARY KEY,
+    hash TEXT NOT NULL,
+    owner INTEGER NOT NULL,
+    timestamp INTEGER NOT NULL,
+    expiry INTEGER NOT NULL,
+    data BLOB NOT NULL
+);
+        )");
+
+        SQLite::Transaction t{*conn};
+
+        if (owner_filter) {
+            conn->exec("CREATE TEMP TABLE snapshot_owners (id INTEGER PRIMARY KEY)");
+            SQLite::Statement ins{*conn, "INSERT INTO temp.snapshot_owners (id) VALUES (?)"};
+            SQLite::Statement sel{*conn, "SELECT id, type, pubkey FROM main.owners"};
+            while (sel.executeStep()) {
+                auto [id, type, pubkey] = get<int64_t, uint8_t, std::string>(sel);
+                if (owner_filter(impl->load_pubkey(type, std::move(pubkey)))) {
+                    exec_query(ins, id);
+                    ins.reset();
+                }
+            }
+        }
+
+        const char* owner_cond = owner_filter
+            ? " AND owner IN (SELECT id FROM temp.snapshot_owners)" : "";
+
+        exec_query(*conn, (std::string{"INSERT INTO snap.owners (id, type, pubkey)"
+                    " SELECT id, type, pubkey FROM main.owners"
+                    " WHERE id IN (SELECT owner FROM main.messages WHERE expiry > ?"} + owner_cond + ")").c_str(),
+                to_epoch_ms(std::chrono::system_clock::now()));
+
+        // Keep the id order so that the importer inserts in the same relative order (which matters
+        // for `retrieve`'s last_hash handling).
+        count = exec_query(*conn, (std::string{"INSERT INTO snap.messages"
+                    " (id, hash, owner, timestamp, expiry, data)"
+                    " SELECT id, hash, owner, timestamp, expiry, data FROM main.messages"
+                    " WHERE owner IN (SELECT id FROM snap.owners) AND expiry > ?"} + owner_cond + " ORDER BY id").c_str(),
+                to_epoch_ms(std::chrono::system_clock::now()));
+
+        t.commit();
+        conn->exec("DETACH DATABASE snap");
+    }
+
+    std::filesystem::rename(tmp_path, path);
+
+    OXEN_LOG(info, "Exported {} messages to snapshot {}", count, path.u8string());
+    return count;
+}
+
+int64_t Database::import_snapshot(const std::filesystem::path& path) {
+    auto conn = impl->open_snapshot_connection(path, false);
+
+    if (int version = conn->execAndGet("PRAGMA snap.user_version").getInt();
+            version != SNAPSHOT_VERSION || conn->execAndGet("SELECT COUNT(*) FROM snap.sqlite_master"
+                " WHERE type = 'table' AND name IN ('owners', 'messages')").getInt() != 2)
+        throw std::runtime_error{fmt::format(
+                "{} is not a valid storage snapshot (version {}, expected {})",
+                path.u8string(), version, SNAPSHOT_VERSION)};
+
+    auto now = to_epoch_ms(std::chrono::system_clock::now());
+
+    // A snapshot can hold gigabytes of messages, so rather than one long write transaction (which
+    // would block every store on the node until it finishes) we copy it over in chunks of at most
+    // IMPORT_CHUNK messages, in snapshot id order, each committed on its own.  A chunk copies the
+    // owners of its messages along with the messages themselves, so every committed chunk is
+    // complete; an import that fails part-way leaves the earlier chunks in place, and can simply be
+    // retried since we skip messages that we already have.
+    SQLite::Statement last_id{*conn, "SELECT MAX(id) FROM snap.messages"};
+    SQLite::Statement chunk_end{*conn, "SELECT id FROM snap.messages WHERE id > ?"
+        " ORDER BY id LIMIT 1 OFFSET ?"};
+    SQLite::Statement ins_owners{*conn, "INSERT INTO main.owners (type, pubkey)"
+            " SELECT type, pubkey FROM snap.owners"
+            " WHERE id IN (SELECT owner FROM snap.messages WHERE id > ? AND id <= ? AND expiry > ?)"
+            " ORDER BY id"
+            " ON CONFLICT DO NOTHING"};
+    SQLite::Statement ins_msgs{*conn, "INSERT INTO main.messages (hash, owner, timestamp, expiry, data)"
+            " SELECT m.hash, o.id, m.timestamp, m.expiry, m.data FROM snap.messages m"
+            "  JOIN snap.owners so ON so.id = m.owner"
+            "  JOIN main.owners o ON o.type = so.type AND o.pubkey = so.pubkey"
+            " WHERE m.id > ? AND m.id <= ? AND m.expiry > ?"
+            " ORDER BY m.id"
+            " ON CONFLICT DO NOTHING"};
+
+    int64_t count = 0;
+    // MAX() of an empty table is a NULL, which converts to 0, so an empty snapshot copies nothing
+    const auto last = exec_and_get<int64_t>(last_id);
+    for (int64_t from = std::numeric_limits<int64_t>::min(); from < last; ) {
+        auto to = exec_and_maybe_get<int64_t>(chunk_end, from, IMPORT_CHUNK - 1).value_or(last);
+        chunk_end.reset();
+
+        SQLite::Transaction t{*conn};
+        exec_query(ins_owners, from, to, now);
+        ins_owners.reset();
+        count += exec_query(ins_msgs, from, to, now);
+        ins_msgs.reset();
+        t.commit();
+
+        from = to;
+    }
+
+    conn->exec("DETACH DATABASE snap");
+
+    OXEN_LOG(info, "Imported {} new messages from snapshot {}", count, path.u8string());
+    return count;
+}
+
 } // namespace oxen
@@ -128,3 +128,33 @@ TEST_CASE("config not found", "[cli][config]") {
                 "--config-file", "foobar"}),
             "path provided in --config-file does not exist");
 }
+
+TEST_CASE("store batch window", "[cli][store-batch-window]") {
+    oxen::command_line_parser parser;
+    REQUIRE_NOTHROW(parser.parse_args({"httpserver", "0.0.0.0", "80", "--omq-port", "123"}));
+    CHECK(parser.get_options().store_batch_window == 1);
+
+    oxen::command_line_parser parser2;
+    REQUIRE_NOTHROW(
+            parser2.parse_args({"httpserver", "0.0.0.0", "80", "--omq-port", "123",
+                "--store-batch-window", "0"}));
+    CHECK(parser2.get_options().store_batch_window == 0);
+}
+
+TEST_CASE("omq thread counts", "[cli][omq-threads]") {
+    oxen::command_line_parser parser;
+    REQUIRE_NOTHROW(parser.parse_args({"httpserver", "0.0.0.0", "80", "--omq-port", "123"}));
+    CHECK(parser.get_options().threads.general == 0);
+    CHECK(parser.get_options().threads.bulk == 0);
+
+    oxen::command_line_parser parser2;
+    REQUIRE_NOTHROW(
+            parser2.parse_args({"httpserver", "0.0.0.0", "80", "--omq-port", "123",
+                "--omq-threads", "12", "--omq-threads-sn", "3", "--omq-threads-bulk", "2"}));
+    auto& threads = parser2.get_options().threads;
+    CHECK(threads.general == 12);
+    CHECK(threads.sn == 3);
+    CHECK(threads.storage == 0);
+    CHECK(threads.https == 0);
+    CHECK(threads.bulk == 2);
+}
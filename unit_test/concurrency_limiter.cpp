@@ -0,0 +1,78 @@
+#include "concurrency_limiter.h"
+
+#include <catch2/catch.hpp>
+
+#include <string>
+#include <vector>
+
+using oxen::ConcurrencyLimiter;
+
+TEST_CASE("concurrency limiter - limits and queueing", "[limiter]") {
+    ConcurrencyLimiter limiter{4, 2, 3, 2};
+    std::vector<std::string> started;
+    auto start = [&](std::string name) { return [&started, name] { started.push_back(name); }; };
+
+    CHECK(limiter.submit("a", start("a1")));
+    CHECK(limiter.submit("a", start("a2")));
+    // Over the per-key limit, so these queue, up to the per-key queue limit
+    CHECK(limiter.submit("a", start("a3")));
+    CHECK(limiter.submit("a", start("a4")));
+    CHECK_FALSE(limiter.submit("a", start("a5")));
+    CHECK(started == std::vector<std::string>{"a1", "a2"});
+    CHECK(limiter.in_flight() == 2);
+    CHECK(limiter.queued() == 2);
+
+    // Another key isn't held up by "a"
+    CHECK(limiter.submit("b", start("b1")));
+    CHECK(limiter.submit("c", start("c1")));
+    CHECK(limiter.in_flight() == 4);
+    // At the global limit, so this queues, which fills the global queue
+    CHECK(limiter.submit("d", start("d1")));
+    CHECK(limiter.queued() == 3);
+    CHECK_FALSE(limiter.submit("e", start("e1")));
+    CHECK(started == std::vector<std::string>{"a1", "a2", "b1", "c1"});
+
+    // Finishing a "b" frees a global slot; "a" is still at its own limit, so "d1" goes first.
+    limiter.finished("b");
+    CHECK(started.back() == "d1");
+    CHECK(limiter.queued() == 2);
+
+    limiter.finished("a");
+    CHECK(started.back() == "a3");
+    limiter.finished("a");
+    CHECK(started.back() == "a4");
+    CHECK(limiter.queued() == 0);
+    CHECK(limiter.in_flight() == 4);
+
+    for (auto k : {"a", "a", "c", "d"})
+        limiter.finished(k);
+    CHECK(limiter.in_flight() == 0);
+
+    // Unmatched finishes are ignored
+    limiter.finished("a");
+    limiter.finished("zzz");
+    CHECK(limiter.in_flight() == 0);
+    CHECK(limiter.submit("a", start("a6")));
+    CHECK(limiter.in_flight() == 1);
+}
+
+TEST_CASE("concurrency limiter - reentrant start", "[limiter]") {
+    // An operation that completes immediately (calling back into the limiter from `start`) must
+    // not deadlock, and must let the queued ones run.
+    ConcurrencyLimiter limiter{1, 1, 10, 10};
+    int done = 0;
+    std::function<void()> quick = [&] {
+        done++;
+        limiter.finished("x");
+    };
+    bool blocked_started = false;
+    CHECK(limiter.submit("x", [&] { blocked_started = true; }));
+    for (int i = 0; i < 5; i++)
+        CHECK(limiter.submit("x", quick));
+    CHECK(done == 0);
+    limiter.finished("x");
+    CHECK(blocked_started);
+    CHECK(done == 5);
+    CHECK(limiter.in_flight() == 0);
+    CHECK(limiter.queued() == 0);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// Fixtures shared between the test files.
+
+#include "oxen_common.h"
+
+#include <string>
+
+#include <catch2/catch.hpp>
+
+namespace oxen::test {
+
+// Returns a distinct (05-prefixed) user pubkey for each `i`.
+inline user_pubkey_t make_pubkey(int i) {
+    user_pubkey_t pk;
+    auto hex = std::to_string(i);
+    hex.insert(0, 66 - hex.size(), '0');
+    hex[1] = '5';
+    REQUIRE(pk.load(hex));
+    return pk;
+}
+
+// Two distinct service node keys, as whichever key type (legacy_pubkey, x25519_pubkey, ...) a test
+// needs.
+template <typename Key>
+inline const Key PK1 = Key::from_hex("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abc000");
+template <typename Key>
+inline const Key PK2 = Key::from_hex("5123456789abcdef0123456789abcdef0123456789abcdef0123456789abc000");
+
+} // namespace oxen::test
@@ -0,0 +1,195 @@
+#include "omq_server.h"
+#include "oxend_cache.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+#include <oxenmq/bt_serialize.h>
+
+using namespace oxen;
+using nlohmann::json;
+using namespace std::literals;
+
+namespace {
+
+// Stands in for oxend: records the requests made to it, which the test then answers.
+struct fake_oxend {
+    std::vector<std::function<void(bool, std::vector<std::string>)>> requests;
+
+    oxend_cache::fetcher fetcher() {
+        return [this](auto done) { requests.push_back(std::move(done)); };
+    }
+    void reply(size_t i, std::string result) {
+        requests.at(i)(true, {"200", std::move(result)});
+    }
+};
+
+struct replies {
+    std::vector<oxend_cache::reply> got;
+    oxend_cache::callback cb() {
+        return [this](const oxend_cache::reply& r) { got.push_back(r); };
+    }
+};
+
+} // namespace
+
+TEST_CASE("oxend cache - caching and coalescing", "[oxend-cache]") {
+    oxend_cache cache;
+    fake_oxend oxend;
+    replies r;
+
+    auto params = json::parse(R"({"name_hash": ["abc"], "type": 0})");
+    auto reordered = json::parse(R"({ "type": 0,  "name_hash": ["abc"] })");
+
+    // Concurrent identical requests only make one request to oxend
+    cache.get("hash1", "ons_resolve", params, r.cb(), oxend.fetcher());
+    cache.get("hash1", "ons_resolve", reordered, r.cb(), oxend.fetcher());
+    cache.get("hash1", "ons_resolve", params, r.cb(), oxend.fetcher());
+    REQUIRE(oxend.requests.size() == 1);
+    CHECK(r.got.empty());
+
+    oxend.reply(0, R"({"encrypted_value": "1234", "nonce": "5678"})");
+    REQUIRE(r.got.size() == 3);
+    for (auto& g : r.got) {
+        REQUIRE(g.result);
+        CHECK(g.result == r.got[0].result);
+    }
+    CHECK(r.got[0].result->json_body(123) ==
+            R"({"result":{"encrypted_value":"1234","nonce":"5678"},"t":123})");
+    CHECK(r.got[0].result->bt_body(123) == oxenmq::bt_serialize(json_to_bt(
+                    json{{"result", {{"encrypted_value", "1234"}, {"nonce", "5678"}}}, {"t", 123}})));
+
+    // Now it's cached
+    cache.get("hash1", "ons_resolve", reordered, r.cb(), oxend.fetcher());
+    REQUIRE(r.got.size() == 4);
+    CHECK(r.got[3].result == r.got[0].result);
+    CHECK(oxend.requests.size() == 1);
+
+    // Different params or endpoints are separate
+    cache.get("hash1", "ons_resolve", json{{"type", 1}}, r.cb(), oxend.fetcher());
+    cache.get("hash1", "get_service_nodes", std::nullopt, r.cb(), oxend.fetcher());
+    CHECK(oxend.requests.size() == 3);
+    oxend.reply(1, "{}");
+    oxend.reply(2, "[]");
+
+    // Empty params are the same as no params
+    cache.get("hash1", "get_service_nodes", json::object(), r.cb(), oxend.fetcher());
+    CHECK(oxend.requests.size() == 3);
+    REQUIRE(r.got.size() == 7);
+    CHECK(r.got[6].result->json_body(1) == R"({"result":[],"t":1})");
+
+    auto stats = cache.get_stats();
+    CHECK(stats.hits == 2);
+    CHECK(stats.coalesced == 2);
+    CHECK(stats.misses == 3);
+    CHECK(stats.entries == 3);
+
+    // A new block invalidates everything
+    cache.get("hash2", "ons_resolve", params, r.cb(), oxend.fetcher());
+    CHECK(oxend.requests.size() == 4);
+    CHECK(cache.get_stats().entries == 0);
+}
+
+TEST_CASE("oxend cache - block changes during a request", "[oxend-cache]") {
+    oxend_cache cache;
+    fake_oxend oxend;
+    replies r;
+
+    cache.get("hash1", "get_service_nodes", std::nullopt, r.cb(), oxend.fetcher());
+    // A request at the next block doesn't join the one from the previous block
+    cache.get("hash2", "get_service_nodes", std::nullopt, r.cb(), oxend.fetcher());
+    REQUIRE(oxend.requests.size() == 2);
+
+    // The old block's result goes to its caller, but isn't cached
+    oxend.reply(0, R"("old")");
+    REQUIRE(r.got.size() == 1);
+    CHECK(r.got[0].result->json_body(0) == R"({"result":"old","t":0})");
+    CHECK(cache.get_stats().entries == 0);
+
+    // The second one is still in progress, and can still be joined
+    cache.get("hash2", "get_service_nodes", std::nullopt, r.cb(), oxend.fetcher());
+    CHECK(oxend.requests.size() == 2);
+    oxend.reply(1, R"("new")");
+    REQUIRE(r.got.size() == 3);
+    CHECK(r.got[1].result == r.got[2].result);
+    CHECK(cache.get_stats().entries == 1);
+
+    // While syncing (no block) nothing is cached or coalesced
+    cache.get("", "get_service_nodes", std::nullopt, r.cb(), oxend.fetcher());
+    cache.get("", "get_service_nodes", std::nullopt, r.cb(), oxend.fetcher());
+    CHECK(oxend.requests.size() == 4);
+    oxend.reply(2, R"("a")");
+    oxend.reply(3, R"("b")");
+    REQUIRE(r.got.size() == 5);
+    CHECK(r.got[3].result->json_body(0) == R"({"result":"a","t":0})");
+    CHECK(r.got[4].result->json_body(0) == R"({"result":"b","t":0})");
+}
+
+TEST_CASE("oxend cache - failures", "[oxend-cache]") {
+    oxend_cache cache;
+    fake_oxend oxend;
+    replies r;
+
+    cache.get("hash1", "ons_resolve", std::nullopt, r.cb(), oxend.fetcher());
+    cache.get("hash1", "ons_resolve", std::nullopt, r.cb(), oxend.fetcher());
+    REQUIRE(oxend.requests.size() == 1);
+    oxend.requests[0](true, {"400", "Invalid name"});
+    REQUIRE(r.got.size() == 2);
+    for (auto& g : r.got) {
+        CHECK_FALSE(g.result);
+        CHECK(g.status == http::BAD_REQUEST);
+        CHECK(g.error == "Invalid name");
+    }
+
+    // Failures aren't cached
+    cache.get("hash1", "ons_resolve", std::nullopt, r.cb(), oxend.fetcher());
+    REQUIRE(oxend.requests.size() == 2);
+    oxend.requests[1](false, {"TIMEOUT"});
+    REQUIRE(r.got.size() == 3);
+    CHECK(r.got[2].status == http::BAD_REQUEST);
+    CHECK(r.got[2].error == "Unknown oxend error");
+
+    cache.get("hash1", "ons_resolve", std::nullopt, r.cb(), oxend.fetcher());
+    oxend.reply(2, "not json");
+    REQUIRE(r.got.size() == 4);
+    CHECK(r.got[3].status == http::BAD_GATEWAY);
+    CHECK(cache.get_stats().entries == 0);
+
+    // A result that can't be bt-encoded is still fine for json requests
+    cache.get("hash1", "ons_resolve", std::nullopt, r.cb(), oxend.fetcher());
+    oxend.reply(3, R"({"x": 1.5})");
+    REQUIRE(r.got.size() == 5);
+    REQUIRE(r.got[4].result);
+    CHECK_FALSE(r.got[4].result->bt);
+    CHECK(r.got[4].result->json_body(0) == R"({"result":{"x":1.5},"t":0})");
+}
+
+TEST_CASE("oxend cache - memory bound", "[oxend-cache]") {
+    oxend_cache cache;
+    fake_oxend oxend;
+    replies r;
+
+    auto big = "\"" + std::string(oxend_cache::MAX_BYTES / 5, 'x') + "\"";
+    for (int i = 0; i < 3; i++) {
+        cache.get("hash1", "ons_resolve", json{{"i", i}}, r.cb(), oxend.fetcher());
+        oxend.reply(i, big);
+    }
+    auto stats = cache.get_stats();
+    CHECK(stats.entries == 2);
+    CHECK(stats.evictions == 1);
+    CHECK(stats.bytes <= oxend_cache::MAX_BYTES);
+
+    // The oldest was evicted
+    cache.get("hash1", "ons_resolve", json{{"i", 2}}, r.cb(), oxend.fetcher());
+    CHECK(oxend.requests.size() == 3);
+    cache.get("hash1", "ons_resolve", json{{"i", 0}}, r.cb(), oxend.fetcher());
+    CHECK(oxend.requests.size() == 4);
+
+    // Results too large to cache at all are still returned
+    oxend.reply(3, "\"" + std::string(oxend_cache::MAX_BYTES, 'x') + "\"");
+    CHECK(r.got.back().result);
+    CHECK(cache.get_stats().entries == 2);
+}
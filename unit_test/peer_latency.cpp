@@ -0,0 +1,61 @@
+#include "fixtures.h"
+#include "peer_latency.h"
+
+#include <catch2/catch.hpp>
+
+using oxen::peer_latency;
+using namespace std::literals;
+
+static const auto& PK1 = oxen::test::PK1<oxen::legacy_pubkey>;
+static const auto& PK2 = oxen::test::PK2<oxen::legacy_pubkey>;
+
+TEST_CASE("peer latency - timeouts", "[peer_latency]") {
+    peer_latency lat;
+    CHECK(lat.timeout(PK1) == peer_latency::MAX_TIMEOUT);
+    CHECK_FALSE(lat.get(PK1));
+
+    // Not enough samples yet
+    for (size_t i = 1; i < peer_latency::MIN_SAMPLES; i++)
+        lat.success(PK1, 100ms);
+    CHECK(lat.timeout(PK1) == peer_latency::MAX_TIMEOUT);
+
+    lat.success(PK1, 100ms);
+    CHECK(lat.timeout(PK1) == peer_latency::MIN_TIMEOUT);
+
+    for (int i = 0; i < 100; i++)
+        lat.success(PK1, i % 10 == 0 ? 600ms : 200ms);
+    auto s = lat.get(PK1);
+    REQUIRE(s);
+    CHECK(s->samples == peer_latency::SAMPLES);
+    CHECK(s->p50 == 200ms);
+    CHECK(s->p95 == 600ms);
+    CHECK(s->average > 200ms);
+    CHECK(s->average < 600ms);
+    CHECK(lat.timeout(PK1) == 1800ms);
+
+    // Each failure doubles the timeout, up to the maximum
+    lat.failure(PK1);
+    CHECK(lat.timeout(PK1) == 3600ms);
+    lat.failure(PK1);
+    CHECK(lat.timeout(PK1) == peer_latency::MAX_TIMEOUT);
+
+    // Other peers are unaffected
+    CHECK(lat.timeout(PK2) == peer_latency::MAX_TIMEOUT);
+}
+
+TEST_CASE("peer latency - unreachable peers", "[peer_latency]") {
+    peer_latency lat;
+    for (int i = 0; i < peer_latency::UNREACHABLE_FAILURES; i++) {
+        CHECK_FALSE(lat.unreachable(PK1));
+        lat.failure(PK1);
+    }
+    CHECK(lat.unreachable(PK1));
+    CHECK_FALSE(lat.unreachable(PK2));
+    REQUIRE(lat.get(PK1));
+    CHECK(lat.get(PK1)->failures == peer_latency::UNREACHABLE_FAILURES);
+
+    // One answer and it's back
+    lat.success(PK1, 50ms);
+    CHECK_FALSE(lat.unreachable(PK1));
+    CHECK(lat.get(PK1)->failures == 0);
+}
@@ -0,0 +1,209 @@
+#include "reconcile.h"
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <set>
+
+using namespace oxen::reconcile;
+
+static std::vector<std::string> make_hashes(size_t count, const std::string& prefix) {
+    std::vector<std::string> hashes;
+    for (size_t i = 0; i < count; i++)
+        hashes.push_back(prefix + std::to_string(i));
+    return hashes;
+}
+
+// Runs a reconciliation of `a` against `b` through the wire encoding; returns the number of bytes
+// exchanged.
+static size_t reconcile(session& s, const fingerprint_set& b) {
+    size_t bytes = 0;
+    while (!s.done()) {
+        auto queries = s.next_queries();
+        auto req = encode(queries);
+        auto rep = encode(respond(b, decode_queries(req)));
+        bytes += req.size() + rep.size();
+        s.process(queries, decode_replies(rep));
+    }
+    return bytes;
+}
+
+TEST_CASE("reconcile - range splitting", "[reconcile]") {
+    auto parts = split(range{});
+    REQUIRE(parts.size() == FANOUT);
+    CHECK(parts.front().lo == 0);
+    CHECK(parts.back().hi == UINT64_MAX);
+    for (size_t i = 1; i < parts.size(); i++)
+        CHECK(parts[i].lo == parts[i - 1].hi + 1);
+
+    parts = split(range{5, 7});
+    REQUIRE(parts.size() == 3);
+    CHECK(parts[0].lo == 5);
+    CHECK(parts[0].hi == 5);
+    CHECK(parts[2].lo == 7);
+    CHECK(parts[2].hi == 7);
+
+    parts = split(range{9, 9});
+    REQUIRE(parts.size() == 1);
+    CHECK(parts[0].lo == 9);
+    CHECK(parts[0].hi == 9);
+}
+
+TEST_CASE("reconcile - summaries", "[reconcile]") {
+    fingerprint_set s{make_hashes(1000, "h")};
+    CHECK(s.size() == 1000);
+    auto all = s.summarize(range{});
+    CHECK(all.count == 1000);
+
+    uint64_t count = 0, digest = 0;
+    for (auto& r : split(range{})) {
+        auto part = s.summarize(r);
+        count += part.count;
+        digest ^= part.digest;
+        auto fps = s.fingerprints(r);
+        CHECK(fps.size() == part.count);
+    }
+    CHECK(count == all.count);
+    CHECK(digest == all.digest);
+
+    auto fp = fingerprint("h123");
+    REQUIRE(s.find(fp));
+    CHECK(*s.find(fp) == "h123");
+    CHECK_FALSE(s.find(fingerprint("x")));
+
+    // Duplicate hashes only count once
+    fingerprint_set dupes{{"a", "b", "a"}};
+    CHECK(dupes.size() == 2);
+}
+
+TEST_CASE("reconcile - identical sets", "[reconcile]") {
+    auto a = std::make_shared<fingerprint_set>(make_hashes(10000, "m"));
+    fingerprint_set b{make_hashes(10000, "m")};
+    session s{a};
+    auto bytes = reconcile(s, b);
+    CHECK(s.rounds == 1);
+    CHECK(s.missing().empty());
+    CHECK(s.extra().empty());
+    CHECK(bytes < 100);
+}
+
+TEST_CASE("reconcile - differences", "[reconcile]") {
+    auto common = make_hashes(50000, "common");
+    auto a_hashes = common, b_hashes = common;
+    auto a_only = make_hashes(7, "a");
+    auto b_only = make_hashes(13, "b");
+    a_hashes.insert(a_hashes.end(), a_only.begin(), a_only.end());
+    b_hashes.insert(b_hashes.end(), b_only.begin(), b_only.end());
+    // Drop a few common messages from b, too
+    b_hashes.erase(b_hashes.begin(), b_hashes.begin() + 5);
+    for (int i = 0; i < 5; i++)
+        a_only.push_back(common[i]);
+
+    auto a = std::make_shared<fingerprint_set>(a_hashes);
+    fingerprint_set b{b_hashes};
+    session s{a};
+    auto bytes = reconcile(s, b);
+
+    std::set<std::string> extra{s.extra().begin(), s.extra().end()};
+    CHECK(extra == std::set<std::string>{a_only.begin(), a_only.end()});
+
+    std::set<uint64_t> missing{s.missing().begin(), s.missing().end()}, expected;
+    for (auto& h : b_only)
+        expected.insert(fingerprint(h));
+    CHECK(missing == expected);
+
+    // The exchange scales with the difference, not the set size (50000 fingerprints alone would be
+    // 400kB).
+    CHECK(bytes < 40'000);
+}
+
+TEST_CASE("reconcile - empty side", "[reconcile]") {
+    auto a = std::make_shared<fingerprint_set>(std::vector<std::string>{});
+    fingerprint_set b{make_hashes(300, "x")};
+    session s{a};
+    reconcile(s, b);
+    CHECK(s.missing().size() == 300);
+    CHECK(s.extra().empty());
+
+    auto c = std::make_shared<fingerprint_set>(make_hashes(300, "x"));
+    session s2{c};
+    reconcile(s2, fingerprint_set{std::vector<std::string>{}});
+    CHECK(s2.missing().empty());
+    CHECK(s2.extra().size() == 300);
+}
+
+TEST_CASE("reconcile - leaf replies are bounded", "[reconcile]") {
+    // A new node (with nothing) reconciling against a large one doesn't get every fingerprint in a
+    // single reply: the responder keeps splitting until its own share of a range is small.
+    auto empty = std::make_shared<fingerprint_set>(std::vector<std::string>{});
+    fingerprint_set big{make_hashes(100'000, "big")};
+
+    auto first = respond(big, session{empty}.next_queries());
+    REQUIRE(first.size() == 1);
+    CHECK(first[0].k == reply::kind::split);
+
+    session s{empty};
+    size_t largest_leaf = 0, largest_reply = 0;
+    while (!s.done()) {
+        auto queries = s.next_queries();
+        auto replies = respond(big, queries);
+        for (auto& r : replies)
+            largest_leaf = std::max(largest_leaf, r.fps.size());
+        largest_reply = std::max(largest_reply, encode(replies).size());
+        s.process(queries, replies);
+    }
+    CHECK(s.missing().size() == 100'000);
+    CHECK(largest_leaf <= LEAF_SIZE);
+    CHECK(largest_reply <= MAX_RANGES * (LEAF_SIZE + 1) * sizeof(uint64_t));
+
+    // The other way around the responder has nothing, so it can answer with an (empty) leaf
+    auto all = std::make_shared<fingerprint_set>(make_hashes(1000, "big"));
+    auto rep = respond(fingerprint_set{std::vector<std::string>{}}, session{all}.next_queries());
+    REQUIRE(rep.size() == 1);
+    CHECK(rep[0].k == reply::kind::leaf);
+    CHECK(rep[0].fps.empty());
+}
+
+TEST_CASE("reconcile - malformed data", "[reconcile]") {
+    CHECK_THROWS_AS(decode_queries("1234567"), std::invalid_argument);
+    CHECK_THROWS_AS(decode_fingerprints("123456789"), std::invalid_argument);
+
+    // A leaf reply claiming more fingerprints than it contains
+    std::string bad = encode(std::vector<uint64_t>{(5 << 2) | 2, 1, 2});
+    CHECK_THROWS_AS(decode_replies(bad), std::invalid_argument);
+    // Invalid type
+    CHECK_THROWS_AS(decode_replies(encode(std::vector<uint64_t>{3})), std::invalid_argument);
+
+    // Replies that don't match the queries
+    auto a = std::make_shared<fingerprint_set>(make_hashes(10, "m"));
+    session s{a};
+    auto queries = s.next_queries();
+    CHECK_THROWS_AS(s.process(queries, {}), std::invalid_argument);
+}
+
+TEST_CASE("reconcile - one run at a time", "[reconcile]") {
+    run_guard guard;
+    auto run = guard.start();
+    REQUIRE(run);
+    CHECK(guard.running());
+    CHECK_FALSE(guard.start());
+
+    // The run stays active while any of its steps (here, a pending callback) still holds it
+    std::function<void()> next_step = [run] {};
+    run.reset();
+    CHECK(guard.running());
+    next_step = nullptr;
+    CHECK_FALSE(guard.running());
+
+    // A run whose fingerprint scan throws (e.g. a transient database error) doesn't stop the next
+    auto failing_scan = [](run_guard::token) -> std::shared_ptr<fingerprint_set> {
+        throw std::runtime_error{"database is locked"};
+    };
+    run = guard.start();
+    REQUIRE(run);
+    CHECK_THROWS_AS(failing_scan(std::move(run)), std::runtime_error);
+    CHECK_FALSE(guard.running());
+    CHECK(guard.start());
+}
@@ -0,0 +1,200 @@
+#include "relay_transfer.h"
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+
+using oxen::relay_transfer;
+using namespace std::literals;
+
+using status = relay_transfer::status;
+
+static std::vector<std::string> batches(std::initializer_list<std::string> b) { return b; }
+
+TEST_CASE("relay transfer - windowed send", "[relay]") {
+    const auto now = relay_transfer::clock::now();
+    relay_transfer t{oxen::sn_record{}, 123, now};
+
+    size_t chunks = 0;
+    int64_t cursor = 0;
+    while (auto read = t.start_read()) {
+        CHECK(read->cursor == cursor);
+        cursor = read->cursor + 10;
+        t.add_chunk(*read, batches({"a", "bc"}), 5, cursor);
+        chunks++;
+    }
+    CHECK(chunks == relay_transfer::WINDOW);
+
+    auto due = t.due(now);
+    REQUIRE(due.size() == 2 * relay_transfer::WINDOW);
+    CHECK(due[0].data == "a");
+    CHECK(due[1].data == "bc");
+    // Already in flight, so not due again
+    CHECK(t.due(now).empty());
+
+    // Acking the second chunk doesn't move the resume point until the first is also done
+    auto c0 = due[0].chunk, c1 = due[2].chunk;
+    t.acked(c1, 0, now);
+    t.acked(c1, 1, now);
+    CHECK(t.acked_cursor() == 0);
+    CHECK_FALSE(t.wants_chunk());
+    t.acked(c0, 0, now);
+    CHECK(t.acked_cursor() == 0);
+    t.acked(c0, 1, now);
+    CHECK(t.acked_cursor() == 20);
+    CHECK(t.stats().messages_acked == 10);
+    CHECK(t.stats().bytes_acked == 6);
+
+    // Duplicate acks are ignored
+    t.acked(c0, 1, now);
+    CHECK(t.stats().batches_acked == 4);
+
+    // Two chunks completed, so we have room for two more
+    CHECK(t.wants_chunk());
+    auto read = t.start_read();
+    REQUIRE(read);
+    CHECK(read->cursor == 10 * relay_transfer::WINDOW);
+    t.add_chunk(*read, {}, 0, 50);
+    read = t.start_read();
+    REQUIRE(read);
+    t.read_done(*read, now);
+    CHECK_FALSE(t.wants_chunk());
+
+    for (auto& b : due)
+        if (b.chunk != c0 && b.chunk != c1)
+            t.acked(b.chunk, b.index, now + 1s);
+    CHECK(t.state() == status::done);
+    CHECK(t.acked_cursor() == 50);
+    CHECK(t.stats().messages_acked == 20);
+    CHECK(t.throughput() == Approx(12.0));
+}
+
+TEST_CASE("relay transfer - retries and resume", "[relay]") {
+    auto now = relay_transfer::clock::now();
+    relay_transfer t{oxen::sn_record{}, 123, now};
+
+    auto read = t.start_read();
+    REQUIRE(read);
+    t.add_chunk(*read, batches({"a"}), 1, 10);
+    read = t.start_read();
+    REQUIRE(read);
+    // The second chunk ends part way through the owner after cursor 20
+    t.add_chunk(*read, batches({"b"}), 1, 20, 1234);
+    auto due = t.due(now);
+    REQUIRE(due.size() == 2);
+    t.acked(due[0].chunk, due[0].index, now);
+    CHECK(t.acked_cursor() == 10);
+    CHECK(t.acked_message_cursor() == 0);
+
+    // A read that is in progress when we stall is dropped
+    read = t.start_read();
+    REQUIRE(read);
+
+    // Failures back off exponentially
+    auto failed = due[1];
+    auto backoff = relay_transfer::RETRY_BACKOFF;
+    for (int i = 0; i < relay_transfer::MAX_RETRIES; i++) {
+        t.failed(failed.chunk, failed.index, now);
+        CHECK(t.state() == status::sending);
+        CHECK(t.due(now + backoff - 1ms).empty());
+        now += std::min<relay_transfer::clock::duration>(backoff, relay_transfer::RETRY_BACKOFF_MAX);
+        auto retry = t.due(now);
+        REQUIRE(retry.size() == 1);
+        CHECK(retry[0].data == "b");
+        backoff *= 2;
+    }
+    CHECK(t.stats().retries == relay_transfer::MAX_RETRIES);
+
+    // One failure too many stalls the transfer until the resume delay has passed
+    t.failed(failed.chunk, failed.index, now);
+    CHECK(t.state() == status::stalled);
+    CHECK_FALSE(t.ready(now + relay_transfer::RESUME_DELAY - 1s));
+    CHECK_FALSE(t.wants_chunk());
+
+    // Responses from before the stall are ignored
+    t.acked(failed.chunk, failed.index, now);
+    CHECK(t.stats().batches_acked == 1);
+
+    now += relay_transfer::RESUME_DELAY;
+    CHECK(t.ready(now));
+    CHECK(t.stats().resumes == 1);
+    CHECK(t.wants_chunk());
+    // We resume from the last acknowledged position
+    auto resumed = t.start_read();
+    REQUIRE(resumed);
+    CHECK(resumed->cursor == 10);
+    CHECK(resumed->message_cursor == 0);
+
+    // The read from before the stall completing doesn't affect the resumed transfer
+    t.add_chunk(*read, batches({"stale"}), 1, 30);
+    t.add_chunk(*resumed, batches({"b"}), 1, 20, 1234);
+    due = t.due(now);
+    REQUIRE(due.size() == 1);
+    CHECK(due[0].data == "b");
+    t.acked(due[0].chunk, due[0].index, now);
+    CHECK(t.acked_cursor() == 20);
+    CHECK(t.acked_message_cursor() == 1234);
+}
+
+TEST_CASE("relay transfer - reads", "[relay]") {
+    auto now = relay_transfer::clock::now();
+    relay_transfer t{oxen::sn_record{}, 123, now};
+
+    // Only one read at a time
+    auto read = t.start_read();
+    REQUIRE(read);
+    CHECK_FALSE(t.wants_chunk());
+    CHECK_FALSE(t.start_read());
+
+    // A cancelled read is read again from the same position
+    t.cancel_read(*read);
+    auto again = t.start_read();
+    REQUIRE(again);
+    CHECK(again->id != read->id);
+    CHECK(again->cursor == read->cursor);
+    CHECK(again->message_cursor == read->message_cursor);
+
+    // An owner split across chunks: the next read continues within it
+    t.add_chunk(*again, batches({"a"}), 100, 5, 777);
+    read = t.start_read();
+    REQUIRE(read);
+    CHECK(read->cursor == 5);
+    CHECK(read->message_cursor == 777);
+    t.add_chunk(*read, batches({"b"}), 20, 6);
+    read = t.start_read();
+    REQUIRE(read);
+    CHECK(read->cursor == 6);
+    CHECK(read->message_cursor == 0);
+
+    // A read can't complete an aborted transfer
+    t.abort(now);
+    t.read_done(*read, now);
+    CHECK(t.state() == status::failed);
+    CHECK(t.stats().messages_acked == 0);
+}
+
+TEST_CASE("relay transfer - giving up", "[relay]") {
+    auto now = relay_transfer::clock::now();
+    relay_transfer t{oxen::sn_record{}, 123, now};
+
+    for (int resume = 0; resume <= relay_transfer::MAX_RESUMES; resume++) {
+        REQUIRE(t.ready(now));
+        auto read = t.start_read();
+        REQUIRE(read);
+        t.add_chunk(*read, batches({"a"}), 1, 10);
+        for (int i = 0; i <= relay_transfer::MAX_RETRIES; i++) {
+            now += relay_transfer::RETRY_BACKOFF_MAX;
+            auto due = t.due(now);
+            REQUIRE(due.size() == 1);
+            t.failed(due[0].chunk, due[0].index, now);
+        }
+        now += relay_transfer::RESUME_DELAY;
+    }
+    CHECK(t.state() == status::failed);
+    CHECK(t.finished());
+    CHECK_FALSE(t.ready(now));
+
+    relay_transfer t2{oxen::sn_record{}, 123, now};
+    t2.abort(now);
+    CHECK(t2.state() == status::failed);
+}
@@ -0,0 +1,247 @@
+#include "Database.hpp"
+#include "fixtures.h"
+#include "request_shards.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using oxen::request_shards;
+using oxen::user_pubkey_t;
+using oxen::test::make_pubkey;
+using namespace std::literals;
+
+TEST_CASE("request shards - disabled", "[request-shards]") {
+    request_shards shards;
+    CHECK_FALSE(shards.enabled());
+    CHECK(shards.size() == 0);
+    CHECK(shards.stats().empty());
+}
+
+TEST_CASE("request shards - owner affinity", "[request-shards]") {
+    std::atomic<int> inits = 0;
+    request_shards shards{4, [&inits] { inits++; }};
+    REQUIRE(shards.enabled());
+    REQUIRE(shards.size() == 4);
+
+    std::set<size_t> used;
+    for (int i = 0; i < 100; i++) {
+        auto pk = make_pubkey(i);
+        CHECK(shards.shard_for(pk) == shards.shard_for(make_pubkey(i)));
+        used.insert(shards.shard_for(pk));
+    }
+    CHECK(used.size() == 4);
+
+    // Jobs for an owner run in order, always on the same thread
+    std::mutex m;
+    std::vector<std::pair<int, std::thread::id>> ran;
+    std::promise<void> done;
+    auto pk = make_pubkey(42);
+    for (int i = 0; i < 100; i++)
+        REQUIRE(shards.run(pk, [&, i] {
+            std::lock_guard lock{m};
+            ran.emplace_back(i, std::this_thread::get_id());
+            if (i == 99)
+                done.set_value();
+        }));
+    REQUIRE(done.get_future().wait_for(5s) == std::future_status::ready);
+    REQUIRE(ran.size() == 100);
+    for (int i = 0; i < 100; i++) {
+        CHECK(ran[i].first == i);
+        CHECK(ran[i].second == ran[0].second);
+    }
+    CHECK(ran[0].second != std::this_thread::get_id());
+
+    shards.stop();
+    CHECK(inits == 4);
+    uint64_t jobs = 0;
+    for (auto& s : shards.stats())
+        jobs += s.jobs;
+    CHECK(jobs == 100);
+    CHECK_FALSE(shards.run(pk, [] {}));
+}
+
+TEST_CASE("request shards - full queues", "[request-shards]") {
+    request_shards shards{2};
+    auto pk = make_pubkey(1);
+    int i = 2;
+    while (shards.shard_for(make_pubkey(i)) == shards.shard_for(pk))
+        i++;
+    auto other = make_pubkey(i);
+
+    std::promise<void> started, release;
+    REQUIRE(shards.run(pk, [&] {
+        started.set_value();
+        release.get_future().wait();
+    }));
+    started.get_future().wait();
+
+    for (size_t j = 0; j < request_shards::MAX_QUEUE; j++)
+        REQUIRE(shards.run(pk, [] {}));
+    CHECK_FALSE(shards.run(pk, [] {}));
+    CHECK(shards.stats()[shards.shard_for(pk)].queued == request_shards::MAX_QUEUE);
+
+    // Other shards are unaffected
+    std::promise<void> other_ran;
+    REQUIRE(shards.run(other, [&] { other_ran.set_value(); }));
+    CHECK(other_ran.get_future().wait_for(5s) == std::future_status::ready);
+
+    // Exceptions from a job don't take down the shard
+    release.set_value();
+    std::promise<void> after;
+    while (!shards.run(pk, [] { throw std::runtime_error{"oops"}; }))
+        std::this_thread::sleep_for(1ms);
+    while (!shards.run(pk, [&] { after.set_value(); }))
+        std::this_thread::sleep_for(1ms);
+    CHECK(after.get_future().wait_for(5s) == std::future_status::ready);
+    shards.stop();
+}
+
+TEST_CASE("request shards - jobs dropped at shutdown", "[request-shards]") {
+    request_shards shards{1};
+    auto pk = make_pubkey(1);
+
+    std::promise<void> started, release;
+    REQUIRE(shards.run(pk, [&] {
+        started.set_value();
+        release.get_future().wait();
+    }));
+    started.get_future().wait();
+
+    std::atomic<int> ran = 0, dropped = 0;
+    for (int i = 0; i < 3; i++)
+        REQUIRE(shards.run(pk, [&] { ran++; }, [&] { dropped++; }));
+
+    auto stopped = std::async(std::launch::async, [&] { shards.stop(); });
+    // Wait until the shard is stopping before letting its current job finish
+    while (shards.run(pk, [] {}))
+        std::this_thread::sleep_for(1ms);
+    release.set_value();
+    REQUIRE(stopped.wait_for(5s) == std::future_status::ready);
+
+    // The queued jobs didn't run, but were told that they were dropped
+    CHECK(ran == 0);
+    CHECK(dropped == 3);
+}
+
+namespace {
+
+// The pre-sharding dispatch: any of a pool of worker threads picks up the next job from a single
+// shared queue, using the shared database connection.
+class shared_queue {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> queue;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+
+  public:
+    explicit shared_queue(int count) {
+        for (int i = 0; i < count; i++)
+            threads.emplace_back([this] {
+                std::unique_lock lock{mutex};
+                while (true) {
+                    cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                    if (queue.empty())
+                        return;
+                    auto job = std::move(queue.front());
+                    queue.pop_front();
+                    lock.unlock();
+                    job();
+                    lock.lock();
+                }
+            });
+    }
+    ~shared_queue() {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+    void run(const user_pubkey_t&, std::function<void()> job) {
+        {
+            std::lock_guard lock{mutex};
+            queue.push_back(std::move(job));
+        }
+        cv.notify_one();
+    }
+};
+
+// Simulates a burst of client traffic: each of `owners` owners stores a message and then
+// retrieves its messages, `rounds` times over, with the requests submitted to `dispatch`.
+// Returns once every request has been processed.
+template <typename Dispatcher>
+int64_t client_traffic(oxen::Database& db, Dispatcher& dispatch,
+        const std::vector<user_pubkey_t>& owners, int rounds) {
+    struct progress {
+        std::atomic<int64_t> retrieved = 0;
+        std::atomic<int> remaining;
+        std::promise<void> done;
+        void finished() {
+            if (--remaining == 0)
+                done.set_value();
+        }
+    };
+    auto p = std::make_shared<progress>();
+    p->remaining = static_cast<int>(owners.size()) * rounds * 2;
+    auto done = p->done.get_future();
+
+    static std::atomic<int64_t> counter = 0;
+    auto now = std::chrono::system_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (auto& pk : owners) {
+            dispatch.run(pk, [&db, p, pk, now, n = counter++] {
+                db.store({pk, "h" + std::to_string(n), now, now + 1h, std::string(100, 'x')});
+                p->finished();
+            });
+            dispatch.run(pk, [&db, p, pk] {
+                p->retrieved += db.retrieve(pk, "", 10).size();
+                p->finished();
+            });
+        }
+    }
+    done.wait();
+    return p->retrieved;
+}
+
+} // namespace
+
+// Compares pushing client-like store/retrieve traffic through a shared worker queue (as the
+// https/omq workers do) against the per-owner shards.
+TEST_CASE("request shards - dispatch performance", "[.][bench][request-shards]") {
+    std::filesystem::remove("storage.db");
+    oxen::Database db{"."};
+
+    std::vector<user_pubkey_t> owners;
+    for (int i = 0; i < 200; i++)
+        owners.push_back(make_pubkey(i));
+
+    const int threads = 4;
+    shared_queue shared{threads};
+    request_shards sharded{threads, [&db] { db.use_thread_reader(); }};
+
+    BENCHMARK("shared queue, 200 owners x 5 rounds") {
+        return client_traffic(db, shared, owners, 5);
+    };
+    BENCHMARK("owner shards, 200 owners x 5 rounds") {
+        return client_traffic(db, sharded, owners, 5);
+    };
+
+    sharded.stop();
+    std::filesystem::remove("storage.db");
+}
@@ -0,0 +1,129 @@
+#include "fixtures.h"
+#include "retrieve_flights.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using oxen::retrieve_flights;
+using oxen::test::make_pubkey;
+
+namespace {
+struct bodies {
+    std::vector<std::shared_ptr<const std::string>> got;
+    retrieve_flights::callback cb() {
+        return [this](auto body) { got.push_back(std::move(body)); };
+    }
+};
+} // namespace
+
+TEST_CASE("retrieve flights - coalescing", "[retrieve-flights]") {
+    retrieve_flights flights;
+    bodies b;
+    auto pk = make_pubkey(1);
+
+    auto f = flights.join(pk, "", true, b.cb());
+    REQUIRE(f);
+    CHECK_FALSE(flights.join(pk, "", true, b.cb()));
+    CHECK_FALSE(flights.join(pk, "", true, b.cb()));
+
+    // Different last_hash, encoding or owner aren't the same retrieve
+    auto f2 = flights.join(pk, "abc", true, b.cb());
+    auto f3 = flights.join(pk, "", false, b.cb());
+    auto f4 = flights.join(make_pubkey(2), "", true, b.cb());
+    CHECK(f2);
+    CHECK(f3);
+    CHECK(f4);
+    CHECK(b.got.empty());
+
+    auto body = std::make_shared<const std::string>("{\"messages\":[]");
+    flights.finish(f, body);
+    REQUIRE(b.got.size() == 3);
+    for (auto& g : b.got)
+        CHECK(g == body);
+
+    // Once finished, the next one starts a new retrieve
+    CHECK(flights.join(pk, "", true, b.cb()));
+
+    // Failures are shared too
+    CHECK_FALSE(flights.join(pk, "abc", true, b.cb()));
+    flights.finish(f2, nullptr);
+    REQUIRE(b.got.size() == 5);
+    CHECK_FALSE(b.got[3]);
+    CHECK_FALSE(b.got[4]);
+
+    CHECK(flights.executed() == 5);
+    CHECK(flights.coalesced() == 3);
+}
+
+TEST_CASE("retrieve flights - invalidation", "[retrieve-flights]") {
+    retrieve_flights flights;
+    bodies b;
+    auto pk = make_pubkey(1), other = make_pubkey(2);
+
+    auto f = flights.join(pk, "", true, b.cb());
+    auto o = flights.join(other, "", true, b.cb());
+    CHECK_FALSE(flights.join(pk, "", true, b.cb()));
+
+    // After a write for pk, new retrieves for it don't join the one in progress (which may not
+    // include the change), but those already waiting still get its reply
+    flights.invalidate(pk);
+    auto f2 = flights.join(pk, "", true, b.cb());
+    REQUIRE(f2);
+    CHECK(f2 != f);
+    CHECK_FALSE(flights.join(other, "", true, b.cb()));
+
+    auto old_body = std::make_shared<const std::string>("old");
+    flights.finish(f, old_body);
+    REQUIRE(b.got.size() == 2);
+    CHECK(b.got[0] == old_body);
+    CHECK(b.got[1] == old_body);
+
+    // The newer one is unaffected by the older one finishing
+    CHECK_FALSE(flights.join(pk, "", true, b.cb()));
+    flights.finish(f2, std::make_shared<const std::string>("new"));
+    REQUIRE(b.got.size() == 4);
+    CHECK(*b.got[2] == "new");
+    CHECK(*b.got[3] == "new");
+
+    flights.invalidate_all();
+    CHECK(flights.join(other, "", true, b.cb()));
+    flights.finish(o, nullptr);
+    CHECK(b.got.size() == 6);
+}
+
+TEST_CASE("retrieve flights - concurrent retrieves", "[retrieve-flights]") {
+    retrieve_flights flights;
+    auto pk = make_pubkey(1);
+    std::atomic<int> replies = 0, failed = 0, executed = 0;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++)
+        threads.emplace_back([&] {
+            for (int i = 0; i < 1000; i++) {
+                auto f = flights.join(pk, "", true, [&](auto body) {
+                    if (!body || *body != "body")
+                        failed++;
+                    replies++;
+                });
+                if (f) {
+                    executed++;
+                    std::this_thread::yield();
+                    flights.finish(f, std::make_shared<const std::string>("body"));
+                }
+                if (i % 100 == 0)
+                    flights.invalidate(pk);
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+
+    CHECK(replies == 8000);
+    CHECK(failed == 0);
+    CHECK(flights.executed() == uint64_t(executed));
+    CHECK(flights.executed() + flights.coalesced() == 8000);
+}
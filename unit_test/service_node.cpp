@@ -1,13 +1,23 @@
 #include <catch2/catch.hpp>
 #include <iostream>
 
+#include "omq_server.h"
 #include "oxend_key.h"
 #include "request_handler.h"
+#include "serialization.h"
+#include "service_node.h"
 #include "swarm.h"
 #include "time.hpp"
 
+#include <nlohmann/json.hpp>
 #include <oxenmq/base64.h>
 
+#include <atomic>
+#include <filesystem>
+#include <limits>
+#include <random>
+#include <thread>
+
 using namespace std::literals;
 
 static auto create_dummy_sn_record() -> oxen::sn_record {
@@ -115,3 +125,457 @@ TEST_CASE("service nodes - pubkey to swarm id") {
     REQUIRE(pk.load("050000000000000000000000000000000000000000000000000123456789abcdef"));
     CHECK(pubkey_to_swarm_space(pk) == 0x0123456789abcdefULL);
 }
+
+TEST_CASE("service nodes - swarm snapshots", "[service-nodes][swarm]") {
+    using oxen::sn_record;
+    using oxen::SwarmInfo;
+
+    auto me = create_dummy_sn_record();
+    auto peer = create_dummy_sn_record();
+    peer.pubkey_legacy = oxen::legacy_pubkey::from_hex(
+        "ff0e73449f6656cfe7816fa00d850af1f45884eab9e404026ca51f54b045e385");
+
+    oxen::Swarm swarm{me};
+    auto before = swarm.snapshot();
+    REQUIRE(before);
+    CHECK_FALSE(before->is_valid());
+
+    std::vector<SwarmInfo> swarms{{123, {me, peer}}};
+    auto events = swarm.derive_swarm_events(swarms);
+    REQUIRE(events.our_swarm_id == 123);
+    swarm.set_swarm_id(events.our_swarm_id);
+    swarm.update_state(swarms, {}, events, true);
+
+    // Nothing is visible until the update is published
+    CHECK(swarm.snapshot() == before);
+    CHECK_FALSE(swarm.find_node(peer.pubkey_legacy));
+
+    swarm.publish();
+    auto after = swarm.snapshot();
+    CHECK(after != before);
+    CHECK(after->is_valid());
+    CHECK(after->swarm_id == 123);
+    CHECK(after->swarm_peers == std::vector<sn_record>{peer});
+    CHECK(swarm.find_node(peer.pubkey_legacy));
+
+    oxen::user_pubkey_t pk;
+    REQUIRE(pk.load("05ffba630924aa1224bb930dde21c0d11bf004608f2812217f8ac812d6c7e3ad48"));
+    CHECK(swarm.is_pubkey_for_us(pk));
+
+    // Old snapshots remain intact for anyone still holding them
+    CHECK_FALSE(before->is_valid());
+    CHECK(before->all_funded_nodes.empty());
+
+    // Snapshots are cached per thread; that mustn't mix up different Swarms, nor hide a publish
+    // from other threads
+    oxen::Swarm other{me};
+    CHECK_FALSE(other.snapshot()->is_valid());
+    CHECK(swarm.snapshot() == after);
+    other.set_swarm_id(456);
+    other.publish();
+    CHECK(other.snapshot()->swarm_id == 456);
+    CHECK(swarm.snapshot() == after);
+
+    std::shared_ptr<const oxen::SwarmState> seen;
+    std::thread{[&] { seen = swarm.snapshot(); }}.join();
+    CHECK(seen == after);
+    swarm.set_swarm_id(789);
+    swarm.publish();
+    auto latest = swarm.snapshot();
+    CHECK(latest->swarm_id == 789);
+    std::thread{[&] { seen = swarm.snapshot(); }}.join();
+    CHECK(seen == latest);
+}
+
+TEST_CASE("service nodes - swarm update deltas", "[service-nodes][swarm]") {
+    using oxen::sn_record;
+    using oxen::SwarmInfo;
+
+    auto me = create_dummy_sn_record();
+    auto peer = create_dummy_sn_record();
+    peer.pubkey_legacy = oxen::legacy_pubkey::from_hex(
+        "ff0e73449f6656cfe7816fa00d850af1f45884eab9e404026ca51f54b045e385");
+    peer.pubkey_ed25519 = oxen::ed25519_pubkey::from_hex(
+        "ff8418ae9af2fedb560f400953f91cefb91a7a7efc971edfa31744ce5c4e319a");
+    peer.pubkey_x25519 = oxen::x25519_pubkey::from_hex(
+        "ffab11bed0e6219e1f3aea9b9e33f89cf636d5db203ed4efb9090cdb15902414");
+    auto other = create_dummy_sn_record();
+    other.pubkey_legacy = oxen::legacy_pubkey::from_hex(
+        "ee0e73449f6656cfe7816fa00d850af1f45884eab9e404026ca51f54b045e385");
+    other.pubkey_ed25519 = oxen::ed25519_pubkey::from_hex(
+        "ee8418ae9af2fedb560f400953f91cefb91a7a7efc971edfa31744ce5c4e319a");
+    other.pubkey_x25519 = oxen::x25519_pubkey::from_hex(
+        "eeab11bed0e6219e1f3aea9b9e33f89cf636d5db203ed4efb9090cdb15902414");
+
+    oxen::Swarm swarm{me};
+    auto update = [&](const std::vector<SwarmInfo>& swarms,
+                      const std::vector<sn_record>& decomm = {}) {
+        auto events = swarm.derive_swarm_events(swarms);
+        swarm.set_swarm_id(events.our_swarm_id);
+        swarm.update_state(swarms, decomm, events, true);
+        swarm.publish();
+        return events;
+    };
+
+    update({{100, {me, peer}}});
+    auto first = swarm.snapshot();
+    REQUIRE(first->all_funded_nodes.size() == 2);
+
+    // An identical update doesn't publish anything new
+    auto events = update({{100, {me, peer}}});
+    CHECK(events.new_snodes.empty());
+    CHECK(events.new_swarms.empty());
+    CHECK(swarm.snapshot() == first);
+
+    // New swarm and new swarm member
+    events = update({{100, {me, peer, other}}, {200, {}}});
+    CHECK(events.new_snodes == std::vector<sn_record>{other});
+    CHECK(events.new_swarms == std::vector<oxen::swarm_id_t>{200});
+    auto second = swarm.snapshot();
+    CHECK(second != first);
+    CHECK(second->all_funded_nodes.size() == 3);
+    CHECK(swarm.find_node(other.pubkey_ed25519));
+
+    // Changed address and key of an existing node
+    other.ip = "1.2.3.4";
+    auto old_ed = other.pubkey_ed25519;
+    other.pubkey_ed25519 = oxen::ed25519_pubkey::from_hex(
+        "dd8418ae9af2fedb560f400953f91cefb91a7a7efc971edfa31744ce5c4e319a");
+    update({{100, {me, peer}}, {200, {}}}, {other});
+    auto third = swarm.snapshot();
+    CHECK(third != second);
+    REQUIRE(swarm.find_node(other.pubkey_legacy));
+    CHECK(swarm.find_node(other.pubkey_legacy)->ip == "1.2.3.4");
+    CHECK_FALSE(swarm.find_node(old_ed));
+    CHECK(swarm.find_node(other.pubkey_ed25519));
+    CHECK(third->swarm_peers == std::vector<sn_record>{peer});
+
+    // Deregistered node
+    update({{100, {me, peer}}, {200, {}}});
+    auto fourth = swarm.snapshot();
+    CHECK(fourth->all_funded_nodes.size() == 2);
+    CHECK_FALSE(swarm.find_node(other.pubkey_legacy));
+    CHECK_FALSE(swarm.find_node(other.pubkey_ed25519));
+    CHECK(fourth->all_funded_ed25519.size() == 2);
+    CHECK(fourth->all_funded_x25519.size() == 2);
+    CHECK(third->find_node(other.pubkey_legacy)); // Still in the old snapshot
+}
+
+// Straightforward linear scan for the nearest swarm (wrapping around the ends of the ring) to check
+// get_swarm_by_pk against.
+static oxen::swarm_id_t nearest_swarm_linear(
+        const std::vector<oxen::SwarmInfo>& swarms, const oxen::user_pubkey_t& pk) {
+    constexpr auto MAX_ID = oxen::INVALID_SWARM_ID - 1;
+    const uint64_t res = oxen::pubkey_to_swarm_space(pk);
+    oxen::swarm_id_t best = oxen::INVALID_SWARM_ID;
+    uint64_t best_dist = std::numeric_limits<uint64_t>::max();
+    for (const auto& si : swarms) {
+        uint64_t dist = si.swarm_id > res ? si.swarm_id - res : res - si.swarm_id;
+        uint64_t wrap = si.swarm_id > res
+            ? res + (MAX_ID - si.swarm_id)
+            : (MAX_ID - res) + si.swarm_id;
+        if (wrap < dist)
+            dist = wrap;
+        if (dist < best_dist) {
+            best = si.swarm_id;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+static std::vector<oxen::SwarmInfo> random_swarms(size_t count, std::mt19937_64& rng) {
+    std::vector<oxen::SwarmInfo> swarms(count);
+    for (auto& si : swarms)
+        si.swarm_id = rng() % oxen::INVALID_SWARM_ID;
+    std::sort(swarms.begin(), swarms.end(),
+            [](const auto& a, const auto& b) { return a.swarm_id < b.swarm_id; });
+    return swarms;
+}
+
+static oxen::user_pubkey_t random_pubkey(std::mt19937_64& rng) {
+    std::string raw(33, '\x05');
+    for (size_t i = 1; i < raw.size(); i++)
+        raw[i] = static_cast<char>(rng());
+    oxen::user_pubkey_t pk;
+    pk.load(raw);
+    return pk;
+}
+
+TEST_CASE("service nodes - swarm lookup", "[service-nodes][swarm]") {
+    std::mt19937_64 rng{12345};
+    oxen::user_pubkey_t pk;
+
+    CHECK(oxen::get_swarm_by_pk({}, random_pubkey(rng)).swarm_id == oxen::INVALID_SWARM_ID);
+
+    // pubkey_to_swarm_space of these is 0 and 0x0123456789abcdef
+    oxen::user_pubkey_t zero, mid;
+    REQUIRE(zero.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(mid.load("050000000000000000000000000000000000000000000000000123456789abcdef"));
+
+    std::vector<oxen::SwarmInfo> swarms{
+        {98, {}}, {0x0123456789abcdefULL, {}}, {oxen::INVALID_SWARM_ID - 100, {}}};
+    CHECK(oxen::get_swarm_by_pk(swarms, mid).swarm_id == 0x0123456789abcdefULL);
+    // The top swarm is 99 away from 0 (by wrapping around the ring), so 98 is closer but 100 isn't:
+    CHECK(oxen::get_swarm_by_pk(swarms, zero).swarm_id == 98);
+    swarms.front().swarm_id = 100;
+    CHECK(oxen::get_swarm_by_pk(swarms, zero).swarm_id == oxen::INVALID_SWARM_ID - 100);
+
+    // The dummy swarm is never returned
+    swarms = {{oxen::INVALID_SWARM_ID, {}}};
+    CHECK(oxen::get_swarm_by_pk(swarms, zero).swarm_id == oxen::INVALID_SWARM_ID);
+    swarms = {{1000, {}}, {oxen::INVALID_SWARM_ID, {}}};
+    CHECK(oxen::get_swarm_by_pk(swarms, zero).swarm_id == 1000);
+
+    for (size_t count : {1, 2, 3, 10, 1000}) {
+        swarms = random_swarms(count, rng);
+        for (int i = 0; i < 1000; i++) {
+            pk = random_pubkey(rng);
+            REQUIRE(oxen::get_swarm_by_pk(swarms, pk).swarm_id == nearest_swarm_linear(swarms, pk));
+        }
+    }
+}
+
+TEST_CASE("service nodes - swarm lookup performance", "[.][bench][service-nodes]") {
+    std::mt19937_64 rng{42};
+    auto swarms = random_swarms(1500, rng);
+    std::vector<oxen::user_pubkey_t> pks;
+    for (int i = 0; i < 256; i++)
+        pks.push_back(random_pubkey(rng));
+
+    size_t i = 0;
+    BENCHMARK("get_swarm_by_pk, 1500 swarms") {
+        return oxen::get_swarm_by_pk(swarms, pks[i++ % pks.size()]).swarm_id;
+    };
+    BENCHMARK("linear scan, 1500 swarms") {
+        return nearest_swarm_linear(swarms, pks[i++ % pks.size()]);
+    };
+}
+
+static std::string random_hex(std::mt19937_64& rng, size_t bytes = 32) {
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string hex(2 * bytes, '0');
+    for (auto& c : hex)
+        c = digits[rng() % 16];
+    return hex;
+}
+
+// Builds a get_service_nodes response like oxend's with `count` nodes in swarms of about 5
+static nlohmann::json make_sn_response(size_t count, std::mt19937_64& rng) {
+    auto states = nlohmann::json::array();
+    std::vector<oxen::swarm_id_t> swarm_ids(count / 5 + 1);
+    for (auto& id : swarm_ids)
+        id = rng() % oxen::INVALID_SWARM_ID;
+    for (size_t i = 0; i < count; i++) {
+        states.push_back({
+            {"service_node_pubkey", random_hex(rng)},
+            {"pubkey_x25519", random_hex(rng)},
+            {"pubkey_ed25519", random_hex(rng)},
+            {"public_ip", "10.1." + std::to_string(i / 256) + "." + std::to_string(i % 256)},
+            {"storage_port", 22021},
+            {"storage_lmq_port", 22020},
+            {"swarm_id", i % 50 == 49 ? oxen::INVALID_SWARM_ID : swarm_ids[i % swarm_ids.size()]},
+            {"funded", true}});
+    }
+    return {
+        {"height", 123456},
+        {"block_hash", random_hex(rng)},
+        {"hardfork", 18},
+        {"snode_revision", 1},
+        {"status", "OK"},
+        {"service_node_states", std::move(states)}};
+}
+
+TEST_CASE("service nodes - parse swarm update", "[service-nodes][swarm]") {
+    using namespace oxen;
+    auto me = create_dummy_sn_record();
+
+    auto sn_json = [&](const sn_record& sn, swarm_id_t swarm, bool funded = true) {
+        return nlohmann::json{
+            {"service_node_pubkey", sn.pubkey_legacy.hex()},
+            {"pubkey_x25519", sn.pubkey_x25519.hex()},
+            {"pubkey_ed25519", sn.pubkey_ed25519.hex()},
+            {"public_ip", sn.ip},
+            {"storage_port", sn.port},
+            {"storage_lmq_port", sn.omq_port},
+            {"swarm_id", swarm},
+            {"funded", funded},
+            {"ignored", {{"nested", {1, 2, 3}}}}};
+    };
+    auto other = me;
+    other.pubkey_legacy = legacy_pubkey::from_hex(
+        "ff0e73449f6656cfe7816fa00d850af1f45884eab9e404026ca51f54b045e385");
+    other.ip = "1.2.3.4";
+    auto unfunded = me;
+    unfunded.pubkey_legacy = legacy_pubkey::from_hex(
+        "ee0e73449f6656cfe7816fa00d850af1f45884eab9e404026ca51f54b045e385");
+    auto no_keys = sn_json(unfunded, 7);
+    no_keys["pubkey_x25519"] = "";
+    no_keys["pubkey_ed25519"] = "";
+
+    nlohmann::json response{
+        {"height", 1000},
+        {"block_hash", "abcd"},
+        {"hardfork", 18},
+        {"snode_revision", 1},
+        {"service_node_states", {
+            sn_json(me, 200), sn_json(other, INVALID_SWARM_ID), sn_json(unfunded, 7, false),
+            no_keys, sn_json(other, 100)}}};
+
+    auto check = [&](const block_update& bu) {
+        CHECK(bu.height == 1000);
+        CHECK(bu.block_hash == "abcd");
+        CHECK(bu.hardfork == 18);
+        CHECK(bu.snode_revision == 1);
+        CHECK_FALSE(bu.unchanged);
+        REQUIRE(bu.swarms.size() == 2);
+        CHECK(bu.swarms[0].swarm_id == 100);
+        REQUIRE(bu.swarms[0].snodes.size() == 1);
+        CHECK(bu.swarms[0].snodes[0].pubkey_legacy == other.pubkey_legacy);
+        CHECK(bu.swarms[0].snodes[0].ip == "1.2.3.4");
+        CHECK(bu.swarms[1].swarm_id == 200);
+        REQUIRE(bu.swarms[1].snodes.size() == 1);
+        CHECK(bu.swarms[1].snodes[0].pubkey_legacy == me.pubkey_legacy);
+        CHECK(bu.swarms[1].snodes[0].pubkey_x25519 == me.pubkey_x25519);
+        CHECK(bu.swarms[1].snodes[0].pubkey_ed25519 == me.pubkey_ed25519);
+        CHECK(bu.swarms[1].snodes[0].port == me.port);
+        CHECK(bu.swarms[1].snodes[0].omq_port == me.omq_port);
+        REQUIRE(bu.decommissioned_nodes.size() == 1);
+        CHECK(bu.decommissioned_nodes[0].pubkey_legacy == other.pubkey_legacy);
+        CHECK(bu.active_x25519_pubkeys.size() == 1);
+    };
+
+    check(parse_swarm_update(response.dump()));
+
+    sn_list_cache cache;
+    check(parse_swarm_update(response.dump(), &cache));
+    CHECK(cache.valid);
+    auto hash = cache.hash;
+
+    // Same list on a new block: comes from the cache
+    response["height"] = 1001;
+    response["block_hash"] = "ef01";
+    cache.swarms[0].snodes[0].ip = "5.6.7.8";
+    auto bu = parse_swarm_update(response.dump(), &cache);
+    CHECK(bu.height == 1001);
+    CHECK(bu.block_hash == "ef01");
+    REQUIRE(bu.swarms.size() == 2);
+    CHECK(bu.swarms[0].snodes[0].ip == "5.6.7.8");
+
+    // A changed list gets parsed (and re-cached)
+    response["service_node_states"].erase(0);
+    bu = parse_swarm_update(response.dump(), &cache);
+    CHECK(cache.hash != hash);
+    REQUIRE(bu.swarms.size() == 1);
+    CHECK(bu.swarms[0].snodes[0].ip == "1.2.3.4");
+    CHECK(cache.swarms[0].snodes[0].ip == "1.2.3.4");
+
+    bu = parse_swarm_update(
+            R"({"height":1001,"block_hash":"ef01","hardfork":18,"unchanged":true})", &cache);
+    CHECK(bu.unchanged);
+    CHECK(bu.swarms.empty());
+
+    CHECK_THROWS(parse_swarm_update(""));
+    CHECK_THROWS(parse_swarm_update("{\"height\":"));
+    CHECK_THROWS(parse_swarm_update(R"({"height":1,"block_hash":"ab","hardfork":18})"));
+    response["service_node_states"][0].erase("swarm_id");
+    CHECK_THROWS(parse_swarm_update(response.dump()));
+    response["service_node_states"][0]["swarm_id"] = "123";
+    CHECK_THROWS(parse_swarm_update(response.dump()));
+}
+
+TEST_CASE("service nodes - saved swarm serialization", "[service-nodes][swarm]") {
+    std::mt19937_64 rng{7};
+    auto bu = oxen::parse_swarm_update(make_sn_response(100, rng).dump());
+    REQUIRE(bu.swarms.size() > 1);
+    REQUIRE(bu.decommissioned_nodes.size() == 2);
+
+    oxen::block_update loaded;
+    oxen::deserialize_swarms(oxen::serialize_swarms(bu), loaded);
+
+    REQUIRE(loaded.swarms.size() == bu.swarms.size());
+    for (size_t i = 0; i < bu.swarms.size(); i++) {
+        CHECK(loaded.swarms[i].swarm_id == bu.swarms[i].swarm_id);
+        REQUIRE(loaded.swarms[i].snodes.size() == bu.swarms[i].snodes.size());
+        for (size_t j = 0; j < bu.swarms[i].snodes.size(); j++) {
+            auto& a = loaded.swarms[i].snodes[j];
+            auto& b = bu.swarms[i].snodes[j];
+            CHECK(a.pubkey_legacy == b.pubkey_legacy);
+            CHECK(a.pubkey_ed25519 == b.pubkey_ed25519);
+            CHECK(a.pubkey_x25519 == b.pubkey_x25519);
+            CHECK(a.ip == b.ip);
+            CHECK(a.port == b.port);
+            CHECK(a.omq_port == b.omq_port);
+        }
+    }
+    CHECK(loaded.decommissioned_nodes == bu.decommissioned_nodes);
+    CHECK(loaded.active_x25519_pubkeys == bu.active_x25519_pubkeys);
+
+    CHECK_THROWS(oxen::deserialize_swarms("{}", loaded));
+    CHECK_THROWS(oxen::deserialize_swarms("not json", loaded));
+}
+
+TEST_CASE("service nodes - parse swarm update performance", "[.][bench][service-nodes]") {
+    std::mt19937_64 rng{42};
+    auto response = make_sn_response(2000, rng).dump();
+    oxen::sn_list_cache cache;
+    oxen::parse_swarm_update(response, &cache);
+
+    BENCHMARK("json DOM parse, 2000 nodes") {
+        return nlohmann::json::parse(response).size();
+    };
+    BENCHMARK("parse_swarm_update, 2000 nodes") {
+        return oxen::parse_swarm_update(response).swarms.size();
+    };
+    BENCHMARK("parse_swarm_update, 2000 nodes, unchanged list") {
+        return oxen::parse_swarm_update(response, &cache).swarms.size();
+    };
+}
+
+// Measures the latency of the request-path swarm lookups while other threads are continuously
+// bulk-storing pushed message batches, i.e. how much the database writes stall client requests.
+TEST_CASE("service nodes - swarm lookup contention", "[.][bench][service-nodes]") {
+    std::filesystem::remove("storage.db");
+
+    auto me = create_dummy_sn_record();
+    oxen::OxenmqServer omq{me, oxen::x25519_seckey{}, {},
+            oxen::thread_counts{}.resolve(std::thread::hardware_concurrency())};
+    oxen::ServiceNode sn{me, oxen::legacy_seckey{}, omq, ".", true /*force start*/};
+
+    oxen::user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    // Pre-serialize some batches of 2000 x 1kB messages for the writer threads to push
+    std::vector<std::string> batches;
+    auto now = std::chrono::system_clock::now();
+    for (int b = 0; b < 10; b++) {
+        std::vector<oxen::message> msgs;
+        for (int i = 0; i < 2000; i++)
+            msgs.emplace_back(pk, "hash-" + std::to_string(b) + "-" + std::to_string(i),
+                    now, now + 1h, std::string(1000, 'x'));
+        for (auto& batch : serialize_messages(msgs.begin(), msgs.end(), oxen::SERIALIZATION_VERSION_BT))
+            batches.push_back(std::move(batch));
+    }
+
+    std::atomic<bool> done = false;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 2; t++)
+        writers.emplace_back([&, t] {
+            for (size_t i = t; !done; i++)
+                sn.process_push_batch(batches[i % batches.size()]);
+        });
+
+    BENCHMARK("is_pubkey_for_us during bulk stores") {
+        return sn.is_pubkey_for_us(pk);
+    };
+
+    BENCHMARK("swarm lookup during bulk stores") {
+        return oxen::get_swarm_by_pk(sn.swarm_state()->all_valid_swarms, pk).swarm_id;
+    };
+
+    done = true;
+    for (auto& w : writers)
+        w.join();
+
+    std::filesystem::remove("storage.db");
+}
@@ -3,6 +3,7 @@
 
 #include "oxen_logger.h"
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
 #include <iostream>
@@ -266,6 +267,68 @@ TEST_CASE("storage - bulk storage with overlap", "[storage]") {
     }
 }
 
+TEST_CASE("storage - batch storage", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("051111111111111111111111111111111111111111111111111111111111111111"));
+    const auto ttl = 123456ms;
+    const auto timestamp = std::chrono::system_clock::now();
+
+    Database storage{"."};
+
+    CHECK(storage.store({pubkey1, "b", timestamp, timestamp + ttl, "data"}));
+
+    std::vector<message> items;
+    items.emplace_back(pubkey1, "a", timestamp, timestamp + ttl, "data");
+    items.emplace_back(pubkey1, "b", timestamp, timestamp + ttl, "data");
+    items.emplace_back(pubkey2, "c", timestamp, timestamp + ttl, "data");
+    items.emplace_back(pubkey2, "a", timestamp, timestamp + ttl, "data");
+
+    auto results = storage.store_batch(items);
+    REQUIRE(results.size() == 4);
+    CHECK(results[0] == true);
+    CHECK(results[1] == false); // Already stored
+    CHECK(results[2] == true);
+    CHECK(results[3] == false); // Same hash as the first one
+
+    CHECK(storage.get_owner_count() == 2);
+    CHECK(storage.get_message_count() == 3);
+    CHECK(storage.retrieve(pubkey2, "").size() == 1);
+
+    CHECK(storage.store_batch({}).empty());
+}
+
+TEST_CASE("storage - thread reader connections", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto timestamp = std::chrono::system_clock::now();
+
+    Database storage{"."};
+    CHECK(storage.store({pubkey, "a", timestamp, timestamp + 1h, "data"}));
+
+    std::thread reader{[&] {
+        storage.use_thread_reader();
+        storage.use_thread_reader(); // Does nothing if we already have one
+        CHECK(storage.retrieve(pubkey, "").size() == 1);
+
+        // Sees stores (and deletes) made on the shared connection, including from this thread
+        CHECK(storage.store({pubkey, "b", timestamp, timestamp + 1h, "data"}));
+        auto msgs = storage.retrieve(pubkey, "a");
+        REQUIRE(msgs.size() == 1);
+        CHECK(msgs[0].hash == "b");
+        CHECK(storage.delete_all(pubkey).size() == 2);
+        CHECK(storage.retrieve(pubkey, "").empty());
+    }};
+    reader.join();
+
+    CHECK(storage.store({pubkey, "c", timestamp, timestamp + 1h, "data"}));
+    CHECK(storage.retrieve(pubkey, "").size() == 1);
+}
+
 TEST_CASE("storage - retrieve limit", "[storage]") {
     StorageDeleter fixture;
 
@@ -300,3 +363,239 @@ TEST_CASE("storage - retrieve limit", "[storage]") {
     CHECK(storage.retrieve(pubkey, "", 101).size() == 100);
     CHECK(storage.retrieve(pubkey2, "", 10).size() == 5);
 }
+
+TEST_CASE("storage - owner iteration", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    int64_t cursor = 0;
+    CHECK(storage.get_owners(cursor, 10).empty());
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey_t> pubkeys;
+    for (int i = 0; i < 25; i++) {
+        auto& pk = pubkeys.emplace_back();
+        REQUIRE(pk.load(fmt::format("05{:064x}", i + 1)));
+        for (int j = 0; j <= i % 3; j++)
+            storage.store({pk, fmt::format("hash{}-{}", i, j), now, now + 100s, "data"});
+    }
+
+    std::vector<user_pubkey_t> seen;
+    std::vector<size_t> chunks;
+    cursor = 0;
+    while (true) {
+        auto owners = storage.get_owners(cursor, 10);
+        if (owners.empty())
+            break;
+        chunks.push_back(owners.size());
+        seen.insert(seen.end(), owners.begin(), owners.end());
+    }
+    CHECK(chunks == std::vector<size_t>{10, 10, 5});
+    CHECK(seen == pubkeys);
+}
+
+TEST_CASE("storage - message paging", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey, pubkey2;
+    REQUIRE(pubkey.load("05"s + std::string(64, '1')));
+    REQUIRE(pubkey2.load("05"s + std::string(64, '2')));
+
+    int64_t cursor = 0;
+    CHECK(storage.get_messages(pubkey, cursor, 10).empty());
+    CHECK(cursor == 0);
+
+    // Interleave the two owners' messages so that the ids of each owner's messages have gaps
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 25; i++) {
+        storage.store({pubkey, fmt::format("hash{}", i), now, now + 100s, "data"});
+        storage.store({pubkey2, fmt::format("other{}", i), now, now + 100s, "data"});
+    }
+
+    std::vector<std::string> hashes;
+    std::vector<size_t> pages;
+    while (true) {
+        auto msgs = storage.get_messages(pubkey, cursor, 10);
+        pages.push_back(msgs.size());
+        for (auto& m : msgs) {
+            CHECK(m.pubkey == pubkey);
+            hashes.push_back(m.hash);
+        }
+        if (msgs.size() < 10)
+            break;
+    }
+    CHECK(pages == std::vector<size_t>{10, 10, 5});
+    REQUIRE(hashes.size() == 25);
+    for (int i = 0; i < 25; i++)
+        CHECK(hashes[i] == fmt::format("hash{}", i));
+
+    // Messages stored after we finished are picked up from the same cursor
+    storage.store({pubkey, "late", now, now + 100s, "data"});
+    auto late = storage.get_messages(pubkey, cursor, 10);
+    REQUIRE(late.size() == 1);
+    CHECK(late[0].hash == "late");
+}
+
+TEST_CASE("storage - message hashes", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+    CHECK(storage.get_message_hashes().empty());
+
+    auto now = std::chrono::system_clock::now();
+    user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("05"s + std::string(64, '1')));
+    REQUIRE(pk2.load("05"s + std::string(64, '2')));
+    storage.store({pk1, "a", now, now + 100s, "data"});
+    storage.store({pk1, "b", now, now + 100s, "data"});
+    storage.store({pk2, "c", now, now + 100s, "data"});
+    // Expired messages are skipped
+    storage.store({pk2, "d", now - 200s, now - 100s, "data"});
+
+    auto hashes = storage.get_message_hashes();
+    std::sort(hashes.begin(), hashes.end());
+    CHECK(hashes == std::vector<std::string>{"a", "b", "c"});
+
+    hashes = storage.get_message_hashes([&pk1](const user_pubkey_t& pk) { return pk == pk1; });
+    std::sort(hashes.begin(), hashes.end());
+    CHECK(hashes == std::vector<std::string>{"a", "b"});
+}
+
+struct SnapshotDeleter {
+    SnapshotDeleter() { cleanup(); }
+    ~SnapshotDeleter() { cleanup(); }
+    void cleanup() {
+        std::filesystem::remove_all("snapshot_src");
+        std::filesystem::remove_all("snapshot_dst");
+        std::filesystem::remove("test.snapshot");
+    }
+};
+
+TEST_CASE("storage - snapshot export and import", "[storage][snapshot]") {
+    SnapshotDeleter fixture;
+    std::filesystem::create_directory("snapshot_src");
+    std::filesystem::create_directory("snapshot_dst");
+
+    user_pubkey_t pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+
+    Database src{"snapshot_src"};
+    for (int i = 0; i < 20; i++)
+        src.store({pubkey1, "hash" + std::to_string(i), now, now + 100s, "data" + std::to_string(i)});
+    for (int i = 0; i < 5; i++)
+        src.store({pubkey2, "other" + std::to_string(i), now, now + 100s, "bytes"});
+
+    SECTION("full snapshot restores everything") {
+        CHECK(src.export_snapshot("test.snapshot") == 25);
+        CHECK(std::filesystem::exists("test.snapshot"));
+
+        Database dst{"snapshot_dst"};
+        CHECK(dst.import_snapshot("test.snapshot") == 25);
+        CHECK(dst.get_owner_count() == 2);
+        CHECK(dst.get_message_count() == 25);
+
+        // Order (and thus last_hash retrieval) is preserved
+        auto items = dst.retrieve(pubkey1, "hash9");
+        REQUIRE(items.size() == 10);
+        CHECK(items[0].hash == "hash10");
+        CHECK(items[0].data == "data10");
+
+        CHECK(dst.retrieve_by_hash("other3"));
+        dst.clean_expired();
+        CHECK(dst.get_message_count() == 25);
+
+        // Re-importing doesn't duplicate anything
+        CHECK(dst.import_snapshot("test.snapshot") == 0);
+        CHECK(dst.get_message_count() == 25);
+    }
+
+    SECTION("filtered snapshot only includes matching owners") {
+        CHECK(src.export_snapshot("test.snapshot",
+                    [&](const user_pubkey_t& pk) { return pk == pubkey2; }) == 5);
+
+        Database dst{"snapshot_dst"};
+        dst.store({pubkey1, "hash0", now, now + 100s, "data0"});
+        CHECK(dst.import_snapshot("test.snapshot") == 5);
+        CHECK(dst.get_owner_count() == 2);
+        CHECK(dst.retrieve(pubkey2, "").size() == 5);
+        CHECK(dst.retrieve(pubkey1, "").size() == 1);
+    }
+
+    SECTION("large snapshots are imported in chunks") {
+        std::vector<message> more;
+        for (int i = 0; i < Database::IMPORT_CHUNK + 500; i++)
+            more.push_back({i % 2 ? pubkey1 : pubkey2, "bulk" + std::to_string(i), now, now + 100s, "x"});
+        src.bulk_store(more);
+        CHECK(src.export_snapshot("test.snapshot") == Database::IMPORT_CHUNK + 525);
+
+        Database dst{"snapshot_dst"};
+        dst.store({pubkey1, "bulk7", now, now + 100s, "x"});
+        CHECK(dst.import_snapshot("test.snapshot") == Database::IMPORT_CHUNK + 524);
+        CHECK(dst.get_message_count() == Database::IMPORT_CHUNK + 525);
+        CHECK(dst.get_owner_count() == 2);
+
+        // Messages of later chunks still come after those of earlier ones
+        auto items = dst.retrieve(pubkey2, "");
+        REQUIRE_FALSE(items.empty());
+        CHECK(items.back().hash == "bulk" + std::to_string(Database::IMPORT_CHUNK + 498));
+    }
+
+    SECTION("invalid snapshots are rejected") {
+        Database dst{"snapshot_dst"};
+        CHECK_THROWS(dst.import_snapshot("test.snapshot"));
+        CHECK_THROWS(dst.import_snapshot("snapshot_src/storage.db"));
+        CHECK(dst.get_message_count() == 0);
+    }
+}
+
+TEST_CASE("storage - node state", "[storage]") {
+    StorageDeleter fixture;
+
+    {
+        Database storage{"."};
+        CHECK_FALSE(storage.load_state("foo"));
+
+        storage.save_state("foo", "abc");
+        storage.save_state("bar", std::string_view{"x\0y", 3});
+        storage.save_state("foo", "def");
+        CHECK(storage.load_state("foo") == "def");
+    }
+
+    // Survives reopening, and doesn't count as stored messages
+    Database storage{"."};
+    CHECK(storage.load_state("foo") == "def");
+    CHECK(storage.load_state("bar") == std::string{"x\0y", 3});
+    CHECK(storage.get_message_count() == 0);
+    CHECK(storage.get_owner_count() == 0);
+}
+
+// Measures per-query overhead (on an empty database the query itself is trivial, so this mostly
+// measures statement lookup).
+TEST_CASE("storage - prepared statement overhead", "[.][bench][storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    BENCHMARK("get_owner_count") {
+        return storage.get_owner_count();
+    };
+
+    BENCHMARK("get_owner_count x 10000, 4 threads") {
+        std::vector<std::thread> threads;
+        std::atomic<int64_t> total = 0;
+        for (int t = 0; t < 4; t++)
+            threads.emplace_back([&] {
+                for (int i = 0; i < 10000; i++)
+                    total += storage.get_owner_count();
+            });
+        for (auto& t : threads)
+            t.join();
+        return total.load();
+    };
+}
@@ -0,0 +1,96 @@
+#include "fixtures.h"
+#include "store_batcher.h"
+
+#include <catch2/catch.hpp>
+
+using oxen::store_batcher;
+using namespace std::literals;
+
+static const auto& PK1 = oxen::test::PK1<oxen::x25519_pubkey>;
+static const auto& PK2 = oxen::test::PK2<oxen::x25519_pubkey>;
+
+TEST_CASE("store batcher - batching", "[store-batcher]") {
+    store_batcher batcher;
+
+    auto a1 = batcher.add(PK1, "store1", nullptr, 2s);
+    CHECK(a1.first);
+    CHECK_FALSE(a1.full);
+    auto a2 = batcher.add(PK1, "store2", nullptr, 3s);
+    CHECK_FALSE(a2.first);
+    CHECK(a2.id == a1.id);
+    auto b1 = batcher.add(PK2, "store3", nullptr, 1s);
+    CHECK(b1.first);
+    CHECK(b1.id != a1.id);
+
+    auto b = batcher.take(PK1, a1.id);
+    REQUIRE(b);
+    CHECK(b->peer == PK1);
+    CHECK(b->stores == std::vector<std::string>{"store1", "store2"});
+    CHECK(b->callbacks.size() == 2);
+    CHECK(b->timeout == 3s);
+    CHECK(b->bytes == 12);
+    // Already taken
+    CHECK_FALSE(batcher.take(PK1, a1.id));
+
+    // The next store to PK1 starts a new batch, which an old id doesn't take
+    auto a3 = batcher.add(PK1, "store4", nullptr, 1s);
+    CHECK(a3.first);
+    CHECK_FALSE(batcher.take(PK1, a1.id));
+    CHECK(batcher.take(PK1, a3.id));
+
+    CHECK(batcher.take(PK2, b1.id));
+    CHECK(batcher.batches() == 3);
+    CHECK(batcher.batched_stores() == 4);
+}
+
+TEST_CASE("store batcher - full batches", "[store-batcher]") {
+    store_batcher batcher;
+    for (size_t i = 1; i < store_batcher::MAX_STORES; i++)
+        CHECK_FALSE(batcher.add(PK1, "x", nullptr, 1s).full);
+    auto a = batcher.add(PK1, "x", nullptr, 1s);
+    CHECK(a.full);
+    REQUIRE(batcher.take(PK1, a.id));
+
+    std::string big(store_batcher::MAX_BYTES / 2, 'x');
+    CHECK_FALSE(batcher.add(PK1, big, nullptr, 1s).full);
+    CHECK(batcher.add(PK1, big, nullptr, 1s).full);
+}
+
+TEST_CASE("store batcher - delivering replies", "[store-batcher]") {
+    auto reply = store_batcher::encode_reply({"d4:hash3:abce"});
+    CHECK(store_batcher::decode_reply(reply) == std::vector<std::string>{"d4:hash3:abce"});
+    auto error = store_batcher::encode_reply({"421", "wrong swarm"});
+    CHECK(store_batcher::decode_reply(error) == std::vector<std::string>{"421", "wrong swarm"});
+    CHECK_THROWS(store_batcher::decode_reply("d1:ai1ee"));
+
+    store_batcher batcher;
+    std::vector<std::pair<bool, std::vector<std::string>>> got(3);
+    uint64_t id = 0;
+    for (int i = 0; i < 3; i++)
+        id = batcher.add(PK1, "store", [&got, i](bool success, std::vector<std::string> parts) {
+            got[i] = {success, std::move(parts)};
+        }, 1s).id;
+
+    SECTION("replies") {
+        auto b = batcher.take(PK1, id);
+        REQUIRE(b);
+        store_batcher::deliver(*b, true, {reply, error, "garbage"});
+        CHECK(got[0] == std::make_pair(true, std::vector<std::string>{"d4:hash3:abce"}));
+        CHECK(got[1] == std::make_pair(true, std::vector<std::string>{"421", "wrong swarm"}));
+        CHECK(got[2] == std::make_pair(true, std::vector<std::string>{}));
+    }
+    SECTION("timeout") {
+        auto b = batcher.take(PK1, id);
+        REQUIRE(b);
+        store_batcher::deliver(*b, false, {});
+        for (auto& g : got)
+            CHECK(g == std::make_pair(false, std::vector<std::string>{}));
+    }
+    SECTION("wrong number of replies") {
+        auto b = batcher.take(PK1, id);
+        REQUIRE(b);
+        store_batcher::deliver(*b, true, {reply});
+        for (auto& g : got)
+            CHECK(g == std::make_pair(true, std::vector<std::string>{}));
+    }
+}
@@ -0,0 +1,86 @@
+#include "omq_server.h"
+#include "swarm_responses.h"
+
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+#include <oxenmq/bt_serialize.h>
+
+using namespace oxen;
+using nlohmann::json;
+
+static SwarmInfo make_swarm(swarm_id_t id, int nodes) {
+    SwarmInfo swarm{id, {}};
+    for (int i = 0; i < nodes; i++) {
+        auto& sn = swarm.snodes.emplace_back();
+        sn.ip = "10.0.0." + std::to_string(i + 1);
+        sn.port = 22021;
+        sn.omq_port = 22020;
+        sn.pubkey_legacy = legacy_pubkey::from_hex(
+                "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abc00" + std::to_string(i));
+        sn.pubkey_ed25519 = ed25519_pubkey::from_hex(
+                "1123456789abcdef0123456789abcdef0123456789abcdef0123456789abc00" + std::to_string(i));
+        sn.pubkey_x25519 = x25519_pubkey::from_hex(
+                "2123456789abcdef0123456789abcdef0123456789abcdef0123456789abc00" + std::to_string(i));
+    }
+    return swarm;
+}
+
+TEST_CASE("swarm responses - serialization", "[swarm-responses]") {
+    swarm_responses responses;
+    auto swarm = make_swarm(0x1234, 3);
+    auto e = responses.get(1, swarm);
+    REQUIRE(e);
+    CHECK(e->size == 3);
+    CHECK(e->etag.size() == 16);
+
+    auto expected = swarm_to_json(swarm);
+    expected["etag"] = e->etag;
+    expected["t"] = 1234567890123;
+    CHECK(e->json_body(1234567890123) == expected.dump());
+    CHECK(json::parse(e->json_body(1234567890123)) == expected);
+    CHECK(e->bt_body(1234567890123) == oxenmq::bt_serialize(json_to_bt(expected)));
+    CHECK(expected["swarm"] == "1234");
+    CHECK(expected["snodes"].size() == 3);
+    CHECK(expected["snodes"][0]["port"] == "22021");
+    CHECK(expected["snodes"][0]["port_https"] == 22021);
+    CHECK(expected["snodes"][0]["ip"] == "10.0.0.1");
+}
+
+TEST_CASE("swarm responses - caching", "[swarm-responses]") {
+    swarm_responses responses;
+    auto swarm = make_swarm(0x1234, 3);
+    auto other = make_swarm(0x5678, 2);
+
+    auto e1 = responses.get(1, swarm);
+    CHECK(responses.get(1, swarm) == e1);
+    auto o1 = responses.get(1, other);
+    CHECK(o1 != e1);
+    CHECK(o1->etag != e1->etag);
+    CHECK(responses.hits() == 1);
+    CHECK(responses.misses() == 2);
+
+    // A new version is serialized again, but the etag only depends on the swarm itself
+    auto e2 = responses.get(2, swarm);
+    CHECK(e2 != e1);
+    CHECK(e2->etag == e1->etag);
+    CHECK(e2->json == e1->json);
+
+    // Another instance (e.g. after a restart, or on another node) produces the same etag
+    swarm_responses fresh;
+    CHECK(fresh.get(7, swarm)->etag == e1->etag);
+
+    // A request that still sees an old version gets a correct (but uncached) entry, and doesn't
+    // disturb the entries of the current version
+    auto old = responses.get(1, other);
+    CHECK(old->etag == o1->etag);
+    CHECK(responses.get(2, swarm) == e2);
+    CHECK(responses.hits() == 2);
+
+    // Any change to the swarm changes the etag
+    auto changed = swarm;
+    changed.snodes[1].ip = "10.0.0.99";
+    CHECK(responses.get(3, changed)->etag != e1->etag);
+    changed = swarm;
+    changed.snodes.pop_back();
+    CHECK(responses.get(4, changed)->etag != e1->etag);
+}
@@ -0,0 +1,164 @@
+#include "omq_server.h"
+#include "swarm_results.h"
+
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+#include <oxenmq/bt_serialize.h>
+
+#include <random>
+
+using namespace oxen;
+using nlohmann::json;
+
+static std::string random_bytes(std::mt19937_64& rng, size_t size) {
+    std::string s(size, '\0');
+    for (auto& c : s)
+        c = static_cast<char>(rng());
+    return s;
+}
+
+static std::string random_hex(std::mt19937_64& rng) {
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string hex(64, '0');
+    for (auto& c : hex)
+        c = digits[rng() % 16];
+    return hex;
+}
+
+// A recursive store response, as assembled by the node handling the request, plus the raw replies
+// of `peers` other swarm members.
+static std::pair<json, raw_swarm_results> make_store_results(size_t peers, std::mt19937_64& rng) {
+    std::string hash = random_bytes(rng, 43);
+    json result{{"hash", hash}, {"difficulty", 1}};
+    result["swarm"][random_hex(rng)] = {
+        {"hash", hash}, {"signature", random_bytes(rng, 64)}, {"t", 1634567890123}};
+    // One peer that timed out
+    result["swarm"][random_hex(rng)] = {{"failed", true}, {"timeout", true}};
+
+    raw_swarm_results raw;
+    for (size_t i = 0; i < peers; i++)
+        raw.emplace_back(random_hex(rng), oxenmq::bt_serialize(oxenmq::bt_dict{
+                    {"hash", hash},
+                    {"signature", random_bytes(rng, 64)},
+                    {"t", 1634567890123 + i}}));
+    return {std::move(result), std::move(raw)};
+}
+
+// The old way of building the response: decode every peer reply into the json result, then
+// convert the whole thing to bt.
+static std::string decode_and_encode(json result, const raw_swarm_results& peers) {
+    merge_swarm_results(result, peers, false);
+    return oxenmq::bt_serialize(json_to_bt(std::move(result)));
+}
+
+TEST_CASE("swarm results - scanning peer results", "[swarm-results]") {
+    CHECK_FALSE(scan_swarm_result(oxenmq::bt_serialize(oxenmq::bt_dict{{"hash", "abc"}})));
+    CHECK(scan_swarm_result(oxenmq::bt_serialize(oxenmq::bt_dict{
+                    {"failed", 1}, {"query_failure", 1}})));
+    CHECK_FALSE(scan_swarm_result("de"));
+    CHECK_THROWS(scan_swarm_result(""));
+    CHECK_THROWS(scan_swarm_result("li1ee"));
+    CHECK_THROWS(scan_swarm_result("d4:hash"));
+}
+
+TEST_CASE("swarm results - splicing", "[swarm-results]") {
+    std::mt19937_64 rng{123};
+    for (size_t peers : {0, 1, 9}) {
+        auto [result, raw] = make_store_results(peers, rng);
+        auto expected = decode_and_encode(result, raw);
+        CHECK(splice_swarm_results(result, raw) == expected);
+    }
+
+    // No "swarm" key of our own
+    auto [result, raw] = make_store_results(3, rng);
+    result.erase("swarm");
+    CHECK(splice_swarm_results(result, raw) == decode_and_encode(result, raw));
+
+    // json results get decoded, with base64 signatures
+    json j = result;
+    merge_swarm_results(j, raw, true);
+    REQUIRE(j["swarm"].size() == 3);
+    for (auto& [pk, r] : j["swarm"].items())
+        CHECK(r["signature"].get<std::string>().size() == 88);
+}
+
+TEST_CASE("swarm results - waiting for every member", "[swarm-results]") {
+    swarm_quorum q;
+    q.wait();
+    // Peers "c" and "d" are unreachable, so we don't wait for them
+    q.wait("a");
+    q.wait("b");
+    CHECK(q.pending() == 3);
+
+    CHECK_FALSE(q.done("", true));
+    CHECK_FALSE(q.done("b", false));
+    CHECK(q.pending() == 1);
+    CHECK_FALSE(q.replied());
+    CHECK(q.done("a", true));
+    CHECK(q.replied());
+    CHECK(q.pending() == 0);
+    CHECK(q.confirmed() == 2);
+
+    // No quorum was requested, so there's nothing to add to the reply
+    json result = json::object();
+    q.add_quorum(result);
+    CHECK(result.empty());
+}
+
+TEST_CASE("swarm results - quorum larger than the reachable swarm", "[swarm-results]") {
+    swarm_quorum q{5};
+    q.wait();
+    q.wait("a");
+    q.wait("b");
+
+    // The quorum can't be reached, so we reply once everyone we waited on has responded
+    CHECK_FALSE(q.done("a", true));
+    CHECK_FALSE(q.done("", true));
+    CHECK(q.done("b", true));
+    CHECK(q.pending() == 0);
+
+    json result = json::object();
+    q.add_quorum(result);
+    CHECK(result["quorum"] == json{{"required", 5}, {"confirmed", 3}, {"pending", json::array()}});
+}
+
+TEST_CASE("swarm results - late replies after the quorum", "[swarm-results]") {
+    swarm_quorum q{2};
+    q.wait();
+    for (auto peer : {"a", "b", "c", "d"})
+        q.wait(peer);
+
+    CHECK_FALSE(q.done("", true));
+    CHECK_FALSE(q.done("c", false));
+    CHECK(q.done("a", true));
+    CHECK(q.replied());
+    CHECK(q.pending() == 2);
+
+    json result = json::object();
+    q.add_quorum(result);
+    CHECK(result["quorum"] == json{
+            {"required", 2}, {"confirmed", 2}, {"pending", json::array({"b", "d"})}});
+
+    // Later replies are counted off, but don't lead to another reply or change the confirmed count
+    CHECK_FALSE(q.done("d", true));
+    CHECK_FALSE(q.done("b", false));
+    CHECK(q.pending() == 0);
+    CHECK(q.confirmed() == 2);
+}
+
+// Compares building the response to a recursive store in a 10-member swarm (us, a failed peer, and
+// 8 successful ones) by splicing the peers' raw replies against decoding them into json and
+// re-encoding.
+TEST_CASE("swarm results - response assembly performance", "[.][bench][swarm-results]") {
+    std::mt19937_64 rng{42};
+    auto results = make_store_results(8, rng);
+    auto& result = results.first;
+    auto& raw = results.second;
+
+    BENCHMARK("decode and re-encode, 10 member swarm") {
+        return decode_and_encode(result, raw);
+    };
+    BENCHMARK("splice, 10 member swarm") {
+        return splice_swarm_results(result, raw);
+    };
+}
@@ -0,0 +1,127 @@
+#include "thread_pools.h"
+
+#include <catch2/catch.hpp>
+
+using oxen::thread_counts;
+using oxen::thread_monitor;
+using namespace std::literals;
+
+TEST_CASE("thread pools - default counts", "[thread-pools]") {
+    thread_counts configured;
+
+    auto small = configured.resolve(2);
+    CHECK(small.general == 1);
+    CHECK(small.sn == 1);
+    CHECK(small.storage == 1);
+    CHECK(small.https == 1);
+    CHECK(small.bulk == 1);
+
+    // hardware_concurrency() returns 0 when it can't tell
+    auto unknown = configured.resolve(0);
+    CHECK(unknown.general == 1);
+    CHECK(unknown.bulk == 1);
+
+    auto big = configured.resolve(16);
+    CHECK(big.general == 8);
+    CHECK(big.sn == 4);
+    CHECK(big.storage == 2);
+    CHECK(big.https == 4);
+    CHECK(big.bulk == 1);
+
+    auto huge = configured.resolve(128);
+    CHECK(huge.general == 8);
+    CHECK(huge.sn == 4);
+    CHECK(huge.storage == 2);
+    CHECK(huge.https == 4);
+    CHECK(huge.bulk == 2);
+
+    configured.general = 3;
+    configured.bulk = 5;
+    auto explicit_counts = configured.resolve(16);
+    CHECK(explicit_counts.general == 3);
+    CHECK(explicit_counts.sn == 4);
+    CHECK(explicit_counts.bulk == 5);
+}
+
+static const thread_monitor::pool_stats& find(
+        const std::vector<thread_monitor::pool_stats>& stats, std::string_view name) {
+    for (auto& s : stats)
+        if (s.name == name)
+            return s;
+    throw std::runtime_error{"no such pool"};
+}
+
+TEST_CASE("thread pools - monitor", "[thread-pools]") {
+    thread_monitor monitor;
+    monitor.add_pool("general", 4);
+    monitor.add_pool("sn", 2);
+
+    auto t = thread_monitor::clock::now();
+    CHECK_FALSE(monitor.probe_start("nonexistent", t));
+
+    // Quick probes: the pool is keeping up
+    for (int i = 0; i < 5; i++) {
+        REQUIRE(monitor.probe_start("general", t));
+        monitor.probe_done("general", t + 1ms);
+        t += thread_monitor::PROBE_INTERVAL;
+    }
+    auto g = find(monitor.stats(), "general");
+    CHECK(g.samples == 5);
+    CHECK(g.average_delay == 1ms);
+    CHECK(g.state == thread_monitor::load::ok);
+    CHECK(g.suggested_threads == 4);
+
+    // A single slow probe moves the average, but not enough to be busy
+    REQUIRE(monitor.probe_start("general", t));
+    monitor.probe_done("general", t + 100ms);
+    auto g2 = find(monitor.stats(), "general");
+    CHECK(g2.last_delay == 100ms);
+    CHECK(g2.average_delay == 25750us);
+    CHECK(g2.state == thread_monitor::load::ok);
+
+    // Consistently slow probes make it busy
+    for (int i = 0; i < 5; i++) {
+        t += thread_monitor::PROBE_INTERVAL;
+        REQUIRE(monitor.probe_start("general", t));
+        monitor.probe_done("general", t + 100ms);
+    }
+    auto g3 = find(monitor.stats(), "general");
+    CHECK(g3.state == thread_monitor::load::busy);
+    CHECK(g3.suggested_threads == 5);
+
+    // The other pool is unaffected
+    auto sn = find(monitor.stats(), "sn");
+    CHECK(sn.samples == 0);
+    CHECK(sn.state == thread_monitor::load::ok);
+    CHECK(sn.suggested_threads == 2);
+}
+
+TEST_CASE("thread pools - stuck probes", "[thread-pools]") {
+    thread_monitor monitor;
+    monitor.add_pool("sn", 2);
+
+    auto t = thread_monitor::clock::now();
+    REQUIRE(monitor.probe_start("sn", t));
+    // The probe hasn't run by the next interval: we don't queue another, but count the wait
+    CHECK_FALSE(monitor.probe_start("sn", t + 1s));
+    CHECK_FALSE(monitor.probe_start("sn", t + 2s));
+    auto s = find(monitor.stats(), "sn");
+    CHECK(s.samples == 2);
+    CHECK(s.last_delay == 2s);
+    CHECK(s.state == thread_monitor::load::saturated);
+    CHECK(s.suggested_threads == 4);
+
+    // Once it finally runs we can probe again, and quick probes bring the pool back to ok
+    monitor.probe_done("sn", t + 3s);
+    // A second probe_done without a probe_start is ignored
+    monitor.probe_done("sn", t + 4s);
+    CHECK(find(monitor.stats(), "sn").samples == 3);
+    for (int i = 0; i < 30; i++) {
+        t += thread_monitor::PROBE_INTERVAL;
+        REQUIRE(monitor.probe_start("sn", t));
+        monitor.probe_done("sn", t);
+    }
+    s = find(monitor.stats(), "sn");
+    CHECK(s.state == thread_monitor::load::ok);
+    CHECK(s.suggested_threads == 2);
+}